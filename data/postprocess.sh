@@ -1,9 +1,12 @@
 #!/bin/sh
 
 # The post-processing script gets called after taking a burst of
-# pictures into a temporary directory. The first argument is the
+# pictures into a staging directory. The first argument is the
 # directory containing the raw files in the burst. The contents
-# are 1.dng, 2.dng.... up to the number of photos in the burst.
+# are 0.dng, 1.dng.... up to the number of photos in the burst, and
+# merged.dng if the burst was merged into a single denoised frame.
+# The directory is usually on the same file system as the target,
+# so files moved out of it are renamed instead of copied.
 #
 # The second argument is the filename for the final photo without
 # the extension, like "/home/user/Pictures/IMG202104031234" 
@@ -12,7 +15,7 @@
 # is 0 the .dng file should not be moved to the output directory
 #
 # The post-processing script is responsible for cleaning up
-# temporary directory for the burst.
+# the staging directory for the burst.
 
 set -e
 
@@ -27,8 +30,10 @@ SAVE_DNG="$3"
 
 MAIN_PICTURE="$BURST_DIR"/1
 
-# Copy the first frame of the burst as the raw photo
-cp "$BURST_DIR"/1.dng "$TARGET_NAME.dng"
+# Prefer the merged burst over a single frame
+if [ -f "$BURST_DIR"/merged.dng ]; then
+	MAIN_PICTURE="$BURST_DIR"/merged
+fi
 
 # Create a .jpg if raw processing tools are installed
 DCRAW=""
@@ -90,16 +95,17 @@ if [ -n "$DCRAW" ]; then
 
 		echo "$TARGET_NAME.jpg"
 	else
-		cp "$MAIN_PICTURE.$TIFF_EXT" "$TARGET_NAME.tiff"
+		mv "$MAIN_PICTURE.$TIFF_EXT" "$TARGET_NAME.tiff"
 
 		echo "$TARGET_NAME.tiff"
 	fi
 fi
 
-# Clean up the temp dir containing the burst
-rm -rf "$BURST_DIR"
-
-# Clean up the .dng if the user didn't want it
-if [ "$SAVE_DNG" -eq "0" ]; then
-	rm "$TARGET_NAME.dng"
+# Keep the main picture of the burst as the raw photo if the user wants
+# it, it's only copied when the burst was staged on another file system
+if [ "$SAVE_DNG" -ne "0" ]; then
+	mv "$MAIN_PICTURE.dng" "$TARGET_NAME.dng"
 fi
+
+# Clean up the staging dir containing the burst
+rm -rf "$BURST_DIR"
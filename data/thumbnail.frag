@@ -0,0 +1,28 @@
+#ifdef GL_ES
+precision mediump float;
+#endif
+
+uniform sampler2D texture;
+// Size of a thumbnail pixel in texture coordinates
+uniform vec2 pixel_size;
+
+varying vec2 uv;
+
+// The average of a grid of taps over the area of the source that ends up in
+// the thumbnail pixel. Each tap averages 2x2 texels with linear filtering, so
+// scaling down by up to 8 doesn't skip any texels.
+#define TAPS 4
+
+void
+main()
+{
+        vec3 sum = vec3(0);
+        for (int y = 0; y < TAPS; ++y) {
+                for (int x = 0; x < TAPS; ++x) {
+                        vec2 offset = (vec2(x, y) + 0.5) / float(TAPS) - 0.5;
+                        sum += texture2D(texture, uv + offset * pixel_size).rgb;
+                }
+        }
+
+        gl_FragColor = vec4(sum / float(TAPS * TAPS), 1);
+}
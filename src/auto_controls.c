@@ -0,0 +1,238 @@
+#include "auto_controls.h"
+
+#include <glib.h>
+#include <math.h>
+#include <stdlib.h>
+
+// Mean luminance the exposure is driven to, as a fraction of the white level.
+// The frames are linear, the developer and the preview brighten them further.
+#define TARGET_BRIGHTNESS 0.16f
+
+// Changes smaller than this factor are ignored, so the loop settles. Once it
+// has, the brightness has to be off by RESTART_DEADBAND before it moves again.
+#define DEADBAND 1.1f
+#define RESTART_DEADBAND 1.3f
+// The largest change made at once, beyond this the linear model is guesswork
+#define MAX_STEP 8.0f
+
+// When more than this fraction of the samples is in the top bin, the exposure
+// is lowered by at least HIGHLIGHT_STEP. Brightening stops short of putting
+// half as many there, or it would undo that again.
+#define HIGHLIGHT_FRACTION 0.02f
+#define HIGHLIGHT_STEP 0.5f
+
+// Sensors apply new exposure and gain values a frame or two late, the frames
+// until then are skipped
+#define SETTLE_FRAMES 3
+
+// Weight of the newest frame in the white balance estimate
+#define NEUTRAL_WEIGHT 0.25f
+// Frames with fewer usable samples don't change the white balance
+#define MIN_GRAY_FRACTION 0.05f
+#define MIN_NEUTRAL 0.2f
+#define MAX_NEUTRAL 5.0f
+
+struct _MPAutoControls {
+        int exposure_min;
+        int exposure_max;
+        int gain_min;
+        int gain_max;
+
+        // In the 8-bit units of the statistics
+        float black_level;
+
+        int settle_frames;
+        bool is_settled;
+
+        bool has_neutral;
+        float neutral[3];
+};
+
+MPAutoControls *
+mp_auto_controls_new(int exposure_min,
+                     int exposure_max,
+                     int gain_min,
+                     int gain_max,
+                     float black_level)
+{
+        MPAutoControls *controls = calloc(1, sizeof(MPAutoControls));
+        controls->exposure_min = MAX(exposure_min, 1);
+        controls->exposure_max = MAX(exposure_max, controls->exposure_min);
+        controls->gain_min = gain_min;
+        controls->gain_max = MAX(gain_max, gain_min);
+        controls->black_level = black_level * 255;
+        mp_auto_controls_reset(controls);
+        return controls;
+}
+
+void
+mp_auto_controls_free(MPAutoControls *controls)
+{
+        free(controls);
+}
+
+void
+mp_auto_controls_reset(MPAutoControls *controls)
+{
+        controls->settle_frames = SETTLE_FRAMES;
+        controls->is_settled = false;
+        controls->has_neutral = false;
+        for (int i = 0; i < 3; ++i) {
+                controls->neutral[i] = 1;
+        }
+}
+
+static void
+update_neutral(MPAutoControls *controls, const MPImageStats *stats)
+{
+        if (stats->num_gray_samples < stats->num_samples * MIN_GRAY_FRACTION ||
+            stats->num_gray_samples == 0) {
+                return;
+        }
+
+        // Gray world, over the samples that are neither clipped nor noise
+        float n = stats->num_gray_samples;
+        float black = controls->black_level;
+        float red = stats->gray_sum[0] / n - black;
+        float green = stats->gray_sum[1] / (2 * n) - black;
+        float blue = stats->gray_sum[2] / n - black;
+        if (green < 1) {
+                return;
+        }
+
+        float neutral[3] = {
+                CLAMP(red / green, MIN_NEUTRAL, MAX_NEUTRAL),
+                1,
+                CLAMP(blue / green, MIN_NEUTRAL, MAX_NEUTRAL),
+        };
+
+        float weight = controls->has_neutral ? NEUTRAL_WEIGHT : 1;
+        for (int i = 0; i < 3; ++i) {
+                controls->neutral[i] +=
+                        (neutral[i] - controls->neutral[i]) * weight;
+        }
+        controls->has_neutral = true;
+}
+
+/*
+ * The largest ratio the frame can be brightened by before more than half of
+ * HIGHLIGHT_FRACTION of the samples end up in the top bin of the histogram.
+ */
+static float
+get_max_brightening(const MPAutoControls *controls, const MPImageStats *stats)
+{
+        const int bin_size = 256 / MP_IMAGE_HISTOGRAM_BINS;
+        float black = controls->black_level;
+        float top = (MP_IMAGE_HISTOGRAM_BINS - 1) * bin_size;
+        uint32_t limit = stats->num_samples * HIGHLIGHT_FRACTION / 2;
+
+        uint32_t count = 0;
+        for (int i = MP_IMAGE_HISTOGRAM_BINS - 1; i >= 0; --i) {
+                count += stats->histogram[i];
+                if (count > limit) {
+                        // The samples in this bin have to stay below the top
+                        float level = (i + 1) * bin_size - black;
+                        return level > 0 ? (top - black) / level : MAX_STEP;
+                }
+        }
+        return MAX_STEP;
+}
+
+/*
+ * How much brighter the next frames should be. The frames are linear, so the
+ * mean scales with the exposure time times the gain until it clips.
+ */
+static float
+get_brightness_ratio(const MPAutoControls *controls, const MPImageStats *stats)
+{
+        float black = controls->black_level;
+        float mean = (float)stats->luminance_sum / stats->num_samples - black;
+        float target = TARGET_BRIGHTNESS * (255 - black);
+        float ratio = target / MAX(mean, 0.5f);
+
+        // Clipped highlights make the mean too low. A few light sources in an
+        // otherwise dark frame shouldn't darken it further though.
+        uint32_t highlights = stats->histogram[MP_IMAGE_HISTOGRAM_BINS - 1];
+        if (highlights > stats->num_samples * HIGHLIGHT_FRACTION) {
+                ratio = ratio < 1 / HIGHLIGHT_STEP ? MIN(ratio, HIGHLIGHT_STEP) : 1;
+        } else if (ratio > 1) {
+                ratio = MIN(ratio, MAX(get_max_brightening(controls, stats), 1));
+        }
+
+        return CLAMP(ratio, 1 / MAX_STEP, MAX_STEP);
+}
+
+bool
+mp_auto_controls_update(MPAutoControls *controls,
+                        const MPImageStats *stats,
+                        bool adjust_exposure,
+                        int *exposure,
+                        bool adjust_gain,
+                        int *gain)
+{
+        if (stats->num_samples == 0) {
+                return false;
+        }
+
+        update_neutral(controls, stats);
+
+        if (controls->settle_frames > 0) {
+                --controls->settle_frames;
+                return false;
+        }
+
+        if (!adjust_exposure && !adjust_gain) {
+                return false;
+        }
+
+        float ratio = get_brightness_ratio(controls, stats);
+        float deadband = controls->is_settled ? RESTART_DEADBAND : DEADBAND;
+        if (ratio < deadband && ratio > 1 / deadband) {
+                controls->is_settled = true;
+                return false;
+        }
+        controls->is_settled = false;
+
+        // Longer exposures are less noisy than more gain, so brightening
+        // raises the exposure first and darkening lowers the gain first
+        int new_exposure = *exposure;
+        int new_gain = *gain;
+        if (ratio > 1) {
+                if (adjust_exposure) {
+                        float wanted = MAX(*exposure, 1) * ratio;
+                        new_exposure = MIN(lroundf(wanted), controls->exposure_max);
+                        ratio = wanted / MAX(new_exposure, 1);
+                }
+                if (adjust_gain) {
+                        float wanted = MAX(*gain, 1) * ratio;
+                        new_gain = MIN(lroundf(wanted), controls->gain_max);
+                }
+        } else {
+                if (adjust_gain) {
+                        float wanted = MAX(*gain, 1) * ratio;
+                        new_gain = MAX(lroundf(wanted), controls->gain_min);
+                        ratio = wanted / MAX(new_gain, 1);
+                }
+                if (adjust_exposure) {
+                        float wanted = MAX(*exposure, 1) * ratio;
+                        new_exposure = MAX(lroundf(wanted), controls->exposure_min);
+                }
+        }
+
+        if (new_exposure == *exposure && new_gain == *gain) {
+                return false;
+        }
+
+        *exposure = new_exposure;
+        *gain = new_gain;
+        controls->settle_frames = SETTLE_FRAMES;
+        return true;
+}
+
+void
+mp_auto_controls_get_neutral(const MPAutoControls *controls, float neutral[3])
+{
+        for (int i = 0; i < 3; ++i) {
+                neutral[i] = controls->neutral[i];
+        }
+}
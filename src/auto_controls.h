@@ -0,0 +1,38 @@
+#pragma once
+
+#include "image.h"
+#include <stdbool.h>
+
+/*
+ * Software auto exposure, gain and white balance, driven by the statistics of
+ * the preview frames. Used for sensors that only have manual exposure and gain
+ * controls. The white balance is estimated for every camera, since the raw
+ * frames never have it applied. Only used from the io pipeline.
+ */
+typedef struct _MPAutoControls MPAutoControls;
+
+// The ranges of the exposure and gain controls, and the black level as a
+// fraction of the white level
+MPAutoControls *mp_auto_controls_new(int exposure_min,
+                                     int exposure_max,
+                                     int gain_min,
+                                     int gain_max,
+                                     float black_level);
+void mp_auto_controls_free(MPAutoControls *controls);
+
+// Forgets the earlier frames, for when the camera or its mode changes
+void mp_auto_controls_reset(MPAutoControls *controls);
+
+// Feeds the statistics of the next preview frame. exposure and gain hold the
+// values the frame was taken with and get the new ones, only those that are
+// adjusted are changed. Returns whether either changed.
+bool mp_auto_controls_update(MPAutoControls *controls,
+                             const MPImageStats *stats,
+                             bool adjust_exposure,
+                             int *exposure,
+                             bool adjust_gain,
+                             int *gain);
+
+// The camera RGB of a neutral surface with green at 1, as DNG AsShotNeutral.
+// This is 1, 1, 1 until a frame with enough neutral samples was seen.
+void mp_auto_controls_get_neutral(const MPAutoControls *controls, float neutral[3]);
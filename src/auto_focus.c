@@ -0,0 +1,222 @@
+#include "auto_focus.h"
+
+#include <glib.h>
+#include <stdlib.h>
+
+// The coarse sweep takes this many steps over the whole range, and the fine
+// sweep splits each coarse step in FINE_STEPS
+#define COARSE_STEPS 10
+#define FINE_STEPS 4
+
+// Frames skipped after moving the lens, one is usually exposed during the move
+// and the lens needs a moment to settle
+#define SETTLE_FRAMES 2
+
+// A sweep stops early once the sharpness has been below this fraction of the
+// peak for PAST_PEAK_STEPS steps, the peak won't come back after that
+#define PEAK_DROP 0.7f
+#define PAST_PEAK_STEPS 2
+
+enum phase {
+        PHASE_IDLE,
+        PHASE_COARSE,
+        PHASE_FINE,
+        // Moving to the peak, done once the lens settled
+        PHASE_FINAL,
+};
+
+struct _MPAutoFocus {
+        int min;
+        int max;
+
+        enum phase phase;
+        int position;
+        int step;
+        int end;
+        int settle_frames;
+        int num_frames;
+
+        // best_position is only valid once a sample was added to the search,
+        // it's kept from the coarse sweep while the fine sweep starts
+        bool has_best;
+        int best_position;
+        uint64_t best_sharpness;
+        int steps_past_peak;
+
+        // Sharpness of the steps on either side of the best one, for
+        // interpolating the peak. Zero when not measured.
+        uint64_t before_best;
+        uint64_t after_best;
+        uint64_t last_sharpness;
+};
+
+MPAutoFocus *
+mp_auto_focus_new(int min, int max)
+{
+        MPAutoFocus *focus = calloc(1, sizeof(MPAutoFocus));
+        focus->min = min;
+        focus->max = MAX(max, min);
+        return focus;
+}
+
+void
+mp_auto_focus_free(MPAutoFocus *focus)
+{
+        free(focus);
+}
+
+static int
+move_to(MPAutoFocus *focus, int position)
+{
+        focus->position = CLAMP(position, focus->min, focus->max);
+        focus->settle_frames = SETTLE_FRAMES;
+        return focus->position;
+}
+
+static int
+start_sweep(MPAutoFocus *focus, enum phase phase, int start, int end, int step)
+{
+        focus->phase = phase;
+        focus->step = MAX(step, 1);
+        focus->end = MIN(end, focus->max);
+        focus->best_sharpness = 0;
+        focus->steps_past_peak = 0;
+        focus->before_best = 0;
+        focus->after_best = 0;
+        focus->last_sharpness = 0;
+        return move_to(focus, start);
+}
+
+int
+mp_auto_focus_start(MPAutoFocus *focus)
+{
+        focus->num_frames = 0;
+        focus->has_best = false;
+        return start_sweep(focus,
+                           PHASE_COARSE,
+                           focus->min,
+                           focus->max,
+                           (focus->max - focus->min) / COARSE_STEPS);
+}
+
+void
+mp_auto_focus_cancel(MPAutoFocus *focus)
+{
+        focus->phase = PHASE_IDLE;
+}
+
+bool
+mp_auto_focus_stop(MPAutoFocus *focus, int *position)
+{
+        enum phase phase = focus->phase;
+        focus->phase = PHASE_IDLE;
+
+        // Nothing was measured yet, or the lens is already moving to the peak
+        if (phase == PHASE_IDLE || phase == PHASE_FINAL || !focus->has_best) {
+                return false;
+        }
+
+        *position = move_to(focus, focus->best_position);
+        return true;
+}
+
+bool
+mp_auto_focus_is_running(const MPAutoFocus *focus)
+{
+        return focus->phase != PHASE_IDLE;
+}
+
+int
+mp_auto_focus_get_num_frames(const MPAutoFocus *focus)
+{
+        return focus->num_frames;
+}
+
+// Adds the sharpness at the current position, returns whether the sweep is done
+static bool
+add_sample(MPAutoFocus *focus, uint64_t sharpness)
+{
+        if (sharpness > focus->best_sharpness) {
+                focus->before_best = focus->last_sharpness;
+                focus->after_best = 0;
+                focus->best_sharpness = sharpness;
+                focus->best_position = focus->position;
+                focus->has_best = true;
+                focus->steps_past_peak = 0;
+        } else {
+                if (focus->steps_past_peak == 0) {
+                        focus->after_best = sharpness;
+                }
+                ++focus->steps_past_peak;
+        }
+        focus->last_sharpness = sharpness;
+
+        if (focus->steps_past_peak >= PAST_PEAK_STEPS &&
+            sharpness < focus->best_sharpness * PEAK_DROP) {
+                return true;
+        }
+        return focus->position + focus->step > focus->end;
+}
+
+/*
+ * The peak of the parabola through the best step and the ones next to it,
+ * the sharpness falls off roughly like that around the focus.
+ */
+static int
+interpolate_peak(const MPAutoFocus *focus)
+{
+        if (focus->before_best == 0 || focus->after_best == 0) {
+                return focus->best_position;
+        }
+
+        double before = focus->before_best;
+        double best = focus->best_sharpness;
+        double after = focus->after_best;
+        double curvature = before - 2 * best + after;
+        if (curvature >= 0) {
+                return focus->best_position;
+        }
+
+        double offset = CLAMP(0.5 * (before - after) / curvature, -0.5, 0.5);
+        return focus->best_position + (int)(offset * focus->step);
+}
+
+bool
+mp_auto_focus_update(MPAutoFocus *focus, uint64_t sharpness, int *position)
+{
+        if (focus->phase == PHASE_IDLE) {
+                return false;
+        }
+
+        ++focus->num_frames;
+        if (focus->settle_frames > 0) {
+                --focus->settle_frames;
+                return false;
+        }
+
+        if (focus->phase == PHASE_FINAL) {
+                focus->phase = PHASE_IDLE;
+                return false;
+        }
+
+        if (!add_sample(focus, sharpness)) {
+                *position = move_to(focus, focus->position + focus->step);
+                return true;
+        }
+
+        int fine_step = focus->step / FINE_STEPS;
+        if (focus->phase == PHASE_COARSE && fine_step > 0) {
+                // The peak is within a coarse step of the sharpest position
+                int best = focus->best_position;
+                *position = start_sweep(focus,
+                                        PHASE_FINE,
+                                        best - focus->step + fine_step,
+                                        best + focus->step - fine_step,
+                                        fine_step);
+                return true;
+        }
+
+        focus->phase = PHASE_FINAL;
+        *position = move_to(focus, interpolate_peak(focus));
+        return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Contrast detection auto focus for lenses that only have an absolute focus
+ * control. The lens is swept over its range in coarse steps and then in fine
+ * steps around the sharpest position, and ends up at the peak interpolated
+ * from the sharpest fine steps. Only used from the io pipeline.
+ */
+typedef struct _MPAutoFocus MPAutoFocus;
+
+// The range of the focus control
+MPAutoFocus *mp_auto_focus_new(int min, int max);
+void mp_auto_focus_free(MPAutoFocus *focus);
+
+// Starts a search, returns the first lens position to move to
+int mp_auto_focus_start(MPAutoFocus *focus);
+void mp_auto_focus_cancel(MPAutoFocus *focus);
+// Ends a search early. Returns true and the sharpest position found so far when
+// the lens has to move there.
+bool mp_auto_focus_stop(MPAutoFocus *focus, int *position);
+bool mp_auto_focus_is_running(const MPAutoFocus *focus);
+
+// Feeds the sharpness of the next frame. Returns true and the position the
+// lens should move to when it has to move, the search is done once the lens
+// has been moved to the peak.
+bool mp_auto_focus_update(MPAutoFocus *focus, uint64_t sharpness, int *position);
+
+// Frames fed to the last search
+int mp_auto_focus_get_num_frames(const MPAutoFocus *focus);
@@ -0,0 +1,559 @@
+#include "burst_merge.h"
+#include "workers.h"
+
+#include <assert.h>
+#include <glib.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Alignment works on a half resolution luma image, where every pixel is the
+ * sum of a 2x2 Bayer quad scaled to 8 bits, and a quarter resolution image
+ * made from that. Tiles overlap by half and are blended with a raised cosine
+ * window, so there are no seams where neighbouring tiles moved differently.
+ *
+ * Sizes below are in luma pixels, one luma pixel is two raw pixels. Moving by
+ * whole luma pixels keeps the Bayer pattern in phase.
+ */
+#define TILE_SIZE 16
+#define TILE_STRIDE (TILE_SIZE / 2)
+#define RAW_TILE_SIZE (TILE_SIZE * 2)
+
+// Search range in quarter resolution pixels, 4 is 16 raw pixels
+#define COARSE_SEARCH 4
+// Refinement around the upscaled coarse match, in luma pixels
+#define FINE_SEARCH 1
+
+// Tiles with a difference below the first factor times the noise level are
+// fully merged, above the second one they're rejected
+#define MATCH_FULL 1.5f
+#define MATCH_REJECT 3.0f
+
+struct _MPBurstMerge {
+        int width;
+        int height;
+        int depth;
+        int num_threads;
+
+        int luma_width;
+        int luma_height;
+        int coarse_width;
+        int coarse_height;
+
+        int tiles_x;
+        int tiles_y;
+
+        uint16_t *ref;
+        uint8_t *ref_luma;
+        uint8_t *ref_coarse;
+
+        // Scratch space for the frame being merged
+        uint16_t *frame;
+        uint8_t *luma;
+        uint8_t *coarse;
+
+        float *num;
+        float *den;
+
+        int *tile_dx;
+        int *tile_dy;
+        float *tile_diff;
+        float *tile_weight;
+
+        float window[RAW_TILE_SIZE];
+
+        int frames_merged;
+        float tiles_accepted;
+        double align_time;
+        double merge_time;
+};
+
+MPBurstMerge *
+mp_burst_merge_new(int width, int height, int depth, int num_threads)
+{
+        assert(width % 2 == 0 && height % 2 == 0);
+        assert(depth >= 8 && depth <= 16);
+
+        MPBurstMerge *merge = calloc(1, sizeof(MPBurstMerge));
+        merge->width = width;
+        merge->height = height;
+        merge->depth = depth;
+        merge->num_threads = MAX(num_threads, 1);
+
+        merge->luma_width = width / 2;
+        merge->luma_height = height / 2;
+        merge->coarse_width = merge->luma_width / 2;
+        merge->coarse_height = merge->luma_height / 2;
+
+        // Tiles that don't fit are left out, the border they would have
+        // covered is taken from the reference frame
+        merge->tiles_x = MAX((merge->luma_width - TILE_SIZE) / TILE_STRIDE + 1, 0);
+        merge->tiles_y = MAX((merge->luma_height - TILE_SIZE) / TILE_STRIDE + 1, 0);
+
+        size_t num_pixels = (size_t)width * height;
+        size_t num_luma = (size_t)merge->luma_width * merge->luma_height;
+        size_t num_coarse = (size_t)merge->coarse_width * merge->coarse_height;
+        size_t num_tiles = (size_t)merge->tiles_x * merge->tiles_y;
+
+        merge->ref = malloc(num_pixels * sizeof(uint16_t));
+        merge->ref_luma = malloc(num_luma);
+        merge->ref_coarse = malloc(num_coarse);
+        merge->frame = malloc(num_pixels * sizeof(uint16_t));
+        merge->luma = malloc(num_luma);
+        merge->coarse = malloc(num_coarse);
+        merge->num = calloc(num_pixels, sizeof(float));
+        merge->den = calloc(num_pixels, sizeof(float));
+        merge->tile_dx = calloc(num_tiles, sizeof(int));
+        merge->tile_dy = calloc(num_tiles, sizeof(int));
+        merge->tile_diff = calloc(num_tiles, sizeof(float));
+        merge->tile_weight = calloc(num_tiles, sizeof(float));
+
+        for (int i = 0; i < RAW_TILE_SIZE; ++i) {
+                merge->window[i] =
+                        0.5f - 0.5f * cosf(2.0f * M_PI * (i + 0.5f) / RAW_TILE_SIZE);
+        }
+
+        return merge;
+}
+
+void
+mp_burst_merge_free(MPBurstMerge *merge)
+{
+        free(merge->ref);
+        free(merge->ref_luma);
+        free(merge->ref_coarse);
+        free(merge->frame);
+        free(merge->luma);
+        free(merge->coarse);
+        free(merge->num);
+        free(merge->den);
+        free(merge->tile_dx);
+        free(merge->tile_dy);
+        free(merge->tile_diff);
+        free(merge->tile_weight);
+        free(merge);
+}
+
+/*
+ * Run func over the rows [0, count) split into bands over the worker pool.
+ * With step 2 only every other row starting at first is processed, which is
+ * used to blend tile rows that don't overlap each other in parallel.
+ */
+typedef void (*BandFunc)(MPBurstMerge *merge, int row);
+
+struct rows {
+        MPBurstMerge *merge;
+        BandFunc func;
+        int first;
+        int step;
+};
+
+static void
+run_band(struct rows *rows, int start, int end)
+{
+        for (int i = start; i < end; ++i) {
+                rows->func(rows->merge, rows->first + i * rows->step);
+        }
+}
+
+static void
+run_bands(MPBurstMerge *merge, BandFunc func, int first, int count, int step)
+{
+        int num_rows = count > first ? (count - first + step - 1) / step : 0;
+
+        struct rows rows = {
+                .merge = merge,
+                .func = func,
+                .first = first,
+                .step = step,
+        };
+
+        mp_workers_run_bands(
+                (MPBandFunc)run_band, &rows, num_rows, merge->num_threads);
+}
+
+static void
+make_luma(const uint16_t *frame,
+          uint8_t *luma,
+          uint8_t *coarse,
+          int width,
+          int luma_width,
+          int luma_height,
+          int depth)
+{
+        // The sum of 4 samples has depth + 2 bits
+        int shift = depth - 6;
+
+        for (int y = 0; y < luma_height; ++y) {
+                const uint16_t *row0 = frame + (size_t)y * 2 * width;
+                const uint16_t *row1 = row0 + width;
+                uint8_t *out = luma + (size_t)y * luma_width;
+
+                for (int x = 0; x < luma_width; ++x) {
+                        uint32_t sum = row0[2 * x] + row0[2 * x + 1] + row1[2 * x] +
+                                       row1[2 * x + 1];
+                        out[x] = MIN(sum >> shift, 255);
+                }
+        }
+
+        int coarse_width = luma_width / 2;
+        int coarse_height = luma_height / 2;
+        for (int y = 0; y < coarse_height; ++y) {
+                const uint8_t *row0 = luma + (size_t)y * 2 * luma_width;
+                const uint8_t *row1 = row0 + luma_width;
+                uint8_t *out = coarse + (size_t)y * coarse_width;
+
+                for (int x = 0; x < coarse_width; ++x) {
+                        out[x] = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] +
+                                  row1[2 * x + 1] + 2) >>
+                                 2;
+                }
+        }
+}
+
+// Sum of absolute differences of a 16 pixel wide block
+static uint32_t
+sad_16(const uint8_t *a, const uint8_t *b, int stride, int rows)
+{
+#if defined(__SSE2__)
+        __m128i sum = _mm_setzero_si128();
+        for (int y = 0; y < rows; ++y) {
+                __m128i va = _mm_loadu_si128((const __m128i *)(a + y * stride));
+                __m128i vb = _mm_loadu_si128((const __m128i *)(b + y * stride));
+                sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+        }
+        return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#elif defined(__ARM_NEON)
+        uint16x8_t sum = vdupq_n_u16(0);
+        for (int y = 0; y < rows; ++y) {
+                uint8x16_t va = vld1q_u8(a + y * stride);
+                uint8x16_t vb = vld1q_u8(b + y * stride);
+                sum = vpadalq_u8(sum, vabdq_u8(va, vb));
+        }
+        uint64x2_t sum64 = vpaddlq_u32(vpaddlq_u16(sum));
+        return vgetq_lane_u64(sum64, 0) + vgetq_lane_u64(sum64, 1);
+#else
+        uint32_t sum = 0;
+        for (int y = 0; y < rows; ++y) {
+                for (int x = 0; x < 16; ++x) {
+                        sum += abs(a[y * stride + x] - b[y * stride + x]);
+                }
+        }
+        return sum;
+#endif
+}
+
+// Sum of absolute differences of an 8 pixel wide block
+static uint32_t
+sad_8(const uint8_t *a, const uint8_t *b, int stride, int rows)
+{
+#if defined(__SSE2__)
+        __m128i sum = _mm_setzero_si128();
+        for (int y = 0; y < rows; ++y) {
+                __m128i va = _mm_loadl_epi64((const __m128i *)(a + y * stride));
+                __m128i vb = _mm_loadl_epi64((const __m128i *)(b + y * stride));
+                sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+        }
+        return _mm_cvtsi128_si32(sum);
+#elif defined(__ARM_NEON)
+        uint16x8_t sum = vdupq_n_u16(0);
+        for (int y = 0; y < rows; ++y) {
+                uint8x8_t va = vld1_u8(a + y * stride);
+                uint8x8_t vb = vld1_u8(b + y * stride);
+                sum = vabal_u8(sum, va, vb);
+        }
+        uint64x2_t sum64 = vpaddlq_u32(vpaddlq_u16(sum));
+        return vgetq_lane_u64(sum64, 0) + vgetq_lane_u64(sum64, 1);
+#else
+        uint32_t sum = 0;
+        for (int y = 0; y < rows; ++y) {
+                for (int x = 0; x < 8; ++x) {
+                        sum += abs(a[y * stride + x] - b[y * stride + x]);
+                }
+        }
+        return sum;
+#endif
+}
+
+static void
+align_tile_row(MPBurstMerge *merge, int ty)
+{
+        int cw = merge->coarse_width;
+        int ch = merge->coarse_height;
+        int lw = merge->luma_width;
+        int lh = merge->luma_height;
+
+        for (int tx = 0; tx < merge->tiles_x; ++tx) {
+                int lx = tx * TILE_STRIDE;
+                int ly = ty * TILE_STRIDE;
+
+                // Coarse search, preferring no movement on ties
+                int cx = lx / 2;
+                int cy = ly / 2;
+                const uint8_t *ref_coarse = merge->ref_coarse + cy * cw + cx;
+                int best_dx = 0, best_dy = 0;
+                uint32_t best =
+                        sad_8(ref_coarse, merge->coarse + cy * cw + cx, cw, 8);
+
+                for (int dy = -COARSE_SEARCH; dy <= COARSE_SEARCH; ++dy) {
+                        if (cy + dy < 0 || cy + dy + 8 > ch) {
+                                continue;
+                        }
+
+                        for (int dx = -COARSE_SEARCH; dx <= COARSE_SEARCH; ++dx) {
+                                if (cx + dx < 0 || cx + dx + 8 > cw) {
+                                        continue;
+                                }
+
+                                uint32_t sad = sad_8(
+                                        ref_coarse,
+                                        merge->coarse + (cy + dy) * cw + cx + dx,
+                                        cw,
+                                        8);
+                                if (sad < best) {
+                                        best = sad;
+                                        best_dx = dx;
+                                        best_dy = dy;
+                                }
+                        }
+                }
+
+                // Refine at full luma resolution
+                const uint8_t *ref_luma = merge->ref_luma + ly * lw + lx;
+                int center_dx = best_dx * 2;
+                int center_dy = best_dy * 2;
+                best = UINT32_MAX;
+
+                for (int dy = center_dy - FINE_SEARCH; dy <= center_dy + FINE_SEARCH;
+                     ++dy) {
+                        if (ly + dy < 0 || ly + dy + TILE_SIZE > lh) {
+                                continue;
+                        }
+
+                        for (int dx = center_dx - FINE_SEARCH;
+                             dx <= center_dx + FINE_SEARCH;
+                             ++dx) {
+                                if (lx + dx < 0 || lx + dx + TILE_SIZE > lw) {
+                                        continue;
+                                }
+
+                                uint32_t sad = sad_16(
+                                        ref_luma,
+                                        merge->luma + (ly + dy) * lw + lx + dx,
+                                        lw,
+                                        TILE_SIZE);
+                                if (sad < best) {
+                                        best = sad;
+                                        best_dx = dx;
+                                        best_dy = dy;
+                                }
+                        }
+                }
+
+                size_t tile = ty * merge->tiles_x + tx;
+                merge->tile_dx[tile] = best_dx * 2;
+                merge->tile_dy[tile] = best_dy * 2;
+
+                // Mean difference of the aligned raw tile, used for weighting
+                int rx = lx * 2;
+                int ry = ly * 2;
+                int dx = merge->tile_dx[tile];
+                int dy = merge->tile_dy[tile];
+                uint64_t diff = 0;
+                for (int y = 0; y < RAW_TILE_SIZE; ++y) {
+                        const uint16_t *a =
+                                merge->ref + (size_t)(ry + y) * merge->width + rx;
+                        const uint16_t *b = merge->frame +
+                                            (size_t)(ry + y + dy) * merge->width +
+                                            rx + dx;
+                        for (int x = 0; x < RAW_TILE_SIZE; ++x) {
+                                diff += abs(a[x] - b[x]);
+                        }
+                }
+                merge->tile_diff[tile] =
+                        (float)diff / (RAW_TILE_SIZE * RAW_TILE_SIZE);
+        }
+}
+
+static void
+accumulate_tile_row(MPBurstMerge *merge, int ty)
+{
+        for (int tx = 0; tx < merge->tiles_x; ++tx) {
+                size_t tile = ty * merge->tiles_x + tx;
+                float weight = merge->tile_weight[tile];
+                if (weight <= 0) {
+                        continue;
+                }
+
+                int rx = tx * TILE_STRIDE * 2;
+                int ry = ty * TILE_STRIDE * 2;
+                int dx = merge->tile_dx[tile];
+                int dy = merge->tile_dy[tile];
+
+                for (int y = 0; y < RAW_TILE_SIZE; ++y) {
+                        size_t dst = (size_t)(ry + y) * merge->width + rx;
+                        const uint16_t *src = merge->frame +
+                                              (size_t)(ry + y + dy) * merge->width +
+                                              rx + dx;
+                        float row_weight = weight * merge->window[y];
+
+                        for (int x = 0; x < RAW_TILE_SIZE; ++x) {
+                                float w = row_weight * merge->window[x];
+                                merge->num[dst + x] += w * src[x];
+                                merge->den[dst + x] += w;
+                        }
+                }
+        }
+}
+
+static int
+compare_float(const void *a, const void *b)
+{
+        float fa = *(const float *)a, fb = *(const float *)b;
+        return (fa > fb) - (fa < fb);
+}
+
+static void
+merge_frame(MPBurstMerge *merge)
+{
+        size_t num_tiles = (size_t)merge->tiles_x * merge->tiles_y;
+
+        if (merge->frames_merged == 0) {
+                // The reference is merged with full weight everywhere
+                memcpy(merge->ref,
+                       merge->frame,
+                       (size_t)merge->width * merge->height * sizeof(uint16_t));
+                make_luma(merge->ref,
+                          merge->ref_luma,
+                          merge->ref_coarse,
+                          merge->width,
+                          merge->luma_width,
+                          merge->luma_height,
+                          merge->depth);
+
+                for (size_t i = 0; i < num_tiles; ++i) {
+                        merge->tile_dx[i] = 0;
+                        merge->tile_dy[i] = 0;
+                        merge->tile_weight[i] = 1;
+                }
+        } else {
+                gint64 start = g_get_monotonic_time();
+
+                make_luma(merge->frame,
+                          merge->luma,
+                          merge->coarse,
+                          merge->width,
+                          merge->luma_width,
+                          merge->luma_height,
+                          merge->depth);
+
+                run_bands(merge, align_tile_row, 0, merge->tiles_y, 1);
+
+                // Estimate the noise level from the best matching quarter of
+                // the tiles, assuming at least that much of the scene is static
+                float *sorted = malloc(num_tiles * sizeof(float));
+                memcpy(sorted, merge->tile_diff, num_tiles * sizeof(float));
+                qsort(sorted, num_tiles, sizeof(float), compare_float);
+                float noise = num_tiles ? MAX(sorted[num_tiles / 4], 0.5f) : 1;
+                free(sorted);
+
+                int accepted = 0;
+                for (size_t i = 0; i < num_tiles; ++i) {
+                        float weight = (MATCH_REJECT * noise - merge->tile_diff[i]) /
+                                       ((MATCH_REJECT - MATCH_FULL) * noise);
+                        merge->tile_weight[i] = CLAMP(weight, 0, 1);
+                        accepted += merge->tile_weight[i] > 0;
+                }
+
+                // Running average over the non-reference frames
+                int n = merge->frames_merged - 1;
+                float fraction = num_tiles ? (float)accepted / num_tiles : 0;
+                merge->tiles_accepted =
+                        (merge->tiles_accepted * n + fraction) / (n + 1);
+
+                merge->align_time += (g_get_monotonic_time() - start) / 1e6;
+        }
+
+        gint64 start = g_get_monotonic_time();
+
+        // Overlapping tile rows are never blended at the same time
+        run_bands(merge, accumulate_tile_row, 0, merge->tiles_y, 2);
+        run_bands(merge, accumulate_tile_row, 1, merge->tiles_y, 2);
+
+        merge->merge_time += (g_get_monotonic_time() - start) / 1e6;
+
+        ++merge->frames_merged;
+}
+
+void
+mp_burst_merge_add_frame16(MPBurstMerge *merge, const uint16_t *image)
+{
+        memcpy(merge->frame,
+               image,
+               (size_t)merge->width * merge->height * sizeof(uint16_t));
+        merge_frame(merge);
+}
+
+void
+mp_burst_merge_add_frame(MPBurstMerge *merge,
+                         const uint8_t *image,
+                         const MPMode *mode)
+{
+        assert(mode->width == merge->width && mode->height == merge->height);
+
+        size_t row_length =
+                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width);
+        size_t stride = row_length + mp_pixel_format_width_to_padding(
+                                             mode->pixel_format, mode->width);
+
+        for (int y = 0; y < merge->height; ++y) {
+                const uint8_t *src = image + y * stride;
+                uint16_t *dst = merge->frame + (size_t)y * merge->width;
+
+                if (mp_pixel_format_bits_per_pixel(mode->pixel_format) == 10) {
+                        for (size_t x = 0; x < row_length; x += 5) {
+                                uint8_t lo = src[x + 4];
+                                dst[0] = (src[x] << 2) | (lo >> 6);
+                                dst[1] = (src[x + 1] << 2) | (lo >> 4 & 0x03);
+                                dst[2] = (src[x + 2] << 2) | (lo >> 2 & 0x03);
+                                dst[3] = (src[x + 3] << 2) | (lo & 0x03);
+                                dst += 4;
+                        }
+                } else {
+                        for (int x = 0; x < merge->width; ++x) {
+                                dst[x] = src[x];
+                        }
+                }
+        }
+
+        merge_frame(merge);
+}
+
+void
+mp_burst_merge_get_result(MPBurstMerge *merge, uint16_t *dst)
+{
+        float scale = 1 << (16 - merge->depth);
+        size_t num_pixels = (size_t)merge->width * merge->height;
+
+        for (size_t i = 0; i < num_pixels; ++i) {
+                float value = merge->den[i] > 0 ? merge->num[i] / merge->den[i] :
+                                                  merge->ref[i];
+                dst[i] = MIN(lroundf(value * scale), UINT16_MAX);
+        }
+}
+
+void
+mp_burst_merge_get_stats(MPBurstMerge *merge, MPBurstMergeStats *stats)
+{
+        stats->frames_merged = merge->frames_merged;
+        stats->tiles_accepted = merge->tiles_accepted;
+        stats->align_time = merge->align_time;
+        stats->merge_time = merge->merge_time;
+}
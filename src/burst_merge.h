@@ -0,0 +1,43 @@
+#pragma once
+
+#include "mode.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Align and merge a burst of raw Bayer frames into a single frame with less
+ * noise. The first frame added is the reference, the other frames are aligned
+ * to it per tile and averaged in with a weight that drops for tiles that
+ * don't match, so moving objects don't ghost.
+ */
+typedef struct _MPBurstMerge MPBurstMerge;
+
+typedef struct {
+        int frames_merged;
+
+        // Fraction of tiles of the non-reference frames that were merged in
+        float tiles_accepted;
+
+        double align_time;
+        double merge_time;
+} MPBurstMergeStats;
+
+MPBurstMerge *mp_burst_merge_new(int width, int height, int depth, int num_threads);
+void mp_burst_merge_free(MPBurstMerge *merge);
+
+// Add a frame in the sensor format of mode, the row padding is skipped
+void mp_burst_merge_add_frame(MPBurstMerge *merge,
+                              const uint8_t *image,
+                              const MPMode *mode);
+// Add a frame of unpacked samples with `depth` bits each
+void mp_burst_merge_add_frame16(MPBurstMerge *merge, const uint16_t *image);
+
+/*
+ * Get the merged frame as 16-bit samples. The result is scaled up from the
+ * input depth to keep the extra precision of the average, the black and white
+ * levels scale by the same 1 << (16 - depth).
+ */
+void mp_burst_merge_get_result(MPBurstMerge *merge, uint16_t *dst);
+
+void mp_burst_merge_get_stats(MPBurstMerge *merge, MPBurstMergeStats *stats);
@@ -1,18 +1,22 @@
 #include "camera.h"
+#include "control_writer.h"
 #include "mode.h"
+#include "recording.h"
+#include "trace.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <glib.h>
 #include <linux/v4l2-subdev.h>
+#include <poll.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/wait.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #define MAX_VIDEO_BUFFERS 20
-#define MAX_BG_TASKS 8
+#define MAX_CACHED_CONTROLS 64
 
 static void
 errno_printerr(const char *s)
@@ -30,12 +34,19 @@ xioctl(int fd, int request, void *arg)
         return r;
 }
 
+static void load_controls(MPCamera *camera);
+
 struct video_buffer {
         uint32_t length;
         uint8_t *data;
         int fd;
 };
 
+struct cached_control {
+        MPControl control;
+        int32_t value;
+};
+
 struct _MPCamera {
         int video_fd;
         int subdev_fd;
@@ -44,15 +55,46 @@ struct _MPCamera {
         bool has_set_mode;
         MPMode current_mode;
 
+        // What was last applied to each device and what it made of it, so
+        // setting a mode only reprograms the devices that differ
+        bool has_subdev_format;
+        MPMode subdev_request;
+        MPMode subdev_mode;
+        bool has_video_format;
+        MPMode video_request;
+        MPMode video_mode;
+
         struct video_buffer buffers[MAX_VIDEO_BUFFERS];
         uint32_t num_buffers;
 
-        // keeping track of background task child-PIDs for cleanup code
-        int child_bg_pids[MAX_BG_TASKS];
+        // Writes the controls set in the background, made on the first one
+        MPControlWriter *control_writer;
+
+        // Integer controls read when the camera is opened, kept up to date by
+        // the control events subscribed to for each
+        struct cached_control cached_controls[MAX_CACHED_CONTROLS];
+        int num_cached_controls;
 
         bool use_mplane;
+
+        // Set when frames come from a recording instead of a device, the
+        // video fd is then a timer that paces the frames
+        MPRecording *replay;
+        float replay_rate;
+        int replay_position;
+        bool replay_buffer_used[MAX_VIDEO_BUFFERS];
+        const MPRecordedFrame *replay_frame;
 };
 
+static int
+control_fd(MPCamera *camera)
+{
+        if (camera->subdev_fd != -1) {
+                return camera->subdev_fd;
+        }
+        return camera->video_fd;
+}
+
 MPCamera *
 mp_camera_new(int video_fd, int subdev_fd, int bridge_fd)
 {
@@ -79,105 +121,93 @@ mp_camera_new(int video_fd, int subdev_fd, int bridge_fd)
         camera->subdev_fd = subdev_fd;
         camera->bridge_fd = bridge_fd;
         camera->has_set_mode = false;
+        camera->has_subdev_format = false;
+        camera->has_video_format = false;
         camera->num_buffers = 0;
         camera->use_mplane = use_mplane;
-        memset(camera->child_bg_pids,
-               0,
-               sizeof(camera->child_bg_pids[0]) * MAX_BG_TASKS);
+        camera->control_writer = NULL;
+        camera->num_cached_controls = 0;
+        camera->replay = NULL;
+
+        load_controls(camera);
         return camera;
 }
 
-void
-mp_camera_free(MPCamera *camera)
+MPCamera *
+mp_camera_new_replay(const char *path, float rate)
 {
-        mp_camera_wait_bg_tasks(camera);
+        MPRecording *recording = mp_recording_open(path);
+        if (!recording) {
+                return NULL;
+        }
 
-        g_warn_if_fail(camera->num_buffers == 0);
-        if (camera->num_buffers != 0) {
-                mp_camera_stop_capture(camera);
+        if (mp_recording_get_num_frames(recording) == 0) {
+                g_printerr("Recording %s has no frames\n", path);
+                mp_recording_close(recording);
+                return NULL;
         }
 
-        free(camera);
+        int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd == -1) {
+                errno_printerr("timerfd_create");
+                mp_recording_close(recording);
+                return NULL;
+        }
+
+        MPCamera *camera = calloc(1, sizeof(MPCamera));
+        camera->video_fd = timer_fd;
+        camera->subdev_fd = -1;
+        camera->bridge_fd = -1;
+        camera->replay = recording;
+        camera->replay_rate = rate;
+        camera->replay_frame = mp_recording_get_frame(recording, 0);
+        return camera;
 }
 
 void
-mp_camera_add_bg_task(MPCamera *camera, pid_t pid)
+mp_camera_free(MPCamera *camera)
 {
-        int status;
-        while (true) {
-                for (size_t i = 0; i < MAX_BG_TASKS; ++i) {
-                        if (camera->child_bg_pids[i] == 0) {
-                                camera->child_bg_pids[i] = pid;
-                                return;
-                        } else {
-                                // error == -1, still running == 0
-                                if (waitpid(camera->child_bg_pids[i],
-                                            &status,
-                                            WNOHANG) <= 0)
-                                        continue; // consider errored wait still
-                                                  // running
-
-                                if (WIFEXITED(status)) {
-                                        // replace exited
-                                        camera->child_bg_pids[i] = pid;
-                                        return;
-                                }
-                        }
-                }
+        if (camera->control_writer) {
+                mp_control_writer_free(camera->control_writer);
+        }
 
-                // wait for any status change on child processes
-                pid_t changed = waitpid(-1, &status, 0);
-                if (WIFEXITED(status)) {
-                        // some child exited
-                        for (size_t i = 0; i < MAX_BG_TASKS; ++i) {
-                                if (camera->child_bg_pids[i] == changed) {
-                                        camera->child_bg_pids[i] = pid;
-                                        return;
-                                }
-                        }
-                }
+        if (camera->num_cached_controls > 0) {
+                struct v4l2_event_subscription subscription = {
+                        .type = V4L2_EVENT_ALL,
+                };
+                xioctl(control_fd(camera),
+                       VIDIOC_UNSUBSCRIBE_EVENT,
+                       &subscription);
+        }
 
-                // no luck, repeat and check if something exited maybe
+        g_warn_if_fail(camera->num_buffers == 0);
+        if (camera->num_buffers != 0) {
+                mp_camera_stop_capture(camera);
         }
+
+        if (camera->replay) {
+                close(camera->video_fd);
+                mp_recording_close(camera->replay);
+        }
+
+        free(camera);
 }
 
 void
 mp_camera_wait_bg_tasks(MPCamera *camera)
 {
-        for (size_t i = 0; i < MAX_BG_TASKS; ++i) {
-                if (camera->child_bg_pids[i] != 0) {
-                        // ignore errors
-                        waitpid(camera->child_bg_pids[i], NULL, 0);
-                }
+        if (camera->control_writer) {
+                mp_control_writer_sync(camera->control_writer);
         }
 }
 
 bool
-mp_camera_check_task_complete(MPCamera *camera, pid_t pid)
+mp_camera_check_task_complete(MPCamera *camera, MPControlTask task)
 {
-        // this method is potentially unsafe because pid could already be reused at
-        // this point, but extremely unlikely so we won't implement this.
-        int status;
-
-        if (pid == 0)
+        if (task == 0) {
                 return true;
-
-        // ignore errors (-1), no exit == 0
-        int pidchange = waitpid(pid, &status, WNOHANG);
-        if (pidchange == -1) // error or exists and runs
-                return false;
-
-        if (WIFEXITED(status)) {
-                for (size_t i = 0; i < MAX_BG_TASKS; ++i) {
-                        if (camera->child_bg_pids[i] == pid) {
-                                camera->child_bg_pids[i] = 0;
-                                break;
-                        }
-                }
-                return true;
-        } else {
-                return false;
         }
+        return mp_control_writer_is_complete(camera->control_writer, task);
 }
 
 bool
@@ -245,9 +275,36 @@ camera_mode_impl(MPCamera *camera, int request, MPMode *mode)
         return true;
 }
 
+/*
+ * Replay only has the modes that were recorded, pick the one with the same
+ * format and size or fall back to the mode of the first frame.
+ */
+static void
+replay_find_mode(MPCamera *camera, MPMode *mode)
+{
+        int num_frames = mp_recording_get_num_frames(camera->replay);
+        for (int i = 0; i < num_frames; ++i) {
+                const MPMode *recorded =
+                        &mp_recording_get_frame(camera->replay, i)->mode;
+                if (recorded->pixel_format == mode->pixel_format &&
+                    recorded->width == mode->width &&
+                    recorded->height == mode->height) {
+                        *mode = *recorded;
+                        return;
+                }
+        }
+
+        *mode = mp_recording_get_frame(camera->replay, 0)->mode;
+}
+
 bool
 mp_camera_try_mode(MPCamera *camera, MPMode *mode)
 {
+        if (camera->replay) {
+                replay_find_mode(camera, mode);
+                return true;
+        }
+
         if (!camera_mode_impl(camera, VIDIOC_TRY_FMT, mode)) {
                 errno_printerr("VIDIOC_S_FMT");
                 return false;
@@ -261,89 +318,130 @@ mp_camera_get_mode(const MPCamera *camera)
         return &camera->current_mode;
 }
 
-bool
-mp_camera_set_mode(MPCamera *camera, MPMode *mode)
+// Sets the frame interval and format of the sensor subdev and the bridge
+static bool
+set_subdev_mode(MPCamera *camera, MPMode *mode)
 {
-        // Set the mode in the subdev the camera is one
-        if (mp_camera_is_subdev(camera)) {
-                struct v4l2_subdev_frame_interval interval = {};
-                interval.pad = 0;
+        camera->has_subdev_format = false;
+        camera->subdev_request = *mode;
+
+        struct v4l2_subdev_frame_interval interval = {};
+        interval.pad = 0;
+        interval.interval = mode->frame_interval;
+        if (xioctl(camera->subdev_fd,
+                   VIDIOC_SUBDEV_S_FRAME_INTERVAL,
+                   &interval) == -1) {
+                errno_printerr("VIDIOC_SUBDEV_S_FRAME_INTERVAL");
+        }
+
+        bool did_set_frame_rate =
+                interval.interval.numerator == mode->frame_interval.numerator &&
+                interval.interval.denominator == mode->frame_interval.denominator;
+
+        struct v4l2_subdev_format fmt = {};
+        fmt.pad = 0;
+        fmt.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+        fmt.format.width = mode->width;
+        fmt.format.height = mode->height;
+        fmt.format.code = mp_pixel_format_to_v4l_bus_code(mode->pixel_format);
+        fmt.format.field = V4L2_FIELD_ANY;
+        if (xioctl(camera->subdev_fd, VIDIOC_SUBDEV_S_FMT, &fmt) == -1) {
+                errno_printerr("VIDIOC_SUBDEV_S_FMT");
+                return false;
+        }
+
+        // sun6i-csi-bridge will return EINVAL when trying to read
+        // frames if the resolution it's configured with doesn't match
+        // the resolution of its input.
+        if (camera->bridge_fd > 0) {
+                struct v4l2_subdev_format bridge_fmt = fmt;
+
+                if (xioctl(camera->bridge_fd, VIDIOC_SUBDEV_S_FMT, &bridge_fmt) ==
+                    -1) {
+                        errno_printerr("VIDIOC_SUBDEV_S_FMT");
+                        return false;
+                }
+
+                if (fmt.format.width != bridge_fmt.format.width ||
+                    fmt.format.height != bridge_fmt.format.height) {
+                        g_printerr("Bridge format resolution mismatch\n");
+                        return false;
+                }
+        }
+
+        // Some drivers like ov5640 don't allow you to set the frame format
+        // with too high a frame-rate, but that means the frame-rate won't be
+        // set after the format change. So we need to try again here if we
+        // didn't succeed before. Ideally we'd be able to set both at once.
+        if (!did_set_frame_rate) {
                 interval.interval = mode->frame_interval;
                 if (xioctl(camera->subdev_fd,
                            VIDIOC_SUBDEV_S_FRAME_INTERVAL,
                            &interval) == -1) {
                         errno_printerr("VIDIOC_SUBDEV_S_FRAME_INTERVAL");
                 }
+        }
 
-                bool did_set_frame_rate = interval.interval.numerator ==
-                                                  mode->frame_interval.numerator &&
-                                          interval.interval.denominator ==
-                                                  mode->frame_interval.denominator;
+        // Update the mode
 
-                struct v4l2_subdev_format fmt = {};
-                fmt.pad = 0;
-                fmt.which = V4L2_SUBDEV_FORMAT_ACTIVE;
-                fmt.format.width = mode->width;
-                fmt.format.height = mode->height;
-                fmt.format.code =
-                        mp_pixel_format_to_v4l_bus_code(mode->pixel_format);
-                fmt.format.field = V4L2_FIELD_ANY;
-                if (xioctl(camera->subdev_fd, VIDIOC_SUBDEV_S_FMT, &fmt) == -1) {
-                        errno_printerr("VIDIOC_SUBDEV_S_FMT");
-                        return false;
-                }
+        // TODO: Some how the format gets changed to YUYV if this isn't
+        // commented out.
+        //mode->pixel_format =
+        //        mp_pixel_format_from_v4l_bus_code(fmt.format.code);
 
-                // sun6i-csi-bridge will return EINVAL when trying to read
-                // frames if the resolution it's configured with doesn't match
-                // the resolution of its input.
-                if (camera->bridge_fd > 0) {
-                        struct v4l2_subdev_format bridge_fmt = fmt;
-
-                        if (xioctl(camera->bridge_fd,
-                                   VIDIOC_SUBDEV_S_FMT,
-                                   &bridge_fmt) == -1) {
-                                errno_printerr("VIDIOC_SUBDEV_S_FMT");
-                                return false;
-                        }
+        mode->frame_interval = interval.interval;
+        mode->width = fmt.format.width;
+        mode->height = fmt.format.height;
 
-                        if (fmt.format.width != bridge_fmt.format.width ||
-                            fmt.format.height != bridge_fmt.format.height) {
-                                g_printerr("Bridge format resolution mismatch\n");
-                                return false;
-                        }
-                }
-
-                // Some drivers like ov5640 don't allow you to set the frame format
-                // with too high a frame-rate, but that means the frame-rate won't be
-                // set after the format change. So we need to try again here if we
-                // didn't succeed before. Ideally we'd be able to set both at once.
-                if (!did_set_frame_rate) {
-                        interval.interval = mode->frame_interval;
-                        if (xioctl(camera->subdev_fd,
-                                   VIDIOC_SUBDEV_S_FRAME_INTERVAL,
-                                   &interval) == -1) {
-                                errno_printerr("VIDIOC_SUBDEV_S_FRAME_INTERVAL");
-                        }
-                }
+        camera->has_subdev_format = true;
+        camera->subdev_mode = *mode;
+        return true;
+}
 
-                // Update the mode
+void
+mp_camera_invalidate_mode(MPCamera *camera)
+{
+        camera->has_subdev_format = false;
+        camera->has_video_format = false;
+}
 
-                // TODO: Some how the format gets changed to YUYV if this isn't
-                // commented out.
-                //mode->pixel_format =
-                //        mp_pixel_format_from_v4l_bus_code(fmt.format.code);
+bool
+mp_camera_set_mode(MPCamera *camera, MPMode *mode)
+{
+        if (camera->replay) {
+                replay_find_mode(camera, mode);
+                camera->has_set_mode = true;
+                camera->current_mode = *mode;
+                return true;
+        }
 
-                mode->frame_interval = interval.interval;
-                mode->width = fmt.format.width;
-                mode->height = fmt.format.height;
+        // Set the mode in the subdev the camera is one
+        if (mp_camera_is_subdev(camera)) {
+                if (camera->has_subdev_format &&
+                    mp_mode_is_equivalent(mode, &camera->subdev_request)) {
+                        mode->frame_interval = camera->subdev_mode.frame_interval;
+                        mode->width = camera->subdev_mode.width;
+                        mode->height = camera->subdev_mode.height;
+                } else if (!set_subdev_mode(camera, mode)) {
+                        return false;
+                }
         }
 
         // Set the mode for the video device
-        {
+        if (camera->has_video_format &&
+            mp_mode_is_equivalent(mode, &camera->video_request)) {
+                mode->width = camera->video_mode.width;
+                mode->height = camera->video_mode.height;
+                mode->pixel_format = camera->video_mode.pixel_format;
+        } else {
+                camera->has_video_format = false;
+                camera->video_request = *mode;
                 if (!camera_mode_impl(camera, VIDIOC_S_FMT, mode)) {
                         errno_printerr("VIDIOC_S_FMT");
                         return false;
                 }
+                camera->has_video_format = true;
+                camera->video_mode = *mode;
         }
 
         camera->has_set_mode = true;
@@ -358,6 +456,20 @@ mp_camera_start_capture(MPCamera *camera)
         g_return_val_if_fail(camera->has_set_mode, false);
         g_return_val_if_fail(camera->num_buffers == 0, false);
 
+        if (camera->replay) {
+                camera->num_buffers = MAX_VIDEO_BUFFERS;
+                memset(camera->replay_buffer_used,
+                       0,
+                       sizeof(camera->replay_buffer_used));
+
+                // Deliver the first frame right away
+                struct itimerspec timer = {
+                        .it_value = { .tv_nsec = 1 },
+                };
+                timerfd_settime(camera->video_fd, 0, &timer, NULL);
+                return true;
+        }
+
         const enum v4l2_buf_type buftype = get_buf_type(camera);
 
         // Start by requesting buffers
@@ -502,6 +614,13 @@ mp_camera_stop_capture(MPCamera *camera)
 {
         g_return_val_if_fail(camera->num_buffers > 0, false);
 
+        if (camera->replay) {
+                struct itimerspec timer = {};
+                timerfd_settime(camera->video_fd, 0, &timer, NULL);
+                camera->num_buffers = 0;
+                return true;
+        }
+
         const enum v4l2_buf_type buftype = get_buf_type(camera);
 
         enum v4l2_buf_type type = buftype;
@@ -540,9 +659,99 @@ mp_camera_is_capturing(MPCamera *camera)
         return camera->num_buffers > 0;
 }
 
+uint32_t
+mp_camera_get_num_buffers(MPCamera *camera)
+{
+        return camera->num_buffers;
+}
+
+static int
+replay_next_frame(MPCamera *camera, int position)
+{
+        int num_frames = mp_recording_get_num_frames(camera->replay);
+        for (int i = 0; i < num_frames; ++i) {
+                int index = (position + i) % num_frames;
+                const MPRecordedFrame *frame =
+                        mp_recording_get_frame(camera->replay, index);
+                if (mp_mode_is_equivalent(&frame->mode, &camera->current_mode)) {
+                        return index;
+                }
+        }
+        return -1;
+}
+
+static bool
+replay_capture_buffer(MPCamera *camera, MPBuffer *buffer)
+{
+        uint64_t expirations;
+        if (read(camera->video_fd, &expirations, sizeof(expirations)) == -1) {
+                return false;
+        }
+
+        int index = replay_next_frame(camera, camera->replay_position);
+        if (index == -1) {
+                return false;
+        }
+
+        const MPRecordedFrame *frame =
+                mp_recording_get_frame(camera->replay, index);
+        int next = replay_next_frame(camera, index + 1);
+        const MPRecordedFrame *next_frame =
+                mp_recording_get_frame(camera->replay, next);
+        camera->replay_position = next;
+
+        // Pace at the forced rate, the recorded timestamps or the frame
+        // interval of the mode, in that order
+        int64_t delay_ns;
+        const struct v4l2_fract *interval = &camera->current_mode.frame_interval;
+        if (camera->replay_rate > 0) {
+                delay_ns = 1000000000 / camera->replay_rate;
+        } else if (next_frame->timestamp > frame->timestamp) {
+                delay_ns = (next_frame->timestamp - frame->timestamp) * 1000;
+        } else if (interval->denominator > 0) {
+                delay_ns = 1000000000ll * interval->numerator /
+                           interval->denominator;
+        } else {
+                delay_ns = 1000000000 / 30;
+        }
+
+        struct itimerspec timer = {
+                .it_value = {
+                        .tv_sec = delay_ns / 1000000000,
+                        .tv_nsec = MAX(delay_ns % 1000000000, 1),
+                },
+        };
+        timerfd_settime(camera->video_fd, 0, &timer, NULL);
+
+        // Like a sensor, drop the frame when every buffer is in use
+        for (uint32_t i = 0; i < camera->num_buffers; ++i) {
+                if (camera->replay_buffer_used[i]) {
+                        continue;
+                }
+
+                camera->replay_buffer_used[i] = true;
+                camera->replay_frame = frame;
+
+                buffer->index = i;
+                buffer->data = (uint8_t *)frame->data;
+                buffer->fd = -1;
+                buffer->sequence = frame->sequence;
+                // Delivery time, so traces of a replay measure its latency
+                buffer->timestamp = mp_trace_now();
+                mp_trace_frame(buffer->sequence, buffer->timestamp);
+                return true;
+        }
+
+        return false;
+}
+
 bool
 mp_camera_capture_buffer(MPCamera *camera, MPBuffer *buffer)
 {
+        if (camera->replay) {
+                return replay_capture_buffer(camera, buffer);
+        }
+
         const enum v4l2_buf_type buftype = get_buf_type(camera);
 
         struct v4l2_buffer buf = {};
@@ -555,6 +764,7 @@ mp_camera_capture_buffer(MPCamera *camera, MPBuffer *buffer)
                 buf.length = 1;
         }
 
+        int64_t trace_start = mp_trace_now();
         if (xioctl(camera->video_fd, VIDIOC_DQBUF, &buf) == -1) {
                 switch (errno) {
                 case EAGAIN:
@@ -588,6 +798,12 @@ mp_camera_capture_buffer(MPCamera *camera, MPBuffer *buffer)
         buffer->index = buf.index;
         buffer->data = camera->buffers[buf.index].data;
         buffer->fd = camera->buffers[buf.index].fd;
+        buffer->sequence = buf.sequence;
+        buffer->timestamp =
+                (int64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+
+        mp_trace_frame(buffer->sequence, buffer->timestamp);
+        mp_trace_span("dqbuf", buffer->sequence, trace_start);
 
         return true;
 }
@@ -595,6 +811,11 @@ mp_camera_capture_buffer(MPCamera *camera, MPBuffer *buffer)
 bool
 mp_camera_release_buffer(MPCamera *camera, uint32_t buffer_index)
 {
+        if (camera->replay) {
+                camera->replay_buffer_used[buffer_index] = false;
+                return true;
+        }
+
         const enum v4l2_buf_type buftype = get_buf_type(camera);
 
         struct v4l2_buffer buf = {};
@@ -801,10 +1022,42 @@ available_modes(MPCamera *camera, MPMode *mode)
                mp_mode_is_equivalent(mode, &attempt);
 }
 
+static MPModeList *
+get_replay_modes(MPCamera *camera)
+{
+        MPModeList *item = NULL;
+
+        int num_frames = mp_recording_get_num_frames(camera->replay);
+        for (int i = 0; i < num_frames; ++i) {
+                const MPMode *mode =
+                        &mp_recording_get_frame(camera->replay, i)->mode;
+
+                bool is_listed = false;
+                for (MPModeList *other = item; other; other = other->next) {
+                        if (mp_mode_is_equivalent(&other->mode, mode)) {
+                                is_listed = true;
+                                break;
+                        }
+                }
+                if (is_listed) {
+                        continue;
+                }
+
+                MPModeList *new_item = malloc(sizeof(MPModeList));
+                new_item->mode = *mode;
+                new_item->next = item;
+                item = new_item;
+        }
+
+        return item;
+}
+
 MPModeList *
 mp_camera_list_supported_modes(MPCamera *camera)
 {
-        if (mp_camera_is_subdev(camera)) {
+        if (camera->replay) {
+                return get_replay_modes(camera);
+        } else if (mp_camera_is_subdev(camera)) {
                 return get_subdev_modes(camera, all_modes);
         } else {
                 return get_video_modes(camera, all_modes);
@@ -814,7 +1067,9 @@ mp_camera_list_supported_modes(MPCamera *camera)
 MPModeList *
 mp_camera_list_available_modes(MPCamera *camera)
 {
-        if (mp_camera_is_subdev(camera)) {
+        if (camera->replay) {
+                return get_replay_modes(camera);
+        } else if (mp_camera_is_subdev(camera)) {
                 return get_subdev_modes(camera, available_modes);
         } else {
                 return get_video_modes(camera, available_modes);
@@ -1014,13 +1269,151 @@ struct _MPControlList {
         MPControlList *next;
 };
 
-static int
-control_fd(MPCamera *camera)
+static void
+control_from_query(const struct v4l2_query_ext_ctrl *ctrl, MPControl *control)
 {
-        if (camera->subdev_fd != -1) {
-                return camera->subdev_fd;
+        control->id = ctrl->id;
+        control->type = ctrl->type;
+        strcpy(control->name, ctrl->name);
+        control->min = ctrl->minimum;
+        control->max = ctrl->maximum;
+        control->step = ctrl->step;
+        control->default_value = ctrl->default_value;
+        control->flags = ctrl->flags;
+        control->element_size = ctrl->elem_size;
+        control->element_count = ctrl->elems;
+        control->dimensions_count = ctrl->nr_of_dims;
+        memcpy(control->dimensions,
+               ctrl->dims,
+               sizeof(uint32_t) * V4L2_CTRL_MAX_DIMS);
+}
+
+static bool
+is_int32_control(uint32_t type)
+{
+        switch (type) {
+        case V4L2_CTRL_TYPE_INTEGER:
+        case V4L2_CTRL_TYPE_BOOLEAN:
+        case V4L2_CTRL_TYPE_MENU:
+        case V4L2_CTRL_TYPE_INTEGER_MENU:
+                return true;
         }
-        return camera->video_fd;
+        return false;
+}
+
+/*
+ * Reads the integer controls of the camera once and subscribes to their
+ * events, which report every later change to the value or range, including the
+ * ones made through this fd. Controls that can't be subscribed to aren't
+ * cached and are read from the driver as before.
+ */
+static void
+load_controls(MPCamera *camera)
+{
+        int fd = control_fd(camera);
+
+        struct v4l2_query_ext_ctrl ctrl = {};
+        ctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+        while (camera->num_cached_controls < MAX_CACHED_CONTROLS &&
+               xioctl(fd, VIDIOC_QUERY_EXT_CTRL, &ctrl) != -1) {
+                uint32_t id = ctrl.id;
+                ctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+
+                if (!is_int32_control(ctrl.type) ||
+                    ctrl.flags & V4L2_CTRL_FLAG_WRITE_ONLY) {
+                        continue;
+                }
+
+                struct v4l2_event_subscription subscription = {
+                        .type = V4L2_EVENT_CTRL,
+                        .id = id,
+                        .flags = V4L2_EVENT_SUB_FL_ALLOW_FEEDBACK,
+                };
+                if (xioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &subscription) == -1) {
+                        continue;
+                }
+
+                // Read after subscribing, so no change can be missed
+                struct v4l2_ext_control value = { .id = id };
+                struct v4l2_ext_controls values = {
+                        .which = V4L2_CTRL_WHICH_CUR_VAL,
+                        .count = 1,
+                        .controls = &value,
+                };
+                if (xioctl(fd, VIDIOC_G_EXT_CTRLS, &values) == -1) {
+                        xioctl(fd, VIDIOC_UNSUBSCRIBE_EVENT, &subscription);
+                        continue;
+                }
+
+                struct cached_control *cached =
+                        &camera->cached_controls[camera->num_cached_controls++];
+                control_from_query(&ctrl, &cached->control);
+                cached->control.id = id;
+                cached->value = value.value;
+        }
+}
+
+static struct cached_control *
+find_cached_control(MPCamera *camera, uint32_t id)
+{
+        for (int i = 0; i < camera->num_cached_controls; ++i) {
+                if (camera->cached_controls[i].control.id == id) {
+                        return &camera->cached_controls[i];
+                }
+        }
+        return NULL;
+}
+
+int
+mp_camera_get_control_event_fd(MPCamera *camera)
+{
+        if (camera->num_cached_controls == 0) {
+                return -1;
+        }
+        return control_fd(camera);
+}
+
+bool
+mp_camera_handle_control_events(MPCamera *camera)
+{
+        int fd = control_fd(camera);
+        bool changed = false;
+
+        // Dequeuing blocks on a blocking fd, so only do it while one is pending
+        struct pollfd pollfd = { .fd = fd, .events = POLLPRI };
+        while (camera->num_cached_controls > 0 && poll(&pollfd, 1, 0) > 0 &&
+               pollfd.revents & POLLPRI) {
+                struct v4l2_event event;
+                if (xioctl(fd, VIDIOC_DQEVENT, &event) == -1) {
+                        break;
+                }
+
+                struct cached_control *cached =
+                        find_cached_control(camera, event.id);
+                if (event.type != V4L2_EVENT_CTRL || !cached) {
+                        continue;
+                }
+
+                const struct v4l2_event_ctrl *ctrl = &event.u.ctrl;
+                if (ctrl->changes & V4L2_EVENT_CTRL_CH_VALUE &&
+                    cached->value != ctrl->value) {
+                        cached->value = ctrl->value;
+                        changed = true;
+                }
+                if (ctrl->changes & V4L2_EVENT_CTRL_CH_FLAGS) {
+                        cached->control.flags = ctrl->flags;
+                        changed = true;
+                }
+                if (ctrl->changes & V4L2_EVENT_CTRL_CH_RANGE) {
+                        cached->control.min = ctrl->minimum;
+                        cached->control.max = ctrl->maximum;
+                        cached->control.step = ctrl->step;
+                        cached->control.default_value = ctrl->default_value;
+                        changed = true;
+                }
+        }
+
+        return changed;
 }
 
 MPControlList *
@@ -1028,6 +1421,10 @@ mp_camera_list_controls(MPCamera *camera)
 {
         MPControlList *item = NULL;
 
+        if (camera->replay) {
+                return item;
+        }
+
         struct v4l2_query_ext_ctrl ctrl = {};
         ctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
         while (true) {
@@ -1038,28 +1435,8 @@ mp_camera_list_controls(MPCamera *camera)
                         break;
                 }
 
-                MPControl control = {
-                        .id = ctrl.id,
-                        .type = ctrl.type,
-                        .name = {},
-                        .min = ctrl.minimum,
-                        .max = ctrl.maximum,
-                        .step = ctrl.step,
-                        .default_value = ctrl.default_value,
-                        .flags = ctrl.flags,
-                        .element_size = ctrl.elem_size,
-                        .element_count = ctrl.elems,
-                        .dimensions_count = ctrl.nr_of_dims,
-                        .dimensions = {},
-                };
-
-                strcpy(control.name, ctrl.name);
-                memcpy(control.dimensions,
-                       ctrl.dims,
-                       sizeof(uint32_t) * V4L2_CTRL_MAX_DIMS);
-
                 MPControlList *new_item = malloc(sizeof(MPControlList));
-                new_item->control = control;
+                control_from_query(&ctrl, &new_item->control);
                 new_item->next = item;
                 item = new_item;
 
@@ -1093,9 +1470,81 @@ mp_control_list_free(MPControlList *list)
         }
 }
 
+/*
+ * A replayed camera has the gain and exposure controls, reporting the values
+ * recorded with the current frame. Setting them is accepted and ignored.
+ */
+static bool
+replay_query_control(MPCamera *camera, uint32_t id, MPControl *control)
+{
+        MPControl replay_control = {
+                .id = id,
+                .min = 0,
+                .step = 1,
+                .element_size = sizeof(int32_t),
+                .element_count = 1,
+        };
+
+        switch (id) {
+        case V4L2_CID_GAIN:
+        case V4L2_CID_ANALOGUE_GAIN:
+                replay_control.type = V4L2_CTRL_TYPE_INTEGER;
+                replay_control.max = mp_recording_get_gain_max(camera->replay);
+                break;
+        case V4L2_CID_EXPOSURE:
+                replay_control.type = V4L2_CTRL_TYPE_INTEGER;
+                replay_control.max = mp_recording_get_exposure_max(camera->replay);
+                break;
+        case V4L2_CID_AUTOGAIN:
+        case V4L2_CID_EXPOSURE_AUTO:
+                replay_control.type = V4L2_CTRL_TYPE_BOOLEAN;
+                replay_control.max = 1;
+                break;
+        default:
+                return false;
+        }
+
+        strcpy(replay_control.name, mp_control_id_to_str(id));
+        if (control) {
+                *control = replay_control;
+        }
+        return true;
+}
+
+static int32_t
+replay_get_control(MPCamera *camera, uint32_t id)
+{
+        const MPRecordedFrame *frame = camera->replay_frame;
+        switch (id) {
+        case V4L2_CID_GAIN:
+        case V4L2_CID_ANALOGUE_GAIN:
+                return frame->gain;
+        case V4L2_CID_EXPOSURE:
+                return frame->exposure;
+        case V4L2_CID_AUTOGAIN:
+                return !frame->gain_is_manual;
+        case V4L2_CID_EXPOSURE_AUTO:
+                return frame->exposure_is_manual ? V4L2_EXPOSURE_MANUAL
+                                                 : V4L2_EXPOSURE_AUTO;
+        }
+        return 0;
+}
+
 bool
 mp_camera_query_control(MPCamera *camera, uint32_t id, MPControl *control)
 {
+        if (camera->replay) {
+                return replay_query_control(camera, id, control);
+        }
+
+        struct cached_control *cached = find_cached_control(camera, id);
+        if (cached) {
+                if (control) {
+                        *control = cached->control;
+                }
+                return true;
+        }
+
         struct v4l2_query_ext_ctrl ctrl = {};
         ctrl.id = id;
         if (xioctl(control_fd(camera), VIDIOC_QUERY_EXT_CTRL, &ctrl) == -1) {
@@ -1106,20 +1555,7 @@ mp_camera_query_control(MPCamera *camera, uint32_t id, MPControl *control)
         }
 
         if (control) {
-                control->id = ctrl.id;
-                control->type = ctrl.type;
-                strcpy(control->name, ctrl.name);
-                control->min = ctrl.minimum;
-                control->max = ctrl.maximum;
-                control->step = ctrl.step;
-                control->default_value = ctrl.default_value;
-                control->flags = ctrl.flags;
-                control->element_size = ctrl.elem_size;
-                control->element_count = ctrl.elems;
-                control->dimensions_count = ctrl.nr_of_dims;
-                memcpy(control->dimensions,
-                       ctrl.dims,
-                       sizeof(uint32_t) * V4L2_CTRL_MAX_DIMS);
+                control_from_query(&ctrl, control);
         }
         return true;
 }
@@ -1127,6 +1563,26 @@ mp_camera_query_control(MPCamera *camera, uint32_t id, MPControl *control)
 static bool
 control_impl_int32(MPCamera *camera, uint32_t id, int request, int32_t *value)
 {
+        if (camera->replay) {
+                if (!replay_query_control(camera, id, NULL)) {
+                        return false;
+                }
+                // The request codes don't fit in an int without wrapping
+                if (request == (int)VIDIOC_G_EXT_CTRLS) {
+                        *value = replay_get_control(camera, id);
+                }
+                return true;
+        }
+
+        // Volatile controls change without sending events, so those are always
+        // read from the driver
+        struct cached_control *cached = find_cached_control(camera, id);
+        if (cached && request == (int)VIDIOC_G_EXT_CTRLS &&
+            !(cached->control.flags & V4L2_CTRL_FLAG_VOLATILE)) {
+                *value = cached->value;
+                return true;
+        }
+
         struct v4l2_ext_control ctrl = {};
         ctrl.id = id;
         ctrl.value = *value;
@@ -1141,40 +1597,32 @@ control_impl_int32(MPCamera *camera, uint32_t id, int request, int32_t *value)
                 return false;
         }
 
+        if (cached && request == (int)VIDIOC_S_EXT_CTRLS) {
+                cached->value = ctrl.value;
+        }
+
         *value = ctrl.value;
         return true;
 }
 
-pid_t
+MPControlTask
 mp_camera_control_set_int32_bg(MPCamera *camera, uint32_t id, int32_t v)
 {
-        struct v4l2_ext_control ctrl = {};
-        ctrl.id = id;
-        ctrl.value = v;
-
-        struct v4l2_ext_controls ctrls = {
-                .ctrl_class = 0,
-                .which = V4L2_CTRL_WHICH_CUR_VAL,
-                .count = 1,
-                .controls = &ctrl,
-        };
-
-        int fd = control_fd(camera);
+        if (camera->replay) {
+                return 0;
+        }
 
-        // fork only after all the memory has been read
-        pid_t pid = fork();
-        if (pid == -1) {
-                return 0; // discard errors, nothing to do in parent process
-        } else if (pid != 0) {
-                // parent process adding pid to wait list (to clear zombie processes)
-                mp_camera_add_bg_task(camera, pid);
-                return pid;
+        if (!camera->control_writer) {
+                camera->control_writer = mp_control_writer_new(control_fd(camera));
         }
 
-        // ignore errors
-        xioctl(fd, VIDIOC_S_EXT_CTRLS, &ctrls);
-        // exit without calling exit handlers
-        _exit(0);
+        // Assume the write succeeds, the event sent once it's done has the
+        // value the driver actually took
+        struct cached_control *cached = find_cached_control(camera, id);
+        if (cached) {
+                cached->value = v;
+        }
+        return mp_control_writer_set(camera->control_writer, id, v);
 }
 
 bool
@@ -1186,6 +1634,8 @@ mp_camera_control_try_int32(MPCamera *camera, uint32_t id, int32_t *v)
 bool
 mp_camera_control_set_int32(MPCamera *camera, uint32_t id, int32_t v)
 {
+        // Don't let a write queued earlier overwrite this one
+        mp_camera_wait_bg_tasks(camera);
         return control_impl_int32(camera, id, VIDIOC_S_EXT_CTRLS, &v);
 }
 
@@ -1209,6 +1659,7 @@ mp_camera_control_try_boolean(MPCamera *camera, uint32_t id, bool *v)
 bool
 mp_camera_control_set_bool(MPCamera *camera, uint32_t id, bool v)
 {
+        mp_camera_wait_bg_tasks(camera);
         int32_t value = v;
         return control_impl_int32(camera, id, VIDIOC_S_EXT_CTRLS, &value);
 }
@@ -1221,7 +1672,7 @@ mp_camera_control_get_bool(MPCamera *camera, uint32_t id)
         return v;
 }
 
-pid_t
+MPControlTask
 mp_camera_control_set_bool_bg(MPCamera *camera, uint32_t id, bool v)
 {
         int32_t value = v;
@@ -1,26 +1,33 @@
 #pragma once
 
+#include "control_writer.h"
 #include "mode.h"
 
 #include <stdbool.h>
 #include <stdint.h>
-#include <sys/wait.h>
 
 typedef struct {
         uint32_t index;
 
         uint8_t *data;
         int fd;
+
+        uint32_t sequence;
+        // Microseconds on CLOCK_MONOTONIC
+        int64_t timestamp;
 } MPBuffer;
 
 typedef struct _MPCamera MPCamera;
 
 MPCamera *mp_camera_new(int video_fd, int subdev_fd, int bridge_fd);
+// Replays a recording made with MPRecorder, at rate frames per second or at the
+// recorded timing when rate is 0
+MPCamera *mp_camera_new_replay(const char *path, float rate);
 void mp_camera_free(MPCamera *camera);
 
-void mp_camera_add_bg_task(MPCamera *camera, pid_t pid);
+// Waits for the controls set in the background
 void mp_camera_wait_bg_tasks(MPCamera *camera);
-bool mp_camera_check_task_complete(MPCamera *camera, pid_t pid);
+bool mp_camera_check_task_complete(MPCamera *camera, MPControlTask task);
 
 bool mp_camera_is_subdev(MPCamera *camera);
 int mp_camera_get_video_fd(MPCamera *camera);
@@ -30,9 +37,13 @@ const MPMode *mp_camera_get_mode(const MPCamera *camera);
 bool mp_camera_try_mode(MPCamera *camera, MPMode *mode);
 
 bool mp_camera_set_mode(MPCamera *camera, MPMode *mode);
+// Makes the next mode be set on every device, after something else may have
+// changed their formats
+void mp_camera_invalidate_mode(MPCamera *camera);
 bool mp_camera_start_capture(MPCamera *camera);
 bool mp_camera_stop_capture(MPCamera *camera);
 bool mp_camera_is_capturing(MPCamera *camera);
+uint32_t mp_camera_get_num_buffers(MPCamera *camera);
 bool mp_camera_capture_buffer(MPCamera *camera, MPBuffer *buffer);
 bool mp_camera_release_buffer(MPCamera *camera, uint32_t buffer_index);
 
@@ -72,14 +83,23 @@ void mp_control_list_free(MPControlList *list);
 
 bool mp_camera_query_control(MPCamera *camera, uint32_t id, MPControl *control);
 
+// The fd that becomes readable for priority data when a cached control
+// changes, or -1 when no controls are cached
+int mp_camera_get_control_event_fd(MPCamera *camera);
+// Applies the pending control events, returns whether any control changed
+bool mp_camera_handle_control_events(MPCamera *camera);
+
 bool mp_camera_control_try_int32(MPCamera *camera, uint32_t id, int32_t *v);
 bool mp_camera_control_set_int32(MPCamera *camera, uint32_t id, int32_t v);
 int32_t mp_camera_control_get_int32(MPCamera *camera, uint32_t id);
-// set the value in the background, discards result
-pid_t mp_camera_control_set_int32_bg(MPCamera *camera, uint32_t id, int32_t v);
+// Set the value from a worker thread, discards the result. Values queued
+// for the same control are coalesced.
+MPControlTask
+mp_camera_control_set_int32_bg(MPCamera *camera, uint32_t id, int32_t v);
 
 bool mp_camera_control_try_bool(MPCamera *camera, uint32_t id, bool *v);
 bool mp_camera_control_set_bool(MPCamera *camera, uint32_t id, bool v);
 bool mp_camera_control_get_bool(MPCamera *camera, uint32_t id);
 // set the value in the background, discards result
-pid_t mp_camera_control_set_bool_bg(MPCamera *camera, uint32_t id, bool v);
+MPControlTask
+mp_camera_control_set_bool_bg(MPCamera *camera, uint32_t id, bool v);
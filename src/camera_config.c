@@ -292,6 +292,12 @@ config_ini_handler(void *user,
                         if (cc->flash_display) {
                                 cc->has_flash = true;
                         }
+                } else if (strcmp(name, "record") == 0) {
+                        strcpy(cc->record_path, value);
+                } else if (strcmp(name, "replay") == 0) {
+                        strcpy(cc->replay_path, value);
+                } else if (strcmp(name, "replay-rate") == 0) {
+                        cc->replay_rate = strtof(value, NULL);
                 } else {
                         g_printerr("Unknown key '%s' in [%s]\n", name, section);
                         exit(1);
@@ -322,6 +328,12 @@ mp_load_config()
                 return false;
         }
 
+        return mp_load_config_file(file);
+}
+
+bool
+mp_load_config_file(const char *file)
+{
         int result = ini_parse(file, config_ini_handler, NULL);
         if (result == -1) {
                 g_printerr("Config file not found\n");
@@ -68,9 +68,16 @@ struct mp_camera_config {
         char flash_path[260];
         bool flash_display;
         bool has_flash;
+
+        // Dump raw frames to a recording, or read them from one instead of
+        // the sensor
+        char record_path[260];
+        char replay_path[260];
+        float replay_rate;
 };
 
 bool mp_load_config();
+bool mp_load_config_file(const char *file);
 
 const char *mp_get_device_make();
 const char *mp_get_device_model();
@@ -0,0 +1,166 @@
+#include "control_writer.h"
+
+#include <errno.h>
+#include <glib.h>
+#include <linux/videodev2.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+// Distinct controls that can be queued, setting more waits for the worker
+#define MAX_QUEUED_CONTROLS 16
+
+struct _MPControlWriter {
+        int fd;
+
+        GMutex mutex;
+        GCond cond;
+        GThread *thread;
+        bool stop;
+
+        // Controls waiting for the worker, in the order they were first set
+        struct v4l2_ext_control queued[MAX_QUEUED_CONTROLS];
+        int num_queued;
+
+        // The last task handed out and the last one written
+        MPControlTask last_task;
+        MPControlTask completed_task;
+};
+
+static int
+xioctl(int fd, int request, void *arg)
+{
+        int r;
+        do {
+                r = ioctl(fd, request, arg);
+        } while (r == -1 && errno == EINTR);
+        return r;
+}
+
+static bool
+write_controls(int fd, struct v4l2_ext_control *controls, int count)
+{
+        struct v4l2_ext_controls ctrls = {
+                .ctrl_class = 0,
+                .which = V4L2_CTRL_WHICH_CUR_VAL,
+                .count = count,
+                .controls = controls,
+        };
+        return xioctl(fd, VIDIOC_S_EXT_CTRLS, &ctrls) != -1;
+}
+
+static gpointer
+write_queued_controls(MPControlWriter *writer)
+{
+        struct v4l2_ext_control controls[MAX_QUEUED_CONTROLS];
+
+        g_mutex_lock(&writer->mutex);
+        for (;;) {
+                while (writer->num_queued == 0 && !writer->stop) {
+                        g_cond_wait(&writer->cond, &writer->mutex);
+                }
+                if (writer->num_queued == 0) {
+                        break;
+                }
+
+                int count = writer->num_queued;
+                memcpy(controls, writer->queued, count * sizeof(controls[0]));
+                writer->num_queued = 0;
+                MPControlTask task = writer->last_task;
+                // Room for more controls
+                g_cond_broadcast(&writer->cond);
+                g_mutex_unlock(&writer->mutex);
+
+                // The whole batch fails when one control is rejected, in which
+                // case the others are still written one by one
+                if (!write_controls(writer->fd, controls, count) && count > 1) {
+                        for (int i = 0; i < count; ++i) {
+                                write_controls(writer->fd, &controls[i], 1);
+                        }
+                }
+
+                g_mutex_lock(&writer->mutex);
+                writer->completed_task = task;
+                g_cond_broadcast(&writer->cond);
+        }
+        g_mutex_unlock(&writer->mutex);
+
+        return NULL;
+}
+
+MPControlWriter *
+mp_control_writer_new(int fd)
+{
+        MPControlWriter *writer = g_new0(MPControlWriter, 1);
+        writer->fd = fd;
+        g_mutex_init(&writer->mutex);
+        g_cond_init(&writer->cond);
+        writer->thread = g_thread_new(
+                "control_writer", (GThreadFunc)write_queued_controls, writer);
+        return writer;
+}
+
+void
+mp_control_writer_free(MPControlWriter *writer)
+{
+        g_mutex_lock(&writer->mutex);
+        writer->stop = true;
+        g_cond_broadcast(&writer->cond);
+        g_mutex_unlock(&writer->mutex);
+
+        g_thread_join(writer->thread);
+        g_mutex_clear(&writer->mutex);
+        g_cond_clear(&writer->cond);
+        g_free(writer);
+}
+
+MPControlTask
+mp_control_writer_set(MPControlWriter *writer, uint32_t id, int32_t value)
+{
+        g_mutex_lock(&writer->mutex);
+
+        int index;
+        for (;;) {
+                index = 0;
+                while (index < writer->num_queued &&
+                       writer->queued[index].id != id) {
+                        ++index;
+                }
+                if (index < MAX_QUEUED_CONTROLS) {
+                        break;
+                }
+                g_cond_wait(&writer->cond, &writer->mutex);
+        }
+
+        if (index == writer->num_queued) {
+                memset(&writer->queued[index], 0, sizeof(writer->queued[0]));
+                writer->queued[index].id = id;
+                ++writer->num_queued;
+        }
+        writer->queued[index].value = value;
+
+        // Replaces the task of an earlier value, which completes with this one
+        MPControlTask task = ++writer->last_task;
+        g_cond_broadcast(&writer->cond);
+        g_mutex_unlock(&writer->mutex);
+
+        return task;
+}
+
+bool
+mp_control_writer_is_complete(MPControlWriter *writer, MPControlTask task)
+{
+        g_mutex_lock(&writer->mutex);
+        bool complete = writer->completed_task >= task;
+        g_mutex_unlock(&writer->mutex);
+        return complete;
+}
+
+void
+mp_control_writer_sync(MPControlWriter *writer)
+{
+        g_mutex_lock(&writer->mutex);
+        while (writer->completed_task < writer->last_task) {
+                g_cond_wait(&writer->cond, &writer->mutex);
+        }
+        g_mutex_unlock(&writer->mutex);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Sets V4L2 controls from a worker thread, so the pipelines don't wait for
+ * slow sensor writes. Writes that are still queued are coalesced, the latest
+ * value for a control wins, and everything queued is written with a single
+ * VIDIOC_S_EXT_CTRLS.
+ */
+typedef struct _MPControlWriter MPControlWriter;
+
+// Identifies a queued write, tasks are complete in the order they were queued.
+// 0 is always complete.
+typedef uint64_t MPControlTask;
+
+MPControlWriter *mp_control_writer_new(int fd);
+// Finishes the queued writes
+void mp_control_writer_free(MPControlWriter *writer);
+
+MPControlTask
+mp_control_writer_set(MPControlWriter *writer, uint32_t id, int32_t value);
+bool mp_control_writer_is_complete(MPControlWriter *writer, MPControlTask task);
+// Waits until every queued write is done
+void mp_control_writer_sync(MPControlWriter *writer);
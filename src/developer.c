@@ -0,0 +1,583 @@
+#include "developer.h"
+
+#include "matrix.h"
+#include "tiff_ifd.h"
+#include "workers.h"
+#include <glib.h>
+#include <jpeglib.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Rows developed by a thread at a time, and handed to the encoder at once
+#define BAND_ROWS 32
+
+// Rows around a band that are needed for the demosaic and sharpen kernels
+#define DEMOSAIC_BORDER 2
+#define SHARPEN_BORDER 1
+
+#define TONE_LUT_SIZE 4096
+
+#define JPEG_QUALITY 90
+
+// Brightness is raised until this fraction of the green samples clip, but
+// never by more than MAX_GAIN
+#define CLIP_FRACTION 0.01f
+#define MAX_GAIN 4.0f
+
+// Contrast and midpoint of the S-curve applied after the sRGB gamma
+#define CONTRAST 6.0f
+#define CONTRAST_MIDPOINT 0.5f
+
+#define SHARPEN_AMOUNT 0.8f
+
+static const float colormatrix_srgb[] = { 3.2409, -1.5373, -0.4986, -0.9692, 1.8759,
+                                          0.0415, 0.0556,  -0.2039, 1.0569 };
+
+// XYZ (D50) to linear sRGB, with Bradford adaptation to D65
+static const float xyz_d50_to_srgb[] = { 3.1339,  -1.6169, -0.4906,
+                                         -0.9788, 1.9161,  0.0335,
+                                         0.0719,  -0.2290, 1.4052 };
+
+struct developer {
+        const uint8_t *image;
+        int width;
+        int height;
+        size_t stride;
+        int bits_per_sample;
+
+        // Samples are normalised to (value - black) * scale
+        float black;
+        float scale;
+
+        // Colour of each pixel in a 2x2 block, 0 is red, 1 green and 2 blue
+        uint8_t cfa[4];
+
+        // Camera RGB to linear sRGB, including the exposure gain
+        float matrix[9];
+
+        uint8_t tone[TONE_LUT_SIZE];
+
+        uint8_t *output;
+
+        int num_bands;
+        gint next_band;
+
+        GMutex mutex;
+        GCond cond;
+        bool *band_done;
+};
+
+static float
+get_sample(const struct developer *dev, const uint8_t *row, int x)
+{
+        int value;
+        if (dev->bits_per_sample == 16) {
+                value = ((const uint16_t *)row)[x];
+        } else if (dev->bits_per_sample == 10) {
+                // Groups of 4 pixels with the low bits packed in the 5th byte
+                const uint8_t *group = row + (x / 4) * 5;
+                int shift = 6 - (x % 4) * 2;
+                value = (group[x % 4] << 2) | ((group[4] >> shift) & 0x03);
+        } else {
+                value = row[x];
+        }
+
+        return (value - dev->black) * dev->scale;
+}
+
+/*
+ * Load row y into dst, which has room for DEMOSAIC_BORDER samples on either
+ * side. Rows and columns outside the image are mirrored around the edge
+ * sample, which keeps them at the same position in the Bayer pattern.
+ */
+static void
+load_row(const struct developer *dev, int y, float *dst)
+{
+        if (y < 0) {
+                y = -y;
+        } else if (y >= dev->height) {
+                y = 2 * dev->height - 2 - y;
+        }
+
+        const uint8_t *row = dev->image + (size_t)y * dev->stride;
+        int w = dev->width;
+
+        for (int x = 0; x < w; ++x) {
+                dst[x] = get_sample(dev, row, x);
+        }
+
+        for (int i = 1; i <= DEMOSAIC_BORDER; ++i) {
+                dst[-i] = dst[i];
+                dst[w - 1 + i] = dst[w - 1 - i];
+        }
+}
+
+static inline uint8_t
+tone_map(const struct developer *dev, float value)
+{
+        value = CLAMP(value, 0.0f, 1.0f);
+        return dev->tone[(int)(value * (TONE_LUT_SIZE - 1) + 0.5f)];
+}
+
+/*
+ * Demosaic a row with the gradient corrected bilinear interpolation from
+ * Malvar, He and Cutler, and convert it to tone mapped sRGB. rows points to
+ * the 5 rows centered on row y.
+ */
+static void
+develop_row(const struct developer *dev, const float *rows[5], int y, uint8_t *dst)
+{
+#define P(dy, dx) rows[2 + (dy)][x + (dx)]
+
+        const float *m = dev->matrix;
+
+        for (int x = 0; x < dev->width; ++x) {
+                int color = dev->cfa[(y % 2) * 2 + x % 2];
+
+                float c = P(0, 0);
+                float diagonal = P(-1, -1) + P(-1, 1) + P(1, -1) + P(1, 1);
+                float far_h = P(0, -2) + P(0, 2);
+                float far_v = P(-2, 0) + P(2, 0);
+                float near_h = P(0, -1) + P(0, 1);
+                float near_v = P(-1, 0) + P(1, 0);
+
+                float rgb[3];
+                if (color == 1) {
+                        // Interpolate the colour of the horizontal and vertical
+                        // neighbours
+                        float h = (5 * c - far_h - diagonal + 0.5f * far_v +
+                                   4 * near_h) /
+                                  8;
+                        float v = (5 * c - far_v - diagonal + 0.5f * far_h +
+                                   4 * near_v) /
+                                  8;
+
+                        int h_color = dev->cfa[(y % 2) * 2 + (x + 1) % 2];
+                        rgb[0] = h_color == 0 ? h : v;
+                        rgb[1] = c;
+                        rgb[2] = h_color == 0 ? v : h;
+                } else {
+                        float g =
+                                (4 * c + 2 * (near_h + near_v) - far_h - far_v) / 8;
+                        float other =
+                                (6 * c + 2 * diagonal - 1.5f * (far_h + far_v)) / 8;
+
+                        rgb[0] = color == 0 ? c : other;
+                        rgb[1] = g;
+                        rgb[2] = color == 0 ? other : c;
+                }
+
+                for (int i = 0; i < 3; ++i) {
+                        float value = m[i * 3] * rgb[0] + m[i * 3 + 1] * rgb[1] +
+                                      m[i * 3 + 2] * rgb[2];
+                        dst[x * 3 + i] = tone_map(dev, value);
+                }
+        }
+
+#undef P
+}
+
+/*
+ * Unsharp mask on the luma of the tone mapped image, with a 3x3 binomial blur.
+ * The difference is added to all channels so the colour noise isn't
+ * sharpened with it.
+ */
+static void
+sharpen_row(const struct developer *dev,
+            const uint16_t *luma[3],
+            const uint8_t *src,
+            uint8_t *dst)
+{
+        int w = dev->width;
+        int amount = SHARPEN_AMOUNT * 256;
+
+        for (int x = 0; x < w; ++x) {
+                int l = MAX(x - 1, 0);
+                int r = MIN(x + 1, w - 1);
+
+                int blur = 0;
+                for (int i = 0; i < 3; ++i) {
+                        int weight = i == 1 ? 2 : 1;
+                        blur += weight *
+                                (luma[i][l] + 2 * luma[i][x] + luma[i][r]);
+                }
+
+                // Luma is the sum of 4 samples and the blur is scaled by 16
+                int delta = (luma[1][x] * 16 - blur) * amount / (64 * 256);
+
+                for (int i = 0; i < 3; ++i) {
+                        int value = src[x * 3 + i] + delta;
+                        dst[x * 3 + i] = CLAMP(value, 0, 255);
+                }
+        }
+}
+
+static void
+develop_bands(struct developer *dev)
+{
+        int w = dev->width;
+        int padded_width = w + 2 * DEMOSAIC_BORDER;
+
+        int max_rows = BAND_ROWS + 2 * SHARPEN_BORDER;
+        int max_raw_rows = max_rows + 2 * DEMOSAIC_BORDER;
+
+        float *raw = malloc(sizeof(float) * padded_width * max_raw_rows);
+        uint8_t *rgb = malloc((size_t)w * 3 * max_rows);
+        uint16_t *luma = malloc(sizeof(uint16_t) * w * max_rows);
+
+        int band;
+        while ((band = g_atomic_int_add(&dev->next_band, 1)) < dev->num_bands) {
+                int y_start = band * BAND_ROWS;
+                int y_end = MIN(y_start + BAND_ROWS, dev->height);
+
+                // Rows of the band plus the ones the sharpening needs, rows
+                // outside the image repeat the edge row
+                int first = MAX(y_start - SHARPEN_BORDER, 0);
+                int last = MIN(y_end + SHARPEN_BORDER, dev->height) - 1;
+                int num_rows = last - first + 1;
+
+                for (int i = 0; i < num_rows + 2 * DEMOSAIC_BORDER; ++i) {
+                        load_row(dev,
+                                 first - DEMOSAIC_BORDER + i,
+                                 raw + i * padded_width + DEMOSAIC_BORDER);
+                }
+
+                for (int i = 0; i < num_rows; ++i) {
+                        const float *rows[5];
+                        for (int j = 0; j < 5; ++j) {
+                                rows[j] = raw + (i + j) * padded_width +
+                                          DEMOSAIC_BORDER;
+                        }
+
+                        uint8_t *rgb_row = rgb + (size_t)i * w * 3;
+                        develop_row(dev, rows, first + i, rgb_row);
+
+                        uint16_t *luma_row = luma + (size_t)i * w;
+                        for (int x = 0; x < w; ++x) {
+                                luma_row[x] = rgb_row[x * 3] +
+                                              2 * rgb_row[x * 3 + 1] +
+                                              rgb_row[x * 3 + 2];
+                        }
+                }
+
+                for (int y = y_start; y < y_end; ++y) {
+                        int i = y - first;
+                        const uint16_t *luma_rows[3] = {
+                                luma + (size_t)MAX(i - 1, 0) * w,
+                                luma + (size_t)i * w,
+                                luma + (size_t)MIN(i + 1, num_rows - 1) * w,
+                        };
+
+                        sharpen_row(dev,
+                                    luma_rows,
+                                    rgb + (size_t)i * w * 3,
+                                    dev->output + (size_t)y * w * 3);
+                }
+
+                g_mutex_lock(&dev->mutex);
+                dev->band_done[band] = true;
+                g_cond_broadcast(&dev->cond);
+                g_mutex_unlock(&dev->mutex);
+        }
+
+        free(raw);
+        free(rgb);
+        free(luma);
+}
+
+static void
+init_tone_curve(struct developer *dev)
+{
+        // Sigmoidal contrast, scaled so 0 and 1 stay in place
+        float low = 1 / (1 + expf(CONTRAST * CONTRAST_MIDPOINT));
+        float high = 1 / (1 + expf(CONTRAST * (CONTRAST_MIDPOINT - 1)));
+
+        for (int i = 0; i < TONE_LUT_SIZE; ++i) {
+                float value = i / (float)(TONE_LUT_SIZE - 1);
+
+                if (value <= 0.0031308f) {
+                        value *= 12.92f;
+                } else {
+                        value = 1.055f * powf(value, 1 / 2.4f) - 0.055f;
+                }
+
+                value = 1 / (1 + expf(CONTRAST * (CONTRAST_MIDPOINT - value)));
+                value = (value - low) / (high - low);
+
+                dev->tone[i] = CLAMP(lroundf(value * 255), 0, 255);
+        }
+}
+
+static void
+init_color_matrix(struct developer *dev, const struct mp_camera_config *camera)
+{
+        float camera_to_srgb[9];
+
+        if (camera->forwardmatrix[0]) {
+                // The forward matrix maps white balanced camera RGB to XYZ
+                multiply_matrices((float *)xyz_d50_to_srgb,
+                                  (float *)camera->forwardmatrix,
+                                  camera_to_srgb);
+        } else {
+                // The colour matrix goes the other way, the DNG writer uses the
+                // sRGB matrix when the config has none
+                const float *colormatrix = camera->colormatrix[0] ?
+                                                   camera->colormatrix :
+                                                   colormatrix_srgb;
+
+                float xyz_to_srgb[9];
+                float camera_to_xyz[9];
+                memcpy(xyz_to_srgb, colormatrix_srgb, sizeof(xyz_to_srgb));
+                if (!invert_matrix(colormatrix, camera_to_xyz)) {
+                        invert_matrix(colormatrix_srgb, camera_to_xyz);
+                }
+                multiply_matrices(xyz_to_srgb, camera_to_xyz, camera_to_srgb);
+
+                // The neutral is 1, 1, 1 so camera white has to map to white
+                for (int i = 0; i < 3; ++i) {
+                        float sum = camera_to_srgb[i * 3] +
+                                    camera_to_srgb[i * 3 + 1] +
+                                    camera_to_srgb[i * 3 + 2];
+                        for (int j = 0; j < 3; ++j) {
+                                camera_to_srgb[i * 3 + j] /= sum;
+                        }
+                }
+        }
+
+        memcpy(dev->matrix, camera_to_srgb, sizeof(dev->matrix));
+}
+
+/*
+ * Find the exposure gain from a histogram of a subset of the green samples,
+ * like dcraw brightens images so a small fraction of the pixels is white.
+ */
+static float
+find_gain(const struct developer *dev)
+{
+        int histogram[1024] = { 0 };
+        int total = 0;
+
+        for (int y = 0; y < dev->height; y += 4) {
+                const uint8_t *row = dev->image + (size_t)y * dev->stride;
+                int x = dev->cfa[(y % 2) * 2] == 1 ? 0 : 1;
+
+                for (; x < dev->width; x += 4) {
+                        float value = get_sample(dev, row, x);
+                        ++histogram[CLAMP((int)(value * 1023), 0, 1023)];
+                        ++total;
+                }
+        }
+
+        int clipped = total * CLIP_FRACTION;
+        int white = 1023;
+        for (int count = 0; white > 0; --white) {
+                count += histogram[white];
+                if (count > clipped) {
+                        break;
+                }
+        }
+
+        return CLAMP(1023.0f / MAX(white, 1), 1.0f, MAX_GAIN);
+}
+
+/*
+ * Build the APP1 segment with the EXIF data the DNG writer also adds, in a
+ * TIFF header followed by the IFDs.
+ */
+static uint8_t *
+make_exif(const struct mp_dng_info *info, size_t *size)
+{
+        struct tm tim = *(localtime(&info->time));
+        char datetime[20] = { 0 };
+        strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tim);
+
+        MPTiffIfd ifd0 = { 0 };
+        mp_tiff_ifd_add_ascii(&ifd0, 0x010f, mp_get_device_make());
+        mp_tiff_ifd_add_ascii(&ifd0, 0x0110, mp_get_device_model());
+        mp_tiff_ifd_add_short(&ifd0, 0x0112, mp_dng_info_get_orientation(info));
+        mp_tiff_ifd_add_ascii(&ifd0, 0x0131, "Megapixels");
+        mp_tiff_ifd_add_ascii(&ifd0, 0x0132, datetime);
+        mp_tiff_ifd_add_long(&ifd0, 0x8769, 0);
+
+        MPTiffIfd exif = { 0 };
+        mp_dng_info_add_exif(info, &exif);
+
+        size_t ifd0_offset = MP_TIFF_HEADER_SIZE;
+        size_t exif_ifd_offset = ifd0_offset + mp_tiff_ifd_size(&ifd0);
+        size_t tiff_size = exif_ifd_offset + mp_tiff_ifd_size(&exif);
+        mp_tiff_ifd_set_long(&ifd0, 0x8769, exif_ifd_offset);
+
+        *size = 6 + tiff_size;
+        uint8_t *data = calloc(1, *size);
+        memcpy(data, "Exif\0\0", 6);
+
+        uint8_t *tiff = data + 6;
+        mp_tiff_write_header(tiff, ifd0_offset);
+        mp_tiff_ifd_write(&ifd0, tiff, ifd0_offset, 0);
+        mp_tiff_ifd_write(&exif, tiff, exif_ifd_offset, 0);
+
+        return data;
+}
+
+struct jpeg_error {
+        struct jpeg_error_mgr mgr;
+        jmp_buf jump;
+};
+
+static void
+on_jpeg_error(j_common_ptr cinfo)
+{
+        struct jpeg_error *error = (struct jpeg_error *)cinfo->err;
+
+        char message[JMSG_LENGTH_MAX];
+        cinfo->err->format_message(cinfo, message);
+        g_printerr("Could not encode JPEG: %s\n", message);
+
+        longjmp(error->jump, 1);
+}
+
+bool
+mp_develop_jpeg(const char *path,
+                const uint8_t *image,
+                const struct mp_dng_info *info,
+                int num_threads)
+{
+        const struct mp_camera_config *camera = info->camera;
+        const MPMode *mode = &info->mode;
+
+        const char *cfa = mp_pixel_format_cfa_pattern(mode->pixel_format);
+        if (!cfa) {
+                g_printerr("Can't develop %s frames\n",
+                           mp_pixel_format_to_str(mode->pixel_format));
+                return false;
+        }
+
+        struct developer dev = {
+                .image = image,
+                .width = mode->width,
+                .height = mode->height,
+                .bits_per_sample =
+                        mp_pixel_format_bits_per_pixel(mode->pixel_format),
+        };
+        memcpy(dev.cfa, cfa, 4);
+
+        int depth = mp_pixel_format_pixel_depth(mode->pixel_format);
+        float white = camera->whitelevel ? camera->whitelevel : (1 << depth) - 1;
+        float black = camera->blacklevel;
+
+        if (info->is_merged) {
+                // Merged samples are scaled up to 16 bits, see burst_merge.h
+                dev.bits_per_sample = 16;
+                dev.stride = mode->width * sizeof(uint16_t);
+                white *= 1 << (16 - depth);
+                black *= 1 << (16 - depth);
+        } else {
+                dev.stride =
+                        mp_pixel_format_width_to_bytes(mode->pixel_format,
+                                                       mode->width) +
+                        mp_pixel_format_width_to_padding(mode->pixel_format,
+                                                         mode->width);
+        }
+
+        dev.black = black;
+        dev.scale = 1 / (white - black);
+
+        init_tone_curve(&dev);
+        init_color_matrix(&dev, camera);
+
+        // The matrix maps camera white to white, the white balance makes the
+        // estimated neutral camera white
+        if (info->neutral[1]) {
+                for (int i = 0; i < 9; ++i) {
+                        dev.matrix[i] /= info->neutral[i % 3];
+                }
+        }
+
+        float gain = find_gain(&dev);
+        for (int i = 0; i < 9; ++i) {
+                dev.matrix[i] *= gain;
+        }
+
+        FILE *file = fopen(path, "wb");
+        if (!file) {
+                g_printerr("Could not open %s\n", path);
+                return false;
+        }
+
+        dev.output = malloc((size_t)dev.width * dev.height * 3);
+        dev.num_bands = (dev.height + BAND_ROWS - 1) / BAND_ROWS;
+        dev.band_done = calloc(dev.num_bands, sizeof(bool));
+        g_mutex_init(&dev.mutex);
+        g_cond_init(&dev.cond);
+
+        MPWorkerJob *job = mp_workers_start((MPWorkerFunc)develop_bands,
+                                            &dev,
+                                            CLAMP(num_threads, 1, dev.num_bands));
+
+        struct jpeg_compress_struct cinfo;
+        struct jpeg_error error;
+        bool success = false;
+
+        size_t exif_size;
+        uint8_t *exif = make_exif(info, &exif_size);
+
+        cinfo.err = jpeg_std_error(&error.mgr);
+        error.mgr.error_exit = on_jpeg_error;
+        if (setjmp(error.jump)) {
+                goto out;
+        }
+
+        jpeg_create_compress(&cinfo);
+        jpeg_stdio_dest(&cinfo, file);
+
+        cinfo.image_width = dev.width;
+        cinfo.image_height = dev.height;
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, JPEG_QUALITY, TRUE);
+        cinfo.write_JFIF_header = FALSE;
+
+        jpeg_start_compress(&cinfo, TRUE);
+        jpeg_write_marker(&cinfo, JPEG_APP0 + 1, exif, exif_size);
+
+        // Encode the bands in order as they finish
+        for (int band = 0; band < dev.num_bands; ++band) {
+                g_mutex_lock(&dev.mutex);
+                while (!dev.band_done[band]) {
+                        g_cond_wait(&dev.cond, &dev.mutex);
+                }
+                g_mutex_unlock(&dev.mutex);
+
+                while (cinfo.next_scanline < MIN((band + 1) * BAND_ROWS,
+                                                 dev.height)) {
+                        JSAMPROW row = dev.output +
+                                       (size_t)cinfo.next_scanline * dev.width * 3;
+                        jpeg_write_scanlines(&cinfo, &row, 1);
+                }
+        }
+
+        jpeg_finish_compress(&cinfo);
+        success = true;
+
+out:
+        jpeg_destroy_compress(&cinfo);
+
+        // Encoding errors leave the workers running, let them finish
+        mp_workers_wait(job);
+
+        if (fclose(file) != 0) {
+                success = false;
+        }
+
+        g_mutex_clear(&dev.mutex);
+        g_cond_clear(&dev.cond);
+        free(dev.band_done);
+        free(dev.output);
+        free(exif);
+
+        return success;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "dng_writer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Develop a raw Bayer frame into a JPEG without going through the
+ * postprocessor script. The image is in the sensor format of info->mode, or
+ * 16-bit samples when info->is_merged is set, like the DNG writer takes.
+ *
+ * Demosaicing, colour conversion, tone mapping and sharpening run on up to
+ * num_threads threads of the worker pool in bands of rows, while the calling
+ * thread encodes the bands that are done.
+ */
+bool mp_develop_jpeg(const char *path,
+                     const uint8_t *image,
+                     const struct mp_dng_info *info,
+                     int num_threads);
@@ -7,13 +7,85 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <linux/v4l2-subdev.h>
 #include <linux/media.h>
 
+/*
+ * Devnode paths resolved before. An entry is only used while the node at its
+ * path still has the device number, so a node that was renamed or replaced
+ * since is resolved through sysfs again.
+ */
+#define MAX_CACHED_PATHS 32
+
+struct cached_path {
+        uint32_t major;
+        uint32_t minor;
+        char path[260];
+};
+
+static struct cached_path cached_paths[MAX_CACHED_PATHS];
+static int num_cached_paths = 0;
+// Statically allocated mutexes need no initialisation
+static GMutex cached_paths_mutex;
+
+static struct cached_path *
+find_cached_path(struct media_v2_intf_devnode devnode)
+{
+        for (int i = 0; i < num_cached_paths; ++i) {
+                if (cached_paths[i].major == devnode.major &&
+                    cached_paths[i].minor == devnode.minor) {
+                        return &cached_paths[i];
+                }
+        }
+        return NULL;
+}
+
+static bool
+get_cached_path(struct media_v2_intf_devnode devnode, char *path, int length)
+{
+        g_mutex_lock(&cached_paths_mutex);
+        struct cached_path *cached = find_cached_path(devnode);
+        if (cached) {
+                g_strlcpy(path, cached->path, length);
+        }
+        g_mutex_unlock(&cached_paths_mutex);
+
+        if (!cached) {
+                return false;
+        }
+
+        struct stat st;
+        return stat(path, &st) == 0 && S_ISCHR(st.st_mode) &&
+               major(st.st_rdev) == devnode.major &&
+               minor(st.st_rdev) == devnode.minor;
+}
+
+static void
+add_cached_path(struct media_v2_intf_devnode devnode, const char *path)
+{
+        g_mutex_lock(&cached_paths_mutex);
+        struct cached_path *cached = find_cached_path(devnode);
+        if (!cached) {
+                // When full the oldest entries are replaced
+                cached = &cached_paths[num_cached_paths % MAX_CACHED_PATHS];
+                num_cached_paths = MIN(num_cached_paths + 1, MAX_CACHED_PATHS);
+        }
+        cached->major = devnode.major;
+        cached->minor = devnode.minor;
+        g_strlcpy(cached->path, path, sizeof(cached->path));
+        g_mutex_unlock(&cached_paths_mutex);
+}
+
 bool
 mp_find_device_path(struct media_v2_intf_devnode devnode, char *path, int length)
 {
+        if (get_cached_path(devnode, path, length)) {
+                return true;
+        }
+
         char uevent_path[256];
         snprintf(uevent_path,
                  256,
@@ -26,26 +98,33 @@ mp_find_device_path(struct media_v2_intf_devnode devnode, char *path, int length
                 return false;
         }
 
+        bool found = false;
         char line[512];
         while (fgets(line, 512, f)) {
                 if (strncmp(line, "DEVNAME=", 8) == 0) {
                         // Drop newline
-                        int length = strlen(line);
-                        if (line[length - 1] == '\n')
-                                line[length - 1] = '\0';
+                        int line_length = strlen(line);
+                        if (line[line_length - 1] == '\n')
+                                line[line_length - 1] = '\0';
 
                         snprintf(path, length, "/dev/%s", line + 8);
-                        return true;
+                        found = true;
+                        break;
                 }
         }
 
         fclose(f);
 
-        return false;
+        if (found) {
+                add_cached_path(devnode, path);
+        }
+        return found;
 }
 
 struct _MPDevice {
         int fd;
+        // Cameras on the same media device share it
+        int refcount;
 
         struct media_device_info info;
 
@@ -154,6 +233,7 @@ mp_device_new(int fd)
         // Create the device
         MPDevice *device = calloc(1, sizeof(MPDevice));
         device->fd = fd;
+        device->refcount = 1;
         device->entities =
                 calloc(topology.num_entities, sizeof(struct media_v2_entity));
         device->num_entities = topology.num_entities;
@@ -186,9 +266,20 @@ mp_device_new(int fd)
         return device;
 }
 
+MPDevice *
+mp_device_ref(MPDevice *device)
+{
+        ++device->refcount;
+        return device;
+}
+
 void
 mp_device_close(MPDevice *device)
 {
+        if (--device->refcount > 0) {
+                return;
+        }
+
         close(device->fd);
         free(device->entities);
         free(device->interfaces);
@@ -594,28 +685,30 @@ mp_device_list_free(MPDeviceList *device_list)
         }
 }
 
+bool
+mp_device_matches(const MPDevice *device,
+                  const char *driver_name,
+                  const char *dev_name)
+{
+        const struct media_device_info *info = mp_device_get_info(device);
+        return strncmp(info->driver, driver_name, strlen(driver_name)) == 0 &&
+               mp_device_find_entity(device, dev_name);
+}
+
 MPDevice *
 mp_device_list_find_remove(MPDeviceList **list,
                            const char *driver_name,
                            const char *dev_name)
 {
-        MPDevice *found_device = NULL;
-        int length = strlen(driver_name);
-
         while (*list) {
-                MPDevice *device = mp_device_list_get(*list);
-                const struct media_device_info *info = mp_device_get_info(device);
-
-                if (strncmp(info->driver, driver_name, length) == 0 &&
-                    mp_device_find_entity(device, dev_name)) {
-                        found_device = mp_device_list_remove(list);
-                        break;
+                if (mp_device_matches((*list)->device, driver_name, dev_name)) {
+                        return mp_device_list_remove(list);
                 }
 
                 list = &(*list)->next;
         }
 
-        return found_device;
+        return NULL;
 }
 
 MPDevice *
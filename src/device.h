@@ -16,8 +16,15 @@ typedef struct _MPDevice MPDevice;
 MPDevice *mp_device_find(const char *driver_name, const char *dev_name);
 MPDevice *mp_device_open(const char *path);
 MPDevice *mp_device_new(int fd);
+MPDevice *mp_device_ref(MPDevice *device);
+// Drops a reference, the device is closed with the last one
 void mp_device_close(MPDevice *device);
 
+// Whether the driver name starts with driver_name and it has an entity dev_name
+bool mp_device_matches(const MPDevice *device,
+                       const char *driver_name,
+                       const char *dev_name);
+
 int mp_device_get_fd(const MPDevice *device);
 
 bool mp_device_setup_entity_link(MPDevice *device,
@@ -0,0 +1,930 @@
+// For fallocate()
+#define _GNU_SOURCE
+
+#include "dng_writer.h"
+
+#include "ljpeg.h"
+#include "raw10.h"
+#include "trace.h"
+#include "uring_writer.h"
+#include "workers.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// TIFF, EXIF and DNG tags written
+#define TAG_NEW_SUBFILE_TYPE 254
+#define TAG_IMAGE_WIDTH 256
+#define TAG_IMAGE_LENGTH 257
+#define TAG_BITS_PER_SAMPLE 258
+#define TAG_COMPRESSION 259
+#define TAG_PHOTOMETRIC 262
+#define TAG_MAKE 271
+#define TAG_MODEL 272
+#define TAG_STRIP_OFFSETS 273
+#define TAG_ORIENTATION 274
+#define TAG_SAMPLES_PER_PIXEL 277
+#define TAG_ROWS_PER_STRIP 278
+#define TAG_STRIP_BYTE_COUNTS 279
+#define TAG_PLANAR_CONFIG 284
+#define TAG_SOFTWARE 305
+#define TAG_DATETIME 306
+#define TAG_TILE_WIDTH 322
+#define TAG_TILE_LENGTH 323
+#define TAG_TILE_OFFSETS 324
+#define TAG_TILE_BYTE_COUNTS 325
+#define TAG_SUB_IFDS 330
+#define TAG_CFA_REPEAT_PATTERN_DIM 33421
+#define TAG_CFA_PATTERN 33422
+#define TAG_EXPOSURE_TIME 33434
+#define TAG_FNUMBER 33437
+#define TAG_EXIF_IFD 34665
+#define TAG_EXPOSURE_PROGRAM 34850
+#define TAG_ISO_SPEED_RATINGS 34855
+#define TAG_DATETIME_ORIGINAL 36867
+#define TAG_DATETIME_DIGITIZED 36868
+#define TAG_FLASH 37385
+#define TAG_FOCAL_LENGTH 37386
+#define TAG_FOCAL_LENGTH_IN_35MM_FILM 41989
+#define TAG_DNG_VERSION 50706
+#define TAG_DNG_BACKWARD_VERSION 50707
+#define TAG_UNIQUE_CAMERA_MODEL 50708
+#define TAG_BLACK_LEVEL 50714
+#define TAG_WHITE_LEVEL 50717
+#define TAG_COLOR_MATRIX_1 50721
+#define TAG_AS_SHOT_NEUTRAL 50728
+#define TAG_CALIBRATION_ILLUMINANT_1 50778
+#define TAG_FORWARD_MATRIX_1 50964
+
+#define COMPRESSION_NONE 1
+#define COMPRESSION_LJPEG 7
+
+#define PHOTOMETRIC_RGB 2
+#define PHOTOMETRIC_CFA 32803
+
+#define ORIENTATION_TOPLEFT 1
+#define ORIENTATION_TOPRIGHT 2
+#define ORIENTATION_BOTRIGHT 3
+#define ORIENTATION_BOTLEFT 4
+#define ORIENTATION_LEFTTOP 5
+#define ORIENTATION_RIGHTTOP 6
+#define ORIENTATION_RIGHTBOT 7
+#define ORIENTATION_LEFTBOT 8
+
+#define ILLUMINANT_D65 21
+
+static const float colormatrix_srgb[] = { 3.2409, -1.5373, -0.4986, -0.9692, 1.8759,
+                                          0.0415, 0.0556,  -0.2039, 1.0569 };
+
+// Writes are limited to this many threads, more only compete for the disk
+#define NUM_WRITER_THREADS 2
+
+// Maximum number of frames waiting to be written. Each of these holds on to a
+// full resolution camera buffer.
+#define MAX_PENDING_JOBS 4
+
+// The pixel data starts at a multiple of this in the file
+#define DATA_ALIGNMENT 4096
+
+// Compressed raw images are stored in tiles of this size, which are encoded in
+// parallel
+#define TILE_SIZE 256
+
+// Submission queue entries of the io_uring, a file takes a few
+#define URING_QUEUE_DEPTH 32
+
+// Buffers registered with the io_uring that 10-bit frames are repacked into,
+// with room for the header in front of the frame
+#define MAX_STAGING_BUFFERS NUM_WRITER_THREADS
+#define STAGING_HEADER_SIZE (256 * 1024)
+
+struct tile_encoder {
+        const uint8_t *image;
+        size_t stride;
+        int width;
+        int height;
+        // 8 or 10 for frames in the sensor format, 16 for merged bursts
+        int bits_per_sample;
+
+        int tiles_across;
+        int num_tiles;
+        gint next_tile;
+
+        uint8_t **tiles;
+        uint32_t *tile_sizes;
+};
+
+// A DNG laid out in memory, ready to be written
+struct dng_file {
+        // The header with the metadata and preview, followed by the raw image
+        struct iovec *iov;
+        int iovcnt;
+        size_t size;
+
+        // Set when the header and the repacked image are in a buffer of the
+        // caller instead of being allocated
+        bool in_buffer;
+        uint8_t *header;
+        uint8_t *repacked;
+        struct tile_encoder enc;
+};
+
+struct dng_job {
+        char path[260];
+        GBytes *image;
+        struct mp_dng_info info;
+
+        MPDngWriterCallback callback;
+        void *user_data;
+
+        // Only used when writing through io_uring
+        struct dng_file file;
+        int staging_index;
+        int64_t trace_start;
+};
+
+static GThreadPool *pool = NULL;
+
+// Writes are submitted to io_uring when it's available, the writer threads
+// then only prepare the files and never wait for the disk
+static MPUringWriter *uring = NULL;
+
+static GMutex staging_mutex;
+static uint8_t *staging_buffers[MAX_STAGING_BUFFERS];
+static bool staging_in_use[MAX_STAGING_BUFFERS];
+static int num_staging_buffers = 0;
+// Zero until the buffers are registered for the first 10-bit frame
+static size_t staging_size = 0;
+static bool staging_failed = false;
+
+static GMutex pending_mutex;
+static GCond pending_cond;
+static int pending_jobs = 0;
+
+uint16_t
+mp_dng_info_get_orientation(const struct mp_dng_info *info)
+{
+        bool mirrored = info->camera->mirrored;
+
+        if (info->rotation == 0) {
+                return mirrored ? ORIENTATION_TOPRIGHT : ORIENTATION_TOPLEFT;
+        } else if (info->rotation == 90) {
+                return mirrored ? ORIENTATION_RIGHTBOT : ORIENTATION_LEFTBOT;
+        } else if (info->rotation == 180) {
+                return mirrored ? ORIENTATION_BOTLEFT : ORIENTATION_BOTRIGHT;
+        } else {
+                return mirrored ? ORIENTATION_LEFTTOP : ORIENTATION_RIGHTTOP;
+        }
+}
+
+float
+mp_dng_info_get_exposure_time(const struct mp_dng_info *info)
+{
+        const MPMode *mode = &info->mode;
+        return (mode->frame_interval.numerator /
+                (float)mode->frame_interval.denominator) /
+               ((float)mode->height / (float)info->exposure);
+}
+
+uint16_t
+mp_dng_info_get_iso(const struct mp_dng_info *info)
+{
+        const struct mp_camera_config *camera = info->camera;
+        if (!camera->iso_min || !camera->iso_max) {
+                return 0;
+        }
+
+        // Same as remap() in main.c, which the tools linking this don't have
+        long long iso_spread = camera->iso_max - camera->iso_min;
+        return camera->iso_min + (info->gain - 1) * iso_spread / info->gain_max;
+}
+
+void
+mp_dng_info_add_exif(const struct mp_dng_info *info, MPTiffIfd *exif)
+{
+        const struct mp_camera_config *camera = info->camera;
+
+        struct tm tim = *(localtime(&info->time));
+        char datetime[20] = { 0 };
+        strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tim);
+
+        float exposure = mp_dng_info_get_exposure_time(info);
+        mp_tiff_ifd_add_rational(
+                exif, TAG_EXPOSURE_TIME, lroundf(exposure * 1e6), 1000000);
+        if (camera->fnumber) {
+                mp_tiff_ifd_add_rational(
+                        exif, TAG_FNUMBER, lroundf(camera->fnumber * 100), 100);
+        }
+
+        // 1 = manual, 2 = full auto, 3 = aperture priority, 4 = shutter priority
+        mp_tiff_ifd_add_short(
+                exif, TAG_EXPOSURE_PROGRAM, info->exposure_is_manual ? 1 : 2);
+
+        uint16_t isospeed = mp_dng_info_get_iso(info);
+        if (isospeed) {
+                mp_tiff_ifd_add_short(exif, TAG_ISO_SPEED_RATINGS, isospeed);
+        }
+
+        mp_tiff_ifd_add_ascii(exif, TAG_DATETIME_ORIGINAL, datetime);
+        mp_tiff_ifd_add_ascii(exif, TAG_DATETIME_DIGITIZED, datetime);
+
+        if (!camera->has_flash) {
+                // No flash function
+                mp_tiff_ifd_add_short(exif, TAG_FLASH, 0x20);
+        } else {
+                // Flash present, and whether it fired
+                mp_tiff_ifd_add_short(
+                        exif, TAG_FLASH, info->flash_enabled ? 0x1 : 0x0);
+        }
+
+        if (camera->focallength) {
+                mp_tiff_ifd_add_rational(exif,
+                                         TAG_FOCAL_LENGTH,
+                                         lroundf(camera->focallength * 100),
+                                         100);
+        }
+        if (camera->focallength && camera->cropfactor) {
+                mp_tiff_ifd_add_short(exif,
+                                      TAG_FOCAL_LENGTH_IN_35MM_FILM,
+                                      camera->focallength * camera->cropfactor);
+        }
+}
+
+static void
+load_tile_row(const struct tile_encoder *enc, int y, int x0, uint16_t *dst)
+{
+        const uint8_t *row = enc->image + y * enc->stride;
+        int count = MIN(TILE_SIZE, enc->width - x0);
+
+        if (enc->bits_per_sample == 16) {
+                memcpy(dst, (const uint16_t *)row + x0, count * sizeof(uint16_t));
+        } else if (enc->bits_per_sample == 10) {
+                // Groups of 4 pixels with the low bits packed in the 5th byte,
+                // every tile starts at a group
+                const uint8_t *src = row + x0 / 4 * 5;
+                int x = 0;
+                for (; x + 4 <= count; x += 4, src += 5) {
+                        uint8_t lo = src[4];
+                        dst[x] = (src[0] << 2) | (lo >> 6);
+                        dst[x + 1] = (src[1] << 2) | (lo >> 4 & 0x03);
+                        dst[x + 2] = (src[2] << 2) | (lo >> 2 & 0x03);
+                        dst[x + 3] = (src[3] << 2) | (lo & 0x03);
+                }
+                for (int i = 0; x < count; ++x, ++i) {
+                        dst[x] = (src[i] << 2) | ((src[4] >> (6 - i * 2)) & 0x03);
+                }
+        } else {
+                for (int x = 0; x < count; ++x) {
+                        dst[x] = row[x0 + x];
+                }
+        }
+
+        // Columns past the right edge repeat the last two, which keeps the CFA
+        // pattern and costs almost nothing to encode
+        for (int x = count; x < TILE_SIZE; ++x) {
+                dst[x] = dst[x - 2];
+        }
+}
+
+static void
+encode_tiles(struct tile_encoder *enc)
+{
+        uint16_t *samples = malloc(sizeof(uint16_t) * TILE_SIZE * TILE_SIZE);
+        uint8_t *buffer = malloc(mp_ljpeg_max_size(TILE_SIZE, TILE_SIZE));
+
+        int tile;
+        while ((tile = g_atomic_int_add(&enc->next_tile, 1)) < enc->num_tiles) {
+                int x0 = (tile % enc->tiles_across) * TILE_SIZE;
+                int y0 = (tile / enc->tiles_across) * TILE_SIZE;
+
+                for (int y = 0; y < TILE_SIZE; ++y) {
+                        // Rows past the bottom repeat the last two as well
+                        int src_y = y0 + y;
+                        if (src_y >= enc->height) {
+                                src_y = enc->height - 2 + (src_y - enc->height) % 2;
+                        }
+                        load_tile_row(enc, src_y, x0, samples + y * TILE_SIZE);
+                }
+
+                size_t size = mp_ljpeg_encode(samples,
+                                              TILE_SIZE,
+                                              TILE_SIZE,
+                                              TILE_SIZE,
+                                              enc->bits_per_sample,
+                                              buffer);
+                enc->tiles[tile] = malloc(size);
+                memcpy(enc->tiles[tile], buffer, size);
+                enc->tile_sizes[tile] = size;
+        }
+
+        free(buffer);
+        free(samples);
+}
+
+// Compresses the raw image into the tiles of enc, on the shared worker pool
+static void
+compress_image(struct tile_encoder *enc)
+{
+        enc->tiles_across = (enc->width + TILE_SIZE - 1) / TILE_SIZE;
+        enc->num_tiles =
+                enc->tiles_across * ((enc->height + TILE_SIZE - 1) / TILE_SIZE);
+        enc->next_tile = 0;
+        enc->tiles = malloc(sizeof(uint8_t *) * enc->num_tiles);
+        enc->tile_sizes = malloc(sizeof(uint32_t) * enc->num_tiles);
+
+        // Both writer threads share the pool, so two DNGs at once don't take
+        // twice the cores
+        mp_workers_run((MPWorkerFunc)encode_tiles,
+                       enc,
+                       MIN(mp_workers_get_num_threads(), enc->num_tiles));
+}
+
+static void
+free_tiles(struct tile_encoder *enc)
+{
+        for (int i = 0; i < enc->num_tiles; ++i) {
+                free(enc->tiles[i]);
+        }
+        free(enc->tiles);
+        free(enc->tile_sizes);
+}
+
+// Write all of size bytes from each of the buffers, starting at offset
+static bool
+write_all(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+        while (iovcnt > 0) {
+                ssize_t written =
+                        pwritev(fd, iov, MIN(iovcnt, IOV_MAX), offset);
+                if (written < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+                offset += written;
+
+                // Skip the buffers that were written completely
+                while (iovcnt > 0 && written >= iov->iov_len) {
+                        written -= iov->iov_len;
+                        ++iov;
+                        --iovcnt;
+                }
+                if (iovcnt > 0) {
+                        iov->iov_base = (uint8_t *)iov->iov_base + written;
+                        iov->iov_len -= written;
+                }
+        }
+        return true;
+}
+
+static void
+dng_file_free(struct dng_file *file)
+{
+        if (!file->in_buffer) {
+                free(file->header);
+                free(file->repacked);
+        }
+        free_tiles(&file->enc);
+        free(file->iov);
+}
+
+/*
+ * The file is laid out as the TIFF header, the IFD of the preview with the
+ * raw image as its sub IFD and the EXIF IFD, the preview pixels and then the
+ * raw pixels. Every offset is known up front, so the metadata and the preview
+ * are written in one go, and the raw image in a few large writes straight
+ * from the frame. Compressed images are encoded before anything is written,
+ * as the offsets of the tiles depend on their size.
+ *
+ * A 10-bit frame is repacked into buffer after the header if it fits, which
+ * makes the whole file a single write.
+ */
+static void
+prepare_file(struct dng_file *file,
+             const uint8_t *image,
+             const struct mp_dng_info *info,
+             uint8_t *buffer,
+             size_t buffer_size)
+{
+        const struct mp_camera_config *camera = info->camera;
+        MPMode mode = info->mode;
+
+        uint32_t bits_per_sample = mp_pixel_format_bits_per_pixel(mode.pixel_format);
+        size_t row_length =
+                mp_pixel_format_width_to_bytes(mode.pixel_format, mode.width);
+        size_t stride = row_length + mp_pixel_format_width_to_padding(
+                                             mode.pixel_format, mode.width);
+        int level_shift = 0;
+
+        // Merged bursts are written with 16 bits per sample, with the levels
+        // scaled up to match
+        if (info->is_merged) {
+                bits_per_sample = 16;
+                row_length = mode.width * sizeof(uint16_t);
+                stride = row_length;
+                level_shift = 16 - mp_pixel_format_pixel_depth(mode.pixel_format);
+        }
+
+        struct tm tim = *(localtime(&info->time));
+
+        char datetime[20] = { 0 };
+        strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tim);
+
+        uint32_t preview_width = mode.width >> 4;
+        uint32_t preview_height = mode.height >> 4;
+        if (info->preview) {
+                preview_width = info->preview_width;
+                preview_height = info->preview_height;
+        }
+        size_t preview_size = preview_width * preview_height * 3;
+        size_t image_size = row_length * mode.height;
+
+        struct tile_encoder enc = {
+                .image = image,
+                .stride = stride,
+                .width = mode.width,
+                .height = mode.height,
+                .bits_per_sample = bits_per_sample,
+        };
+        uint32_t *tile_offsets = NULL;
+        if (info->compress) {
+                int64_t trace_start = mp_trace_now();
+                compress_image(&enc);
+                mp_trace_span("dng_compress", info->sequence, trace_start);
+
+                tile_offsets = calloc(enc.num_tiles, sizeof(uint32_t));
+                image_size = 0;
+                for (int i = 0; i < enc.num_tiles; ++i) {
+                        image_size += enc.tile_sizes[i];
+                }
+        }
+
+        // The preview, in the main IFD
+        MPTiffIfd ifd0 = { 0 };
+        mp_tiff_ifd_add_long(&ifd0, TAG_NEW_SUBFILE_TYPE, 1);
+        mp_tiff_ifd_add_long(&ifd0, TAG_IMAGE_WIDTH, preview_width);
+        mp_tiff_ifd_add_long(&ifd0, TAG_IMAGE_LENGTH, preview_height);
+        static const uint16_t preview_bits[] = { 8, 8, 8 };
+        mp_tiff_ifd_add_shorts(&ifd0, TAG_BITS_PER_SAMPLE, preview_bits, 3);
+        mp_tiff_ifd_add_short(&ifd0, TAG_COMPRESSION, COMPRESSION_NONE);
+        mp_tiff_ifd_add_short(&ifd0, TAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+        mp_tiff_ifd_add_ascii(&ifd0, TAG_MAKE, mp_get_device_make());
+        mp_tiff_ifd_add_ascii(&ifd0, TAG_MODEL, mp_get_device_model());
+        mp_tiff_ifd_add_long(&ifd0, TAG_STRIP_OFFSETS, 0);
+        mp_tiff_ifd_add_short(
+                &ifd0, TAG_ORIENTATION, mp_dng_info_get_orientation(info));
+        mp_tiff_ifd_add_short(&ifd0, TAG_SAMPLES_PER_PIXEL, 3);
+        mp_tiff_ifd_add_long(&ifd0, TAG_ROWS_PER_STRIP, preview_height);
+        mp_tiff_ifd_add_long(&ifd0, TAG_STRIP_BYTE_COUNTS, preview_size);
+        mp_tiff_ifd_add_short(&ifd0, TAG_PLANAR_CONFIG, 1);
+        mp_tiff_ifd_add_ascii(&ifd0, TAG_SOFTWARE, "Megapixels");
+        mp_tiff_ifd_add_ascii(&ifd0, TAG_DATETIME, datetime);
+        mp_tiff_ifd_add_long(&ifd0, TAG_SUB_IFDS, 0);
+        mp_tiff_ifd_add_long(&ifd0, TAG_EXIF_IFD, 0);
+        static const uint8_t dng_version[] = { 1, 1, 0, 0 };
+        static const uint8_t dng_backward_version[] = { 1, 0, 0, 0 };
+        mp_tiff_ifd_add_bytes(&ifd0, TAG_DNG_VERSION, dng_version, 4);
+        mp_tiff_ifd_add_bytes(
+                &ifd0, TAG_DNG_BACKWARD_VERSION, dng_backward_version, 4);
+        char uniquecameramodel[255];
+        snprintf(uniquecameramodel,
+                 sizeof(uniquecameramodel),
+                 "%s %s",
+                 mp_get_device_make(),
+                 mp_get_device_model());
+        mp_tiff_ifd_add_ascii(&ifd0, TAG_UNIQUE_CAMERA_MODEL, uniquecameramodel);
+        if (camera->colormatrix[0]) {
+                mp_tiff_ifd_add_srationals(
+                        &ifd0, TAG_COLOR_MATRIX_1, camera->colormatrix, 9);
+        } else {
+                mp_tiff_ifd_add_srationals(
+                        &ifd0, TAG_COLOR_MATRIX_1, colormatrix_srgb, 9);
+        }
+        if (camera->forwardmatrix[0]) {
+                mp_tiff_ifd_add_srationals(
+                        &ifd0, TAG_FORWARD_MATRIX_1, camera->forwardmatrix, 9);
+        }
+        static const float default_neutral[] = { 1.0, 1.0, 1.0 };
+        mp_tiff_ifd_add_rationals(&ifd0,
+                                  TAG_AS_SHOT_NEUTRAL,
+                                  info->neutral[1] ? info->neutral : default_neutral,
+                                  3);
+        mp_tiff_ifd_add_short(
+                &ifd0, TAG_CALIBRATION_ILLUMINANT_1, ILLUMINANT_D65);
+
+        // The raw image
+        MPTiffIfd raw = { 0 };
+        mp_tiff_ifd_add_long(&raw, TAG_NEW_SUBFILE_TYPE, 0);
+        mp_tiff_ifd_add_long(&raw, TAG_IMAGE_WIDTH, mode.width);
+        mp_tiff_ifd_add_long(&raw, TAG_IMAGE_LENGTH, mode.height);
+        mp_tiff_ifd_add_short(&raw, TAG_BITS_PER_SAMPLE, bits_per_sample);
+        mp_tiff_ifd_add_short(&raw,
+                              TAG_COMPRESSION,
+                              info->compress ? COMPRESSION_LJPEG : COMPRESSION_NONE);
+        mp_tiff_ifd_add_short(&raw, TAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
+        mp_tiff_ifd_add_short(&raw, TAG_SAMPLES_PER_PIXEL, 1);
+        mp_tiff_ifd_add_short(&raw, TAG_PLANAR_CONFIG, 1);
+        if (info->compress) {
+                mp_tiff_ifd_add_long(&raw, TAG_TILE_WIDTH, TILE_SIZE);
+                mp_tiff_ifd_add_long(&raw, TAG_TILE_LENGTH, TILE_SIZE);
+                mp_tiff_ifd_add_longs(
+                        &raw, TAG_TILE_OFFSETS, tile_offsets, enc.num_tiles);
+                mp_tiff_ifd_add_longs(
+                        &raw, TAG_TILE_BYTE_COUNTS, enc.tile_sizes, enc.num_tiles);
+        } else {
+                mp_tiff_ifd_add_long(&raw, TAG_STRIP_OFFSETS, 0);
+                mp_tiff_ifd_add_long(&raw, TAG_ROWS_PER_STRIP, mode.height);
+                mp_tiff_ifd_add_long(&raw, TAG_STRIP_BYTE_COUNTS, image_size);
+        }
+        static const uint16_t cfapatterndim[] = { 2, 2 };
+        mp_tiff_ifd_add_shorts(&raw, TAG_CFA_REPEAT_PATTERN_DIM, cfapatterndim, 2);
+        mp_tiff_ifd_add_bytes(
+                &raw,
+                TAG_CFA_PATTERN,
+                (const uint8_t *)mp_pixel_format_cfa_pattern(mode.pixel_format),
+                4);
+        if (camera->blacklevel) {
+                mp_tiff_ifd_add_rational(
+                        &raw, TAG_BLACK_LEVEL, camera->blacklevel << level_shift, 1);
+        }
+        int whitelevel = camera->whitelevel;
+        if (!whitelevel) {
+                whitelevel =
+                        (1 << mp_pixel_format_pixel_depth(mode.pixel_format)) - 1;
+        }
+        mp_tiff_ifd_add_long(&raw, TAG_WHITE_LEVEL, whitelevel << level_shift);
+
+        MPTiffIfd exif = { 0 };
+        mp_dng_info_add_exif(info, &exif);
+
+        size_t ifd0_offset = MP_TIFF_HEADER_SIZE;
+        size_t raw_offset = ifd0_offset + mp_tiff_ifd_size(&ifd0);
+        size_t exif_offset = raw_offset + mp_tiff_ifd_size(&raw);
+        size_t preview_offset = exif_offset + mp_tiff_ifd_size(&exif);
+        size_t image_offset = preview_offset + preview_size;
+        image_offset = (image_offset + DATA_ALIGNMENT - 1) & ~(DATA_ALIGNMENT - 1);
+
+        mp_tiff_ifd_set_long(&ifd0, TAG_STRIP_OFFSETS, preview_offset);
+        mp_tiff_ifd_set_long(&ifd0, TAG_SUB_IFDS, raw_offset);
+        mp_tiff_ifd_set_long(&ifd0, TAG_EXIF_IFD, exif_offset);
+        if (info->compress) {
+                // The tiles follow each other
+                size_t tile_offset = image_offset;
+                for (int i = 0; i < enc.num_tiles; ++i) {
+                        tile_offsets[i] = tile_offset;
+                        tile_offset += enc.tile_sizes[i];
+                }
+                mp_tiff_ifd_set_longs(
+                        &raw, TAG_TILE_OFFSETS, tile_offsets, enc.num_tiles);
+        } else {
+                mp_tiff_ifd_set_long(&raw, TAG_STRIP_OFFSETS, image_offset);
+        }
+
+        *file = (struct dng_file){
+                .size = image_offset + image_size,
+                .enc = enc,
+        };
+
+        bool repack = bits_per_sample == 10 && !info->compress;
+        if (repack && buffer && image_offset + image_size <= buffer_size) {
+                file->in_buffer = true;
+                file->header = buffer;
+                file->repacked = buffer + image_offset;
+                memset(file->header, 0, image_offset);
+        } else {
+                file->header = calloc(1, image_offset);
+                if (repack) {
+                        file->repacked = malloc(image_size);
+                }
+        }
+
+        uint8_t *header = file->header;
+        mp_tiff_write_header(header, ifd0_offset);
+        mp_tiff_ifd_write(&ifd0, header, ifd0_offset, 0);
+        mp_tiff_ifd_write(&raw, header, raw_offset, 0);
+        mp_tiff_ifd_write(&exif, header, exif_offset, 0);
+
+        // The preview is left black if there is none
+        if (info->preview) {
+                assert(g_bytes_get_size(info->preview) == preview_size);
+                memcpy(header + preview_offset,
+                       g_bytes_get_data(info->preview, NULL),
+                       preview_size);
+        }
+
+        free(tile_offsets);
+
+        const uint8_t *output_image = image;
+
+        // Repack 10-bit image from sensor format into a sequencial format
+        if (repack) {
+                mp_raw10_repack(image, file->repacked, &mode);
+                output_image = file->repacked;
+                stride = row_length;
+        }
+
+        // Rows are contiguous unless the frame has padding at the end of them
+        int num_chunks = stride == row_length ? 1 : mode.height;
+        size_t chunk_size = stride == row_length ? image_size : row_length;
+        if (info->compress) {
+                num_chunks = enc.num_tiles;
+        }
+        file->iov = malloc((1 + num_chunks) * sizeof(struct iovec));
+        file->iovcnt = 1 + num_chunks;
+        file->iov[0].iov_base = header;
+        file->iov[0].iov_len = image_offset;
+        for (int i = 0; i < num_chunks; ++i) {
+                struct iovec *chunk = &file->iov[1 + i];
+                if (info->compress) {
+                        chunk->iov_base = enc.tiles[i];
+                        chunk->iov_len = enc.tile_sizes[i];
+                } else {
+                        chunk->iov_base = (uint8_t *)output_image + i * stride;
+                        chunk->iov_len = chunk_size;
+                }
+        }
+
+        // The buffer holds the header and the image after each other
+        if (file->in_buffer) {
+                file->iov[0].iov_len = file->size;
+                file->iovcnt = 1;
+        }
+}
+
+static int
+open_file(const char *path, size_t size)
+{
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                g_printerr("Could not open %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+
+        // Reserve the whole file at once, so it isn't extended write by write.
+        // Not every file system supports this, in which case it's skipped.
+        if (fallocate(fd, 0, 0, size) != 0 && errno != EOPNOTSUPP) {
+                g_printerr("Could not allocate %s: %s\n", path, strerror(errno));
+        }
+
+        return fd;
+}
+
+bool
+mp_dng_write(const char *path, const uint8_t *image, const struct mp_dng_info *info)
+{
+        struct dng_file file;
+        prepare_file(&file, image, info, NULL, 0);
+
+        int fd = open_file(path, file.size);
+        if (fd < 0) {
+                dng_file_free(&file);
+                return false;
+        }
+
+        bool success = write_all(fd, file.iov, file.iovcnt, 0);
+        if (!success) {
+                g_printerr("Could not write %s: %s\n", path, strerror(errno));
+        }
+
+        dng_file_free(&file);
+
+        // Make sure the file is on disk before the postprocessor gets to it
+        if (success && fsync(fd) != 0) {
+                g_printerr("Could not sync %s\n", path);
+                success = false;
+        }
+
+        close(fd);
+
+        return success;
+}
+
+static void
+finish_job(struct dng_job *job, bool success)
+{
+        mp_trace_span("dng_write", job->info.sequence, job->trace_start);
+        g_bytes_unref(job->image);
+        if (job->info.preview) {
+                g_bytes_unref(job->info.preview);
+        }
+
+        if (job->callback) {
+                job->callback(success, job->user_data);
+        }
+
+        free(job);
+
+        g_mutex_lock(&pending_mutex);
+        --pending_jobs;
+        g_cond_broadcast(&pending_cond);
+        g_mutex_unlock(&pending_mutex);
+}
+
+// Returns -1 if the frame isn't repacked or no buffer is free
+static int
+take_staging_buffer(const struct mp_dng_info *info)
+{
+        const MPMode *mode = &info->mode;
+        if (info->is_merged || info->compress ||
+            mp_pixel_format_bits_per_pixel(mode->pixel_format) != 10) {
+                return -1;
+        }
+
+        size_t size = STAGING_HEADER_SIZE +
+                      mp_pixel_format_width_to_bytes(mode->pixel_format,
+                                                     mode->width) *
+                              mode->height;
+
+        g_mutex_lock(&staging_mutex);
+
+        // Sized for the first frame, larger ones are written from allocated
+        // buffers instead. Registering fails if more memory would be locked
+        // than RLIMIT_MEMLOCK allows, in which case fewer buffers are tried.
+        if (staging_size == 0 && !staging_failed) {
+                for (int i = 0; i < MAX_STAGING_BUFFERS; ++i) {
+                        staging_buffers[i] = malloc(size);
+                }
+                for (int count = MAX_STAGING_BUFFERS; count > 0; --count) {
+                        if (mp_uring_writer_register_buffers(
+                                    uring, staging_buffers, count, size)) {
+                                num_staging_buffers = count;
+                                staging_size = size;
+                                break;
+                        }
+                }
+                for (int i = num_staging_buffers; i < MAX_STAGING_BUFFERS; ++i) {
+                        free(staging_buffers[i]);
+                        staging_buffers[i] = NULL;
+                }
+                staging_failed = num_staging_buffers == 0;
+        }
+
+        int index = -1;
+        if (size <= staging_size) {
+                for (int i = 0; i < num_staging_buffers; ++i) {
+                        if (!staging_in_use[i]) {
+                                staging_in_use[i] = true;
+                                index = i;
+                                break;
+                        }
+                }
+        }
+
+        g_mutex_unlock(&staging_mutex);
+        return index;
+}
+
+static void
+release_staging_buffer(int index)
+{
+        if (index < 0) {
+                return;
+        }
+
+        g_mutex_lock(&staging_mutex);
+        staging_in_use[index] = false;
+        g_mutex_unlock(&staging_mutex);
+}
+
+static void
+on_job_written(int error, struct dng_job *job)
+{
+        if (error) {
+                g_printerr("Could not write %s: %s\n", job->path, strerror(error));
+        }
+
+        dng_file_free(&job->file);
+        release_staging_buffer(job->staging_index);
+        finish_job(job, error == 0);
+}
+
+static void
+process_job(struct dng_job *job, gpointer data)
+{
+        printf("Writing frame to %s\n", job->path);
+
+        job->trace_start = mp_trace_now();
+        const uint8_t *image = g_bytes_get_data(job->image, NULL);
+
+        if (!uring) {
+                finish_job(job, mp_dng_write(job->path, image, &job->info));
+                return;
+        }
+
+        job->staging_index = take_staging_buffer(&job->info);
+        uint8_t *buffer = NULL;
+        if (job->staging_index >= 0) {
+                buffer = staging_buffers[job->staging_index];
+        }
+        prepare_file(&job->file, image, &job->info, buffer, staging_size);
+
+        // The header didn't fit in front of the frame
+        if (buffer && !job->file.in_buffer) {
+                release_staging_buffer(job->staging_index);
+                job->staging_index = -1;
+        }
+
+        int fd = open_file(job->path, job->file.size);
+        if (fd < 0) {
+                dng_file_free(&job->file);
+                release_staging_buffer(job->staging_index);
+                finish_job(job, false);
+                return;
+        }
+
+        mp_uring_writer_write(uring,
+                              fd,
+                              job->file.iov,
+                              job->file.iovcnt,
+                              job->staging_index,
+                              (MPUringWriterCallback)on_job_written,
+                              job);
+}
+
+void
+mp_dng_writer_start()
+{
+        // Falls back to writing from the writer threads
+        uring = mp_uring_writer_new(URING_QUEUE_DEPTH);
+
+        pool = g_thread_pool_new(
+                (GFunc)process_job, NULL, NUM_WRITER_THREADS, FALSE, NULL);
+}
+
+void
+mp_dng_writer_stop()
+{
+        // Finish writing everything that was queued
+        g_thread_pool_free(pool, FALSE, TRUE);
+        pool = NULL;
+
+        if (uring) {
+                mp_uring_writer_free(uring);
+                uring = NULL;
+        }
+
+        for (int i = 0; i < num_staging_buffers; ++i) {
+                free(staging_buffers[i]);
+                staging_buffers[i] = NULL;
+        }
+        num_staging_buffers = 0;
+        staging_size = 0;
+        staging_failed = false;
+}
+
+void
+mp_dng_writer_sync()
+{
+        g_mutex_lock(&pending_mutex);
+        while (pending_jobs > 0) {
+                g_cond_wait(&pending_cond, &pending_mutex);
+        }
+        g_mutex_unlock(&pending_mutex);
+}
+
+int
+mp_dng_writer_get_capacity()
+{
+        g_mutex_lock(&pending_mutex);
+        int capacity = MAX_PENDING_JOBS - pending_jobs;
+        g_mutex_unlock(&pending_mutex);
+        return MAX(capacity, 0);
+}
+
+void
+mp_dng_writer_write(const char *path,
+                    GBytes *image,
+                    const struct mp_dng_info *info,
+                    MPDngWriterCallback callback,
+                    void *user_data)
+{
+        struct dng_job *job = malloc(sizeof(struct dng_job));
+        snprintf(job->path, sizeof(job->path), "%s", path);
+        job->image = g_bytes_ref(image);
+        job->info = *info;
+        if (job->info.preview) {
+                g_bytes_ref(job->info.preview);
+        }
+        job->callback = callback;
+        job->user_data = user_data;
+
+        // The io pipeline stops handing out frames for capture when the queue
+        // is full, this only blocks if frames were already on their way
+        g_mutex_lock(&pending_mutex);
+        while (pending_jobs >= MAX_PENDING_JOBS) {
+                g_cond_wait(&pending_cond, &pending_mutex);
+        }
+        ++pending_jobs;
+        g_mutex_unlock(&pending_mutex);
+
+        g_thread_pool_push(pool, job, NULL);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "camera_config.h"
+#include "tiff_ifd.h"
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Everything needed to write a frame to a DNG, captured at the time the frame
+// was taken since the writer runs behind the process pipeline
+struct mp_dng_info {
+        const struct mp_camera_config *camera;
+        MPMode mode;
+        int rotation;
+
+        time_t time;
+
+        bool exposure_is_manual;
+        int exposure;
+
+        int gain;
+        int gain_max;
+
+        // AsShotNeutral, 1, 1, 1 is written when this is left at zero
+        float neutral[3];
+
+        bool flash_enabled;
+
+        // The image holds 16-bit samples from mp_burst_merge_get_result()
+        // instead of data in the sensor format
+        bool is_merged;
+
+        // Store the raw image as lossless JPEG compressed tiles instead of
+        // uncompressed, which takes more time but much less space
+        bool compress;
+
+        // V4L2 sequence number of the frame, for tracing
+        uint32_t sequence;
+
+        // Optional RGB preview in the orientation of the sensor, stored in
+        // the main IFD. A black one is written without it.
+        GBytes *preview;
+        uint32_t preview_width;
+        uint32_t preview_height;
+};
+
+// EXIF values for the frame, shared with the JPEG developer
+uint16_t mp_dng_info_get_orientation(const struct mp_dng_info *info);
+float mp_dng_info_get_exposure_time(const struct mp_dng_info *info);
+// Returns 0 when the camera config has no ISO range
+uint16_t mp_dng_info_get_iso(const struct mp_dng_info *info);
+// Adds the EXIF IFD entries for the frame
+void mp_dng_info_add_exif(const struct mp_dng_info *info, MPTiffIfd *exif);
+
+// Called from a writer thread once the file has been written and synced
+typedef void (*MPDngWriterCallback)(bool success, void *user_data);
+
+void mp_dng_writer_start();
+void mp_dng_writer_stop();
+void mp_dng_writer_sync();
+
+// Number of frames that can be written without blocking
+int mp_dng_writer_get_capacity();
+
+// Writes the DNG on the calling thread, the writer threads use this as well
+bool mp_dng_write(const char *path,
+                  const uint8_t *image,
+                  const struct mp_dng_info *info);
+
+// Takes a reference to image and to the preview in info. A mapped camera buffer
+// has to be kept from being reused until image is released.
+void mp_dng_writer_write(const char *path,
+                         GBytes *image,
+                         const struct mp_dng_info *info,
+                         MPDngWriterCallback callback,
+                         void *user_data);
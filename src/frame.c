@@ -0,0 +1,67 @@
+#include "frame.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+struct _MPFrame {
+        MPBuffer buffer;
+        MPMode mode;
+
+        MPFrameReleaseCallback release;
+        void *user_data;
+
+        _Atomic int ref_count;
+};
+
+MPFrame *
+mp_frame_new(MPBuffer buffer,
+             const MPMode *mode,
+             MPFrameReleaseCallback release,
+             void *user_data)
+{
+        MPFrame *frame = malloc(sizeof(MPFrame));
+        frame->buffer = buffer;
+        frame->mode = *mode;
+        frame->release = release;
+        frame->user_data = user_data;
+        frame->ref_count = 1;
+        return frame;
+}
+
+MPFrame *
+mp_frame_ref(MPFrame *frame)
+{
+        ++frame->ref_count;
+        return frame;
+}
+
+void
+mp_frame_unref(MPFrame *frame)
+{
+        assert(frame->ref_count > 0);
+
+        if (--frame->ref_count == 0) {
+                if (frame->release) {
+                        frame->release(&frame->buffer, frame->user_data);
+                }
+                free(frame);
+        }
+}
+
+const uint8_t *
+mp_frame_get_data(const MPFrame *frame)
+{
+        return frame->buffer.data;
+}
+
+const MPMode *
+mp_frame_get_mode(const MPFrame *frame)
+{
+        return &frame->mode;
+}
+
+const MPBuffer *
+mp_frame_get_buffer(const MPFrame *frame)
+{
+        return &frame->buffer;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "camera.h"
+#include "mode.h"
+
+// A refcounted view of a captured V4L2 buffer. The buffer is handed back to
+// its owner through the release callback once the last reference is dropped.
+typedef struct _MPFrame MPFrame;
+
+typedef void (*MPFrameReleaseCallback)(const MPBuffer *buffer, void *user_data);
+
+MPFrame *mp_frame_new(MPBuffer buffer,
+                      const MPMode *mode,
+                      MPFrameReleaseCallback release,
+                      void *user_data);
+MPFrame *mp_frame_ref(MPFrame *frame);
+void mp_frame_unref(MPFrame *frame);
+
+const uint8_t *mp_frame_get_data(const MPFrame *frame);
+const MPMode *mp_frame_get_mode(const MPFrame *frame);
+const MPBuffer *mp_frame_get_buffer(const MPFrame *frame);
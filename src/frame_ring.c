@@ -0,0 +1,125 @@
+#include "frame_ring.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+struct _MPFrameRing {
+        MPFrame **frames;
+        int max_frames;
+        int capacity;
+
+        // Index of the oldest frame
+        int start;
+        int count;
+};
+
+MPFrameRing *
+mp_frame_ring_new(int max_frames)
+{
+        MPFrameRing *ring = calloc(1, sizeof(MPFrameRing));
+        ring->frames = calloc(max_frames, sizeof(MPFrame *));
+        ring->max_frames = max_frames;
+        ring->capacity = max_frames;
+        return ring;
+}
+
+void
+mp_frame_ring_free(MPFrameRing *ring)
+{
+        mp_frame_ring_clear(ring);
+        free(ring->frames);
+        free(ring);
+}
+
+static MPFrame *
+get_frame(const MPFrameRing *ring, int i)
+{
+        return ring->frames[(ring->start + i) % ring->max_frames];
+}
+
+static void
+drop_oldest(MPFrameRing *ring)
+{
+        assert(ring->count > 0);
+
+        mp_frame_unref(get_frame(ring, 0));
+        ring->start = (ring->start + 1) % ring->max_frames;
+        --ring->count;
+}
+
+void
+mp_frame_ring_set_capacity(MPFrameRing *ring, int capacity)
+{
+        assert(capacity >= 0);
+
+        ring->capacity = capacity < ring->max_frames ? capacity : ring->max_frames;
+        while (ring->count > ring->capacity) {
+                drop_oldest(ring);
+        }
+}
+
+int
+mp_frame_ring_get_count(const MPFrameRing *ring)
+{
+        return ring->count;
+}
+
+void
+mp_frame_ring_push(MPFrameRing *ring, MPFrame *frame)
+{
+        if (ring->capacity == 0) {
+                mp_frame_unref(frame);
+                return;
+        }
+
+        if (ring->count == ring->capacity) {
+                drop_oldest(ring);
+        }
+
+        int end = (ring->start + ring->count) % ring->max_frames;
+        ring->frames[end] = frame;
+        ++ring->count;
+}
+
+int
+mp_frame_ring_take_burst(MPFrameRing *ring,
+                         int64_t time,
+                         int count,
+                         MPFrame **frames)
+{
+        // One past the newest frame captured at or before time
+        int end = 0;
+        while (end < ring->count &&
+               mp_frame_get_buffer(get_frame(ring, end))->timestamp <= time) {
+                ++end;
+        }
+
+        int start = end > count ? end - count : 0;
+        if (end - start < count) {
+                end = start + count < ring->count ? start + count : ring->count;
+        }
+
+        for (int i = start; i < end; ++i) {
+                frames[i - start] = get_frame(ring, i);
+        }
+
+        // The burst keeps the references of the frames it took
+        for (int i = 0; i < ring->count; ++i) {
+                if (i < start || i >= end) {
+                        mp_frame_unref(get_frame(ring, i));
+                }
+        }
+        ring->start = 0;
+        ring->count = 0;
+
+        return end - start;
+}
+
+void
+mp_frame_ring_clear(MPFrameRing *ring)
+{
+        while (ring->count > 0) {
+                drop_oldest(ring);
+        }
+        ring->start = 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "frame.h"
+#include <stdint.h>
+
+/*
+ * The newest frames from the sensor, so a burst can be taken from frames that
+ * were captured before the shutter was pressed. The ring holds references to
+ * the mapped V4L2 buffers instead of copies, its capacity is bounded by the
+ * buffers that can be kept from the sensor. Only used from the io pipeline.
+ */
+typedef struct _MPFrameRing MPFrameRing;
+
+MPFrameRing *mp_frame_ring_new(int max_frames);
+void mp_frame_ring_free(MPFrameRing *ring);
+
+// Drops the oldest frames beyond capacity, which is at most max_frames
+void mp_frame_ring_set_capacity(MPFrameRing *ring, int capacity);
+int mp_frame_ring_get_count(const MPFrameRing *ring);
+
+// Takes over the reference to frame, dropping the oldest frame when full
+void mp_frame_ring_push(MPFrameRing *ring, MPFrame *frame);
+
+// Takes up to count frames, the newest ones with a timestamp at or before time
+// in the order they were captured. When fewer were captured before time, the
+// frames after it fill up the burst. The other frames are dropped, returns the
+// number of frames stored in frames.
+int mp_frame_ring_take_burst(MPFrameRing *ring,
+                             int64_t time,
+                             int count,
+                             MPFrame **frames);
+void mp_frame_ring_clear(MPFrameRing *ring);
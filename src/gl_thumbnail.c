@@ -0,0 +1,199 @@
+#include "gl_thumbnail.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct _GLThumbnailer {
+        bool use_pack_buffers;
+
+        GLuint frame_buffer;
+        GLuint program;
+        GLuint uniform_transform;
+        GLuint uniform_texture;
+        GLuint uniform_pixel_size;
+
+        GLuint quad;
+};
+
+struct _GLThumbnail {
+        size_t size;
+
+        // Only one of these is set, depending on use_pack_buffers
+        GLuint pack_buffer;
+        uint8_t *data;
+};
+
+GLThumbnailer *
+gl_thumbnailer_new(bool use_pack_buffers)
+{
+        GLuint frame_buffer;
+        glGenFramebuffers(1, &frame_buffer);
+        check_gl();
+
+        GLuint shaders[] = {
+                gl_util_load_shader("/org/postmarketos/Megapixels/blit.vert",
+                                    GL_VERTEX_SHADER,
+                                    NULL,
+                                    0),
+                gl_util_load_shader("/org/postmarketos/Megapixels/thumbnail.frag",
+                                    GL_FRAGMENT_SHADER,
+                                    NULL,
+                                    0),
+        };
+
+        GLuint program = gl_util_link_program(shaders, 2);
+        glBindAttribLocation(program, GL_UTIL_VERTEX_ATTRIBUTE, "vert");
+        glBindAttribLocation(program, GL_UTIL_TEX_COORD_ATTRIBUTE, "tex_coord");
+        check_gl();
+
+        GLThumbnailer *self = malloc(sizeof(GLThumbnailer));
+        self->use_pack_buffers = use_pack_buffers;
+        self->frame_buffer = frame_buffer;
+        self->program = program;
+        self->uniform_transform = glGetUniformLocation(program, "transform");
+        self->uniform_texture = glGetUniformLocation(program, "texture");
+        self->uniform_pixel_size = glGetUniformLocation(program, "pixel_size");
+        check_gl();
+
+        self->quad = gl_util_new_quad();
+
+        return self;
+}
+
+void
+gl_thumbnailer_free(GLThumbnailer *self)
+{
+        glDeleteFramebuffers(1, &self->frame_buffer);
+
+        glDeleteProgram(self->program);
+
+        // Zero when the quad is drawn from client memory, which is ignored
+        glDeleteBuffers(1, &self->quad);
+
+        free(self);
+}
+
+GLThumbnail *
+gl_thumbnailer_render(GLThumbnailer *self,
+                      GLuint texture,
+                      uint32_t width,
+                      uint32_t height,
+                      const GLfloat *transform)
+{
+        GLint viewport[4];
+        GLint program;
+        GLint frame_buffer;
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &frame_buffer);
+
+        GLuint thumbnail_texture;
+        glGenTextures(1, &thumbnail_texture);
+        glBindTexture(GL_TEXTURE_2D, thumbnail_texture);
+        glTexImage2D(GL_TEXTURE_2D,
+                     0,
+                     GL_RGBA,
+                     width,
+                     height,
+                     0,
+                     GL_RGBA,
+                     GL_UNSIGNED_BYTE,
+                     NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        check_gl();
+
+        glBindFramebuffer(GL_FRAMEBUFFER, self->frame_buffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER,
+                               GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D,
+                               thumbnail_texture,
+                               0);
+        check_gl();
+
+        assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+        glViewport(0, 0, width, height);
+        glUseProgram(self->program);
+        glUniformMatrix3fv(self->uniform_transform, 1, GL_FALSE, transform);
+
+        // The quad spans the thumbnail, its texture coordinates go from 0 to 1
+        // along axes that the transform may have rotated
+        float u_pixels = hypotf(transform[0] * width, transform[1] * height);
+        float v_pixels = hypotf(transform[3] * width, transform[4] * height);
+        glUniform2f(self->uniform_pixel_size, 1 / u_pixels, 1 / v_pixels);
+
+        // Filter while scaling down, the textures are otherwise only sampled
+        // pixel for pixel
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glUniform1i(self->uniform_texture, 0);
+        check_gl();
+
+        gl_util_bind_quad(self->quad);
+        gl_util_draw_quad(self->quad);
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        check_gl();
+
+        GLThumbnail *thumbnail = calloc(1, sizeof(GLThumbnail));
+        thumbnail->size = width * height * sizeof(uint32_t);
+
+        if (self->use_pack_buffers) {
+                glGenBuffers(1, &thumbnail->pack_buffer);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, thumbnail->pack_buffer);
+                glBufferData(GL_PIXEL_PACK_BUFFER,
+                             thumbnail->size,
+                             NULL,
+                             GL_STREAM_READ);
+                glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        } else {
+                thumbnail->data = g_malloc(thumbnail->size);
+                glReadPixels(0,
+                             0,
+                             width,
+                             height,
+                             GL_RGBA,
+                             GL_UNSIGNED_BYTE,
+                             thumbnail->data);
+        }
+        check_gl();
+
+        // Deleting is deferred until the read back is done with it
+        glDeleteTextures(1, &thumbnail_texture);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, frame_buffer);
+        glUseProgram(program);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        check_gl();
+
+        return thumbnail;
+}
+
+GBytes *
+gl_thumbnail_finish(GLThumbnail *thumbnail)
+{
+        uint8_t *data = thumbnail->data;
+
+        if (thumbnail->pack_buffer) {
+                data = g_malloc(thumbnail->size);
+
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, thumbnail->pack_buffer);
+                const void *mapped = glMapBufferRange(
+                        GL_PIXEL_PACK_BUFFER, 0, thumbnail->size, GL_MAP_READ_BIT);
+                assert(mapped);
+                memcpy(data, mapped, thumbnail->size);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                glDeleteBuffers(1, &thumbnail->pack_buffer);
+                check_gl();
+        }
+
+        GBytes *bytes = g_bytes_new_take(data, thumbnail->size);
+        free(thumbnail);
+        return bytes;
+}
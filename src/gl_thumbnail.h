@@ -0,0 +1,30 @@
+#pragma once
+
+#include "gl_util.h"
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Scales a texture down into a small offscreen buffer on the GPU and reads
+ * that back, instead of reading back the full texture. With pack buffers the
+ * read back runs asynchronously until gl_thumbnail_finish() is called.
+ */
+typedef struct _GLThumbnailer GLThumbnailer;
+typedef struct _GLThumbnail GLThumbnail;
+
+GLThumbnailer *gl_thumbnailer_new(bool use_pack_buffers);
+void gl_thumbnailer_free(GLThumbnailer *self);
+
+// Draws texture into a width x height thumbnail, with transform applied to the
+// vertices like the blit shader does. Rows are read back from the bottom of the
+// thumbnail up. The viewport, program and frame buffer are restored after.
+GLThumbnail *gl_thumbnailer_render(GLThumbnailer *self,
+                                   GLuint texture,
+                                   uint32_t width,
+                                   uint32_t height,
+                                   const GLfloat *transform);
+
+// Waits for the read back, returns the RGBA pixels and frees the thumbnail.
+// Must be called with the same context current.
+GBytes *gl_thumbnail_finish(GLThumbnail *thumbnail);
@@ -3,6 +3,7 @@
 #include "camera.h"
 #include "gl_util.h"
 #include <stdlib.h>
+#include <string.h>
 
 #define VERTEX_ATTRIBUTE 0
 #define TEX_COORD_ATTRIBUTE 1
@@ -104,32 +105,41 @@ gles2_debayer_use(GLES2Debayer *self)
 }
 
 void
-gles2_debayer_configure(GLES2Debayer *self,
-                        const uint32_t dst_width,
-                        const uint32_t dst_height,
-                        const uint32_t src_width,
-                        const uint32_t src_height,
-                        const uint32_t rotation,
-                        const bool mirrored,
-                        const float *colormatrix,
-                        const uint8_t blacklevel)
+gles2_debayer_get_transform(uint32_t rotation, bool mirrored, GLfloat *matrix)
 {
-        glViewport(0, 0, dst_width, dst_height);
-        check_gl();
-
         GLfloat rotation_list[4] = { 0, -1, 0, 1 };
         int rotation_index = 4 - rotation / 90;
 
         GLfloat sin_rot = rotation_list[rotation_index];
         GLfloat cos_rot = rotation_list[(rotation_index + 1) % 4];
         GLfloat scale_x = mirrored ? 1 : -1;
-        GLfloat matrix[9] = {
+        GLfloat transform[9] = {
                 // clang-format off
 		cos_rot * scale_x,  sin_rot, 0,
 		-sin_rot * scale_x, cos_rot, 0,
 		0,                        0, 1,
                 // clang-format on
         };
+        memcpy(matrix, transform, sizeof(transform));
+}
+
+void
+gles2_debayer_configure(GLES2Debayer *self,
+                        const uint32_t dst_width,
+                        const uint32_t dst_height,
+                        const uint32_t src_width,
+                        const uint32_t src_height,
+                        const uint32_t src_padding,
+                        const uint32_t rotation,
+                        const bool mirrored,
+                        const float *colormatrix,
+                        const uint8_t blacklevel)
+{
+        glViewport(0, 0, dst_width, dst_height);
+        check_gl();
+
+        GLfloat matrix[9];
+        gles2_debayer_get_transform(rotation, mirrored, matrix);
         glUniformMatrix3fv(self->uniform_transform, 1, GL_FALSE, matrix);
         check_gl();
 
@@ -166,9 +176,9 @@ gles2_debayer_configure(GLES2Debayer *self,
                 check_gl();
         }
 
-        GLuint padding_bytes =
-                mp_pixel_format_width_to_padding(self->format, src_width);
-        GLfloat padding_ratio = (float)row_length / (row_length + padding_bytes);
+        // src_padding is the number of padding bytes at the end of each row of
+        // the source texture, 0 if the padding was skipped during upload
+        GLfloat padding_ratio = (float)row_length / (row_length + src_padding);
         glUniform1f(self->uniform_padding_ratio, padding_ratio);
 }
 
@@ -10,11 +10,15 @@ void gles2_debayer_free(GLES2Debayer *self);
 
 void gles2_debayer_use(GLES2Debayer *self);
 
+// The transform applied to the vertices to rotate and mirror the image
+void gles2_debayer_get_transform(uint32_t rotation, bool mirrored, GLfloat *matrix);
+
 void gles2_debayer_configure(GLES2Debayer *self,
                              const uint32_t dst_width,
                              const uint32_t dst_height,
                              const uint32_t src_width,
                              const uint32_t src_height,
+                             const uint32_t src_padding,
                              const uint32_t rotation,
                              const bool mirrored,
                              const float *colormatrix,
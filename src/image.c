@@ -0,0 +1,223 @@
+#include "image.h"
+
+#include <assert.h>
+#include <glib.h>
+#include <string.h>
+
+// Quads sampled for the statistics, in each direction. Every sampled quad
+// touches two cache lines that aren't shared with the others, so this is kept
+// small enough that the frame costs a fraction of a millisecond.
+#define STATS_GRID_WIDTH 64
+#define STATS_GRID_HEIGHT 48
+
+// Largest region used for the sharpness, in quads. Every quad in it is used,
+// as subsampling would lose the detail that changes with focus.
+#define SHARPNESS_MAX_WIDTH 256
+#define SHARPNESS_MAX_HEIGHT 192
+
+// Quads with a sample at or above this are clipped, and below this luminance
+// they're mostly noise
+#define STATS_CLIP_LEVEL 250
+#define STATS_DARK_LEVEL 8
+
+void
+mp_image_extract_gray(const uint8_t *image, const MPMode *mode, uint8_t *dst)
+{
+        size_t row_length =
+                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width);
+        int padding_bytes =
+                mp_pixel_format_width_to_padding(mode->pixel_format, mode->width);
+        size_t i = 0, padding_offset = 0;
+        size_t offset;
+        switch (mode->pixel_format) {
+        case MP_PIXEL_FMT_BGGR8:
+        case MP_PIXEL_FMT_GBRG8:
+        case MP_PIXEL_FMT_GRBG8:
+        case MP_PIXEL_FMT_RGGB8:
+                for (int y = 0; y < mode->height; y += 2) {
+                        for (int x = 0; x < row_length; x += 2) {
+                                dst[i++] = image[x + row_length * y];
+                        }
+                }
+                break;
+        case MP_PIXEL_FMT_BGGR10P:
+        case MP_PIXEL_FMT_GBRG10P:
+        case MP_PIXEL_FMT_GRBG10P:
+        case MP_PIXEL_FMT_RGGB10P:
+                // Skip 5th byte of each 4-pixel segment by incrementing an
+                // offset every time a 5th byte is reached, making the
+                // X coordinate land on the next byte:
+                //
+                // image       | | | | X | | | | X | | | | X | | | | X | ...
+                // x           0   2   4   6   8  10  12  14  16  18  20 ...
+                // offset      0       1       2       3       4       5 ...
+                //                     >       --->    ----->  ------->
+                // x + offset  0   2     4   6     8  10    12  16    18 ...
+                for (int y = 0; y < mode->height; y += 2) {
+                        offset = 0;
+                        for (int x = 0; x < mode->width; x += 2) {
+                                if (x % 4 == 0)
+                                        offset += 1;
+
+                                dst[i++] = image[x + offset + padding_offset +
+                                                 row_length * y];
+                        }
+
+                        // Skip padding
+                        padding_offset += padding_bytes * 2;
+                }
+                break;
+        default:
+                assert(0);
+        }
+}
+
+void
+mp_image_compute_stats(const uint8_t *image,
+                       const MPMode *mode,
+                       MPImageStats *stats)
+{
+        memset(stats, 0, sizeof(MPImageStats));
+
+        const char *cfa = mp_pixel_format_cfa_pattern(mode->pixel_format);
+        if (!cfa) {
+                return;
+        }
+
+        bool is_packed = mp_pixel_format_bits_per_pixel(mode->pixel_format) == 10;
+        size_t stride =
+                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width) +
+                mp_pixel_format_width_to_padding(mode->pixel_format, mode->width);
+
+        int quads_x = mode->width / 2;
+        int quads_y = mode->height / 2;
+        int step_x = MAX(quads_x / STATS_GRID_WIDTH, 1);
+        int step_y = MAX(quads_y / STATS_GRID_HEIGHT, 1);
+
+        for (int qy = step_y / 2; qy < quads_y; qy += step_y) {
+                const uint8_t *row0 = image + (size_t)qy * 2 * stride;
+                const uint8_t *row1 = row0 + stride;
+
+                for (int qx = step_x / 2; qx < quads_x; qx += step_x) {
+                        // Both pixels of a quad row are in the same group of
+                        // a packed row, the low bits in its 5th byte are
+                        // ignored
+                        int x = qx * 2;
+                        if (is_packed) {
+                                x += x / 4;
+                        }
+
+                        uint8_t samples[4] = {
+                                row0[x],
+                                row0[x + 1],
+                                row1[x],
+                                row1[x + 1],
+                        };
+
+                        uint32_t rgb[3] = { 0, 0, 0 };
+                        uint8_t max = 0;
+                        for (int i = 0; i < 4; ++i) {
+                                rgb[(int)cfa[i]] += samples[i];
+                                max = MAX(max, samples[i]);
+                        }
+
+                        uint32_t luminance = (rgb[0] + rgb[1] + rgb[2]) / 4;
+                        ++stats->histogram[luminance * MP_IMAGE_HISTOGRAM_BINS /
+                                           256];
+                        stats->luminance_sum += luminance;
+                        ++stats->num_samples;
+
+                        if (max < STATS_CLIP_LEVEL &&
+                            luminance >= STATS_DARK_LEVEL) {
+                                stats->gray_sum[0] += rgb[0];
+                                stats->gray_sum[1] += rgb[1];
+                                stats->gray_sum[2] += rgb[2];
+                                ++stats->num_gray_samples;
+                        }
+                }
+        }
+}
+
+static int
+clamp_region(float start, float size, int max_size, int length, int *count)
+{
+        int first = CLAMP((int)(start * length), 0, length - 1);
+        int last = CLAMP((int)((start + size) * length), first + 1, length);
+
+        *count = MIN(last - first, max_size);
+        return CLAMP((first + last - *count) / 2, 0, length - *count);
+}
+
+uint64_t
+mp_image_get_sharpness(const uint8_t *image,
+                       const MPMode *mode,
+                       const MPImageRegion *region)
+{
+        const char *cfa = mp_pixel_format_cfa_pattern(mode->pixel_format);
+        int quads_x = mode->width / 2;
+        int quads_y = mode->height / 2;
+        if (!cfa || quads_x < 2 || quads_y < 2) {
+                return 0;
+        }
+
+        // The two green samples of a quad are in opposite corners
+        int green_x = cfa[0] == 1 ? 0 : 1;
+
+        bool is_packed = mp_pixel_format_bits_per_pixel(mode->pixel_format) == 10;
+        size_t stride =
+                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width) +
+                mp_pixel_format_width_to_padding(mode->pixel_format, mode->width);
+
+        int width, height;
+        int start_x = clamp_region(
+                region->x, region->width, SHARPNESS_MAX_WIDTH, quads_x, &width);
+        int start_y = clamp_region(
+                region->y, region->height, SHARPNESS_MAX_HEIGHT, quads_y, &height);
+
+        // Green of the quads in the previous row, for the vertical gradient
+        int previous[SHARPNESS_MAX_WIDTH];
+        uint64_t energy = 0;
+
+        for (int qy = 0; qy < height; ++qy) {
+                const uint8_t *row0 = image + (size_t)(start_y + qy) * 2 * stride;
+                const uint8_t *row1 = row0 + stride;
+                int left = 0;
+
+                for (int qx = 0; qx < width; ++qx) {
+                        int x = (start_x + qx) * 2;
+                        if (is_packed) {
+                                x += x / 4;
+                        }
+
+                        int green = row0[x + green_x] + row1[x + 1 - green_x];
+
+                        if (qx > 0) {
+                                int dx = green - left;
+                                energy += dx * dx;
+                        }
+                        if (qy > 0) {
+                                int dy = green - previous[qx];
+                                energy += dy * dy;
+                        }
+
+                        previous[qx] = green;
+                        left = green;
+                }
+        }
+
+        return energy;
+}
+
+bool
+mp_image_is_blank(const uint8_t *image, const MPMode *mode)
+{
+        // Only check a 10x10 area
+        size_t test_size = MIN(10, mode->width) * MIN(10, mode->height);
+
+        for (size_t i = 0; i < test_size; ++i) {
+                if (image[i] != 0) {
+                        return false;
+                }
+        }
+        return true;
+}
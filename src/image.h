@@ -0,0 +1,55 @@
+#pragma once
+
+#include "mode.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Small kernels that run on every preview frame, kept apart from the
+ * pipelines so megapixels-bench can time them.
+ */
+
+// Grayscale image at half the resolution of the mode, from the first
+// sample of every 2x2 Bayer quad. dst holds (width / 2) * (height / 2) bytes.
+void mp_image_extract_gray(const uint8_t *image, const MPMode *mode, uint8_t *dst);
+
+#define MP_IMAGE_HISTOGRAM_BINS 64
+
+typedef struct {
+        // Luminance of the sampled 2x2 Bayer quads, from the 8 most significant
+        // bits of each sample
+        uint32_t histogram[MP_IMAGE_HISTOGRAM_BINS];
+        uint32_t num_samples;
+        uint32_t luminance_sum;
+
+        // Red, green and blue sums of the quads that are neither clipped nor
+        // too dark, for estimating the white balance. Green has both samples.
+        uint32_t gray_sum[3];
+        uint32_t num_gray_samples;
+} MPImageStats;
+
+// Statistics of a sparse grid of Bayer quads, for the software auto exposure
+// and white balance. Frames that aren't Bayer give empty statistics.
+void mp_image_compute_stats(const uint8_t *image,
+                            const MPMode *mode,
+                            MPImageStats *stats);
+
+// A part of the frame, in fractions of its width and height
+typedef struct {
+        float x;
+        float y;
+        float width;
+        float height;
+} MPImageRegion;
+
+// Gradient energy of the green samples in the region, which peaks when the
+// region is in focus. Large regions are shrunk around their centre, only
+// scores of the same region and mode can be compared.
+uint64_t mp_image_get_sharpness(const uint8_t *image,
+                                const MPMode *mode,
+                                const MPImageRegion *region);
+
+// Frames returned right after a mode switch can be left over from before the
+// switch and are all zeroes, this only looks at the start of the frame
+bool mp_image_is_blank(const uint8_t *image, const MPMode *mode);
@@ -1,14 +1,23 @@
 #include "io_pipeline.h"
 
+#include "auto_controls.h"
+#include "auto_focus.h"
 #include "camera.h"
 #include "device.h"
+#include "dng_writer.h"
 #include "flash.h"
+#include "frame.h"
+#include "frame_ring.h"
+#include "image.h"
 #include "pipeline.h"
 #include "process_pipeline.h"
+#include "recording.h"
+#include "trace.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <glib.h>
+#include <inttypes.h>
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
@@ -36,8 +45,21 @@ struct camera_info {
         int gain_ctrl;
         int gain_max;
 
+        // Exposure and gain are driven by the statistics of the preview when
+        // the sensor can't do it itself
+        MPAutoControls *auto_controls;
+        bool has_software_exposure;
+        bool has_software_gain;
+
         bool has_auto_focus_continuous;
         bool has_auto_focus_start;
+        // Contrast detection focus, for lenses that only have an absolute
+        // focus control
+        MPAutoFocus *auto_focus;
+
+        // Replayed cameras have no media device
+        bool is_replay;
+        MPRecorder *recorder;
 
         // unsigned int entity_id;
         // enum v4l2_buf_type type;
@@ -72,12 +94,29 @@ static size_t num_devices = 0;
 static const struct mp_camera_config *camera = NULL;
 static MPMode mode;
 
+// When the pipeline was started, until the first frame is captured
+static int64_t start_time;
+static bool has_first_frame = false;
+
 static bool just_switched_mode = false;
 static int blank_frame_count = 0;
+// When the mode switch started, until the first frame that isn't blank
+static int64_t mode_switch_start;
 
 static int burst_length;
 static int captures_remaining = 0;
 
+// Frames captured before the shutter was pressed, for cameras that capture in
+// the preview mode. The burst is taken from them without switching modes.
+static MPFrameRing *zsl_ring;
+// The burst is taken in the preview mode, from the ring and the frames after
+static bool is_zsl_burst = false;
+// The automatic exposure and gain are locked for the frames after the press
+static bool burst_locked_controls = false;
+// When the shutter was pressed, in the clock of the buffer timestamps
+static int64_t shutter_time;
+static bool shutter_lag_reported = false;
+
 static int preview_width;
 static int preview_height;
 
@@ -94,18 +133,64 @@ struct control_state {
 static struct control_state desired_controls = {};
 static struct control_state current_controls = {};
 
+// White balance last passed to the process pipeline
+static float reported_neutral[3];
+
 static bool flash_enabled = false;
 
 static bool want_focus = false;
 
+// Where the preview was tapped to focus, in fractions of its size
+struct focus_point {
+        float x;
+        float y;
+};
+static struct focus_point focus_point = { 0.5f, 0.5f };
+
 static MPPipeline *pipeline;
 static GSource *capture_source;
+static GSource *control_source;
+
+// The sensor needs at least this many queued buffers to not drop frames
+#define MIN_QUEUED_BUFFERS 2
+
+// Buffers left for the frames the preview, zbar and the recorder are working
+// on while the ring holds on to the others
+#define ZSL_SPARE_BUFFERS 4
+// More than the longest burst isn't useful
+#define ZSL_MAX_FRAMES 11
+
+// Frames taken from the ring for the burst, sent on as the DNG writer has room
+static MPFrame *zsl_frames[ZSL_MAX_FRAMES];
+static int num_zsl_frames = 0;
+static int next_zsl_frame = 0;
+
+// Buffers handed out to consumers that haven't been released yet. The
+// generation is bumped every time capture is stopped, so releases of buffers
+// from an earlier capture don't get queued again.
+static uint32_t buffers_in_use = 0;
+static uint32_t capture_generation = 0;
+// Frames dropped because too many buffers were in use
+static uint64_t num_dropped_frames = 0;
+
+static struct device_info *
+get_device_info(const struct camera_info *info)
+{
+        if (info->is_replay) {
+                return NULL;
+        }
+        return &devices[info->device_index];
+}
 
 static void
 mp_setup_media_link_pad_crops(struct device_info *dev_info,
                               const struct mp_media_crop_config media_crops[],
                               int num_media_crops)
 {
+        if (!dev_info) {
+                return;
+        }
+
         for(int i = 0; i < num_media_crops; i++) {
                 const struct mp_media_crop_config *crop = media_crops + i;
                 mp_device_setup_media_link_pad_crop(dev_info->device, crop);
@@ -117,6 +202,10 @@ mp_setup_media_link_pad_formats(struct device_info *dev_info,
                                 const struct mp_media_format_config media_formats[],
                                 int num_media_formats)
 {
+        if (!dev_info) {
+                return;
+        }
+
         for(int i = 0; i < num_media_formats; i++) {
                 const struct mp_media_format_config *format =
                         media_formats + i;
@@ -139,6 +228,28 @@ mp_setup_media_link_pad_formats(struct device_info *dev_info,
         }
 }
 
+/*
+ * Configures the media pipeline and the camera for the mode when the camera is
+ * activated. The pad formats and crops from the config are the same for every
+ * mode of the camera, so switching modes after this only has to set the mode of
+ * the camera, which skips the devices that already have the right format.
+ */
+static void
+activate_mode(struct camera_info *info, MPMode *mode)
+{
+        struct device_info *dev_info = get_device_info(info);
+
+        mp_setup_media_link_pad_formats(
+                dev_info, camera->media_formats, camera->num_media_formats);
+        mp_setup_media_link_pad_crops(
+                dev_info, camera->media_crops, camera->num_media_crops);
+
+        // The other cameras share the bridge and the video device, and the
+        // pad formats may have changed the format of the sensor
+        mp_camera_invalidate_mode(info->camera);
+        mp_camera_set_mode(info->camera, mode);
+}
+
 static int
 get_bridge_fd(const MPDevice *device)
 {
@@ -165,9 +276,103 @@ get_bridge_fd(const MPDevice *device)
         return bridge_fd;
 }
 
+static void
+setup_gain(struct camera_info *info)
+{
+        MPControl control;
+        if (mp_camera_query_control(info->camera, V4L2_CID_GAIN, &control)) {
+                info->gain_ctrl = V4L2_CID_GAIN;
+                info->gain_max = control.max;
+        } else if (mp_camera_query_control(
+                           info->camera, V4L2_CID_ANALOGUE_GAIN, &control)) {
+                info->gain_ctrl = V4L2_CID_ANALOGUE_GAIN;
+                info->gain_max = control.max;
+        }
+}
+
+static void
+setup_auto_controls(struct camera_info *info,
+                    const struct mp_camera_config *config)
+{
+        MPControl exposure = {};
+        info->has_software_exposure =
+                !mp_camera_query_control(
+                        info->camera, V4L2_CID_EXPOSURE_AUTO, NULL) &&
+                mp_camera_query_control(info->camera, V4L2_CID_EXPOSURE, &exposure);
+
+        MPControl gain = {};
+        info->has_software_gain =
+                !mp_camera_query_control(info->camera, V4L2_CID_AUTOGAIN, NULL) &&
+                info->gain_max > 0 &&
+                mp_camera_query_control(info->camera, info->gain_ctrl, &gain);
+
+        int depth = mp_pixel_format_pixel_depth(config->preview_mode.pixel_format);
+        float white = config->whitelevel ? config->whitelevel : (1 << depth) - 1;
+
+        info->auto_controls = mp_auto_controls_new(exposure.min,
+                                                   exposure.max,
+                                                   gain.min,
+                                                   gain.max,
+                                                   config->blacklevel / white);
+}
+
+static void
+setup_recorder(struct camera_info *info, const struct mp_camera_config *config)
+{
+        if (!config->record_path[0]) {
+                return;
+        }
+
+        MPControl exposure;
+        if (!mp_camera_query_control(info->camera, V4L2_CID_EXPOSURE, &exposure)) {
+                exposure.max = 0;
+        }
+
+        info->recorder =
+                mp_recorder_new(config->record_path, info->gain_max, exposure.max);
+}
+
+static void
+setup_replay_camera(const struct mp_camera_config *config)
+{
+        struct camera_info *info = &cameras[config->index];
+
+        info->is_replay = true;
+        info->camera =
+                mp_camera_new_replay(config->replay_path, config->replay_rate);
+        if (!info->camera) {
+                exit(EXIT_FAILURE);
+        }
+
+        MPMode mode = config->capture_mode;
+        mp_camera_set_mode(info->camera, &mode);
+
+        setup_gain(info);
+        setup_auto_controls(info, config);
+        setup_recorder(info, config);
+        info->flash = NULL;
+}
+
+// A media device already opened for another camera
+static MPDevice *
+find_shared_device(const char *media_dev_name, const char *dev_name)
+{
+        for (size_t i = 0; i < num_devices; ++i) {
+                if (mp_device_matches(devices[i].device, media_dev_name, dev_name)) {
+                        return mp_device_ref(devices[i].device);
+                }
+        }
+        return NULL;
+}
+
 static void
 setup_camera(MPDeviceList **device_list, const struct mp_camera_config *config)
 {
+        if (config->replay_path[0]) {
+                setup_replay_camera(config);
+                return;
+        }
+
         // Find device info
         size_t device_index = 0;
         for (; device_index < num_devices; ++device_index) {
@@ -186,8 +391,14 @@ setup_camera(MPDeviceList **device_list, const struct mp_camera_config *config)
                 struct device_info *info = &devices[device_index];
                 info->media_dev_name = config->media_dev_name;
                 info->dev_name = config->dev_name;
-                info->device = mp_device_list_find_remove(
-                        device_list, info->media_dev_name, info->dev_name);
+                // The cameras usually share a media device, the first one takes
+                // it out of the list
+                info->device =
+                        find_shared_device(info->media_dev_name, info->dev_name);
+                if (!info->device) {
+                        info->device = mp_device_list_find_remove(
+                                device_list, info->media_dev_name, info->dev_name);
+                }
                 if (!info->device) {
                         g_printerr("Could not find /dev/media* node matching '%s'\n",
                                    info->media_dev_name);
@@ -328,16 +539,18 @@ setup_camera(MPDeviceList **device_list, const struct mp_camera_config *config)
                         info->has_auto_focus_start = true;
                 }
 
-                MPControl control;
-                if (mp_camera_query_control(info->camera, V4L2_CID_GAIN, &control)) {
-                        info->gain_ctrl = V4L2_CID_GAIN;
-                        info->gain_max = control.max;
-                } else if (mp_camera_query_control(
-                                   info->camera, V4L2_CID_ANALOGUE_GAIN, &control)) {
-                        info->gain_ctrl = V4L2_CID_ANALOGUE_GAIN;
-                        info->gain_max = control.max;
+                MPControl focus;
+                if (!info->has_auto_focus_continuous &&
+                    !info->has_auto_focus_start &&
+                    mp_camera_query_control(
+                            info->camera, V4L2_CID_FOCUS_ABSOLUTE, &focus)) {
+                        info->auto_focus = mp_auto_focus_new(focus.min, focus.max);
                 }
 
+                setup_gain(info);
+                setup_auto_controls(info, config);
+                setup_recorder(info, config);
+
                 // Setup flash
                 if (config->flash_path[0]) {
                         info->flash = mp_led_flash_from_path(config->flash_path);
@@ -352,16 +565,24 @@ setup_camera(MPDeviceList **device_list, const struct mp_camera_config *config)
 static void
 setup(MPPipeline *pipeline, const void *data)
 {
+        int64_t setup_start = mp_trace_now();
+
+        zsl_ring = mp_frame_ring_new(ZSL_MAX_FRAMES);
+
+        // The media devices are enumerated once for all cameras
+        MPDeviceList *device_list = mp_device_list_new();
         for (size_t i = 0; i < MP_MAX_CAMERAS; ++i) {
                 const struct mp_camera_config *config = mp_get_camera_config(i);
                 if (!config) {
                         break;
                 }
 
-                MPDeviceList *device_list = mp_device_list_new();
                 setup_camera(&device_list, config);
-                mp_device_list_free(device_list);
         }
+        mp_device_list_free(device_list);
+
+        printf("Set up the cameras in %.1fms\n",
+               (mp_trace_now() - setup_start) / 1000.0);
 }
 
 static void
@@ -369,16 +590,36 @@ clean_cameras()
 {
         for (size_t i = 0; i < MP_MAX_CAMERAS; ++i) {
                 struct camera_info *info = &cameras[i];
+                if (info->recorder) {
+                        mp_recorder_free(info->recorder);
+                        info->recorder = NULL;
+                }
+                if (info->auto_controls) {
+                        mp_auto_controls_free(info->auto_controls);
+                        info->auto_controls = NULL;
+                }
+                if (info->auto_focus) {
+                        mp_auto_focus_free(info->auto_focus);
+                        info->auto_focus = NULL;
+                }
                 if (info->camera) {
                         mp_camera_free(info->camera);
                         info->camera = NULL;
                 }
         }
+
+        for (size_t i = 0; i < num_devices; ++i) {
+                mp_device_close(devices[i].device);
+                devices[i].device = NULL;
+        }
+        num_devices = 0;
 }
 
 void
 mp_io_pipeline_start()
 {
+        start_time = mp_trace_now();
+
         mp_process_pipeline_start();
 
         pipeline = mp_pipeline_new();
@@ -386,17 +627,47 @@ mp_io_pipeline_start()
         mp_pipeline_invoke(pipeline, setup, NULL, 0);
 }
 
+static void
+drop_zsl_frames()
+{
+        for (; next_zsl_frame < num_zsl_frames; ++next_zsl_frame) {
+                mp_frame_unref(zsl_frames[next_zsl_frame]);
+        }
+        num_zsl_frames = 0;
+        next_zsl_frame = 0;
+}
+
+static void
+clean_zsl_ring(MPPipeline *pipeline, const void *data)
+{
+        drop_zsl_frames();
+        mp_frame_ring_free(zsl_ring);
+        zsl_ring = NULL;
+}
+
 void
 mp_io_pipeline_stop()
 {
         if (capture_source) {
                 g_source_destroy(capture_source);
         }
+        if (control_source) {
+                g_source_destroy(control_source);
+        }
+
+        // The frames in the ring, and those still being written, are
+        // released before the cameras are freed
+        mp_pipeline_invoke(pipeline, clean_zsl_ring, NULL, 0);
+        mp_process_pipeline_sync();
+        mp_pipeline_sync(pipeline);
 
         clean_cameras();
 
         mp_pipeline_free(pipeline);
 
+        printf("Sensor frames: %" PRIu64 " dropped to keep buffers queued\n",
+               num_dropped_frames);
+
         mp_process_pipeline_stop();
 }
 
@@ -428,36 +699,179 @@ update_process_pipeline()
                 .exposure_is_manual = current_controls.exposure_is_manual,
                 .exposure = current_controls.exposure,
                 .has_auto_focus_continuous = info->has_auto_focus_continuous,
-                .has_auto_focus_start = info->has_auto_focus_start,
+                .has_auto_focus_start =
+                        info->has_auto_focus_start || info->auto_focus,
                 .flash_enabled = flash_enabled,
         };
+        mp_auto_controls_get_neutral(info->auto_controls, pipeline_state.neutral);
+        memcpy(reported_neutral, pipeline_state.neutral, sizeof(reported_neutral));
         mp_process_pipeline_update_state(&pipeline_state);
 }
 
+/*
+ * A control of the camera changed, for example the exposure picked by the
+ * sensor's auto exposure. Pass it on right away instead of with the next state
+ * update, captures report their controls once they're done.
+ */
+static void
+on_control_change(void *user_data)
+{
+        if (captures_remaining == 0) {
+                update_process_pipeline();
+        }
+}
+
 static void
-focus(MPPipeline *pipeline, const void *data)
+stop_capture(struct camera_info *info)
 {
+        mp_frame_ring_clear(zsl_ring);
+        drop_zsl_frames();
+
+        // Make sure no consumer is still reading from the mapped buffers
+        mp_process_pipeline_sync();
+        if (info->recorder) {
+                mp_recorder_sync(info->recorder);
+        }
+        mp_camera_stop_capture(info->camera);
+
+        buffers_in_use = 0;
+        ++capture_generation;
+}
+
+static void
+focus(MPPipeline *pipeline, const struct focus_point *point)
+{
+        focus_point = *point;
         want_focus = true;
 }
 
 void
-mp_io_pipeline_focus()
+mp_io_pipeline_focus(float x, float y)
 {
-        mp_pipeline_invoke(pipeline, focus, NULL, 0);
+        struct focus_point point = { x, y };
+        mp_pipeline_invoke(pipeline,
+                           (MPPipelineCallback)focus,
+                           &point,
+                           sizeof(struct focus_point));
 }
 
 static void
-capture(MPPipeline *pipeline, const void *data)
+report_shutter_lag(const MPBuffer *buffer)
 {
-        struct camera_info *info = &cameras[camera->index];
-        struct device_info *dev_info = &devices[info->device_index];
-        uint32_t gain;
-        float gain_norm;
+        printf("Shutter lag %.1fms%s\n",
+               (buffer->timestamp - shutter_time) / 1000.0,
+               is_zsl_burst ? " (zero shutter lag)" : "");
+        shutter_lag_reported = true;
+}
 
+static void
+lock_controls(struct camera_info *info)
+{
         // Disable the autogain/exposure while taking the burst
         mp_camera_control_set_int32(info->camera, V4L2_CID_AUTOGAIN, 0);
         mp_camera_control_set_int32(
                 info->camera, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL);
+        burst_locked_controls = true;
+}
+
+static void
+finish_burst(struct camera_info *info)
+{
+        // Restore the auto exposure and gain if needed
+        if (burst_locked_controls) {
+                if (!current_controls.exposure_is_manual) {
+                        mp_camera_control_set_int32_bg(info->camera,
+                                                       V4L2_CID_EXPOSURE_AUTO,
+                                                       V4L2_EXPOSURE_AUTO);
+                }
+
+                if (!current_controls.gain_is_manual) {
+                        mp_camera_control_set_bool_bg(
+                                info->camera, V4L2_CID_AUTOGAIN, true);
+                }
+                burst_locked_controls = false;
+        }
+
+        // Go back to preview mode
+        if (!is_zsl_burst) {
+                mode_switch_start = mp_trace_now();
+                stop_capture(info);
+
+                mode = camera->preview_mode;
+                mp_camera_set_mode(info->camera, &mode);
+                just_switched_mode = true;
+
+                mp_camera_start_capture(info->camera);
+        }
+
+        // Disable flash
+        if (info->flash && flash_enabled) {
+                mp_flash_disable(info->flash);
+        }
+
+        update_process_pipeline();
+}
+
+// Takes the frames of the burst that were captured up to the press from the ring
+static void
+take_zsl_frames()
+{
+        drop_zsl_frames();
+        num_zsl_frames = mp_frame_ring_take_burst(zsl_ring,
+                                                  shutter_time,
+                                                  MIN(burst_length, ZSL_MAX_FRAMES),
+                                                  zsl_frames);
+
+        // The lag is that of the frame closest to the press
+        for (int i = 0; i < num_zsl_frames; ++i) {
+                const MPBuffer *buffer = mp_frame_get_buffer(zsl_frames[i]);
+                if (i == num_zsl_frames - 1 || buffer->timestamp >= shutter_time) {
+                        report_shutter_lag(buffer);
+                        break;
+                }
+        }
+}
+
+/*
+ * Sends the frames taken from the ring on to the burst, only as many as the DNG
+ * writer has room for so the process pipeline doesn't block on it. Returns
+ * whether the burst can take the next frame from the sensor.
+ */
+static bool
+send_zsl_frames(struct camera_info *info)
+{
+        int capacity = mp_dng_writer_get_capacity();
+        for (; next_zsl_frame < num_zsl_frames && capacity > 0; --capacity) {
+                mp_process_pipeline_capture_image(zsl_frames[next_zsl_frame++]);
+
+                if (--captures_remaining == 0) {
+                        finish_burst(info);
+                        return true;
+                }
+        }
+
+        return next_zsl_frame == num_zsl_frames && capacity > 0;
+}
+
+static void
+capture(MPPipeline *pipeline, const int64_t *time)
+{
+        struct camera_info *info = &cameras[camera->index];
+        uint32_t gain;
+        float gain_norm;
+
+        shutter_time = *time;
+        shutter_lag_reported = false;
+        mode_switch_start = mp_trace_now();
+
+        // A running sweep would move the lens during the burst, the sharpest
+        // position found so far is the best focus there is
+        int focus_position;
+        if (info->auto_focus &&
+            mp_auto_focus_stop(info->auto_focus, &focus_position)) {
+                mp_camera_control_set_int32_bg(
+                        info->camera, V4L2_CID_FOCUS_ABSOLUTE, focus_position);
+        }
 
         // Get current gain to calculate a burst length;
         // with low gain there's 3, with the max automatic gain of the ov5640
@@ -468,59 +882,177 @@ capture(MPPipeline *pipeline, const void *data)
         burst_length = (int)fmax(sqrt(gain_norm) * 10, 2) + 1;
         captures_remaining = burst_length;
 
-        // Change camera mode for capturing
-        mp_process_pipeline_sync();
-        mp_camera_stop_capture(info->camera);
+        // Cameras that capture in the preview mode keep streaming, the burst
+        // starts with the frames from before the press. Those were taken
+        // without flash, and the mode switch gives the flash time to light up.
+        bool use_flash = info->flash && flash_enabled;
+        is_zsl_burst = !use_flash && mp_mode_is_equivalent(&camera->preview_mode,
+                                                           &camera->capture_mode);
 
-        mode = camera->capture_mode;
-        if (camera->num_media_links)
-                mp_setup_media_link_pad_formats(dev_info,
-                                                camera->media_formats,
-                                                camera->num_media_formats);
-        if (camera->num_media_crops)
-                mp_setup_media_link_pad_crops(dev_info,
-                                              camera->media_crops,
-                                              camera->num_media_crops);
-        mp_camera_set_mode(info->camera, &mode);
-        just_switched_mode = true;
+        // Enable flash, before the mode switch so it's lit by the first frame
+        if (use_flash) {
+                mp_flash_enable(info->flash);
+        }
 
-        mp_camera_start_capture(info->camera);
+        if (!is_zsl_burst) {
+                lock_controls(info);
 
-        // Enable flash
-        if (info->flash && flash_enabled) {
-                mp_flash_enable(info->flash);
+                // Change camera mode for capturing
+                stop_capture(info);
+
+                mode = camera->capture_mode;
+                mp_camera_set_mode(info->camera, &mode);
+                just_switched_mode = true;
+
+                mp_camera_start_capture(info->camera);
         }
 
         update_process_pipeline();
 
         mp_process_pipeline_capture();
+
+        if (is_zsl_burst) {
+                take_zsl_frames();
+
+                // The rest of the burst comes from the frames after the press
+                if (captures_remaining > num_zsl_frames) {
+                        lock_controls(info);
+                }
+                send_zsl_frames(info);
+        }
 }
 
 void
 mp_io_pipeline_capture()
 {
-        mp_pipeline_invoke(pipeline, capture, NULL, 0);
+        // Taken here rather than on the io pipeline, which may be busy with a
+        // frame when the shutter is pressed
+        int64_t time = mp_trace_now();
+        mp_pipeline_invoke(
+                pipeline, (MPPipelineCallback)capture, &time, sizeof(int64_t));
 }
 
+struct release_buffer_args {
+        uint32_t buffer_index;
+        uint32_t generation;
+};
+
 static void
-release_buffer(MPPipeline *pipeline, const uint32_t *buffer_index)
+release_buffer(MPPipeline *pipeline, const struct release_buffer_args *args)
 {
+        // The buffer belongs to a capture that has since been stopped
+        if (args->generation != capture_generation) {
+                return;
+        }
+
         struct camera_info *info = &cameras[camera->index];
 
-        mp_camera_release_buffer(info->camera, *buffer_index);
+        mp_camera_release_buffer(info->camera, args->buffer_index);
+
+        assert(buffers_in_use > 0);
+        --buffers_in_use;
 }
 
 void
-mp_io_pipeline_release_buffer(uint32_t buffer_index)
+mp_io_pipeline_release_buffer(uint32_t buffer_index, uint32_t generation)
 {
+        struct release_buffer_args args = {
+                .buffer_index = buffer_index,
+                .generation = generation,
+        };
+
         mp_pipeline_invoke(pipeline,
                            (MPPipelineCallback)release_buffer,
-                           &buffer_index,
-                           sizeof(uint32_t));
+                           &args,
+                           sizeof(struct release_buffer_args));
 }
 
-static pid_t focus_continuous_task = 0;
-static pid_t start_focus_task = 0;
+static void
+on_frame_release(const MPBuffer *buffer, void *generation)
+{
+        mp_io_pipeline_release_buffer(buffer->index, (uintptr_t)generation);
+}
+
+// Part of the frame the contrast detection focus looks at, around the point
+// that was tapped
+#define FOCUS_REGION_SIZE 0.2f
+
+static MPImageRegion focus_region;
+static int64_t focus_start;
+
+/*
+ * The preview shows the frame rotated and mirrored, turn the tapped point back
+ * into a point of the frame. This undoes what the zbar pipeline does to the
+ * codes it finds.
+ */
+static void
+get_focus_region(const struct focus_point *point, MPImageRegion *region)
+{
+        int rotation = ((camera->rotate - device_rotation) % 360 + 360) % 360;
+
+        float x = camera->mirrored ? 1 - point->x : point->x;
+        float y = point->y;
+
+        float frame_x, frame_y;
+        switch (rotation) {
+        case 90:
+                frame_x = 1 - y;
+                frame_y = x;
+                break;
+        case 180:
+                frame_x = 1 - x;
+                frame_y = 1 - y;
+                break;
+        case 270:
+                frame_x = y;
+                frame_y = 1 - x;
+                break;
+        default:
+                frame_x = x;
+                frame_y = y;
+                break;
+        }
+
+        float max = 1 - FOCUS_REGION_SIZE;
+        region->x = CLAMP(frame_x - FOCUS_REGION_SIZE / 2, 0, max);
+        region->y = CLAMP(frame_y - FOCUS_REGION_SIZE / 2, 0, max);
+        region->width = FOCUS_REGION_SIZE;
+        region->height = FOCUS_REGION_SIZE;
+}
+
+static void
+start_contrast_focus(struct camera_info *info)
+{
+        get_focus_region(&focus_point, &focus_region);
+        focus_start = mp_trace_now();
+
+        int position = mp_auto_focus_start(info->auto_focus);
+        mp_camera_control_set_int32_bg(
+                info->camera, V4L2_CID_FOCUS_ABSOLUTE, position);
+}
+
+static void
+run_auto_focus(struct camera_info *info, const MPBuffer *buffer)
+{
+        uint64_t sharpness =
+                mp_image_get_sharpness(buffer->data, &mode, &focus_region);
+
+        int position;
+        if (mp_auto_focus_update(info->auto_focus, sharpness, &position)) {
+                mp_camera_control_set_int32_bg(
+                        info->camera, V4L2_CID_FOCUS_ABSOLUTE, position);
+        }
+
+        if (!mp_auto_focus_is_running(info->auto_focus)) {
+                printf("Focused in %.1fms, %d frames\n",
+                       (mp_trace_now() - focus_start) / 1000.0,
+                       mp_auto_focus_get_num_frames(info->auto_focus));
+                mp_trace_span("auto_focus", buffer->sequence, focus_start);
+        }
+}
+
+static MPControlTask focus_continuous_task = 0;
+static MPControlTask start_focus_task = 0;
 static void
 start_focus(struct camera_info *info)
 {
@@ -535,6 +1067,8 @@ start_focus(struct camera_info *info)
         } else if (info->has_auto_focus_start) {
                 start_focus_task = mp_camera_control_set_bool_bg(
                         info->camera, V4L2_CID_AUTO_FOCUS_START, 1);
+        } else if (info->auto_focus) {
+                start_contrast_focus(info);
         }
 }
 
@@ -583,9 +1117,77 @@ update_controls()
         current_controls = desired_controls;
 }
 
+// Neutrals closer than this to the one reported don't update the state
+#define NEUTRAL_TOLERANCE 0.02f
+
 static void
-on_frame(MPBuffer buffer, void *_data)
+run_auto_controls(struct camera_info *info, const MPBuffer *buffer)
 {
+        int64_t trace_start = mp_trace_now();
+
+        MPImageStats stats;
+        mp_image_compute_stats(buffer->data, &mode, &stats);
+
+        bool adjust_exposure =
+                info->has_software_exposure && !current_controls.exposure_is_manual;
+        bool adjust_gain =
+                info->has_software_gain && !current_controls.gain_is_manual;
+
+        // Controls that aren't adjusted here are left alone, they may be
+        // driven by the sensor or not exist at all
+        int exposure = 0;
+        if (adjust_exposure) {
+                exposure = mp_camera_control_get_int32(info->camera,
+                                                       V4L2_CID_EXPOSURE);
+        }
+        int gain = 0;
+        if (adjust_gain) {
+                gain = mp_camera_control_get_int32(info->camera, info->gain_ctrl);
+        }
+        int old_exposure = exposure;
+        int old_gain = gain;
+
+        bool changed = mp_auto_controls_update(info->auto_controls,
+                                               &stats,
+                                               adjust_exposure,
+                                               &exposure,
+                                               adjust_gain,
+                                               &gain);
+        if (exposure != old_exposure) {
+                mp_camera_control_set_int32_bg(
+                        info->camera, V4L2_CID_EXPOSURE, exposure);
+        }
+        if (gain != old_gain) {
+                mp_camera_control_set_int32_bg(info->camera, info->gain_ctrl, gain);
+        }
+
+        float neutral[3];
+        mp_auto_controls_get_neutral(info->auto_controls, neutral);
+        for (int i = 0; i < 3; ++i) {
+                if (fabsf(neutral[i] - reported_neutral[i]) > NEUTRAL_TOLERANCE) {
+                        changed = true;
+                }
+        }
+
+        mp_trace_span("auto_controls", buffer->sequence, trace_start);
+
+        if (changed) {
+                update_process_pipeline();
+        }
+}
+
+static void
+handle_frame(MPBuffer buffer)
+{
+        struct camera_info *info = &cameras[camera->index];
+
+        if (!has_first_frame) {
+                printf("First frame %.1fms after start\n",
+                       (mp_trace_now() - start_time) / 1000.0);
+                mp_trace_span("startup", buffer.sequence, start_time);
+                has_first_frame = true;
+        }
+
         // Only update controls right after a frame was captured
         update_controls();
 
@@ -593,19 +1195,10 @@ on_frame(MPBuffer buffer, void *_data)
         // presumably from buffers made ready during the switch. Ignore these.
         if (just_switched_mode) {
                 if (blank_frame_count < 20) {
-                        // Only check a 10x10 area
-                        size_t test_size =
-                                MIN(10, mode.width) * MIN(10, mode.height);
-
-                        bool image_is_blank = true;
-                        for (size_t i = 0; i < test_size; ++i) {
-                                if (buffer.data[i] != 0) {
-                                        image_is_blank = false;
-                                }
-                        }
-
-                        if (image_is_blank) {
+                        if (mp_image_is_blank(buffer.data, &mode)) {
                                 ++blank_frame_count;
+                                mp_camera_release_buffer(info->camera,
+                                                         buffer.index);
                                 return;
                         }
                 } else {
@@ -614,59 +1207,92 @@ on_frame(MPBuffer buffer, void *_data)
 
                 just_switched_mode = false;
                 blank_frame_count = 0;
-        }
 
-        // Send the image off for processing
-        mp_process_pipeline_process_image(buffer);
+                printf("Switched to the %s mode in %.1fms\n",
+                       captures_remaining > 0 ? "capture" : "preview",
+                       (mp_trace_now() - mode_switch_start) / 1000.0);
+                mp_trace_span("mode_switch", buffer.sequence, mode_switch_start);
+        }
 
-        if (captures_remaining > 0) {
-                --captures_remaining;
+        // Don't take more frames for the burst than can be written to disk,
+        // wait for the writer threads to catch up instead. The frames taken
+        // from the ring go first.
+        if (captures_remaining > 0 && !send_zsl_frames(info)) {
+                mp_camera_release_buffer(info->camera, buffer.index);
+                return;
+        }
 
-                if (captures_remaining == 0) {
-                        struct camera_info *info = &cameras[camera->index];
-                        struct device_info *dev_info = &devices[info->device_index];
-
-                        // Restore the auto exposure and gain if needed
-                        if (!current_controls.exposure_is_manual) {
-                                mp_camera_control_set_int32_bg(
-                                        info->camera,
-                                        V4L2_CID_EXPOSURE_AUTO,
-                                        V4L2_EXPOSURE_AUTO);
-                        }
+        // The exposure and white balance follow the preview, and are left as
+        // they are for the burst. They're also held during a focus sweep, the
+        // sharpness of frames with different exposures can't be compared.
+        if (captures_remaining == 0) {
+                if (info->auto_focus &&
+                    mp_auto_focus_is_running(info->auto_focus)) {
+                        run_auto_focus(info, &buffer);
+                } else {
+                        run_auto_controls(info, &buffer);
+                }
+        }
 
-                        if (!current_controls.gain_is_manual) {
-                                mp_camera_control_set_bool_bg(
-                                        info->camera, V4L2_CID_AUTOGAIN, true);
-                        }
+        // Consumers hold on to the mapped buffer instead of copying it. If
+        // too many are still in use, drop this frame so the sensor always
+        // has enough buffers queued to write into.
+        if (mp_camera_get_num_buffers(info->camera) - buffers_in_use <=
+            MIN_QUEUED_BUFFERS) {
+                mp_camera_release_buffer(info->camera, buffer.index);
+                ++num_dropped_frames;
+                mp_trace_drop("sensor_dropped", buffer.sequence);
+                return;
+        }
 
-                        // Go back to preview mode
-                        mp_process_pipeline_sync();
-                        mp_camera_stop_capture(info->camera);
+        ++buffers_in_use;
 
-                        mode = camera->preview_mode;
-                        if (camera->num_media_links)
-                                mp_setup_media_link_pad_formats(
-                                        dev_info,
-                                        camera->media_formats,
-                                        camera->num_media_formats);
-                        if (camera->num_media_crops)
-                                mp_setup_media_link_pad_crops(
-                                        dev_info,
-                                        camera->media_crops,
-                                        camera->num_media_crops);
-                        mp_camera_set_mode(info->camera, &mode);
-                        just_switched_mode = true;
+        // Send the image off for processing
+        MPFrame *frame = mp_frame_new(buffer,
+                                      &mode,
+                                      on_frame_release,
+                                      (void *)(uintptr_t)capture_generation);
+        if (info->recorder) {
+                MPRecordedControls controls = {
+                        .gain_is_manual = current_controls.gain_is_manual,
+                        .gain = current_controls.gain,
+                        .exposure_is_manual = current_controls.exposure_is_manual,
+                        .exposure = current_controls.exposure,
+                };
+                mp_recorder_add_frame(info->recorder, frame, &controls);
+        }
 
-                        mp_camera_start_capture(info->camera);
+        if (captures_remaining > 0) {
+                if (!shutter_lag_reported) {
+                        report_shutter_lag(&buffer);
+                }
 
-                        // Disable flash
-                        if (info->flash && flash_enabled) {
-                                mp_flash_disable(info->flash);
-                        }
+                mp_process_pipeline_process_image(frame);
 
-                        update_process_pipeline();
+                if (--captures_remaining == 0) {
+                        finish_burst(info);
                 }
+                return;
         }
+
+        // Keep the newest frames around for the next capture, as many as can
+        // be held without starving the sensor
+        if (mp_mode_is_equivalent(&camera->preview_mode, &camera->capture_mode)) {
+                int capacity = (int)mp_camera_get_num_buffers(info->camera) -
+                               MIN_QUEUED_BUFFERS - ZSL_SPARE_BUFFERS;
+                mp_frame_ring_set_capacity(zsl_ring, MAX(capacity, 0));
+                mp_frame_ring_push(zsl_ring, mp_frame_ref(frame));
+        }
+
+        mp_process_pipeline_process_image(frame);
+}
+
+static void
+on_frame(MPBuffer buffer, void *_data)
+{
+        int64_t trace_start = mp_trace_now();
+        handle_frame(buffer);
+        mp_trace_span("on_frame", buffer.sequence, trace_start);
 }
 
 static void
@@ -681,74 +1307,84 @@ update_state(MPPipeline *pipeline, const struct mp_io_pipeline_state *state)
 
                 if (camera) {
                         struct camera_info *info = &cameras[camera->index];
-                        struct device_info *dev_info = &devices[info->device_index];
+                        struct device_info *dev_info = get_device_info(info);
 
-                        mp_process_pipeline_sync();
-                        mp_camera_stop_capture(info->camera);
-                        mp_device_setup_link(dev_info->device,
-                                             info->pad_id,
-                                             dev_info->interface_pad_id,
-                                             false);
+                        stop_capture(info);
+                        if (dev_info) {
+                                mp_device_setup_link(dev_info->device,
+                                                     info->pad_id,
+                                                     dev_info->interface_pad_id,
+                                                     false);
 
-                        // Disable media links
-                        for (int i = 0; i < camera->num_media_links; i++)
-                                mp_device_setup_media_link(
-                                        dev_info->device, &camera->media_links[i], false);
+                                // Disable media links
+                                for (int i = 0; i < camera->num_media_links; i++)
+                                        mp_device_setup_media_link(
+                                                dev_info->device,
+                                                &camera->media_links[i],
+                                                false);
+                        }
                 }
 
                 if (capture_source) {
                         g_source_destroy(capture_source);
                         capture_source = NULL;
                 }
+                if (control_source) {
+                        g_source_destroy(control_source);
+                        control_source = NULL;
+                }
 
                 camera = state->camera;
 
                 if (camera) {
                         struct camera_info *info = &cameras[camera->index];
-                        struct device_info *dev_info = &devices[info->device_index];
+                        struct device_info *dev_info = get_device_info(info);
+
+                        if (dev_info) {
+                                // Only enable the camera here if no links are
+                                // defined in the config file.
+                                if (info->num_media_links == 0) {
+                                        mp_device_setup_link(
+                                                dev_info->device,
+                                                info->pad_id,
+                                                dev_info->interface_pad_id,
+                                                true);
+                                }
 
-                        // Only enable the camera here if no links are defined
-                        // in the config file.
-                        if(info->num_media_links == 0)
-                        {
-                                mp_device_setup_link(dev_info->device,
-                                                     info->pad_id,
-                                                     dev_info->interface_pad_id,
-                                                     true);
+                                // If links are defined, enable all of them.
+                                for (int i = 0; i < camera->num_media_links; i++)
+                                        mp_device_setup_media_link(
+                                                dev_info->device,
+                                                &camera->media_links[i],
+                                                true);
                         }
 
-                        // If links are defined, enable all of them.
-                        for (int i = 0; i < camera->num_media_links; i++)
-                                mp_device_setup_media_link(
-                                        dev_info->device, &camera->media_links[i], true);
-
                         mode = camera->preview_mode;
-                        if (camera->num_media_links)
-                                mp_setup_media_link_pad_formats(
-                                        dev_info,
-                                        camera->media_formats,
-                                        camera->num_media_formats);
-                        if (camera->num_media_crops)
-                                mp_setup_media_link_pad_crops(
-                                        dev_info,
-                                        camera->media_crops,
-                                        camera->num_media_crops);
-                        mp_camera_set_mode(info->camera, &mode);
+                        activate_mode(info, &mode);
 
                         mp_camera_start_capture(info->camera);
                         capture_source = mp_pipeline_add_capture_source(
                                 pipeline, info->camera, on_frame, NULL);
+                        control_source = mp_pipeline_add_control_source(
+                                pipeline, info->camera, on_control_change, NULL);
+
+                        mp_auto_controls_reset(info->auto_controls);
+                        if (info->auto_focus) {
+                                mp_auto_focus_cancel(info->auto_focus);
+                        }
 
                         current_controls.gain_is_manual =
+                                !info->has_software_gain &&
                                 mp_camera_control_get_bool(info->camera,
                                                            V4L2_CID_AUTOGAIN) == 0;
                         current_controls.gain = mp_camera_control_get_int32(
                                 info->camera, info->gain_ctrl);
 
                         current_controls.exposure_is_manual =
+                                !info->has_software_exposure &&
                                 mp_camera_control_get_int32(
                                         info->camera, V4L2_CID_EXPOSURE_AUTO) ==
-                                V4L2_EXPOSURE_MANUAL;
+                                        V4L2_EXPOSURE_MANUAL;
                         current_controls.exposure = mp_camera_control_get_int32(
                                 info->camera, V4L2_CID_EXPOSURE);
                 }
@@ -24,9 +24,11 @@ struct mp_io_pipeline_state {
 void mp_io_pipeline_start();
 void mp_io_pipeline_stop();
 
-void mp_io_pipeline_focus();
+// Focus on the point of the preview at x, y, in fractions of its size
+void mp_io_pipeline_focus(float x, float y);
 void mp_io_pipeline_capture();
 
-void mp_io_pipeline_release_buffer(uint32_t buffer_index);
+// Queue a buffer handed out by capture generation `generation` again
+void mp_io_pipeline_release_buffer(uint32_t buffer_index, uint32_t generation);
 
 void mp_io_pipeline_update_state(const struct mp_io_pipeline_state *state);
@@ -0,0 +1,332 @@
+#include "ljpeg.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Difference categories 0 to 16, the number of bits of the difference
+#define NUM_SYMBOLS 17
+
+#define MAX_CODE_LENGTH 16
+
+// Interleaved components of the tile, one for each CFA column
+#define NUM_COMPONENTS 2
+
+// Predictor 1, the sample of the same component to the left
+#define PREDICTOR_LEFT 1
+
+#define MARKER_SOF3 0xc3
+#define MARKER_DHT 0xc4
+#define MARKER_SOI 0xd8
+#define MARKER_EOI 0xd9
+#define MARKER_SOS 0xda
+
+struct huffman_table {
+        // Number of codes of each length from 1 to 16, and the symbols in
+        // order of their code
+        uint8_t bits[MAX_CODE_LENGTH + 1];
+        uint8_t values[NUM_SYMBOLS];
+        int num_values;
+
+        uint16_t codes[NUM_SYMBOLS];
+        uint8_t lengths[NUM_SYMBOLS];
+};
+
+struct bit_writer {
+        uint8_t *dst;
+        size_t size;
+
+        uint64_t bits;
+        int num_bits;
+};
+
+size_t
+mp_ljpeg_max_size(int width, int height)
+{
+        // A difference takes at most 31 bits, which can double with stuffing,
+        // and the markers take less than 128 bytes
+        return (size_t)width * height * 8 + 128;
+}
+
+static inline void
+put_bits(struct bit_writer *writer, uint32_t value, int count)
+{
+        writer->bits = (writer->bits << count) | (value & ((1ULL << count) - 1));
+        writer->num_bits += count;
+
+        while (writer->num_bits >= 8) {
+                writer->num_bits -= 8;
+                uint8_t byte = writer->bits >> writer->num_bits;
+                writer->dst[writer->size++] = byte;
+
+                // A zero byte after every 0xff tells it apart from a marker
+                if (byte == 0xff) {
+                        writer->dst[writer->size++] = 0;
+                }
+        }
+}
+
+static void
+flush_bits(struct bit_writer *writer)
+{
+        // The last byte is padded with ones
+        if (writer->num_bits > 0) {
+                put_bits(writer, 0x7f, 8 - writer->num_bits);
+        }
+}
+
+static inline int
+get_category(uint16_t diff)
+{
+        // The difference is modulo 2^16, in the range -32767 to 32768
+        int value = diff > 32768 ? diff - 65536 : diff;
+        int magnitude = abs(value);
+        return magnitude ? 32 - __builtin_clz(magnitude) : 0;
+}
+
+/*
+ * Differences of the samples to their prediction, modulo 2^16. The first
+ * sample of each component predicts from the middle of the range on the first
+ * row and from the sample above on the others.
+ */
+static void
+get_differences(const uint16_t *samples,
+                int width,
+                int height,
+                int stride,
+                int bits,
+                uint16_t *diffs)
+{
+        uint16_t initial = 1 << (bits - 1);
+
+        for (int y = 0; y < height; ++y) {
+                const uint16_t *row = samples + y * stride;
+                uint16_t *diff_row = diffs + y * width;
+
+                for (int x = 0; x < NUM_COMPONENTS; ++x) {
+                        uint16_t prediction = y == 0 ? initial : row[x - stride];
+                        diff_row[x] = row[x] - prediction;
+                }
+                for (int x = NUM_COMPONENTS; x < width; ++x) {
+                        diff_row[x] = row[x] - row[x - NUM_COMPONENTS];
+                }
+        }
+}
+
+/*
+ * Optimal code lengths limited to 16 bits, as in annex K.2 of T.81. A
+ * reserved symbol with the lowest frequency makes sure no code is all ones.
+ */
+static void
+build_table(const uint32_t *frequencies, struct huffman_table *table)
+{
+        uint64_t freq[NUM_SYMBOLS + 1];
+        int code_size[NUM_SYMBOLS + 1] = { 0 };
+        int others[NUM_SYMBOLS + 1];
+
+        for (int i = 0; i < NUM_SYMBOLS; ++i) {
+                freq[i] = frequencies[i];
+                others[i] = -1;
+        }
+        freq[NUM_SYMBOLS] = 1;
+        others[NUM_SYMBOLS] = -1;
+
+        // Repeatedly merge the two least frequent trees
+        for (;;) {
+                int c1 = -1;
+                for (int i = 0; i <= NUM_SYMBOLS; ++i) {
+                        if (freq[i] && (c1 < 0 || freq[i] <= freq[c1])) {
+                                c1 = i;
+                        }
+                }
+                int c2 = -1;
+                for (int i = 0; i <= NUM_SYMBOLS; ++i) {
+                        if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2])) {
+                                c2 = i;
+                        }
+                }
+                if (c2 < 0) {
+                        break;
+                }
+
+                freq[c1] += freq[c2];
+                freq[c2] = 0;
+
+                ++code_size[c1];
+                while (others[c1] >= 0) {
+                        c1 = others[c1];
+                        ++code_size[c1];
+                }
+                others[c1] = c2;
+
+                ++code_size[c2];
+                while (others[c2] >= 0) {
+                        c2 = others[c2];
+                        ++code_size[c2];
+                }
+        }
+
+        int bits[NUM_SYMBOLS + 2] = { 0 };
+        for (int i = 0; i <= NUM_SYMBOLS; ++i) {
+                if (code_size[i]) {
+                        ++bits[code_size[i]];
+                }
+        }
+
+        // Move pairs of codes that are too long up the tree
+        for (int i = NUM_SYMBOLS + 1; i > MAX_CODE_LENGTH; --i) {
+                while (bits[i] > 0) {
+                        int j = i - 2;
+                        while (bits[j] == 0) {
+                                --j;
+                        }
+                        bits[i] -= 2;
+                        ++bits[i - 1];
+                        bits[j + 1] += 2;
+                        --bits[j];
+                }
+        }
+
+        // Drop the reserved symbol, which has the longest code
+        int longest = MAX_CODE_LENGTH;
+        while (bits[longest] == 0) {
+                --longest;
+        }
+        --bits[longest];
+
+        for (int i = 1; i <= MAX_CODE_LENGTH; ++i) {
+                table->bits[i] = bits[i];
+        }
+
+        table->num_values = 0;
+        for (int length = 1; length <= NUM_SYMBOLS + 1; ++length) {
+                for (int i = 0; i < NUM_SYMBOLS; ++i) {
+                        if (code_size[i] == length) {
+                                table->values[table->num_values++] = i;
+                        }
+                }
+        }
+
+        // Canonical codes, in order of length
+        uint16_t code = 0;
+        int k = 0;
+        memset(table->lengths, 0, sizeof(table->lengths));
+        for (int length = 1; length <= MAX_CODE_LENGTH; ++length) {
+                for (int i = 0; i < table->bits[length]; ++i) {
+                        table->codes[table->values[k]] = code++;
+                        table->lengths[table->values[k]] = length;
+                        ++k;
+                }
+                code <<= 1;
+        }
+}
+
+static uint8_t *
+put_marker(uint8_t *dst, uint8_t marker, int length)
+{
+        dst[0] = 0xff;
+        dst[1] = marker;
+        // The length includes its own two bytes
+        dst[2] = length >> 8;
+        dst[3] = length;
+        return dst + 4;
+}
+
+static size_t
+write_headers(const struct huffman_table *table,
+              int width,
+              int height,
+              int bits,
+              uint8_t *dst)
+{
+        uint8_t *start = dst;
+
+        dst[0] = 0xff;
+        dst[1] = MARKER_SOI;
+        dst += 2;
+
+        dst = put_marker(dst, MARKER_DHT, 3 + MAX_CODE_LENGTH + table->num_values);
+        // DC table 0
+        *dst++ = 0x00;
+        memcpy(dst, table->bits + 1, MAX_CODE_LENGTH);
+        dst += MAX_CODE_LENGTH;
+        memcpy(dst, table->values, table->num_values);
+        dst += table->num_values;
+
+        dst = put_marker(dst, MARKER_SOF3, 8 + 3 * NUM_COMPONENTS);
+        *dst++ = bits;
+        *dst++ = height >> 8;
+        *dst++ = height;
+        *dst++ = (width / NUM_COMPONENTS) >> 8;
+        *dst++ = width / NUM_COMPONENTS;
+        *dst++ = NUM_COMPONENTS;
+        for (int i = 0; i < NUM_COMPONENTS; ++i) {
+                // Identifier, no subsampling and no quantization table
+                *dst++ = i + 1;
+                *dst++ = 0x11;
+                *dst++ = 0;
+        }
+
+        dst = put_marker(dst, MARKER_SOS, 6 + 2 * NUM_COMPONENTS);
+        *dst++ = NUM_COMPONENTS;
+        for (int i = 0; i < NUM_COMPONENTS; ++i) {
+                // Both components use table 0
+                *dst++ = i + 1;
+                *dst++ = 0x00;
+        }
+        *dst++ = PREDICTOR_LEFT;
+        // End of spectral selection and point transform, unused
+        *dst++ = 0;
+        *dst++ = 0;
+
+        return dst - start;
+}
+
+size_t
+mp_ljpeg_encode(const uint16_t *samples,
+                int width,
+                int height,
+                int stride,
+                int bits,
+                uint8_t *dst)
+{
+        uint16_t *diffs = malloc(sizeof(uint16_t) * width * height);
+        get_differences(samples, width, height, stride, bits, diffs);
+
+        uint32_t frequencies[NUM_SYMBOLS] = { 0 };
+        for (int i = 0; i < width * height; ++i) {
+                ++frequencies[get_category(diffs[i])];
+        }
+
+        struct huffman_table table;
+        build_table(frequencies, &table);
+
+        struct bit_writer writer = {
+                .dst = dst,
+                .size = write_headers(&table, width, height, bits, dst),
+        };
+
+        for (int i = 0; i < width * height; ++i) {
+                uint16_t diff = diffs[i];
+                int category = get_category(diff);
+                uint32_t code = table.codes[category];
+                int length = table.lengths[category];
+
+                // The code is followed by the low bits of the difference,
+                // negative ones minus one. The largest difference of 32768
+                // has no extra bits.
+                if (category > 0 && category < 16) {
+                        uint32_t extra = diff > 32768 ? diff - 1 : diff;
+                        code = (code << category) | (extra & ((1 << category) - 1));
+                        length += category;
+                }
+                put_bits(&writer, code, length);
+        }
+        flush_bits(&writer);
+
+        dst[writer.size++] = 0xff;
+        dst[writer.size++] = MARKER_EOI;
+
+        free(diffs);
+
+        return writer.size;
+}
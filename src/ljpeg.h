@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lossless JPEG (ITU T.81 process 14) encoder for the compressed tiles of
+ * DNG 1.4 files. A Bayer tile is encoded the way DNG readers expect it, as
+ * two interleaved components of half the tile width, so both samples of a
+ * CFA row pair are predicted from the sample of the same color to the left.
+ * Predictor 1 is used with a Huffman table made for every tile.
+ */
+
+// Largest encoded size of a tile, dst should hold at least this much
+size_t mp_ljpeg_max_size(int width, int height);
+
+// Encodes width x height samples of bits precision, width must be even and
+// stride is in samples. Returns the number of bytes written to dst.
+size_t mp_ljpeg_encode(const uint16_t *samples,
+                       int width,
+                       int height,
+                       int stride,
+                       int bits,
+                       uint8_t *dst);
@@ -0,0 +1,75 @@
+#include "mailbox.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+struct _MPMailbox {
+        _Atomic(void *) item;
+        MPMailboxFreeFunc free_item;
+
+        _Atomic uint64_t delivered;
+        _Atomic uint64_t replaced;
+        _Atomic uint64_t dropped;
+};
+
+MPMailbox *
+mp_mailbox_new(MPMailboxFreeFunc free_item)
+{
+        MPMailbox *mailbox = calloc(1, sizeof(MPMailbox));
+        atomic_init(&mailbox->item, NULL);
+        mailbox->free_item = free_item;
+        return mailbox;
+}
+
+void
+mp_mailbox_free(MPMailbox *mailbox)
+{
+        mp_mailbox_clear(mailbox);
+        free(mailbox);
+}
+
+bool
+mp_mailbox_put(MPMailbox *mailbox, void *item)
+{
+        void *old_item = atomic_exchange(&mailbox->item, item);
+        if (!old_item) {
+                return true;
+        }
+
+        atomic_fetch_add_explicit(&mailbox->replaced, 1, memory_order_relaxed);
+        mailbox->free_item(old_item);
+        return false;
+}
+
+void *
+mp_mailbox_take(MPMailbox *mailbox)
+{
+        void *item = atomic_exchange(&mailbox->item, NULL);
+        if (item) {
+                atomic_fetch_add_explicit(
+                        &mailbox->delivered, 1, memory_order_relaxed);
+        }
+        return item;
+}
+
+void
+mp_mailbox_clear(MPMailbox *mailbox)
+{
+        void *item = atomic_exchange(&mailbox->item, NULL);
+        if (item) {
+                atomic_fetch_add_explicit(
+                        &mailbox->dropped, 1, memory_order_relaxed);
+                mailbox->free_item(item);
+        }
+}
+
+void
+mp_mailbox_get_stats(MPMailbox *mailbox, MPMailboxStats *stats)
+{
+        stats->delivered =
+                atomic_load_explicit(&mailbox->delivered, memory_order_relaxed);
+        stats->replaced =
+                atomic_load_explicit(&mailbox->replaced, memory_order_relaxed);
+        stats->dropped =
+                atomic_load_explicit(&mailbox->dropped, memory_order_relaxed);
+}
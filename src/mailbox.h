@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A single slot handing the newest item from one thread to another. Putting
+ * an item replaces one that is still pending, which is freed straight away,
+ * so the consumer always gets the latest frame and never works through a
+ * backlog.
+ */
+typedef struct _MPMailbox MPMailbox;
+
+typedef void (*MPMailboxFreeFunc)(void *item);
+
+typedef struct {
+        // Taken by the consumer
+        uint64_t delivered;
+        // Superseded by a newer item before the consumer got to it
+        uint64_t replaced;
+        // Still pending when the mailbox was cleared
+        uint64_t dropped;
+} MPMailboxStats;
+
+MPMailbox *mp_mailbox_new(MPMailboxFreeFunc free_item);
+// Frees an item that is still pending
+void mp_mailbox_free(MPMailbox *mailbox);
+
+// Returns true if the mailbox was empty, and the consumer has to be told
+bool mp_mailbox_put(MPMailbox *mailbox, void *item);
+// Returns NULL if there is nothing pending
+void *mp_mailbox_take(MPMailbox *mailbox);
+void mp_mailbox_clear(MPMailbox *mailbox);
+
+void mp_mailbox_get_stats(MPMailbox *mailbox, MPMailboxStats *stats);
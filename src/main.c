@@ -5,6 +5,7 @@
 #include "gl_util.h"
 #include "io_pipeline.h"
 #include "process_pipeline.h"
+#include "trace.h"
 #include <asm/errno.h>
 #include <assert.h>
 #include <errno.h>
@@ -27,6 +28,7 @@
 #include <linux/v4l2-subdev.h>
 #include <linux/videodev2.h>
 #include <locale.h>
+#include <stdatomic.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -69,6 +71,10 @@ static bool has_auto_focus_start;
 static bool flash_enabled = false;
 
 static MPProcessPipelineBuffer *current_preview_buffer = NULL;
+// Sequence of the last frame drawn, a frame is only traced the first time
+static uint32_t drawn_preview_sequence = UINT32_MAX;
+// Set while an update of the preview is queued on the main loop
+static atomic_bool preview_update_pending = false;
 static int preview_buffer_width = -1;
 static int preview_buffer_height = -1;
 
@@ -201,23 +207,28 @@ mp_main_set_zbar_result(MPZBarScanResult *result)
 }
 
 static bool
-set_preview(MPProcessPipelineBuffer *buffer)
+update_preview(gpointer data)
 {
-        if (current_preview_buffer) {
-                mp_process_pipeline_buffer_unref(current_preview_buffer);
-        }
-        current_preview_buffer = buffer;
+        // Frames published from here on queue another update
+        atomic_store(&preview_update_pending, false);
+
+        // The frame to draw is picked up when rendering, which is always the
+        // newest one
         gtk_widget_queue_draw(preview);
         return false;
 }
 
 void
-mp_main_set_preview(MPProcessPipelineBuffer *buffer)
+mp_main_update_preview()
 {
+        if (atomic_exchange(&preview_update_pending, true)) {
+                return;
+        }
+
         g_main_context_invoke_full(g_main_context_default(),
                                    G_PRIORITY_DEFAULT_IDLE,
-                                   (GSourceFunc)set_preview,
-                                   buffer,
+                                   (GSourceFunc)update_preview,
+                                   NULL,
                                    NULL);
 }
 
@@ -229,15 +240,18 @@ struct capture_completed_args {
 static bool
 capture_completed(struct capture_completed_args *args)
 {
-        strncpy(last_path, args->fname, 259);
+        // A failed capture leaves the previous photo in place
+        if (args->thumb) {
+                strncpy(last_path, args->fname, 259);
 
-        gtk_image_set_from_paintable(GTK_IMAGE(thumb_last),
-                                     GDK_PAINTABLE(args->thumb));
+                gtk_image_set_from_paintable(GTK_IMAGE(thumb_last),
+                                             GDK_PAINTABLE(args->thumb));
+        }
 
         gtk_spinner_stop(GTK_SPINNER(process_spinner));
         gtk_stack_set_visible_child(GTK_STACK(open_last_stack), thumb_last);
 
-        g_object_unref(args->thumb);
+        g_clear_object(&args->thumb);
         g_free(args->fname);
 
         return false;
@@ -365,6 +379,10 @@ preview_draw(GtkGLArea *area, GdkGLContext *ctx, gpointer data)
                 return FALSE;
         }
 
+        int64_t trace_start = mp_trace_now();
+
+        current_preview_buffer = mp_process_pipeline_get_preview_buffer();
+
 #ifdef RENDERDOC
         if (rdoc_api) {
                 rdoc_api->StartFrameCapture(NULL, NULL);
@@ -396,6 +414,8 @@ preview_draw(GtkGLArea *area, GdkGLContext *ctx, gpointer data)
                 glUniformMatrix3fv(blit_uniform_transform, 1, GL_FALSE, matrix);
                 check_gl();
 
+                mp_process_pipeline_buffer_wait(current_preview_buffer);
+
                 glActiveTexture(GL_TEXTURE0);
                 glBindTexture(GL_TEXTURE_2D,
                               mp_process_pipeline_buffer_get_texture_id(
@@ -405,6 +425,8 @@ preview_draw(GtkGLArea *area, GdkGLContext *ctx, gpointer data)
 
                 gl_util_bind_quad(quad);
                 gl_util_draw_quad(quad);
+
+                mp_process_pipeline_buffer_drawn(current_preview_buffer);
         }
 
         if (zbar_result) {
@@ -483,6 +505,16 @@ preview_draw(GtkGLArea *area, GdkGLContext *ctx, gpointer data)
         }
 #endif
 
+        // This is when the frame was handed to GTK, not when it is scanned out
+        if (current_preview_buffer) {
+                uint32_t sequence = mp_process_pipeline_buffer_get_sequence(
+                        current_preview_buffer);
+                if (sequence != drawn_preview_sequence) {
+                        mp_trace_span("preview_draw", sequence, trace_start);
+                        drawn_preview_sequence = sequence;
+                }
+        }
+
         return FALSE;
 }
 
@@ -684,9 +716,14 @@ preview_pressed(GtkGestureClick *gesture, int n_press, double x, double y)
                 }
         }
 
-        // Tapped preview image itself, try focussing
+        // Tapped preview image itself, try focussing there
         if (has_auto_focus_start) {
-                mp_io_pipeline_focus();
+                float offset_x, offset_y, size_x, size_y;
+                position_preview(&offset_x, &offset_y, &size_x, &size_y);
+
+                mp_io_pipeline_focus(
+                        CLAMP((x * scale_factor - offset_x) / size_x, 0, 1),
+                        CLAMP((y * scale_factor - offset_y) / size_y, 0, 1));
         }
 }
 
@@ -1151,6 +1188,8 @@ activate(GtkApplication *app, gpointer data)
                 GTK_WIDGET(gtk_builder_get_object(builder, "flash-controls-button"));
         GtkWidget *setting_dng_button =
                 GTK_WIDGET(gtk_builder_get_object(builder, "setting-raw"));
+        GtkWidget *setting_compress_dng_button = GTK_WIDGET(
+                gtk_builder_get_object(builder, "setting-compress-raw"));
         GtkWidget *setting_postprocessor_combo =
                 GTK_WIDGET(gtk_builder_get_object(builder, "setting-processor"));
         GtkListStore *setting_postprocessor_list = GTK_LIST_STORE(
@@ -1208,18 +1247,14 @@ activate(GtkApplication *app, gpointer data)
         settings = g_settings_new("org.postmarketos.Megapixels");
         char *setting_postproc = g_settings_get_string(settings, "postprocessor");
 
-        // Initialize the postprocessing gsetting to the old processor if
+        // Initialize the postprocessing gsetting to the native developer if
         // it was not set yet
         if (setting_postproc == NULL || setting_postproc[0] == '\0') {
                 printf("Initializing postprocessor gsetting\n");
-                setting_postproc = malloc(512);
-                if (!mp_process_find_processor(setting_postproc)) {
-                        printf("No processor found\n");
-                        exit(1);
-                }
-                g_settings_set_string(settings, "postprocessor", setting_postproc);
-                printf("Initialized postprocessor to %s\n", setting_postproc);
+                g_settings_set_string(
+                        settings, "postprocessor", MP_PROCESSOR_BUILTIN);
         }
+        g_free(setting_postproc);
 
         // Find all postprocessors for the settings list
         mp_process_find_all_processors(setting_postprocessor_list);
@@ -1230,6 +1265,11 @@ activate(GtkApplication *app, gpointer data)
                         setting_dng_button,
                         "active",
                         G_SETTINGS_BIND_DEFAULT);
+        g_settings_bind(settings,
+                        "compress-raw",
+                        setting_compress_dng_button,
+                        "active",
+                        G_SETTINGS_BIND_DEFAULT);
         g_settings_bind(settings,
                         "postprocessor",
                         setting_postprocessor_combo,
@@ -1310,6 +1350,8 @@ startup(GApplication *app, gpointer data)
 static void
 shutdown(GApplication *app, gpointer data)
 {
+        mp_trace_stop();
+
         // Only do cleanup in development, let the OS clean up otherwise
 #ifdef DEBUG
         mp_io_pipeline_stop();
@@ -1344,6 +1386,8 @@ main(int argc, char *argv[])
 
         setenv("LC_NUMERIC", "C", 1);
 
+        mp_trace_start();
+
         GtkApplication *app = gtk_application_new(APP_ID, 0);
 
         g_signal_connect(app, "startup", G_CALLBACK(startup), NULL);
@@ -25,7 +25,9 @@ struct mp_main_state {
 
 void mp_main_update_state(const struct mp_main_state *state);
 
-void mp_main_set_preview(MPProcessPipelineBuffer *buffer);
+// A new preview frame is available
+void mp_main_update_preview();
+// Takes over thumb, which is NULL along with fname when the capture failed
 void mp_main_capture_completed(GdkTexture *thumb, const char *fname);
 
 void mp_main_set_zbar_result(MPZBarScanResult *result);
@@ -1,3 +1,4 @@
+#include "matrix.h"
 #include <stdio.h>
 
 void
@@ -24,3 +25,25 @@ multiply_matrices(float a[9], float b[9], float out[9])
                 }
         }
 }
+
+bool
+invert_matrix(const float in[9], float out[9])
+{
+        float det = in[0] * (in[4] * in[8] - in[5] * in[7]) -
+                    in[1] * (in[3] * in[8] - in[5] * in[6]) +
+                    in[2] * (in[3] * in[7] - in[4] * in[6]);
+        if (det == 0) {
+                return false;
+        }
+
+        out[0] = (in[4] * in[8] - in[5] * in[7]) / det;
+        out[1] = (in[2] * in[7] - in[1] * in[8]) / det;
+        out[2] = (in[1] * in[5] - in[2] * in[4]) / det;
+        out[3] = (in[5] * in[6] - in[3] * in[8]) / det;
+        out[4] = (in[0] * in[8] - in[2] * in[6]) / det;
+        out[5] = (in[2] * in[3] - in[0] * in[5]) / det;
+        out[6] = (in[3] * in[7] - in[4] * in[6]) / det;
+        out[7] = (in[1] * in[6] - in[0] * in[7]) / det;
+        out[8] = (in[0] * in[4] - in[1] * in[3]) / det;
+        return true;
+}
@@ -1 +1,6 @@
+#pragma once
+
+#include <stdbool.h>
+
 void multiply_matrices(float a[9], float b[9], float out[9]);
+bool invert_matrix(const float in[9], float out[9]);
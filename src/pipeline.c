@@ -1,13 +1,55 @@
 #include "pipeline.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <glib-unix.h>
 #include <gtk/gtk.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * Messages are passed through a fixed ring of preallocated slots, so invoking
+ * a callback on another pipeline doesn't allocate. Any thread may send, only
+ * the pipeline thread receives. Messages that don't fit in a slot, or that
+ * arrive while the ring is full, go through a locked overflow list instead.
+ */
+#define MESSAGE_QUEUE_SIZE 256
+#define MESSAGE_DATA_SIZE 192
+
+struct message_slot {
+        // Ring position this slot is free for, or that position + 1 once
+        // filled
+        _Atomic size_t sequence;
+        MPPipelineCallback callback;
+        max_align_t data[MESSAGE_DATA_SIZE / sizeof(max_align_t)];
+};
+
+struct overflow_message {
+        struct overflow_message *next;
+        MPPipelineCallback callback;
+        max_align_t data[];
+};
 
 struct _MPPipeline {
         GMainContext *main_context;
         GMainLoop *main_loop;
         pthread_t thread;
+
+        struct message_slot slots[MESSAGE_QUEUE_SIZE];
+        _Atomic size_t send_position;
+        size_t receive_position;
+
+        GMutex overflow_mutex;
+        struct overflow_message *overflow_head;
+        struct overflow_message *overflow_tail;
+        // Messages keep their order by not using the ring while this is set
+        atomic_int num_overflow;
+
+        int wake_fd;
+        atomic_bool wake_pending;
+        GSource *wake_source;
 };
 
 static void *
@@ -19,12 +61,158 @@ thread_main_loop(void *arg)
         return NULL;
 }
 
+static bool
+try_send(MPPipeline *pipeline,
+         MPPipelineCallback callback,
+         const void *data,
+         size_t size)
+{
+        size_t position = atomic_load_explicit(&pipeline->send_position,
+                                               memory_order_relaxed);
+        struct message_slot *slot;
+        while (true) {
+                slot = &pipeline->slots[position % MESSAGE_QUEUE_SIZE];
+                size_t sequence = atomic_load_explicit(&slot->sequence,
+                                                       memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+                if (diff < 0) {
+                        return false;
+                }
+
+                if (diff == 0 && atomic_compare_exchange_weak_explicit(
+                                         &pipeline->send_position,
+                                         &position,
+                                         position + 1,
+                                         memory_order_relaxed,
+                                         memory_order_relaxed)) {
+                        break;
+                }
+
+                if (diff > 0) {
+                        position = atomic_load_explicit(&pipeline->send_position,
+                                                        memory_order_relaxed);
+                }
+        }
+
+        slot->callback = callback;
+        if (size > 0) {
+                memcpy(slot->data, data, size);
+        }
+        atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+        return true;
+}
+
+static void
+send_overflow(MPPipeline *pipeline,
+              MPPipelineCallback callback,
+              const void *data,
+              size_t size)
+{
+        struct overflow_message *message =
+                malloc(sizeof(struct overflow_message) + size);
+        message->next = NULL;
+        message->callback = callback;
+        if (size > 0) {
+                memcpy(message->data, data, size);
+        }
+
+        g_mutex_lock(&pipeline->overflow_mutex);
+        if (pipeline->overflow_tail) {
+                pipeline->overflow_tail->next = message;
+        } else {
+                pipeline->overflow_head = message;
+        }
+        pipeline->overflow_tail = message;
+        atomic_fetch_add(&pipeline->num_overflow, 1);
+        g_mutex_unlock(&pipeline->overflow_mutex);
+}
+
+static void
+wake(MPPipeline *pipeline)
+{
+        if (atomic_exchange(&pipeline->wake_pending, true)) {
+                return;
+        }
+
+        uint64_t value = 1;
+        while (write(pipeline->wake_fd, &value, sizeof(value)) == -1 &&
+               errno == EINTR) {
+        }
+}
+
+static bool
+receive_messages(int fd, GIOCondition condition, MPPipeline *pipeline)
+{
+        uint64_t value;
+        while (read(fd, &value, sizeof(value)) == -1 && errno == EINTR) {
+        }
+        // Clear after reading, a message sent from now on wakes us again
+        atomic_store(&pipeline->wake_pending, false);
+
+        while (true) {
+                // Everything in the ring was sent before the overflow list
+                // started, so it is handled first
+                while (true) {
+                        size_t position = pipeline->receive_position;
+                        struct message_slot *slot =
+                                &pipeline->slots[position % MESSAGE_QUEUE_SIZE];
+                        if (atomic_load_explicit(&slot->sequence,
+                                                 memory_order_acquire) !=
+                            position + 1) {
+                                break;
+                        }
+
+                        slot->callback(pipeline, slot->data);
+
+                        atomic_store_explicit(&slot->sequence,
+                                              position + MESSAGE_QUEUE_SIZE,
+                                              memory_order_release);
+                        pipeline->receive_position = position + 1;
+                }
+
+                g_mutex_lock(&pipeline->overflow_mutex);
+                struct overflow_message *message = pipeline->overflow_head;
+                pipeline->overflow_head = NULL;
+                pipeline->overflow_tail = NULL;
+                atomic_store(&pipeline->num_overflow, 0);
+                g_mutex_unlock(&pipeline->overflow_mutex);
+
+                if (!message) {
+                        break;
+                }
+
+                while (message) {
+                        struct overflow_message *next = message->next;
+                        message->callback(pipeline, message->data);
+                        free(message);
+                        message = next;
+                }
+        }
+
+        return true;
+}
+
 MPPipeline *
 mp_pipeline_new()
 {
-        MPPipeline *pipeline = malloc(sizeof(MPPipeline));
+        MPPipeline *pipeline = calloc(1, sizeof(MPPipeline));
         pipeline->main_context = g_main_context_new();
         pipeline->main_loop = g_main_loop_new(pipeline->main_context, false);
+
+        for (size_t i = 0; i < MESSAGE_QUEUE_SIZE; ++i) {
+                atomic_init(&pipeline->slots[i].sequence, i);
+        }
+        g_mutex_init(&pipeline->overflow_mutex);
+
+        pipeline->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        assert(pipeline->wake_fd != -1);
+        pipeline->wake_source = g_unix_fd_source_new(pipeline->wake_fd, G_IO_IN);
+        g_source_set_callback(pipeline->wake_source,
+                              (GSourceFunc)receive_messages,
+                              pipeline,
+                              NULL);
+        g_source_attach(pipeline->wake_source, pipeline->main_context);
+
         int res =
                 pthread_create(&pipeline->thread, NULL, thread_main_loop, pipeline);
         assert(res == 0);
@@ -32,48 +220,30 @@ mp_pipeline_new()
         return pipeline;
 }
 
-struct invoke_args {
-        MPPipeline *pipeline;
-        MPPipelineCallback callback;
-};
-
-static bool
-invoke_impl(struct invoke_args *args)
-{
-        args->callback(args->pipeline, args + 1);
-        return false;
-}
-
 void
 mp_pipeline_invoke(MPPipeline *pipeline,
                    MPPipelineCallback callback,
                    const void *data,
                    size_t size)
 {
-        if (pthread_self() != pipeline->thread) {
-                struct invoke_args *args = malloc(sizeof(struct invoke_args) + size);
-                args->pipeline = pipeline;
-                args->callback = callback;
-
-                if (size > 0) {
-                        memcpy(args + 1, data, size);
-                }
-
-                g_main_context_invoke_full(pipeline->main_context,
-                                           G_PRIORITY_DEFAULT,
-                                           (GSourceFunc)invoke_impl,
-                                           args,
-                                           free);
-        } else {
+        if (pthread_self() == pipeline->thread) {
                 callback(pipeline, data);
+                return;
         }
+
+        if (size > MESSAGE_DATA_SIZE ||
+            atomic_load(&pipeline->num_overflow) > 0 ||
+            !try_send(pipeline, callback, data, size)) {
+                send_overflow(pipeline, callback, data, size);
+        }
+
+        wake(pipeline);
 }
 
-static bool
-unlock_mutex(GMutex *mutex)
+static void
+unlock_mutex(MPPipeline *pipeline, GMutex **mutex)
 {
-        g_mutex_unlock(mutex);
-        return false;
+        g_mutex_unlock(*mutex);
 }
 
 void
@@ -83,11 +253,12 @@ mp_pipeline_sync(MPPipeline *pipeline)
         g_mutex_init(&mutex);
         g_mutex_lock(&mutex);
 
-        g_main_context_invoke_full(pipeline->main_context,
-                                   G_PRIORITY_LOW,
-                                   (GSourceFunc)unlock_mutex,
-                                   &mutex,
-                                   NULL);
+        // Messages are handled in order, so this runs after all pending ones
+        GMutex *mutex_ptr = &mutex;
+        mp_pipeline_invoke(pipeline,
+                           (MPPipelineCallback)unlock_mutex,
+                           &mutex_ptr,
+                           sizeof(GMutex *));
         g_mutex_lock(&mutex);
         g_mutex_unlock(&mutex);
 
@@ -104,6 +275,19 @@ mp_pipeline_free(MPPipeline *pipeline)
 
         void *r;
         pthread_join(pipeline->thread, &r);
+
+        g_source_destroy(pipeline->wake_source);
+        g_source_unref(pipeline->wake_source);
+        close(pipeline->wake_fd);
+
+        struct overflow_message *message = pipeline->overflow_head;
+        while (message) {
+                struct overflow_message *next = message->next;
+                free(message);
+                message = next;
+        }
+        g_mutex_clear(&pipeline->overflow_mutex);
+
         free(pipeline);
 }
 
@@ -142,3 +326,47 @@ mp_pipeline_add_capture_source(MPPipeline *pipeline,
         g_source_attach(video_source, pipeline->main_context);
         return video_source;
 }
+
+struct control_source_args {
+        MPCamera *camera;
+        void (*callback)(void *);
+        void *user_data;
+};
+
+static bool
+on_control_event(int fd,
+                 GIOCondition condition,
+                 struct control_source_args *args)
+{
+        if (mp_camera_handle_control_events(args->camera)) {
+                args->callback(args->user_data);
+        }
+        return true;
+}
+
+// Not thread safe, returns NULL when the camera has no control events
+GSource *
+mp_pipeline_add_control_source(MPPipeline *pipeline,
+                               MPCamera *camera,
+                               void (*callback)(void *),
+                               void *user_data)
+{
+        int event_fd = mp_camera_get_control_event_fd(camera);
+        if (event_fd == -1) {
+                return NULL;
+        }
+
+        GSource *event_source = g_unix_fd_source_new(event_fd, G_IO_PRI);
+
+        struct control_source_args *args =
+                malloc(sizeof(struct control_source_args));
+        args->camera = camera;
+        args->callback = callback;
+        args->user_data = user_data;
+        g_source_set_callback(event_source,
+                              (GSourceFunc)on_control_event,
+                              args,
+                              free);
+        g_source_attach(event_source, pipeline->main_context);
+        return event_source;
+}
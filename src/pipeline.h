@@ -21,3 +21,8 @@ GSource *mp_pipeline_add_capture_source(MPPipeline *pipeline,
                                         MPCamera *camera,
                                         void (*callback)(MPBuffer, void *),
                                         void *user_data);
+// Calls back when the controls cached by the camera change
+GSource *mp_pipeline_add_control_source(MPPipeline *pipeline,
+                                        MPCamera *camera,
+                                        void (*callback)(void *),
+                                        void *user_data);
@@ -1,31 +1,100 @@
 #include "process_pipeline.h"
 
+#include "burst_merge.h"
 #include "config.h"
+#include "developer.h"
+#include "dng_writer.h"
+#include "frame.h"
+#include "gl_thumbnail.h"
 #include "gles2_debayer.h"
+#include "image.h"
 #include "io_pipeline.h"
+#include "mailbox.h"
 #include "main.h"
 #include "pipeline.h"
+#include "swap_chain.h"
+#include "trace.h"
+#include "workers.h"
 #include "zbar_pipeline.h"
 #include <assert.h>
+#include <errno.h>
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
+#include <inttypes.h>
 #include <math.h>
-#include <tiffio.h>
+#include <stdatomic.h>
+#include <sys/statvfs.h>
 
 #include "gl_util.h"
+#include <epoxy/egl.h>
 #include <sys/mman.h>
 
-#define TIFFTAG_FORWARDMATRIX1 50964
+static MPPipeline *pipeline;
 
-static const float colormatrix_srgb[] = { 3.2409, -1.5373, -0.4986, -0.9692, 1.8759,
-                                          0.0415, 0.0556,  -0.2039, 1.0569 };
+// Merges and develops the frames of a burst next to the process pipeline
+static MPPipeline *develop_pipeline;
+
+// A burst that is being captured or that still has frames being written
+struct capture_burst {
+        char dir[255];
+
+        // Path of the final photo without the extension
+        char target[255];
+        bool save_dng;
+        // Write the DNGs with lossless compression
+        bool compress_dng;
+
+        // Develop the JPEG in process instead of running the postprocessor
+        bool develop;
+        // Frame that is developed when the burst isn't merged
+        int develop_frame;
+
+        gint64 start_time;
+
+        // Number of frames that haven't been written to disk yet, including
+        // the merged frame and the developed JPEG
+        int frames_remaining;
+
+        // Thumbnail made from the preview of the last frame of the burst
+        GdkTexture *thumb;
+        GLThumbnail *thumb_readback;
+        uint32_t thumb_width;
+        uint32_t thumb_height;
+
+        // Preview stored in the merged DNG, in the orientation of the sensor
+        GLThumbnail *dng_preview_readback;
+        GBytes *dng_preview;
+        uint32_t dng_preview_width;
+        uint32_t dng_preview_height;
+
+        // Only used on the develop pipeline
+        bool merge;
+        MPBurstMerge *merger;
+        struct mp_dng_info merge_info;
+};
 
-static MPPipeline *pipeline;
+static struct capture_burst *current_burst = NULL;
+
+// Frames of bursts the DNG writer or the merge still read from, the camera
+// can't be stopped until they're released
+static int num_held_frames = 0;
+static GMutex held_frames_mutex;
+static GCond held_frames_cond;
+
+// Name of the directories bursts are staged in, hidden from galleries
+#define BURST_DIR_PREFIX ".megapixels."
+// Seconds after which a leftover burst directory is removed
+#define STALE_BURST_AGE (60 * 60)
+
+// Set from the io pipeline when a capture is requested, frames aren't dropped
+// until the process pipeline has taken all of the burst
+static atomic_bool is_capturing = false;
 
-static char burst_dir[23];
+// Newest preview frame waiting for the process pipeline
+static MPMailbox *preview_mailbox;
 
-static volatile bool is_capturing = false;
-static volatile int frames_processed = 0;
-static volatile int frames_received = 0;
+// Hands the debayered previews in output_buffers to the GTK thread
+static MPSwapChain *output_swap_chain;
 
 static const struct mp_camera_config *camera;
 static int camera_rotation;
@@ -40,6 +109,10 @@ static int preview_height;
 
 static int device_rotation;
 
+// Texture of the newest preview, for the thumbnails of bursts whose last frame
+// was already shown
+static GLuint last_preview_texture = 0;
+
 static int output_buffer_width = -1;
 static int output_buffer_height = -1;
 
@@ -50,37 +123,27 @@ static int gain_max;
 static bool exposure_is_manual;
 static int exposure;
 
-static bool flash_enabled;
+static float neutral[3] = { 1, 1, 1 };
 
-static char capture_fname[255];
+static bool flash_enabled;
 
 static GSettings *settings;
 
-static void
-register_custom_tiff_tags(TIFF *tif)
-{
-        static const TIFFFieldInfo custom_fields[] = {
-                { TIFFTAG_FORWARDMATRIX1,
-                  -1,
-                  -1,
-                  TIFF_SRATIONAL,
-                  FIELD_CUSTOM,
-                  1,
-                  1,
-                  "ForwardMatrix1" },
-        };
-
-        // Add missing dng fields
-        TIFFMergeFieldInfo(tif,
-                           custom_fields,
-                           sizeof(custom_fields) / sizeof(custom_fields[0]));
-}
-
 void
 mp_process_find_all_processors(GtkListStore *store)
 {
         GtkTreeIter iter;
         char buffer[512];
+
+        gtk_list_store_insert(store, &iter, -1);
+        gtk_list_store_set(store,
+                           &iter,
+                           0,
+                           MP_PROCESSOR_BUILTIN,
+                           1,
+                           "(built-in) Native developer",
+                           -1);
+
         // Find all the original postprocess.sh locations
 
         // Check postprocess.sh in the current working directory
@@ -143,65 +206,109 @@ mp_process_find_all_processors(GtkListStore *store)
         }
 }
 
-bool
-mp_process_find_processor(char *script)
+static char *
+get_pictures_dir()
 {
-        char filename[] = "postprocess.sh";
-
-        // Check postprocess.sh in the current working directory
-        sprintf(script, "./data/%s", filename);
-        if (access(script, F_OK) != -1) {
-                sprintf(script, "./data/%s", filename);
-                printf("Found postprocessor script at %s\n", script);
-                return true;
+        if (g_get_user_special_dir(G_USER_DIRECTORY_PICTURES) != NULL) {
+                return g_strdup(g_get_user_special_dir(G_USER_DIRECTORY_PICTURES));
+        } else if (getenv("XDG_PICTURES_DIR") != NULL) {
+                return g_strdup(getenv("XDG_PICTURES_DIR"));
+        } else {
+                return g_build_filename(getenv("HOME"), "Pictures", NULL);
         }
+}
 
-        // Check for a script in XDG_CONFIG_HOME
-        sprintf(script, "%s/megapixels/%s", g_get_user_config_dir(), filename);
-        if (access(script, F_OK) != -1) {
-                printf("Found postprocessor script at %s\n", script);
-                return true;
+static void
+remove_burst_dir(const char *path)
+{
+        GDir *dir = g_dir_open(path, 0, NULL);
+        if (dir) {
+                const char *name;
+                while ((name = g_dir_read_name(dir)) != NULL) {
+                        g_autofree char *file = g_build_filename(path, name, NULL);
+                        g_remove(file);
+                }
+                g_dir_close(dir);
         }
+        g_rmdir(path);
+}
 
-        // Check user overridden /etc/megapixels/postprocessor.sh
-        sprintf(script, "%s/megapixels/%s", SYSCONFDIR, filename);
-        if (access(script, F_OK) != -1) {
-                printf("Found postprocessor script at %s\n", script);
-                return true;
+/*
+ * Bursts are staged next to the photos, where they aren't cleaned up on reboot
+ * like /tmp. Remove the ones left behind when Megapixels or the postprocessor
+ * was killed, unless a postprocessor could still be working on them.
+ */
+static void
+remove_stale_burst_dirs()
+{
+        g_autofree char *pictures_dir = get_pictures_dir();
+        GDir *dir = g_dir_open(pictures_dir, 0, NULL);
+        if (!dir) {
+                return;
         }
 
-        // Check packaged /usr/share/megapixels/postprocessor.sh
-        sprintf(script, "%s/megapixels/%s", DATADIR, filename);
-        if (access(script, F_OK) != -1) {
-                printf("Found postprocessor script at %s\n", script);
-                return true;
-        }
+        time_t now = time(NULL);
+        const char *name;
+        while ((name = g_dir_read_name(dir)) != NULL) {
+                if (!g_str_has_prefix(name, BURST_DIR_PREFIX)) {
+                        continue;
+                }
 
-        return false;
+                g_autofree char *path = g_build_filename(pictures_dir, name, NULL);
+                GStatBuf st;
+                if (g_stat(path, &st) == 0 && S_ISDIR(st.st_mode) &&
+                    now - st.st_mtime > STALE_BURST_AGE) {
+                        printf("Removing stale burst %s\n", path);
+                        remove_burst_dir(path);
+                }
+        }
+        g_dir_close(dir);
 }
 
 static void
 setup(MPPipeline *pipeline, const void *data)
 {
-        TIFFSetTagExtender(register_custom_tiff_tags);
         settings = g_settings_new("org.postmarketos.Megapixels");
+
+        remove_stale_burst_dirs();
 }
 
 void
 mp_process_pipeline_start()
 {
+        preview_mailbox = mp_mailbox_new((MPMailboxFreeFunc)mp_frame_unref);
+        output_swap_chain = mp_swap_chain_new();
+
         pipeline = mp_pipeline_new();
 
         mp_pipeline_invoke(pipeline, setup, NULL, 0);
 
+        develop_pipeline = mp_pipeline_new();
+
         mp_zbar_pipeline_start();
+        mp_dng_writer_start();
 }
 
 void
 mp_process_pipeline_stop()
 {
+        // Finish writing captures while their completion can still be handled
+        mp_pipeline_free(develop_pipeline);
+        mp_dng_writer_stop();
+
         mp_pipeline_free(pipeline);
 
+        MPMailboxStats stats;
+        mp_mailbox_clear(preview_mailbox);
+        mp_mailbox_get_stats(preview_mailbox, &stats);
+        printf("Preview frames: %" PRIu64 " processed, %" PRIu64
+               " replaced, %" PRIu64 " dropped\n",
+               stats.delivered,
+               stats.replaced,
+               stats.dropped);
+        mp_mailbox_free(preview_mailbox);
+        mp_swap_chain_free(output_swap_chain);
+
         mp_zbar_pipeline_stop();
 }
 
@@ -209,27 +316,44 @@ void
 mp_process_pipeline_sync()
 {
         mp_pipeline_sync(pipeline);
+
+        // The zbar pipeline may still hold on to frames handed to it
+        mp_zbar_pipeline_sync();
+
+        // As do the writer threads and the merge, for the last frames of a
+        // burst
+        g_mutex_lock(&held_frames_mutex);
+        while (num_held_frames > 0) {
+                g_cond_wait(&held_frames_cond, &held_frames_mutex);
+        }
+        g_mutex_unlock(&held_frames_mutex);
 }
 
-#define NUM_BUFFERS 4
+// Only one of these is set depending on the fence support of the context
+struct buffer_fence {
+        GLsync sync;
+        EGLSyncKHR egl_sync;
+};
 
 struct _MPProcessPipelineBuffer {
         GLuint texture_id;
-
-        _Atomic(int) refcount;
+        // Sequence number of the frame last debayered into the texture
+        uint32_t sequence;
+
+        // Signalled once the debayer into texture_id has finished
+        struct buffer_fence rendered;
+        // Signalled once the GTK thread has drawn from texture_id, it can
+        // hand the buffer back with the draw still queued
+        struct buffer_fence drawn;
 };
-static MPProcessPipelineBuffer output_buffers[NUM_BUFFERS];
 
-void
-mp_process_pipeline_buffer_ref(MPProcessPipelineBuffer *buf)
-{
-        ++buf->refcount;
-}
+static MPProcessPipelineBuffer output_buffers[MP_SWAP_CHAIN_SIZE];
 
-void
-mp_process_pipeline_buffer_unref(MPProcessPipelineBuffer *buf)
+MPProcessPipelineBuffer *
+mp_process_pipeline_get_preview_buffer()
 {
-        --buf->refcount;
+        int index = mp_swap_chain_acquire(output_swap_chain);
+        return index >= 0 ? &output_buffers[index] : NULL;
 }
 
 uint32_t
@@ -238,51 +362,139 @@ mp_process_pipeline_buffer_get_texture_id(MPProcessPipelineBuffer *buf)
         return buf->texture_id;
 }
 
+uint32_t
+mp_process_pipeline_buffer_get_sequence(MPProcessPipelineBuffer *buf)
+{
+        return buf->sequence;
+}
+
+static enum {
+        FENCE_NONE,
+        FENCE_GL,
+        FENCE_EGL,
+        FENCE_EGL_CLIENT,
+} fence_type = FENCE_NONE;
+
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+
 static void
-repack_image_sequencial(const uint8_t *src_buf, uint8_t *dst_buf, MPMode *mode)
+init_fences(bool is_es, int major)
 {
-        uint16_t pixels[4];
-        uint32_t row_length =
-                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width);
-        uint32_t padding_bytes =
-                mp_pixel_format_width_to_padding(mode->pixel_format, mode->width);
-        size_t si = 0;
+        if (!is_es || major >= 3) {
+                fence_type = FENCE_GL;
+                return;
+        }
+
+        egl_display = eglGetCurrentDisplay();
+        if (egl_display == EGL_NO_DISPLAY ||
+            !epoxy_has_egl_extension(egl_display, "EGL_KHR_fence_sync")) {
+                fence_type = FENCE_NONE;
+        } else if (epoxy_has_egl_extension(egl_display, "EGL_KHR_wait_sync")) {
+                fence_type = FENCE_EGL;
+        } else {
+                fence_type = FENCE_EGL_CLIENT;
+        }
+}
 
-        // Image data must be 10-bit packed
-        assert(mp_pixel_format_bits_per_pixel(mode->pixel_format) == 10);
+static void
+clear_fence(struct buffer_fence *fence)
+{
+        if (fence->sync) {
+                glDeleteSync(fence->sync);
+                fence->sync = NULL;
+        }
 
-        /*
-         * Repack 40 bits stored in sensor format into sequencial format
-         *
-         * src_buf: 11111111 22222222 33333333 44444444 11223344 ...
-         * dst_buf: 11111111 11222222 22223333 33333344 44444444 ...
-         */
-        for (size_t i = 0; i < row_length * mode->height; i += 5) {
-                // Skip padding bytes in source buffer
-                if (i && i % row_length == 0)
-                        si += padding_bytes;
+        if (fence->egl_sync != EGL_NO_SYNC_KHR) {
+                eglDestroySyncKHR(egl_display, fence->egl_sync);
+                fence->egl_sync = EGL_NO_SYNC_KHR;
+        }
+}
 
-                /* Extract pixels from packed sensor format */
-                pixels[0] = (src_buf[si] << 2) | (src_buf[si + 4] >> 6);
-                pixels[1] = (src_buf[si + 1] << 2) | (src_buf[si + 4] >> 4 & 0x03);
-                pixels[2] = (src_buf[si + 2] << 2) | (src_buf[si + 4] >> 2 & 0x03);
-                pixels[3] = (src_buf[si + 3] << 2) | (src_buf[si + 4] & 0x03);
+// Called after the commands the fence is for have been issued
+static void
+set_fence(struct buffer_fence *fence)
+{
+        clear_fence(fence);
+
+        switch (fence_type) {
+        case FENCE_GL:
+                fence->sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                break;
+        case FENCE_EGL:
+        case FENCE_EGL_CLIENT:
+                fence->egl_sync =
+                        eglCreateSyncKHR(egl_display, EGL_SYNC_FENCE_KHR, NULL);
+                break;
+        case FENCE_NONE:
+                break;
+        }
 
-                /* Pack pixels into sequencial format */
-                dst_buf[i] = (pixels[0] >> 2 & 0xff);
-                dst_buf[i + 1] = (pixels[0] << 6 & 0xff) | (pixels[1] >> 4 & 0x3f);
-                dst_buf[i + 2] = (pixels[1] << 4 & 0xff) | (pixels[2] >> 6 & 0x0f);
-                dst_buf[i + 3] = (pixels[2] << 2 & 0xff) | (pixels[3] >> 8 & 0x03);
-                dst_buf[i + 4] = (pixels[3] & 0xff);
+        if (fence->sync || fence->egl_sync != EGL_NO_SYNC_KHR) {
+                // The fence has to reach the GPU before another context can
+                // wait on it
+                glFlush();
+        } else {
+                glFinish();
+        }
+}
 
-                si += 5;
+// Makes the current context wait for the fence
+static void
+wait_fence(const struct buffer_fence *fence)
+{
+        if (fence->sync) {
+                glWaitSync(fence->sync, 0, GL_TIMEOUT_IGNORED);
+        } else if (fence->egl_sync != EGL_NO_SYNC_KHR) {
+                if (fence_type == FENCE_EGL) {
+                        eglWaitSyncKHR(egl_display, fence->egl_sync, 0);
+                } else {
+                        eglClientWaitSyncKHR(egl_display,
+                                             fence->egl_sync,
+                                             0,
+                                             EGL_FOREVER_KHR);
+                }
         }
 }
 
+void
+mp_process_pipeline_buffer_wait(MPProcessPipelineBuffer *buf)
+{
+        wait_fence(&buf->rendered);
+}
+
+/*
+ * The swap chain hands the buffer back to the process thread once the GTK
+ * thread acquires a newer one, which happens after this. The fence is only
+ * touched by the thread that holds the buffer.
+ */
+void
+mp_process_pipeline_buffer_drawn(MPProcessPipelineBuffer *buf)
+{
+        set_fence(&buf->drawn);
+}
+
 static GLES2Debayer *gles2_debayer = NULL;
 
+static GLThumbnailer *thumbnailer = NULL;
+
 static GdkGLContext *context;
 
+// Input textures are kept allocated for the current mode and alternated
+// between frames, so uploading the next frame doesn't have to wait for the
+// debayer of the previous one to finish reading its texture.
+#define NUM_INPUT_BUFFERS 2
+
+static GLuint input_textures[NUM_INPUT_BUFFERS];
+static size_t input_index = 0;
+
+// Pixel unpack buffers are used for uploading when available (GLES 3.0+).
+// These also allow skipping the row padding with GL_UNPACK_ROW_LENGTH.
+static bool use_unpack_buffers = false;
+static GLuint input_unpack_buffers[NUM_INPUT_BUFFERS];
+
+static uint32_t input_texture_width;
+static uint32_t input_stride;
+
 // #define RENDERDOC
 
 #ifdef RENDERDOC
@@ -332,23 +544,52 @@ init_gl(MPPipeline *pipeline, GdkSurface **surface)
         glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
         check_gl();
 
-        for (size_t i = 0; i < NUM_BUFFERS; ++i) {
+        for (size_t i = 0; i < MP_SWAP_CHAIN_SIZE; ++i) {
                 glGenTextures(1, &output_buffers[i].texture_id);
                 glBindTexture(GL_TEXTURE_2D, output_buffers[i].texture_id);
                 glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
                 glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
         }
 
+        glGenTextures(NUM_INPUT_BUFFERS, input_textures);
+        for (size_t i = 0; i < NUM_INPUT_BUFFERS; ++i) {
+                glBindTexture(GL_TEXTURE_2D, input_textures[i]);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+        check_gl();
+
         glBindTexture(GL_TEXTURE_2D, 0);
 
         gboolean is_es = gdk_gl_context_get_use_es(context);
         int major, minor;
         gdk_gl_context_get_version(context, &major, &minor);
 
-        printf("Initialized %s %d.%d\n",
+        use_unpack_buffers = !is_es || major >= 3;
+        init_fences(is_es, major);
+        if (use_unpack_buffers) {
+                glGenBuffers(NUM_INPUT_BUFFERS, input_unpack_buffers);
+                check_gl();
+        }
+
+        // Pack buffers come with the same versions as unpack buffers
+        thumbnailer = gl_thumbnailer_new(use_unpack_buffers);
+
+        static const char *fence_names[] = {
+                [FENCE_NONE] = "glFinish",
+                [FENCE_GL] = "GL fences",
+                [FENCE_EGL] = "EGL fences",
+                [FENCE_EGL_CLIENT] = "EGL client fences",
+        };
+
+        printf("Initialized %s %d.%d%s, syncing with %s\n",
                is_es ? "OpenGL ES" : "OpenGL",
                major,
-               minor);
+               minor,
+               use_unpack_buffers ? " with unpack buffers" : "",
+               fence_names[fence_type]);
 }
 
 void
@@ -360,25 +601,13 @@ mp_process_pipeline_init_gl(GdkSurface *surface)
                            sizeof(GdkSurface *));
 }
 
-static GdkTexture *
-process_image_for_preview(const uint8_t *image)
+// Returns the texture the preview was rendered to
+static GLuint
+process_image_for_preview(const uint8_t *image, uint32_t sequence)
 {
-#ifdef PROFILE_DEBAYER
-        clock_t t1 = clock();
-#endif
-
-        // Pick an available buffer
-        MPProcessPipelineBuffer *output_buffer = NULL;
-        for (size_t i = 0; i < NUM_BUFFERS; ++i) {
-                if (output_buffers[i].refcount == 0) {
-                        output_buffer = &output_buffers[i];
-                }
-        }
-
-        if (output_buffer == NULL) {
-                return NULL;
-        }
-        assert(output_buffer != NULL);
+        // The back buffer is never drawn from, so there's always one to use
+        MPProcessPipelineBuffer *output_buffer =
+                &output_buffers[mp_swap_chain_get_back(output_swap_chain)];
 
 #ifdef RENDERDOC
         if (rdoc_api) {
@@ -386,40 +615,72 @@ process_image_for_preview(const uint8_t *image)
         }
 #endif
 
-        // Copy image to a GL texture. TODO: This can be avoided
-        GLuint input_texture;
-        glGenTextures(1, &input_texture);
+        // GTK may have given up the buffer with its draw from it still queued
+        // on its own context
+        wait_fence(&output_buffer->drawn);
+        clear_fence(&output_buffer->drawn);
+
+        // Upload the image to the input texture that wasn't used last frame
+        int64_t trace_start = mp_trace_now();
+        GLuint input_texture = input_textures[input_index];
         glBindTexture(GL_TEXTURE_2D, input_texture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexImage2D(GL_TEXTURE_2D,
-                     0,
-                     GL_LUMINANCE,
-                     mp_pixel_format_width_to_bytes(mode.pixel_format, mode.width) +
-                             mp_pixel_format_width_to_padding(mode.pixel_format,
-                                                              mode.width),
-                     mode.height,
-                     0,
-                     GL_LUMINANCE,
-                     GL_UNSIGNED_BYTE,
-                     image);
+
+        void *mapped = NULL;
+        if (use_unpack_buffers) {
+                GLuint unpack_buffer = input_unpack_buffers[input_index];
+                size_t size = input_stride * mode.height;
+
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpack_buffer);
+                mapped = glMapBufferRange(
+                        GL_PIXEL_UNPACK_BUFFER,
+                        0,
+                        size,
+                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+                if (mapped) {
+                        memcpy(mapped, image, size);
+                        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+                } else {
+                        // Upload straight from the frame instead
+                        g_printerr("Could not map the unpack buffer\n");
+                        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                }
+
+                // Read rows with the padding in the stride, but don't upload it
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, input_stride);
+        }
+
+        glTexSubImage2D(GL_TEXTURE_2D,
+                        0,
+                        0,
+                        0,
+                        input_texture_width,
+                        mode.height,
+                        GL_LUMINANCE,
+                        GL_UNSIGNED_BYTE,
+                        mapped ? NULL : image);
+
+        if (use_unpack_buffers) {
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
         check_gl();
 
+        input_index = (input_index + 1) % NUM_INPUT_BUFFERS;
+
+        mp_trace_span("gl_upload", sequence, trace_start);
+
+        // This only measures queueing the commands, the GPU runs behind
+        trace_start = mp_trace_now();
         gles2_debayer_process(
                 gles2_debayer, output_buffer->texture_id, input_texture);
         check_gl();
 
-        glFinish();
-
-        glDeleteTextures(1, &input_texture);
+        // Let the preview wait for the debayer on the GPU instead of blocking
+        // this thread until it's done
+        set_fence(&output_buffer->rendered);
+        check_gl();
 
-#ifdef PROFILE_DEBAYER
-        clock_t t2 = clock();
-        printf("process_image_for_preview %fms\n",
-               (float)(t2 - t1) / CLOCKS_PER_SEC * 1000);
-#endif
+        mp_trace_span("gl_debayer", sequence, trace_start);
 
 #ifdef RENDERDOC
         if (rdoc_api) {
@@ -427,251 +688,45 @@ process_image_for_preview(const uint8_t *image)
         }
 #endif
 
-        mp_process_pipeline_buffer_ref(output_buffer);
-        mp_main_set_preview(output_buffer);
-
-        // Create a thumbnail from the preview for the last capture
-        GdkTexture *thumb = NULL;
-        if (captures_remaining == 1) {
-                printf("Making thumbnail\n");
-
-                size_t size = output_buffer_width * output_buffer_height *
-                              sizeof(uint32_t);
-
-                uint32_t *data = g_malloc_n(size, 1);
-
-                glReadPixels(0,
-                             0,
-                             output_buffer_width,
-                             output_buffer_height,
-                             GL_RGBA,
-                             GL_UNSIGNED_BYTE,
-                             data);
-                check_gl();
+        output_buffer->sequence = sequence;
+        mp_swap_chain_publish(output_swap_chain);
+        mp_main_update_preview();
 
-                // Flip vertically
-                for (size_t y = 0; y < output_buffer_height / 2; ++y) {
-                        for (size_t x = 0; x < output_buffer_width; ++x) {
-                                uint32_t tmp = data[(output_buffer_height - y - 1) *
-                                                            output_buffer_width +
-                                                    x];
-                                data[(output_buffer_height - y - 1) *
-                                             output_buffer_width +
-                                     x] = data[y * output_buffer_width + x];
-                                data[y * output_buffer_width + x] = tmp;
-                        }
-                }
+        last_preview_texture = output_buffer->texture_id;
+        return output_buffer->texture_id;
+}
 
-                thumb = gdk_memory_texture_new(output_buffer_width,
-                                               output_buffer_height,
-                                               GDK_MEMORY_R8G8B8A8,
-                                               g_bytes_new_take(data, size),
-                                               output_buffer_width *
-                                                       sizeof(uint32_t));
-        }
 
-        return thumb;
+static void
+print_capture_latency(struct capture_burst *burst)
+{
+        printf("Shot to %s took %fms\n",
+               burst->develop ? "developed JPEG" : "postprocessed photo",
+               (g_get_monotonic_time() - burst->start_time) / 1000.0);
 }
 
+// Lets the UI stop waiting for a photo that will never come
 static void
-process_image_for_capture(const uint8_t *image, int count)
+capture_failed(struct capture_burst *burst)
 {
-        time_t rawtime;
-        time(&rawtime);
-        struct tm tim = *(localtime(&rawtime));
-
-        char datetime[20] = { 0 };
-        strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tim);
-
-        char fname[255];
-        sprintf(fname, "%s/%d.dng", burst_dir, count);
-
-        TIFF *tif = TIFFOpen(fname, "w");
-        if (!tif) {
-                printf("Could not open tiff\n");
-        }
-
-        // Define TIFF thumbnail
-        TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 1);
-        TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, mode.width >> 4);
-        TIFFSetField(tif, TIFFTAG_IMAGELENGTH, mode.height >> 4);
-        TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
-        TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-        TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-        TIFFSetField(tif, TIFFTAG_MAKE, mp_get_device_make());
-        TIFFSetField(tif, TIFFTAG_MODEL, mp_get_device_model());
-        uint16_t orientation;
-        if (camera_rotation == 0) {
-                orientation = camera->mirrored ? ORIENTATION_TOPRIGHT :
-                                                 ORIENTATION_TOPLEFT;
-        } else if (camera_rotation == 90) {
-                orientation = camera->mirrored ? ORIENTATION_RIGHTBOT :
-                                                 ORIENTATION_LEFTBOT;
-        } else if (camera_rotation == 180) {
-                orientation = camera->mirrored ? ORIENTATION_BOTLEFT :
-                                                 ORIENTATION_BOTRIGHT;
-        } else {
-                orientation = camera->mirrored ? ORIENTATION_LEFTTOP :
-                                                 ORIENTATION_RIGHTTOP;
-        }
-        TIFFSetField(tif, TIFFTAG_ORIENTATION, orientation);
-        TIFFSetField(tif, TIFFTAG_DATETIME, datetime);
-        TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
-        TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-        TIFFSetField(tif, TIFFTAG_SOFTWARE, "Megapixels");
-        long sub_offset = 0;
-        TIFFSetField(tif, TIFFTAG_SUBIFD, 1, &sub_offset);
-        TIFFSetField(tif, TIFFTAG_DNGVERSION, "\001\001\0\0");
-        TIFFSetField(tif, TIFFTAG_DNGBACKWARDVERSION, "\001\0\0\0");
-        char uniquecameramodel[255];
-        sprintf(uniquecameramodel,
-                "%s %s",
-                mp_get_device_make(),
-                mp_get_device_model());
-        TIFFSetField(tif, TIFFTAG_UNIQUECAMERAMODEL, uniquecameramodel);
-        if (camera->colormatrix[0]) {
-                TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, camera->colormatrix);
-        } else {
-                TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, colormatrix_srgb);
-        }
-        if (camera->forwardmatrix[0]) {
-                TIFFSetField(tif, TIFFTAG_FORWARDMATRIX1, 9, camera->forwardmatrix);
-        }
-        static const float neutral[] = { 1.0, 1.0, 1.0 };
-        TIFFSetField(tif, TIFFTAG_ASSHOTNEUTRAL, 3, neutral);
-        TIFFSetField(tif, TIFFTAG_CALIBRATIONILLUMINANT1, 21);
-        // Write black thumbnail, only windows uses this
-        {
-                unsigned char *buf =
-                        (unsigned char *)calloc(1, (mode.width >> 4) * 3);
-                for (int row = 0; row < (mode.height >> 4); row++) {
-                        TIFFWriteScanline(tif, buf, row, 0);
-                }
-                free(buf);
-        }
-        TIFFWriteDirectory(tif);
-
-        // Define main photo
-        TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 0);
-        TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, mode.width);
-        TIFFSetField(tif, TIFFTAG_IMAGELENGTH, mode.height);
-        TIFFSetField(tif,
-                     TIFFTAG_BITSPERSAMPLE,
-                     mp_pixel_format_bits_per_pixel(mode.pixel_format));
-        TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
-        TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
-        TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-        static const short cfapatterndim[] = { 2, 2 };
-        TIFFSetField(tif, TIFFTAG_CFAREPEATPATTERNDIM, cfapatterndim);
-#if (TIFFLIB_VERSION < 20201219) && !LIBTIFF_CFA_PATTERN
-        TIFFSetField(tif,
-                     TIFFTAG_CFAPATTERN,
-                     mp_pixel_format_cfa_pattern(mode.pixel_format));
-#else
-        TIFFSetField(tif,
-                     TIFFTAG_CFAPATTERN,
-                     4,
-                     mp_pixel_format_cfa_pattern(mode.pixel_format));
-#endif
-        printf("TIFF version %d\n", TIFFLIB_VERSION);
-        int whitelevel = camera->whitelevel;
-        if (!whitelevel) {
-                whitelevel =
-                        (1 << mp_pixel_format_pixel_depth(mode.pixel_format)) - 1;
-        }
-        TIFFSetField(tif, TIFFTAG_WHITELEVEL, 1, &whitelevel);
-        if (camera->blacklevel) {
-                const float blacklevel = camera->blacklevel;
-                TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 1, &blacklevel);
-        }
-        TIFFCheckpointDirectory(tif);
-        printf("Writing frame to %s\n", fname);
-
-        uint8_t *output_image = (uint8_t *)image;
-
-        // Repack 10-bit image from sensor format into a sequencial format
-        if (mp_pixel_format_bits_per_pixel(mode.pixel_format) == 10) {
-                output_image = malloc(mp_pixel_format_width_to_bytes(
-                                              mode.pixel_format, mode.width) *
-                                      mode.height);
-
-                repack_image_sequencial(image, output_image, &mode);
-        }
-
-        for (int row = 0; row < mode.height; row++) {
-                TIFFWriteScanline(
-                        tif,
-                        (void *)output_image +
-                                (row * mp_pixel_format_width_to_bytes(
-                                               mode.pixel_format, mode.width)),
-                        row,
-                        0);
-        }
-        TIFFWriteDirectory(tif);
-
-        if (output_image != image)
-                free(output_image);
-
-        // Add an EXIF block to the tiff
-        TIFFCreateEXIFDirectory(tif);
-        // 1 = manual, 2 = full auto, 3 = aperture priority, 4 = shutter priority
-        if (!exposure_is_manual) {
-                TIFFSetField(tif, EXIFTAG_EXPOSUREPROGRAM, 2);
-        } else {
-                TIFFSetField(tif, EXIFTAG_EXPOSUREPROGRAM, 1);
-        }
-
-        TIFFSetField(tif,
-                     EXIFTAG_EXPOSURETIME,
-                     (mode.frame_interval.numerator /
-                      (float)mode.frame_interval.denominator) /
-                             ((float)mode.height / (float)exposure));
-        if (camera->iso_min && camera->iso_max) {
-                uint16_t isospeed = remap(
-                        gain - 1, 0, gain_max, camera->iso_min, camera->iso_max);
-                TIFFSetField(tif, EXIFTAG_ISOSPEEDRATINGS, 1, &isospeed);
-        }
-        if (!camera->has_flash) {
-                // No flash function
-                TIFFSetField(tif, EXIFTAG_FLASH, 0x20);
-        } else if (flash_enabled) {
-                // Flash present and fired
-                TIFFSetField(tif, EXIFTAG_FLASH, 0x1);
-        } else {
-                // Flash present but not fired
-                TIFFSetField(tif, EXIFTAG_FLASH, 0x0);
-        }
-
-        TIFFSetField(tif, EXIFTAG_DATETIMEORIGINAL, datetime);
-        TIFFSetField(tif, EXIFTAG_DATETIMEDIGITIZED, datetime);
-        if (camera->fnumber) {
-                TIFFSetField(tif, EXIFTAG_FNUMBER, camera->fnumber);
-        }
-        if (camera->focallength) {
-                TIFFSetField(tif, EXIFTAG_FOCALLENGTH, camera->focallength);
-        }
-        if (camera->focallength && camera->cropfactor) {
-                TIFFSetField(tif,
-                             EXIFTAG_FOCALLENGTHIN35MMFILM,
-                             (short)(camera->focallength * camera->cropfactor));
-        }
-        uint64_t exif_offset = 0;
-        TIFFWriteCustomDirectory(tif, &exif_offset);
-        TIFFFreeDirectory(tif);
-
-        // Update exif pointer
-        TIFFSetDirectory(tif, 0);
-        TIFFSetField(tif, TIFFTAG_EXIFIFD, exif_offset);
-        TIFFRewriteDirectory(tif);
-
-        TIFFClose(tif);
+        g_printerr("Could not process the burst in %s\n", burst->dir);
+        g_clear_object(&burst->thumb);
+        mp_main_capture_completed(NULL, NULL);
+        free(burst);
 }
 
 static void
-post_process_finished(GSubprocess *proc, GAsyncResult *res, GdkTexture *thumb)
+post_process_finished(GSubprocess *proc,
+                      GAsyncResult *res,
+                      struct capture_burst *burst)
 {
-        char *stdout;
+        char *stdout = NULL;
         g_subprocess_communicate_utf8_finish(proc, res, &stdout, NULL, NULL);
+        if (!stdout || stdout[0] == '\0') {
+                g_free(stdout);
+                capture_failed(burst);
+                return;
+        }
 
         // The last line contains the file name
         int end = strlen(stdout);
@@ -687,159 +742,651 @@ post_process_finished(GSubprocess *proc, GAsyncResult *res, GdkTexture *thumb)
                 --path;
         } while (path > stdout);
 
-        mp_main_capture_completed(thumb, path);
+        print_capture_latency(burst);
+        mp_main_capture_completed(burst->thumb, path);
+        free(burst);
 }
 
 static void
-process_capture_burst(GdkTexture *thumb)
+run_postprocessor(struct capture_burst *burst)
 {
-        time_t rawtime;
-        time(&rawtime);
-        struct tm tim = *(localtime(&rawtime));
-
-        char timestamp[30];
-        strftime(timestamp, 30, "%Y%m%d%H%M%S", &tim);
+        char *postprocessor = g_settings_get_string(settings, "postprocessor");
 
-        if (g_get_user_special_dir(G_USER_DIRECTORY_PICTURES) != NULL) {
-                sprintf(capture_fname,
-                        "%s/IMG%s",
-                        g_get_user_special_dir(G_USER_DIRECTORY_PICTURES),
-                        timestamp);
-        } else if (getenv("XDG_PICTURES_DIR") != NULL) {
-                sprintf(capture_fname,
-                        "%s/IMG%s",
-                        getenv("XDG_PICTURES_DIR"),
-                        timestamp);
-        } else {
-                sprintf(capture_fname,
-                        "%s/Pictures/IMG%s",
-                        getenv("HOME"),
-                        timestamp);
+        // The builtin developer only handles Bayer frames, the packaged
+        // script takes the others
+        if (postprocessor[0] == '\0' ||
+            strcmp(postprocessor, MP_PROCESSOR_BUILTIN) == 0) {
+                g_free(postprocessor);
+                postprocessor =
+                        g_strdup_printf("%s/megapixels/postprocess.sh", DATADIR);
         }
 
-        bool save_dng = g_settings_get_boolean(settings, "save-raw");
-        char *postprocessor = g_settings_get_string(settings, "postprocessor");
-
         char save_dng_s[2] = "0";
-        if (save_dng) {
+        if (burst->save_dng) {
                 save_dng_s[0] = '1';
         }
 
         // Start post-processing the captured burst
         g_print("Post process %s to %s.ext (save-dng %s)\n",
-                burst_dir,
-                capture_fname,
+                burst->dir,
+                burst->target,
                 save_dng_s);
         g_autoptr(GError) error = NULL;
         GSubprocess *proc = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE,
                                              &error,
                                              postprocessor,
-                                             burst_dir,
-                                             capture_fname,
+                                             burst->dir,
+                                             burst->target,
                                              save_dng_s,
                                              NULL);
+        g_free(postprocessor);
 
         if (!proc) {
                 g_printerr("Failed to spawn postprocess process: %s\n",
                            error->message);
+                capture_failed(burst);
                 return;
         }
 
         g_subprocess_communicate_utf8_async(
-                proc, NULL, NULL, (GAsyncReadyCallback)post_process_finished, thumb);
+                proc,
+                NULL,
+                NULL,
+                (GAsyncReadyCallback)post_process_finished,
+                burst);
 }
 
+// Does what the postprocessor script does after developing the photo
 static void
-process_image(MPPipeline *pipeline, const MPBuffer *buffer)
+finish_developed_burst(MPPipeline *pipeline, struct capture_burst **_burst)
 {
-#ifdef PROFILE_PROCESS
-        clock_t t1 = clock();
-#endif
+        struct capture_burst *burst = *_burst;
+
+        if (burst->save_dng) {
+                char raw[270];
+                if (burst->merge) {
+                        sprintf(raw, "%s/merged.dng", burst->dir);
+                } else {
+                        sprintf(raw,
+                                "%s/%d.dng",
+                                burst->dir,
+                                burst->develop_frame);
+                }
+
+                char target[260];
+                sprintf(target, "%s.dng", burst->target);
+
+                // A rename when the burst is next to the photos, only copied
+                // when it had to be staged in /tmp
+                g_autoptr(GFile) src = g_file_new_for_path(raw);
+                g_autoptr(GFile) dst = g_file_new_for_path(target);
+                g_autoptr(GError) error = NULL;
+                if (!g_file_move(src,
+                                 dst,
+                                 G_FILE_COPY_NONE,
+                                 NULL,
+                                 NULL,
+                                 NULL,
+                                 &error)) {
+                        g_printerr("Could not save %s: %s\n",
+                                   target,
+                                   error->message);
+                }
+        }
+
+        // Clean up the staging dir containing the burst
+        remove_burst_dir(burst->dir);
+
+        char path[260];
+        sprintf(path, "%s.jpg", burst->target);
+
+        print_capture_latency(burst);
+        mp_main_capture_completed(burst->thumb, path);
+        free(burst);
+}
+
+static void
+process_capture_burst(struct capture_burst *burst)
+{
+        if (burst->develop) {
+                mp_pipeline_invoke(develop_pipeline,
+                                   (MPPipelineCallback)finish_developed_burst,
+                                   &burst,
+                                   sizeof(struct capture_burst *));
+        } else {
+                run_postprocessor(burst);
+        }
+}
+
+static void
+dng_written(MPPipeline *pipeline, struct capture_burst **_burst)
+{
+        struct capture_burst *burst = *_burst;
+
+        // Only start post-processing once every frame of the burst is on disk
+        if (--burst->frames_remaining == 0) {
+                process_capture_burst(burst);
+        }
+}
+
+static void
+on_dng_written(bool success, struct capture_burst *burst)
+{
+        mp_pipeline_invoke(pipeline,
+                           (MPPipelineCallback)dng_written,
+                           &burst,
+                           sizeof(struct capture_burst *));
+}
+
+struct burst_frame_args {
+        struct capture_burst *burst;
+        GBytes *image;
+        struct mp_dng_info info;
+};
+
+static void
+develop_image(struct capture_burst *burst,
+              GBytes *image,
+              const struct mp_dng_info *info)
+{
+        char path[260];
+        sprintf(path, "%s.jpg", burst->target);
+
+        gint64 start = g_get_monotonic_time();
+        bool success = mp_develop_jpeg(path,
+                                       g_bytes_get_data(image, NULL),
+                                       info,
+                                       mp_workers_get_num_threads());
+        printf("Developed %s in %fms\n",
+               path,
+               (g_get_monotonic_time() - start) / 1000.0);
+        mp_trace_span("develop_jpeg", info->sequence, start);
+
+        on_dng_written(success, burst);
+}
+
+static void
+develop_frame(MPPipeline *pipeline, const struct burst_frame_args *args)
+{
+        develop_image(args->burst, args->image, &args->info);
+        g_bytes_unref(args->image);
+}
+
+static void
+merge_frame(MPPipeline *pipeline, const struct burst_frame_args *args)
+{
+        struct capture_burst *burst = args->burst;
+        const MPMode *mode = &args->info.mode;
+
+        // The first frame of the burst is the reference the others are
+        // aligned to
+        if (!burst->merger) {
+                burst->merger = mp_burst_merge_new(
+                        mode->width,
+                        mode->height,
+                        mp_pixel_format_pixel_depth(mode->pixel_format),
+                        mp_workers_get_num_threads());
+                burst->merge_info = args->info;
+        }
+
+        mp_burst_merge_add_frame(
+                burst->merger, g_bytes_get_data(args->image, NULL), mode);
+        g_bytes_unref(args->image);
+}
+
+static void
+merge_finish(MPPipeline *pipeline, struct capture_burst **_burst)
+{
+        struct capture_burst *burst = *_burst;
+        const MPMode *mode = &burst->merge_info.mode;
+
+        MPBurstMergeStats stats;
+        mp_burst_merge_get_stats(burst->merger, &stats);
+        printf("Merged %d frames, %.0f%% of tiles accepted, "
+               "align %fms, merge %fms\n",
+               stats.frames_merged,
+               stats.tiles_accepted * 100,
+               stats.align_time * 1000,
+               stats.merge_time * 1000);
+
+        size_t size = mode->width * mode->height * sizeof(uint16_t);
+        uint16_t *merged = malloc(size);
+        mp_burst_merge_get_result(burst->merger, merged);
+        mp_burst_merge_free(burst->merger);
+        burst->merger = NULL;
+
+        struct mp_dng_info info = burst->merge_info;
+        info.is_merged = true;
+        info.preview = burst->dng_preview;
+        info.preview_width = burst->dng_preview_width;
+        info.preview_height = burst->dng_preview_height;
+
+        char fname[270];
+        sprintf(fname, "%s/merged.dng", burst->dir);
+
+        GBytes *image = g_bytes_new_take(merged, size);
+        mp_dng_writer_write(
+                fname, image, &info, (MPDngWriterCallback)on_dng_written, burst);
+
+        if (burst->develop) {
+                develop_image(burst, image, &info);
+        }
+
+        g_bytes_unref(image);
+        g_clear_pointer(&burst->dng_preview, g_bytes_unref);
+}
+
+// Largest side of the thumbnail shown in the UI
+#define THUMB_SIZE 256
+
+/*
+ * Renders the thumbnails of the burst from the preview of its last frame.
+ * They're read back in finish_thumbnails, which is queued after this frame
+ * so the GPU has time to catch up.
+ */
+static void
+start_thumbnails(struct capture_burst *burst, GLuint texture, uint32_t sequence)
+{
+        int64_t trace_start = mp_trace_now();
+
+        // Same orientation as the preview, with the rows read back top down
+        static const GLfloat flip_y[9] = {
+                // clang-format off
+                1,  0, 0,
+                0, -1, 0,
+                0,  0, 1,
+                // clang-format on
+        };
+
+        uint32_t scale = MAX(output_buffer_width, output_buffer_height);
+        burst->thumb_width = MAX(1, output_buffer_width * THUMB_SIZE / scale);
+        burst->thumb_height = MAX(1, output_buffer_height * THUMB_SIZE / scale);
+        burst->thumb_readback = gl_thumbnailer_render(thumbnailer,
+                                                      texture,
+                                                      burst->thumb_width,
+                                                      burst->thumb_height,
+                                                      flip_y);
+
+        if (burst->merge) {
+                // Undo the rotation and mirroring of the preview, as the DNG is
+                // stored the way the sensor reads it out
+                GLfloat transform[9];
+                gles2_debayer_get_transform(
+                        camera->rotate, camera->mirrored, transform);
+                GLfloat inverse[9];
+                for (int i = 0; i < 3; ++i) {
+                        for (int j = 0; j < 3; ++j) {
+                                inverse[i * 3 + j] = transform[j * 3 + i];
+                        }
+                }
+
+                burst->dng_preview_width = mode.width >> 4;
+                burst->dng_preview_height = mode.height >> 4;
+                burst->dng_preview_readback =
+                        gl_thumbnailer_render(thumbnailer,
+                                              texture,
+                                              burst->dng_preview_width,
+                                              burst->dng_preview_height,
+                                              inverse);
+        }
+
+        // The thumbnailer binds its own program and quad
+        gles2_debayer_use(gles2_debayer);
+        check_gl();
+
+        mp_trace_span("thumbnail_render", sequence, trace_start);
+}
+
+static void
+finish_thumbnails(MPPipeline *pipeline, struct capture_burst **_burst)
+{
+        struct capture_burst *burst = *_burst;
+
+        GBytes *thumb = gl_thumbnail_finish(burst->thumb_readback);
+        burst->thumb_readback = NULL;
+
+        burst->thumb = gdk_memory_texture_new(burst->thumb_width,
+                                              burst->thumb_height,
+                                              GDK_MEMORY_R8G8B8A8,
+                                              thumb,
+                                              burst->thumb_width * sizeof(uint32_t));
+        g_bytes_unref(thumb);
+
+        if (burst->dng_preview_readback) {
+                GBytes *rgba = gl_thumbnail_finish(burst->dng_preview_readback);
+                burst->dng_preview_readback = NULL;
+
+                // The DNG preview is stored as RGB
+                size_t num_pixels =
+                        burst->dng_preview_width * burst->dng_preview_height;
+                const uint8_t *src = g_bytes_get_data(rgba, NULL);
+                uint8_t *dst = g_malloc(num_pixels * 3);
+                for (size_t i = 0; i < num_pixels; ++i) {
+                        dst[i * 3 + 0] = src[i * 4 + 0];
+                        dst[i * 3 + 1] = src[i * 4 + 1];
+                        dst[i * 3 + 2] = src[i * 4 + 2];
+                }
+                g_bytes_unref(rgba);
+                burst->dng_preview = g_bytes_new_take(dst, num_pixels * 3);
+        }
+
+        // All frames of the burst have been queued for merging by now
+        if (burst->merge) {
+                mp_pipeline_invoke(develop_pipeline,
+                                   (MPPipelineCallback)merge_finish,
+                                   &burst,
+                                   sizeof(struct capture_burst *));
+        }
+
+        // Post-processing was held back until the thumbnail exists
+        dng_written(pipeline, &burst);
+}
+
+static void
+release_held_frame(MPFrame *frame)
+{
+        mp_frame_unref(frame);
+
+        g_mutex_lock(&held_frames_mutex);
+        if (--num_held_frames == 0) {
+                g_cond_broadcast(&held_frames_cond);
+        }
+        g_mutex_unlock(&held_frames_mutex);
+}
+
+/*
+ * The mapped buffer of the frame, which goes back to the io pipeline once the
+ * bytes are released. The io pipeline drops preview frames while too many of
+ * its buffers are held like this.
+ */
+static GBytes *
+hold_frame(MPFrame *frame)
+{
+        g_mutex_lock(&held_frames_mutex);
+        ++num_held_frames;
+        g_mutex_unlock(&held_frames_mutex);
 
         size_t size =
                 (mp_pixel_format_width_to_bytes(mode.pixel_format, mode.width) +
                  mp_pixel_format_width_to_padding(mode.pixel_format, mode.width)) *
                 mode.height;
-        uint8_t *image = malloc(size);
-        memcpy(image, buffer->data, size);
-        mp_io_pipeline_release_buffer(buffer->index);
-
-        MPZBarImage *zbar_image = mp_zbar_image_new(image,
-                                                    mode.pixel_format,
-                                                    mode.width,
-                                                    mode.height,
-                                                    camera_rotation,
-                                                    camera->mirrored);
-        mp_zbar_pipeline_process_image(mp_zbar_image_ref(zbar_image));
-
-#ifdef PROFILE_PROCESS
-        clock_t t2 = clock();
-#endif
+        return g_bytes_new_with_free_func(mp_frame_get_data(frame),
+                                          size,
+                                          (GDestroyNotify)release_held_frame,
+                                          mp_frame_ref(frame));
+}
 
-        GdkTexture *thumb = process_image_for_preview(image);
+static void
+process_image_for_capture(MPFrame *frame,
+                          uint32_t sequence,
+                          struct capture_burst *burst,
+                          int count)
+{
+        GBytes *image = hold_frame(frame);
+
+        struct mp_dng_info info = {
+                .camera = camera,
+                .mode = mode,
+                .rotation = camera_rotation,
+                .exposure_is_manual = exposure_is_manual,
+                .exposure = exposure,
+                .gain = gain,
+                .gain_max = gain_max,
+                .neutral = { neutral[0], neutral[1], neutral[2] },
+                .flash_enabled = flash_enabled,
+                .compress = burst->compress_dng,
+                .sequence = sequence,
+        };
+        time(&info.time);
+
+        char fname[270];
+        sprintf(fname, "%s/%d.dng", burst->dir, count);
+
+        mp_dng_writer_write(
+                fname, image, &info, (MPDngWriterCallback)on_dng_written, burst);
+
+        if (burst->merge) {
+                struct burst_frame_args args = {
+                        .burst = burst,
+                        .image = g_bytes_ref(image),
+                        .info = info,
+                };
+                mp_pipeline_invoke(develop_pipeline,
+                                   (MPPipelineCallback)merge_frame,
+                                   &args,
+                                   sizeof(struct burst_frame_args));
+        } else if (burst->develop && count == burst->develop_frame) {
+                // Developing takes long enough that the camera would be short
+                // of a buffer, or the switch back to the preview would wait
+                size_t size;
+                const void *data = g_bytes_get_data(image, &size);
+                struct burst_frame_args args = {
+                        .burst = burst,
+                        .image = g_bytes_new(data, size),
+                        .info = info,
+                };
+                mp_pipeline_invoke(develop_pipeline,
+                                   (MPPipelineCallback)develop_frame,
+                                   &args,
+                                   sizeof(struct burst_frame_args));
+        }
+
+        g_bytes_unref(image);
+}
+
+static void
+process_image(MPFrame *frame, bool show_preview)
+{
+        uint32_t sequence = mp_frame_get_buffer(frame)->sequence;
+        int64_t trace_start = mp_trace_now();
+
+        // The image is read straight from the mapped V4L2 buffer, which is
+        // handed back to the io pipeline once the last reference is dropped.
+        const uint8_t *image = mp_frame_get_data(frame);
+
+        // Frames that were already shown would make the preview jump back,
+        // and zbar has seen them too
+        GLuint preview_texture = last_preview_texture;
+        if (show_preview || preview_texture == 0) {
+                MPZBarImage *zbar_image = mp_zbar_image_new(
+                        mp_frame_ref(frame), camera_rotation, camera->mirrored);
+                mp_zbar_pipeline_process_image(zbar_image);
+
+                int64_t preview_start = mp_trace_now();
+                preview_texture = process_image_for_preview(image, sequence);
+                mp_trace_span("preview", sequence, preview_start);
+        }
 
         if (captures_remaining > 0) {
                 int count = burst_length - captures_remaining;
                 --captures_remaining;
 
-                process_image_for_capture(image, count);
+                struct capture_burst *burst = current_burst;
+
+                int64_t capture_start = mp_trace_now();
+                process_image_for_capture(frame, sequence, burst, count);
+                mp_trace_span("capture", sequence, capture_start);
 
                 if (captures_remaining == 0) {
-                        assert(thumb);
-                        process_capture_burst(thumb);
-                } else {
-                        assert(!thumb);
+                        current_burst = NULL;
+
+                        // Held until the thumbnails have been read back
+                        ++burst->frames_remaining;
+                        start_thumbnails(burst, preview_texture, sequence);
+                        mp_pipeline_invoke(pipeline,
+                                           (MPPipelineCallback)finish_thumbnails,
+                                           &burst,
+                                           sizeof(struct capture_burst *));
+
+                        // Preview frames sent before the capture started
+                        // don't end it
+                        atomic_store(&is_capturing, false);
                 }
-        } else {
-                assert(!thumb);
         }
 
-        mp_zbar_image_unref(zbar_image);
+        mp_frame_unref(frame);
 
-        ++frames_processed;
-        if (captures_remaining == 0) {
-                is_capturing = false;
-        }
+        mp_trace_span("process_image", sequence, trace_start);
+}
 
-#ifdef PROFILE_PROCESS
-        clock_t t3 = clock();
-        printf("process_image %fms, step 1:%fms, step 2:%fms\n",
-               (float)(t3 - t1) / CLOCKS_PER_SEC * 1000,
-               (float)(t2 - t1) / CLOCKS_PER_SEC * 1000,
-               (float)(t3 - t2) / CLOCKS_PER_SEC * 1000);
-#endif
+static void
+process_captured_image(MPPipeline *pipeline, MPFrame **frame)
+{
+        process_image(*frame, true);
+}
+
+static void
+process_shown_image(MPPipeline *pipeline, MPFrame **frame)
+{
+        process_image(*frame, false);
+}
+
+static void
+process_preview_image(MPPipeline *pipeline, const void *data)
+{
+        // Frames that came in since this was sent replaced the one that was
+        // pending, only the newest is left
+        MPFrame *frame = mp_mailbox_take(preview_mailbox);
+        if (frame) {
+                process_image(frame, true);
+        }
 }
 
 void
-mp_process_pipeline_process_image(MPBuffer buffer)
+mp_process_pipeline_process_image(MPFrame *frame)
 {
-        // If we haven't processed the previous frame yet, drop this one
-        if (frames_received != frames_processed && !is_capturing) {
-                mp_io_pipeline_release_buffer(buffer.index);
+        // Every frame of a burst is needed, queue them all up
+        if (atomic_load(&is_capturing)) {
+                mp_pipeline_invoke(pipeline,
+                                   (MPPipelineCallback)process_captured_image,
+                                   &frame,
+                                   sizeof(MPFrame *));
                 return;
         }
 
-        ++frames_received;
+        // Otherwise only the newest frame is processed, if the previous one is
+        // still waiting it's released right away. The drop is traced under the
+        // sequence of the frame that replaced it.
+        uint32_t sequence = mp_frame_get_buffer(frame)->sequence;
+        if (mp_mailbox_put(preview_mailbox, frame)) {
+                mp_pipeline_invoke(pipeline, process_preview_image, NULL, 0);
+        } else {
+                mp_trace_drop("preview_replaced", sequence);
+        }
+}
 
+void
+mp_process_pipeline_capture_image(MPFrame *frame)
+{
         mp_pipeline_invoke(pipeline,
-                           (MPPipelineCallback)process_image,
-                           &buffer,
-                           sizeof(MPBuffer));
+                           (MPPipelineCallback)process_shown_image,
+                           &frame,
+                           sizeof(MPFrame *));
+}
+
+static uint64_t
+get_free_space(const char *path)
+{
+        struct statvfs st;
+        if (statvfs(path, &st) != 0) {
+                // Unknown, try to use it anyway
+                return UINT64_MAX;
+        }
+        return (uint64_t)st.f_bavail * st.f_frsize;
+}
+
+/*
+ * Makes the directory the frames of a burst are written to, on the same file
+ * system as the photos. The kept frame is then renamed into place instead of
+ * copied, and large bursts don't fill up the RAM when /tmp is a tmpfs. /tmp is
+ * only used when the pictures directory doesn't have room for the burst.
+ */
+static bool
+make_burst_dir(const char *pictures_dir, uint64_t burst_size, char *dir)
+{
+        g_mkdir_with_parents(pictures_dir, 0755);
+
+        const char *parents[] = { pictures_dir, g_get_tmp_dir() };
+        // Only check the free space on the first try, if neither has room the
+        // burst still goes next to the photos and the writes fail there
+        for (int check = 1; check >= 0; --check) {
+                for (int i = 0; i < 2; ++i) {
+                        if (check && get_free_space(parents[i]) < burst_size) {
+                                printf("Not enough space for the burst in %s\n",
+                                       parents[i]);
+                                continue;
+                        }
+
+                        sprintf(dir, "%s/" BURST_DIR_PREFIX "XXXXXX", parents[i]);
+                        if (mkdtemp(dir)) {
+                                return true;
+                        }
+                        g_printerr("Could not make capture directory %s: %s\n",
+                                   dir,
+                                   strerror(errno));
+                }
+        }
+        return false;
 }
 
 static void
 capture()
 {
-        char template[] = "/tmp/megapixels.XXXXXX";
-        char *tempdir;
-        tempdir = mkdtemp(template);
+        current_burst = calloc(1, sizeof(struct capture_burst));
+        current_burst->frames_remaining = burst_length;
+        current_burst->start_time = g_get_monotonic_time();
 
-        if (tempdir == NULL) {
-                g_printerr("Could not make capture directory %s\n", template);
-                exit(EXIT_FAILURE);
+        time_t rawtime;
+        time(&rawtime);
+        struct tm tim = *(localtime(&rawtime));
+
+        char timestamp[30];
+        strftime(timestamp, 30, "%Y%m%d%H%M%S", &tim);
+
+        g_autofree char *pictures_dir = get_pictures_dir();
+        snprintf(current_burst->target,
+                 sizeof(current_burst->target),
+                 "%s/IMG%s",
+                 pictures_dir,
+                 timestamp);
+
+        current_burst->save_dng = g_settings_get_boolean(settings, "save-raw");
+        current_burst->compress_dng =
+                g_settings_get_boolean(settings, "compress-raw");
+
+        // Merge the frames into one with less noise, written as merged.dng
+        if (burst_length > 1 && g_settings_get_boolean(settings, "merge-burst")) {
+                current_burst->merge = true;
+                ++current_burst->frames_remaining;
+        }
+
+        // The postprocessor script is only used when one is picked explicitly,
+        // and for frames that aren't Bayer
+        char *postprocessor = g_settings_get_string(settings, "postprocessor");
+        if ((postprocessor[0] == '\0' ||
+             strcmp(postprocessor, MP_PROCESSOR_BUILTIN) == 0) &&
+            mp_pixel_format_cfa_pattern(mode.pixel_format)) {
+                current_burst->develop = true;
+                // Same frame as postprocess.sh picks
+                current_burst->develop_frame = MIN(1, burst_length - 1);
+                ++current_burst->frames_remaining;
         }
+        g_free(postprocessor);
 
-        strcpy(burst_dir, tempdir);
+        // Every frame of the burst, the merged frame in 16 bits and room for
+        // the photo made from them
+        uint64_t frame_size =
+                (uint64_t)mp_pixel_format_width_to_bytes(mode.pixel_format,
+                                                         mode.width) *
+                mode.height;
+        uint64_t burst_size = (burst_length + 1) * frame_size;
+        if (current_burst->merge) {
+                burst_size += (uint64_t)mode.width * mode.height * 2;
+        }
+
+        if (!make_burst_dir(pictures_dir, burst_size, current_burst->dir)) {
+                exit(EXIT_FAILURE);
+        }
 
         captures_remaining = burst_length;
 }
@@ -847,7 +1394,7 @@ capture()
 void
 mp_process_pipeline_capture()
 {
-        is_capturing = true;
+        atomic_store(&is_capturing, true);
 
         mp_pipeline_invoke(pipeline, capture, NULL, 0);
 }
@@ -864,7 +1411,7 @@ on_output_changed(bool format_changed)
                 output_buffer_height = tmp;
         }
 
-        for (size_t i = 0; i < NUM_BUFFERS; ++i) {
+        for (size_t i = 0; i < MP_SWAP_CHAIN_SIZE; ++i) {
                 glBindTexture(GL_TEXTURE_2D, output_buffers[i].texture_id);
                 glTexImage2D(GL_TEXTURE_2D,
                              0,
@@ -877,6 +1424,39 @@ on_output_changed(bool format_changed)
                              NULL);
         }
 
+        // Allocate the input textures for the new mode. Without unpack buffers
+        // the row padding has to be uploaded as part of the texture.
+        uint32_t row_length =
+                mp_pixel_format_width_to_bytes(mode.pixel_format, mode.width);
+        uint32_t padding_bytes =
+                mp_pixel_format_width_to_padding(mode.pixel_format, mode.width);
+        input_stride = row_length + padding_bytes;
+        input_texture_width = use_unpack_buffers ? row_length : input_stride;
+
+        for (size_t i = 0; i < NUM_INPUT_BUFFERS; ++i) {
+                glBindTexture(GL_TEXTURE_2D, input_textures[i]);
+                glTexImage2D(GL_TEXTURE_2D,
+                             0,
+                             GL_LUMINANCE,
+                             input_texture_width,
+                             mode.height,
+                             0,
+                             GL_LUMINANCE,
+                             GL_UNSIGNED_BYTE,
+                             NULL);
+
+                if (use_unpack_buffers) {
+                        glBindBuffer(GL_PIXEL_UNPACK_BUFFER,
+                                     input_unpack_buffers[i]);
+                        glBufferData(GL_PIXEL_UNPACK_BUFFER,
+                                     input_stride * mode.height,
+                                     NULL,
+                                     GL_STREAM_DRAW);
+                        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                }
+        }
+        check_gl();
+
         glBindTexture(GL_TEXTURE_2D, 0);
 
         // Create new gles2_debayer on format change
@@ -896,6 +1476,7 @@ on_output_changed(bool format_changed)
                 output_buffer_height,
                 mode.width,
                 mode.height,
+                input_texture_width - row_length,
                 camera->rotate,
                 camera->mirrored,
                 camera->previewmatrix[0] == 0 ? NULL : camera->previewmatrix,
@@ -936,6 +1517,8 @@ update_state(MPPipeline *pipeline, const struct mp_process_pipeline_state *state
         exposure_is_manual = state->exposure_is_manual;
         exposure = state->exposure;
 
+        memcpy(neutral, state->neutral, sizeof(neutral));
+
         if (output_changed) {
                 camera_rotation = mod(camera->rotate - device_rotation, 360);
 
@@ -2,6 +2,7 @@
 
 #include "camera.h"
 #include "camera_config.h"
+#include "frame.h"
 #include <gtk/gtk.h>
 
 typedef struct _GdkSurface GdkSurface;
@@ -24,13 +25,18 @@ struct mp_process_pipeline_state {
         bool exposure_is_manual;
         int exposure;
 
+        // Estimated white balance, see mp_auto_controls_get_neutral()
+        float neutral[3];
+
         bool has_auto_focus_continuous;
         bool has_auto_focus_start;
 
         bool flash_enabled;
 };
 
-bool mp_process_find_processor(char *script);
+// Postprocessor setting for developing photos without a script
+#define MP_PROCESSOR_BUILTIN "builtin"
+
 void mp_process_find_all_processors(GtkListStore *store);
 
 void mp_process_pipeline_start();
@@ -39,12 +45,22 @@ void mp_process_pipeline_sync();
 
 void mp_process_pipeline_init_gl(GdkSurface *window);
 
-void mp_process_pipeline_process_image(MPBuffer buffer);
+void mp_process_pipeline_process_image(MPFrame *frame);
+// Adds a frame that was already shown to the burst, without previewing it again
+void mp_process_pipeline_capture_image(MPFrame *frame);
 void mp_process_pipeline_capture();
 void mp_process_pipeline_update_state(const struct mp_process_pipeline_state *state);
 
 typedef struct _MPProcessPipelineBuffer MPProcessPipelineBuffer;
 
-void mp_process_pipeline_buffer_ref(MPProcessPipelineBuffer *buf);
-void mp_process_pipeline_buffer_unref(MPProcessPipelineBuffer *buf);
+// The newest debayered preview, only to be called from the GTK thread. The
+// buffer stays valid until the next call, NULL until a frame has been shown.
+MPProcessPipelineBuffer *mp_process_pipeline_get_preview_buffer();
+
 uint32_t mp_process_pipeline_buffer_get_texture_id(MPProcessPipelineBuffer *buf);
+uint32_t mp_process_pipeline_buffer_get_sequence(MPProcessPipelineBuffer *buf);
+// Make the current GL context wait until the buffer has been rendered
+void mp_process_pipeline_buffer_wait(MPProcessPipelineBuffer *buf);
+// Called after drawing from the buffer, so it isn't rendered into again until
+// the draw has finished
+void mp_process_pipeline_buffer_drawn(MPProcessPipelineBuffer *buf);
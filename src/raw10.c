@@ -0,0 +1,298 @@
+#include "raw10.h"
+#include "workers.h"
+
+#include <assert.h>
+#include <glib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define HAVE_NEON_KERNEL
+#include <arm_neon.h>
+#endif
+
+typedef void (*RepackRowFunc)(const uint8_t *src, uint8_t *dst, size_t row_length);
+
+/*
+ * All kernels repack one row at a time. The source row may be followed by
+ * padding, but the destination row is directly followed by the next one, which
+ * might be written by another thread. Kernels therefore never write past
+ * row_length and finish the last groups of a row with the scalar code.
+ */
+
+static inline void
+repack_group(const uint8_t *src, uint8_t *dst)
+{
+        uint8_t lo = src[4];
+
+        dst[0] = src[0];
+        dst[1] = (lo & 0xc0) | (src[1] >> 2);
+        dst[2] = (src[1] << 6) | (lo & 0x30) | (src[2] >> 4);
+        dst[3] = (src[2] << 4) | (lo & 0x0c) | (src[3] >> 6);
+        dst[4] = (src[3] << 2) | (lo & 0x03);
+}
+
+static void
+repack_row_scalar(const uint8_t *src, uint8_t *dst, size_t row_length)
+{
+        for (size_t x = 0; x < row_length; x += 5) {
+                repack_group(src + x, dst + x);
+        }
+}
+
+/*
+ * The SIMD kernels put one 5-byte group in the low bytes of each 64-bit lane
+ * and apply the same shifts and masks as repack_group() to the whole lane.
+ * The low 5 bytes of the result are the repacked group.
+ */
+#define REPACK_LANES(x, SHL, SHR, AND, OR, SET)                                  \
+        OR(OR(OR(OR(AND(x, SET(0x3000000ffULL)),                                \
+                    AND(SHR(x, 24), SET(0xc000ULL))),                            \
+                 OR(AND(SHR(x, 2), SET(0x3f00ULL)),                              \
+                    AND(SHL(x, 14), SET(0xc00000ULL)))),                         \
+              OR(OR(AND(SHR(x, 16), SET(0x300000ULL)),                           \
+                    AND(SHR(x, 4), SET(0xf0000ULL))),                            \
+                 OR(AND(SHL(x, 12), SET(0xf0000000ULL)),                         \
+                    AND(SHR(x, 8), SET(0x0c000000ULL))))),                       \
+           OR(AND(SHR(x, 6), SET(0x03000000ULL)),                                \
+              AND(SHL(x, 10), SET(0xfc00000000ULL))))
+
+#ifdef HAVE_X86_KERNELS
+
+#define SSE2_SET(v) _mm_set1_epi64x(v)
+
+__attribute__((target("sse2"))) static void
+repack_row_sse2(const uint8_t *src, uint8_t *dst, size_t row_length)
+{
+        size_t x = 0;
+
+        // Two groups per iteration, the stores write 8 bytes at x and x + 5
+        for (; x + 13 <= row_length; x += 10) {
+                __m128i v = _mm_unpacklo_epi64(
+                        _mm_loadl_epi64((const __m128i *)(src + x)),
+                        _mm_loadl_epi64((const __m128i *)(src + x + 5)));
+
+                v = REPACK_LANES(v,
+                                 _mm_slli_epi64,
+                                 _mm_srli_epi64,
+                                 _mm_and_si128,
+                                 _mm_or_si128,
+                                 SSE2_SET);
+
+                _mm_storel_epi64((__m128i *)(dst + x), v);
+                _mm_storel_epi64((__m128i *)(dst + x + 5), _mm_unpackhi_epi64(v, v));
+        }
+
+        repack_row_scalar(src + x, dst + x, row_length - x);
+}
+
+#define AVX2_SET(v) _mm256_set1_epi64x(v)
+
+__attribute__((target("avx2"))) static void
+repack_row_avx2(const uint8_t *src, uint8_t *dst, size_t row_length)
+{
+        // Spread the two groups in each 128-bit half over its 64-bit lanes, and
+        // pack the repacked groups together again afterwards
+        static const uint8_t spread_idx[32] = {
+                0, 1, 2, 3, 4, 5, 6, 7, 5, 6, 7, 8, 9, 10, 11, 12,
+                0, 1, 2, 3, 4, 5, 6, 7, 5, 6, 7, 8, 9, 10, 11, 12,
+        };
+        static const uint8_t gather_idx[32] = {
+                0, 1, 2, 3, 4, 8, 9, 10, 11, 12, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+                0, 1, 2, 3, 4, 8, 9, 10, 11, 12, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+        };
+        const __m256i spread = _mm256_loadu_si256((const __m256i *)spread_idx);
+        const __m256i gather = _mm256_loadu_si256((const __m256i *)gather_idx);
+
+        size_t x = 0;
+
+        // Four groups per iteration, the stores write 16 bytes at x and x + 10
+        for (; x + 26 <= row_length; x += 20) {
+                __m256i v = _mm256_inserti128_si256(
+                        _mm256_castsi128_si256(
+                                _mm_loadu_si128((const __m128i *)(src + x))),
+                        _mm_loadu_si128((const __m128i *)(src + x + 10)),
+                        1);
+                v = _mm256_shuffle_epi8(v, spread);
+
+                v = REPACK_LANES(v,
+                                 _mm256_slli_epi64,
+                                 _mm256_srli_epi64,
+                                 _mm256_and_si256,
+                                 _mm256_or_si256,
+                                 AVX2_SET);
+
+                v = _mm256_shuffle_epi8(v, gather);
+
+                _mm_storeu_si128((__m128i *)(dst + x), _mm256_castsi256_si128(v));
+                _mm_storeu_si128((__m128i *)(dst + x + 10),
+                                 _mm256_extracti128_si256(v, 1));
+        }
+
+        repack_row_scalar(src + x, dst + x, row_length - x);
+}
+
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+
+#define NEON_SHL(v, n) vshlq_n_u64(v, n)
+#define NEON_SHR(v, n) vshrq_n_u64(v, n)
+#define NEON_SET(v) vdupq_n_u64(v)
+
+static void
+repack_row_neon(const uint8_t *src, uint8_t *dst, size_t row_length)
+{
+        static const uint8_t spread_idx[16] = {
+                0, 1, 2, 3, 4, 5, 6, 7, 5, 6, 7, 8, 9, 10, 11, 12,
+        };
+        // Indices out of range produce zeroes
+        static const uint8_t gather_idx[16] = {
+                0, 1, 2, 3, 4, 8, 9, 10, 11, 12, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        };
+        const uint8x16_t spread = vld1q_u8(spread_idx);
+        const uint8x16_t gather = vld1q_u8(gather_idx);
+
+        size_t x = 0;
+
+        // Two groups per iteration, the store writes 16 bytes at x
+        for (; x + 16 <= row_length; x += 10) {
+                uint8x16_t in = vqtbl1q_u8(vld1q_u8(src + x), spread);
+                uint64x2_t v = vreinterpretq_u64_u8(in);
+
+                v = REPACK_LANES(
+                        v, NEON_SHL, NEON_SHR, vandq_u64, vorrq_u64, NEON_SET);
+
+                vst1q_u8(dst + x, vqtbl1q_u8(vreinterpretq_u8_u64(v), gather));
+        }
+
+        repack_row_scalar(src + x, dst + x, row_length - x);
+}
+
+#endif
+
+static const RepackRowFunc kernels[MP_RAW10_KERNEL_MAX] = {
+        [MP_RAW10_KERNEL_SCALAR] = repack_row_scalar,
+#ifdef HAVE_X86_KERNELS
+        [MP_RAW10_KERNEL_SSE2] = repack_row_sse2,
+        [MP_RAW10_KERNEL_AVX2] = repack_row_avx2,
+#endif
+#ifdef HAVE_NEON_KERNEL
+        [MP_RAW10_KERNEL_NEON] = repack_row_neon,
+#endif
+};
+
+const char *
+mp_raw10_kernel_name(MPRaw10Kernel kernel)
+{
+        switch (kernel) {
+        case MP_RAW10_KERNEL_SCALAR:
+                return "scalar";
+        case MP_RAW10_KERNEL_SSE2:
+                return "sse2";
+        case MP_RAW10_KERNEL_AVX2:
+                return "avx2";
+        case MP_RAW10_KERNEL_NEON:
+                return "neon";
+        default:
+                return "unknown";
+        }
+}
+
+bool
+mp_raw10_kernel_is_supported(MPRaw10Kernel kernel)
+{
+        if (kernel < 0 || kernel >= MP_RAW10_KERNEL_MAX || !kernels[kernel]) {
+                return false;
+        }
+
+#ifdef HAVE_X86_KERNELS
+        if (kernel == MP_RAW10_KERNEL_SSE2) {
+                return __builtin_cpu_supports("sse2");
+        }
+        if (kernel == MP_RAW10_KERNEL_AVX2) {
+                return __builtin_cpu_supports("avx2");
+        }
+#endif
+
+        return true;
+}
+
+MPRaw10Kernel
+mp_raw10_best_kernel()
+{
+        for (int kernel = MP_RAW10_KERNEL_MAX - 1; kernel > 0; --kernel) {
+                if (mp_raw10_kernel_is_supported(kernel)) {
+                        return kernel;
+                }
+        }
+
+        return MP_RAW10_KERNEL_SCALAR;
+}
+
+struct repack {
+        RepackRowFunc func;
+
+        const uint8_t *src_buf;
+        uint8_t *dst_buf;
+        size_t row_length;
+        size_t src_stride;
+};
+
+static void
+repack_band(struct repack *repack, int y_start, int y_end)
+{
+        for (int y = y_start; y < y_end; ++y) {
+                repack->func(repack->src_buf + y * repack->src_stride,
+                             repack->dst_buf + y * repack->row_length,
+                             repack->row_length);
+        }
+}
+
+void
+mp_raw10_repack_with(MPRaw10Kernel kernel,
+                     int num_threads,
+                     const uint8_t *src_buf,
+                     uint8_t *dst_buf,
+                     const MPMode *mode)
+{
+        // Image data must be 10-bit packed
+        assert(mp_pixel_format_bits_per_pixel(mode->pixel_format) == 10);
+        assert(mp_raw10_kernel_is_supported(kernel));
+
+        size_t row_length =
+                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width);
+        size_t padding_bytes =
+                mp_pixel_format_width_to_padding(mode->pixel_format, mode->width);
+
+        struct repack repack = {
+                .func = kernels[kernel],
+                .src_buf = src_buf,
+                .dst_buf = dst_buf,
+                .row_length = row_length,
+                .src_stride = row_length + padding_bytes,
+        };
+
+        mp_workers_run_bands(
+                (MPBandFunc)repack_band, &repack, mode->height, num_threads);
+}
+
+void
+mp_raw10_repack(const uint8_t *src_buf, uint8_t *dst_buf, const MPMode *mode)
+{
+        // Holds the kernel plus one, g_once needs a value that isn't zero
+        static gsize best_kernel = 0;
+        if (g_once_init_enter(&best_kernel)) {
+                g_once_init_leave(&best_kernel, mp_raw10_best_kernel() + 1);
+        }
+
+        mp_raw10_repack_with(best_kernel - 1,
+                             mp_workers_get_num_threads(),
+                             src_buf,
+                             dst_buf,
+                             mode);
+}
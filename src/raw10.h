@@ -0,0 +1,37 @@
+#pragma once
+
+#include "mode.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+        MP_RAW10_KERNEL_SCALAR,
+        MP_RAW10_KERNEL_SSE2,
+        MP_RAW10_KERNEL_AVX2,
+        MP_RAW10_KERNEL_NEON,
+
+        MP_RAW10_KERNEL_MAX,
+} MPRaw10Kernel;
+
+const char *mp_raw10_kernel_name(MPRaw10Kernel kernel);
+bool mp_raw10_kernel_is_supported(MPRaw10Kernel kernel);
+
+// The fastest kernel supported by the CPU we're running on
+MPRaw10Kernel mp_raw10_best_kernel();
+
+/*
+ * Repack a 10-bit image from the MIPI sensor format into the sequential
+ * format used by DNG. The padding at the end of the source rows is dropped.
+ *
+ * src_buf: 11111111 22222222 33333333 44444444 11223344 ...
+ * dst_buf: 11111111 11222222 22223333 33333344 44444444 ...
+ */
+void mp_raw10_repack(const uint8_t *src_buf, uint8_t *dst_buf, const MPMode *mode);
+
+// Repack using a specific kernel and number of threads, for benchmarking
+void mp_raw10_repack_with(MPRaw10Kernel kernel,
+                          int num_threads,
+                          const uint8_t *src_buf,
+                          uint8_t *dst_buf,
+                          const MPMode *mode);
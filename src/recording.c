@@ -0,0 +1,335 @@
+#include "recording.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RECORDING_MAGIC "MPRAW001"
+#define RECORDING_VERSION 1
+
+#define RECORDING_ALIGN 64
+
+#define FLAG_GAIN_MANUAL (1 << 0)
+#define FLAG_EXPOSURE_MANUAL (1 << 1)
+
+struct file_header {
+        char magic[8];
+        uint32_t version;
+        int32_t gain_max;
+        int32_t exposure_max;
+        uint8_t reserved[44];
+};
+
+struct frame_header {
+        uint32_t size;
+        uint32_t v4l_pixel_format;
+        uint32_t width;
+        uint32_t height;
+        uint32_t interval_numerator;
+        uint32_t interval_denominator;
+        uint32_t sequence;
+        uint32_t flags;
+        int64_t timestamp;
+        int32_t gain;
+        int32_t exposure;
+        uint8_t reserved[16];
+};
+
+_Static_assert(sizeof(struct file_header) == RECORDING_ALIGN, "bad header size");
+_Static_assert(sizeof(struct frame_header) == RECORDING_ALIGN, "bad header size");
+
+static size_t
+padded_size(size_t size)
+{
+        return (size + RECORDING_ALIGN - 1) & ~(size_t)(RECORDING_ALIGN - 1);
+}
+
+struct _MPRecorder {
+        FILE *file;
+        GThreadPool *pool;
+
+        GMutex pending_mutex;
+        GCond pending_cond;
+        int pending_frames;
+
+        // Set by the writer thread after a short write. Frames after it
+        // couldn't be read back, so the recording stops there.
+        bool failed;
+};
+
+struct record_job {
+        MPFrame *frame;
+        MPRecordedControls controls;
+};
+
+// Returns false on a short write
+static bool
+write_frame_data(struct record_job *job, FILE *file)
+{
+        const MPBuffer *buffer = mp_frame_get_buffer(job->frame);
+        const MPMode *mode = mp_frame_get_mode(job->frame);
+
+        uint32_t stride =
+                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width) +
+                mp_pixel_format_width_to_padding(mode->pixel_format, mode->width);
+
+        struct frame_header header = {
+                .size = stride * mode->height,
+                .v4l_pixel_format =
+                        mp_pixel_format_to_v4l_pixel_format(mode->pixel_format),
+                .width = mode->width,
+                .height = mode->height,
+                .interval_numerator = mode->frame_interval.numerator,
+                .interval_denominator = mode->frame_interval.denominator,
+                .sequence = buffer->sequence,
+                .timestamp = buffer->timestamp,
+                .gain = job->controls.gain,
+                .exposure = job->controls.exposure,
+        };
+        if (job->controls.gain_is_manual) {
+                header.flags |= FLAG_GAIN_MANUAL;
+        }
+        if (job->controls.exposure_is_manual) {
+                header.flags |= FLAG_EXPOSURE_MANUAL;
+        }
+
+        static const uint8_t padding[RECORDING_ALIGN] = { 0 };
+        size_t padding_size = padded_size(header.size) - header.size;
+
+        return fwrite(&header, sizeof(header), 1, file) == 1 &&
+               fwrite(buffer->data, header.size, 1, file) == 1 &&
+               fwrite(padding, 1, padding_size, file) == padding_size;
+}
+
+static void
+write_frame(struct record_job *job, MPRecorder *recorder)
+{
+        if (!recorder->failed && !write_frame_data(job, recorder->file)) {
+                g_printerr("Could not write recorded frame, stopping the "
+                           "recording: %s\n",
+                           strerror(errno));
+                recorder->failed = true;
+        }
+
+        mp_frame_unref(job->frame);
+        free(job);
+
+        g_mutex_lock(&recorder->pending_mutex);
+        --recorder->pending_frames;
+        g_cond_broadcast(&recorder->pending_cond);
+        g_mutex_unlock(&recorder->pending_mutex);
+}
+
+MPRecorder *
+mp_recorder_new(const char *path, int32_t gain_max, int32_t exposure_max)
+{
+        FILE *file = fopen(path, "wb");
+        if (!file) {
+                g_printerr("Could not open recording %s: %s\n",
+                           path,
+                           strerror(errno));
+                return NULL;
+        }
+
+        struct file_header header = {
+                .version = RECORDING_VERSION,
+                .gain_max = gain_max,
+                .exposure_max = exposure_max,
+        };
+        memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+        if (fwrite(&header, sizeof(header), 1, file) != 1) {
+                g_printerr("Could not write recording %s: %s\n",
+                           path,
+                           strerror(errno));
+                fclose(file);
+                return NULL;
+        }
+
+        MPRecorder *recorder = calloc(1, sizeof(MPRecorder));
+        recorder->file = file;
+        g_mutex_init(&recorder->pending_mutex);
+        g_cond_init(&recorder->pending_cond);
+
+        // A single thread keeps the frames in order
+        recorder->pool =
+                g_thread_pool_new((GFunc)write_frame, recorder, 1, FALSE, NULL);
+
+        printf("Recording frames to %s\n", path);
+
+        return recorder;
+}
+
+void
+mp_recorder_free(MPRecorder *recorder)
+{
+        g_thread_pool_free(recorder->pool, FALSE, TRUE);
+
+        if (fclose(recorder->file) != 0 && !recorder->failed) {
+                g_printerr("Could not write recording: %s\n", strerror(errno));
+        }
+        g_mutex_clear(&recorder->pending_mutex);
+        g_cond_clear(&recorder->pending_cond);
+        free(recorder);
+}
+
+void
+mp_recorder_add_frame(MPRecorder *recorder,
+                      MPFrame *frame,
+                      const MPRecordedControls *controls)
+{
+        struct record_job *job = malloc(sizeof(struct record_job));
+        job->frame = mp_frame_ref(frame);
+        job->controls = *controls;
+
+        g_mutex_lock(&recorder->pending_mutex);
+        ++recorder->pending_frames;
+        g_mutex_unlock(&recorder->pending_mutex);
+
+        g_thread_pool_push(recorder->pool, job, NULL);
+}
+
+void
+mp_recorder_sync(MPRecorder *recorder)
+{
+        g_mutex_lock(&recorder->pending_mutex);
+        while (recorder->pending_frames > 0) {
+                g_cond_wait(&recorder->pending_cond, &recorder->pending_mutex);
+        }
+        g_mutex_unlock(&recorder->pending_mutex);
+}
+
+struct _MPRecording {
+        uint8_t *data;
+        size_t size;
+
+        int32_t gain_max;
+        int32_t exposure_max;
+
+        MPRecordedFrame *frames;
+        int num_frames;
+};
+
+MPRecording *
+mp_recording_open(const char *path)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+                g_printerr("Could not open recording %s: %s\n",
+                           path,
+                           strerror(errno));
+                return NULL;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size < sizeof(struct file_header)) {
+                g_printerr("Recording %s is too small\n", path);
+                close(fd);
+                return NULL;
+        }
+
+        uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+                g_printerr("Could not map recording %s: %s\n",
+                           path,
+                           strerror(errno));
+                return NULL;
+        }
+
+        const struct file_header *header = (const struct file_header *)data;
+        if (memcmp(header->magic, RECORDING_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != RECORDING_VERSION) {
+                g_printerr("%s is not a recording\n", path);
+                munmap(data, st.st_size);
+                return NULL;
+        }
+
+        MPRecording *recording = calloc(1, sizeof(MPRecording));
+        recording->data = data;
+        recording->size = st.st_size;
+        recording->gain_max = header->gain_max;
+        recording->exposure_max = header->exposure_max;
+
+        // Index the frames, a frame cut off at the end is ignored
+        int capacity = 0;
+        size_t offset = sizeof(struct file_header);
+        while (offset + sizeof(struct frame_header) <= recording->size) {
+                const struct frame_header *frame =
+                        (const struct frame_header *)(data + offset);
+                size_t data_offset = offset + sizeof(struct frame_header);
+                if (data_offset + frame->size > recording->size) {
+                        break;
+                }
+
+                if (recording->num_frames == capacity) {
+                        capacity = MAX(capacity * 2, 64);
+                        recording->frames = realloc(
+                                recording->frames,
+                                capacity * sizeof(MPRecordedFrame));
+                }
+
+                MPRecordedFrame *recorded =
+                        &recording->frames[recording->num_frames++];
+                recorded->mode.pixel_format = mp_pixel_format_from_v4l_pixel_format(
+                        frame->v4l_pixel_format);
+                recorded->mode.frame_interval.numerator = frame->interval_numerator;
+                recorded->mode.frame_interval.denominator =
+                        frame->interval_denominator;
+                recorded->mode.width = frame->width;
+                recorded->mode.height = frame->height;
+                recorded->sequence = frame->sequence;
+                recorded->timestamp = frame->timestamp;
+                recorded->gain_is_manual = frame->flags & FLAG_GAIN_MANUAL;
+                recorded->gain = frame->gain;
+                recorded->exposure_is_manual = frame->flags & FLAG_EXPOSURE_MANUAL;
+                recorded->exposure = frame->exposure;
+                recorded->data = data + data_offset;
+                recorded->size = frame->size;
+
+                offset = data_offset + padded_size(frame->size);
+        }
+
+        printf("Replaying %d frames from %s\n", recording->num_frames, path);
+
+        return recording;
+}
+
+void
+mp_recording_close(MPRecording *recording)
+{
+        munmap(recording->data, recording->size);
+        free(recording->frames);
+        free(recording);
+}
+
+int
+mp_recording_get_num_frames(const MPRecording *recording)
+{
+        return recording->num_frames;
+}
+
+const MPRecordedFrame *
+mp_recording_get_frame(const MPRecording *recording, int index)
+{
+        assert(index >= 0 && index < recording->num_frames);
+        return &recording->frames[index];
+}
+
+int32_t
+mp_recording_get_gain_max(const MPRecording *recording)
+{
+        return recording->gain_max;
+}
+
+int32_t
+mp_recording_get_exposure_max(const MPRecording *recording)
+{
+        return recording->exposure_max;
+}
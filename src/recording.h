@@ -0,0 +1,66 @@
+#pragma once
+
+#include "frame.h"
+#include "mode.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A recording is a file of raw frames as they came from the sensor, with the
+ * mode they were captured in and the control values at the time. It is
+ * written by MPRecorder and replayed through MPCamera, see
+ * mp_camera_new_replay().
+ *
+ * The file starts with a 64 byte header, followed by one 64 byte header for
+ * every frame and the frame data padded to 64 bytes. Values are stored in
+ * native byte order, recordings are meant to be replayed on the machine used
+ * for profiling and not exchanged.
+ */
+
+typedef struct {
+        MPMode mode;
+
+        uint32_t sequence;
+        // Microseconds, from the V4L2 buffer
+        int64_t timestamp;
+
+        bool gain_is_manual;
+        int32_t gain;
+        bool exposure_is_manual;
+        int32_t exposure;
+
+        const uint8_t *data;
+        uint32_t size;
+} MPRecordedFrame;
+
+typedef struct {
+        bool gain_is_manual;
+        int32_t gain;
+        bool exposure_is_manual;
+        int32_t exposure;
+} MPRecordedControls;
+
+typedef struct _MPRecorder MPRecorder;
+
+MPRecorder *
+mp_recorder_new(const char *path, int32_t gain_max, int32_t exposure_max);
+void mp_recorder_free(MPRecorder *recorder);
+
+// Takes a reference to the frame until it has been written
+void mp_recorder_add_frame(MPRecorder *recorder,
+                           MPFrame *frame,
+                           const MPRecordedControls *controls);
+// Wait until all added frames are written and released
+void mp_recorder_sync(MPRecorder *recorder);
+
+typedef struct _MPRecording MPRecording;
+
+MPRecording *mp_recording_open(const char *path);
+void mp_recording_close(MPRecording *recording);
+
+int mp_recording_get_num_frames(const MPRecording *recording);
+const MPRecordedFrame *mp_recording_get_frame(const MPRecording *recording,
+                                              int index);
+int32_t mp_recording_get_gain_max(const MPRecording *recording);
+int32_t mp_recording_get_exposure_max(const MPRecording *recording);
@@ -0,0 +1,67 @@
+#include "swap_chain.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// Set in middle when it holds a frame the consumer hasn't acquired yet
+#define MIDDLE_IS_NEW 0x4
+#define INDEX_MASK 0x3
+
+struct _MPSwapChain {
+        // Only touched by the producer
+        int back;
+        // Handed between the threads, the index plus MIDDLE_IS_NEW
+        atomic_int middle;
+        // Only touched by the consumer
+        int front;
+        bool has_front;
+};
+
+MPSwapChain *
+mp_swap_chain_new()
+{
+        MPSwapChain *swap_chain = malloc(sizeof(MPSwapChain));
+        swap_chain->back = 0;
+        atomic_init(&swap_chain->middle, 1);
+        swap_chain->front = 2;
+        swap_chain->has_front = false;
+        return swap_chain;
+}
+
+void
+mp_swap_chain_free(MPSwapChain *swap_chain)
+{
+        free(swap_chain);
+}
+
+int
+mp_swap_chain_get_back(MPSwapChain *swap_chain)
+{
+        return swap_chain->back;
+}
+
+void
+mp_swap_chain_publish(MPSwapChain *swap_chain)
+{
+        // Release makes the rendering visible to the consumer, acquire
+        // makes sure it's done reading the buffer we get back
+        int old = atomic_exchange_explicit(&swap_chain->middle,
+                                           swap_chain->back | MIDDLE_IS_NEW,
+                                           memory_order_acq_rel);
+        swap_chain->back = old & INDEX_MASK;
+}
+
+int
+mp_swap_chain_acquire(MPSwapChain *swap_chain)
+{
+        if (atomic_load_explicit(&swap_chain->middle, memory_order_relaxed) &
+            MIDDLE_IS_NEW) {
+                int old = atomic_exchange_explicit(&swap_chain->middle,
+                                                   swap_chain->front,
+                                                   memory_order_acq_rel);
+                swap_chain->front = old & INDEX_MASK;
+                swap_chain->has_front = true;
+        }
+
+        return swap_chain->has_front ? swap_chain->front : -1;
+}
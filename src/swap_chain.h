@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * Triple buffering between one producer and one consumer thread. The swap
+ * chain only hands out indices into the caller's own array of
+ * MP_SWAP_CHAIN_SIZE buffers. The producer always has a buffer to render
+ * into, the consumer always gets the newest one that was published, and
+ * neither ever waits for the other.
+ */
+#define MP_SWAP_CHAIN_SIZE 3
+
+typedef struct _MPSwapChain MPSwapChain;
+
+MPSwapChain *mp_swap_chain_new();
+void mp_swap_chain_free(MPSwapChain *swap_chain);
+
+// Producer: the buffer to render the next frame into
+int mp_swap_chain_get_back(MPSwapChain *swap_chain);
+// Producer: make the back buffer the newest frame, this replaces a published
+// frame the consumer hasn't picked up yet
+void mp_swap_chain_publish(MPSwapChain *swap_chain);
+
+// Consumer: the newest published buffer, which stays valid until the next
+// call. Returns -1 if nothing has been published yet.
+int mp_swap_chain_acquire(MPSwapChain *swap_chain);
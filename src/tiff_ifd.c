@@ -0,0 +1,229 @@
+#include "tiff_ifd.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+static void
+put_u16(uint8_t *dst, uint16_t value)
+{
+        dst[0] = value;
+        dst[1] = value >> 8;
+}
+
+static void
+put_u32(uint8_t *dst, uint32_t value)
+{
+        put_u16(dst, value);
+        put_u16(dst + 2, value >> 16);
+}
+
+/*
+ * Add an entry with room for size bytes of value, which are returned for the
+ * caller to fill in. Entries are inserted in tag order.
+ */
+static uint8_t *
+add_entry(MPTiffIfd *ifd, uint16_t tag, uint16_t type, uint32_t count, size_t size)
+{
+        assert(ifd->num_entries < MP_TIFF_MAX_ENTRIES);
+        assert(ifd->data_size + size <= MP_TIFF_MAX_DATA);
+
+        int index = ifd->num_entries;
+        while (index > 0 && ifd->entries[index - 1].tag > tag) {
+                ifd->entries[index] = ifd->entries[index - 1];
+                --index;
+        }
+        assert(index == 0 || ifd->entries[index - 1].tag != tag);
+
+        ifd->entries[index] = (struct mp_tiff_entry){
+                .tag = tag,
+                .type = type,
+                .count = count,
+                .data_offset = ifd->data_size,
+                .size = size,
+        };
+        ++ifd->num_entries;
+
+        uint8_t *data = ifd->data + ifd->data_size;
+        ifd->data_size += size;
+        return data;
+}
+
+void
+mp_tiff_ifd_add_bytes(MPTiffIfd *ifd,
+                      uint16_t tag,
+                      const uint8_t *values,
+                      uint32_t count)
+{
+        memcpy(add_entry(ifd, tag, MP_TIFF_BYTE, count, count), values, count);
+}
+
+void
+mp_tiff_ifd_add_ascii(MPTiffIfd *ifd, uint16_t tag, const char *value)
+{
+        size_t size = strlen(value) + 1;
+        memcpy(add_entry(ifd, tag, MP_TIFF_ASCII, size, size), value, size);
+}
+
+void
+mp_tiff_ifd_add_shorts(MPTiffIfd *ifd,
+                       uint16_t tag,
+                       const uint16_t *values,
+                       uint32_t count)
+{
+        uint8_t *data = add_entry(ifd, tag, MP_TIFF_SHORT, count, count * 2);
+        for (uint32_t i = 0; i < count; ++i) {
+                put_u16(data + i * 2, values[i]);
+        }
+}
+
+void
+mp_tiff_ifd_add_short(MPTiffIfd *ifd, uint16_t tag, uint16_t value)
+{
+        mp_tiff_ifd_add_shorts(ifd, tag, &value, 1);
+}
+
+void
+mp_tiff_ifd_add_longs(MPTiffIfd *ifd,
+                      uint16_t tag,
+                      const uint32_t *values,
+                      uint32_t count)
+{
+        uint8_t *data = add_entry(ifd, tag, MP_TIFF_LONG, count, count * 4);
+        for (uint32_t i = 0; i < count; ++i) {
+                put_u32(data + i * 4, values[i]);
+        }
+}
+
+void
+mp_tiff_ifd_add_long(MPTiffIfd *ifd, uint16_t tag, uint32_t value)
+{
+        mp_tiff_ifd_add_longs(ifd, tag, &value, 1);
+}
+
+void
+mp_tiff_ifd_add_rational(MPTiffIfd *ifd,
+                         uint16_t tag,
+                         uint32_t numerator,
+                         uint32_t denominator)
+{
+        uint8_t *data = add_entry(ifd, tag, MP_TIFF_RATIONAL, 1, 8);
+        put_u32(data, numerator);
+        put_u32(data + 4, denominator);
+}
+
+static void
+add_fractions(MPTiffIfd *ifd,
+              uint16_t tag,
+              uint16_t type,
+              const float *values,
+              uint32_t count)
+{
+        uint8_t *data = add_entry(ifd, tag, type, count, count * 8);
+        for (uint32_t i = 0; i < count; ++i) {
+                // Signed values are stored as two's complement
+                put_u32(data + i * 8, (uint32_t)(int32_t)lroundf(values[i] * 1e6f));
+                put_u32(data + i * 8 + 4, 1000000);
+        }
+}
+
+void
+mp_tiff_ifd_add_rationals(MPTiffIfd *ifd,
+                          uint16_t tag,
+                          const float *values,
+                          uint32_t count)
+{
+        add_fractions(ifd, tag, MP_TIFF_RATIONAL, values, count);
+}
+
+void
+mp_tiff_ifd_add_srationals(MPTiffIfd *ifd,
+                           uint16_t tag,
+                           const float *values,
+                           uint32_t count)
+{
+        add_fractions(ifd, tag, MP_TIFF_SRATIONAL, values, count);
+}
+
+void
+mp_tiff_ifd_set_longs(MPTiffIfd *ifd,
+                      uint16_t tag,
+                      const uint32_t *values,
+                      uint32_t count)
+{
+        for (int i = 0; i < ifd->num_entries; ++i) {
+                struct mp_tiff_entry *entry = &ifd->entries[i];
+                if (entry->tag == tag) {
+                        assert(entry->type == MP_TIFF_LONG && entry->count == count);
+                        for (uint32_t j = 0; j < count; ++j) {
+                                put_u32(ifd->data + entry->data_offset + j * 4,
+                                        values[j]);
+                        }
+                        return;
+                }
+        }
+        assert(false);
+}
+
+void
+mp_tiff_ifd_set_long(MPTiffIfd *ifd, uint16_t tag, uint32_t value)
+{
+        mp_tiff_ifd_set_longs(ifd, tag, &value, 1);
+}
+
+size_t
+mp_tiff_ifd_size(const MPTiffIfd *ifd)
+{
+        size_t size = 2 + ifd->num_entries * 12 + 4;
+        for (int i = 0; i < ifd->num_entries; ++i) {
+                if (ifd->entries[i].size > 4) {
+                        size += (ifd->entries[i].size + 1) & ~1;
+                }
+        }
+        return size;
+}
+
+void
+mp_tiff_ifd_write(const MPTiffIfd *ifd,
+                  uint8_t *tiff,
+                  size_t offset,
+                  uint32_t next_ifd)
+{
+        uint8_t *dst = tiff + offset;
+        size_t data_offset = offset + 2 + ifd->num_entries * 12 + 4;
+
+        put_u16(dst, ifd->num_entries);
+        dst += 2;
+
+        for (int i = 0; i < ifd->num_entries; ++i) {
+                const struct mp_tiff_entry *entry = &ifd->entries[i];
+                const uint8_t *value = ifd->data + entry->data_offset;
+                put_u16(dst, entry->tag);
+                put_u16(dst + 2, entry->type);
+                put_u32(dst + 4, entry->count);
+
+                // Values of up to four bytes are stored in the entry itself
+                if (entry->size <= 4) {
+                        memset(dst + 8, 0, 4);
+                        memcpy(dst + 8, value, entry->size);
+                } else {
+                        put_u32(dst + 8, data_offset);
+                        memcpy(tiff + data_offset, value, entry->size);
+                        if (entry->size & 1) {
+                                tiff[data_offset + entry->size] = 0;
+                        }
+                        data_offset += (entry->size + 1) & ~1;
+                }
+                dst += 12;
+        }
+
+        put_u32(dst, next_ifd);
+}
+
+void
+mp_tiff_write_header(uint8_t *tiff, uint32_t first_ifd)
+{
+        memcpy(tiff, "II*\0", 4);
+        put_u32(tiff + 4, first_ifd);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Builds little endian TIFF image file directories in memory, for the DNG
+ * writer and the EXIF block of developed JPEGs. Values are copied into the
+ * directory, and entries are kept sorted by tag as TIFF requires.
+ */
+
+#define MP_TIFF_BYTE 1
+#define MP_TIFF_ASCII 2
+#define MP_TIFF_SHORT 3
+#define MP_TIFF_LONG 4
+#define MP_TIFF_RATIONAL 5
+#define MP_TIFF_SRATIONAL 10
+
+#define MP_TIFF_MAX_ENTRIES 32
+// Enough for the tile offsets of a DNG of more than 50 megapixels
+#define MP_TIFF_MAX_DATA 8192
+
+// Size of the header at the start of a TIFF file
+#define MP_TIFF_HEADER_SIZE 8
+
+struct mp_tiff_entry {
+        uint16_t tag;
+        uint16_t type;
+        uint32_t count;
+        // Where the value is in data of the IFD
+        size_t data_offset;
+        size_t size;
+};
+
+typedef struct {
+        struct mp_tiff_entry entries[MP_TIFF_MAX_ENTRIES];
+        int num_entries;
+
+        uint8_t data[MP_TIFF_MAX_DATA];
+        size_t data_size;
+} MPTiffIfd;
+
+void mp_tiff_ifd_add_bytes(MPTiffIfd *ifd,
+                           uint16_t tag,
+                           const uint8_t *values,
+                           uint32_t count);
+void mp_tiff_ifd_add_ascii(MPTiffIfd *ifd, uint16_t tag, const char *value);
+void mp_tiff_ifd_add_shorts(MPTiffIfd *ifd,
+                            uint16_t tag,
+                            const uint16_t *values,
+                            uint32_t count);
+void mp_tiff_ifd_add_short(MPTiffIfd *ifd, uint16_t tag, uint16_t value);
+void mp_tiff_ifd_add_longs(MPTiffIfd *ifd,
+                           uint16_t tag,
+                           const uint32_t *values,
+                           uint32_t count);
+void mp_tiff_ifd_add_long(MPTiffIfd *ifd, uint16_t tag, uint32_t value);
+void mp_tiff_ifd_add_rational(MPTiffIfd *ifd,
+                              uint16_t tag,
+                              uint32_t numerator,
+                              uint32_t denominator);
+// Floats are stored as fractions of a million, which is exact enough for the
+// color matrices and white balance
+void mp_tiff_ifd_add_rationals(MPTiffIfd *ifd,
+                               uint16_t tag,
+                               const float *values,
+                               uint32_t count);
+void mp_tiff_ifd_add_srationals(MPTiffIfd *ifd,
+                                uint16_t tag,
+                                const float *values,
+                                uint32_t count);
+
+// Changes the value of a LONG entry that was added before, for offsets that
+// are only known once the size of every IFD is
+void mp_tiff_ifd_set_longs(MPTiffIfd *ifd,
+                           uint16_t tag,
+                           const uint32_t *values,
+                           uint32_t count);
+void mp_tiff_ifd_set_long(MPTiffIfd *ifd, uint16_t tag, uint32_t value);
+
+// Size of the IFD including the values that don't fit in the entries
+size_t mp_tiff_ifd_size(const MPTiffIfd *ifd);
+
+// Writes the IFD at offset from the start of the TIFF header in tiff, with
+// next_ifd as the offset of the IFD after it or 0
+void mp_tiff_ifd_write(const MPTiffIfd *ifd,
+                       uint8_t *tiff,
+                       size_t offset,
+                       uint32_t next_ifd);
+
+void mp_tiff_write_header(uint8_t *tiff, uint32_t first_ifd);
@@ -0,0 +1,411 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <glib-unix.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Events kept per thread, a few seconds worth at 30fps
+#define RING_SIZE 4096
+
+// Sensor timestamps remembered for matching up drawn frames
+#define NUM_SENSOR_TIMES 256
+
+// Stages frames are dropped at that are counted in a dump
+#define MAX_DROP_COUNTERS 16
+
+static const char SENSOR_EVENT[] = "sensor";
+static const char PREVIEW_DRAW_EVENT[] = "preview_draw";
+
+struct trace_event {
+        const char *name;
+        uint32_t sequence;
+        int64_t start;
+        int64_t end;
+        bool is_drop;
+};
+
+struct trace_ring {
+        struct trace_event events[RING_SIZE];
+        // Number of events ever recorded, only written by the owning thread
+        _Atomic uint64_t head;
+
+        pid_t tid;
+        char thread_name[16];
+
+        // Set once the thread exited, the ring is then reused by a new one
+        atomic_bool is_free;
+
+        struct trace_ring *next;
+};
+
+/*
+ * Rings are never freed. Thread pools retire idle threads and start new ones,
+ * so the ring of a thread that exits is handed to the next new thread. Its
+ * events stay in the dump until then.
+ */
+static _Atomic(struct trace_ring *) rings = NULL;
+static _Thread_local struct trace_ring *thread_ring = NULL;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static void
+release_ring(void *ring)
+{
+        atomic_store(&((struct trace_ring *)ring)->is_free, true);
+}
+
+static void
+create_ring_key()
+{
+        pthread_key_create(&ring_key, release_ring);
+}
+
+static struct trace_ring *
+reuse_ring()
+{
+        for (struct trace_ring *ring = atomic_load(&rings); ring;
+             ring = ring->next) {
+                bool expected = true;
+                if (atomic_compare_exchange_strong(
+                            &ring->is_free, &expected, false)) {
+                        atomic_store(&ring->head, 0);
+                        return ring;
+                }
+        }
+        return NULL;
+}
+
+int64_t
+mp_trace_now()
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static struct trace_ring *
+get_thread_ring()
+{
+        if (thread_ring) {
+                return thread_ring;
+        }
+
+        struct trace_ring *ring = reuse_ring();
+        bool is_new = !ring;
+        if (is_new) {
+                ring = calloc(1, sizeof(struct trace_ring));
+        }
+        ring->tid = syscall(SYS_gettid);
+        prctl(PR_GET_NAME, ring->thread_name);
+
+        // The name is written into the JSON as is, so it must not need escaping
+        for (char *c = ring->thread_name; *c; ++c) {
+                if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) {
+                        *c = '_';
+                }
+        }
+
+        if (is_new) {
+                ring->next = atomic_load(&rings);
+                while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+                }
+        }
+
+        pthread_once(&ring_key_once, create_ring_key);
+        pthread_setspecific(ring_key, ring);
+
+        thread_ring = ring;
+        return ring;
+}
+
+static void
+record(const char *name,
+       uint32_t sequence,
+       int64_t start,
+       int64_t end,
+       bool is_drop)
+{
+        struct trace_ring *ring = get_thread_ring();
+
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        struct trace_event *event = &ring->events[head % RING_SIZE];
+        event->name = name;
+        event->sequence = sequence;
+        event->start = start;
+        event->end = end;
+        event->is_drop = is_drop;
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void
+mp_trace_span(const char *name, uint32_t sequence, int64_t start)
+{
+        record(name, sequence, start, mp_trace_now(), false);
+}
+
+void
+mp_trace_frame(uint32_t sequence, int64_t timestamp)
+{
+        record(SENSOR_EVENT, sequence, timestamp, timestamp, false);
+}
+
+void
+mp_trace_drop(const char *name, uint32_t sequence)
+{
+        int64_t now = mp_trace_now();
+        record(name, sequence, now, now, true);
+}
+
+struct drop_counter {
+        const char *name;
+        uint64_t count;
+};
+
+// Returns the number of drops at the stage up to and including this one, or 0
+// when there are too many stages to count
+static uint64_t
+count_drop(struct drop_counter *counters, int *num_counters, const char *name)
+{
+        for (int i = 0; i < *num_counters; ++i) {
+                if (strcmp(counters[i].name, name) == 0) {
+                        return ++counters[i].count;
+                }
+        }
+
+        if (*num_counters == MAX_DROP_COUNTERS) {
+                return 0;
+        }
+        counters[*num_counters] = (struct drop_counter){ name, 1 };
+        ++*num_counters;
+        return 1;
+}
+
+struct dump_event {
+        struct trace_event event;
+        pid_t tid;
+};
+
+static int
+compare_start(const void *a, const void *b)
+{
+        int64_t sa = ((const struct dump_event *)a)->event.start;
+        int64_t sb = ((const struct dump_event *)b)->event.start;
+        return (sa > sb) - (sa < sb);
+}
+
+/*
+ * Copy the events out of a ring that may still be written to. Anything the
+ * owning thread overwrote while copying is dropped afterwards.
+ */
+static size_t
+collect_ring(struct trace_ring *ring, struct dump_event *events)
+{
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t first = head > RING_SIZE ? head - RING_SIZE : 0;
+
+        for (uint64_t i = first; i < head; ++i) {
+                events[i - first].event = ring->events[i % RING_SIZE];
+                events[i - first].tid = ring->tid;
+        }
+
+        uint64_t new_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t valid = new_head > RING_SIZE ? new_head - RING_SIZE : 0;
+        if (valid <= first) {
+                return head - first;
+        }
+
+        size_t num_dropped = MIN(valid, head) - first;
+        memmove(events,
+                events + num_dropped,
+                (head - first - num_dropped) * sizeof(struct dump_event));
+        return head - first - num_dropped;
+}
+
+bool
+mp_trace_dump(const char *path)
+{
+        FILE *file = fopen(path, "w");
+        if (!file) {
+                g_printerr("Could not write trace to %s: %s\n",
+                           path,
+                           strerror(errno));
+                return false;
+        }
+
+        pid_t pid = getpid();
+
+        fprintf(file, "{\"traceEvents\":[\n");
+
+        int num_rings = 0;
+        for (struct trace_ring *ring = atomic_load(&rings); ring;
+             ring = ring->next) {
+                ++num_rings;
+        }
+
+        struct dump_event *events =
+                malloc((size_t)num_rings * RING_SIZE * sizeof(struct dump_event));
+        size_t num_events = 0;
+        for (struct trace_ring *ring = atomic_load(&rings); ring;
+             ring = ring->next) {
+                fprintf(file,
+                        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                        "\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                        pid,
+                        ring->tid,
+                        ring->thread_name);
+
+                num_events += collect_ring(ring, events + num_events);
+        }
+
+        qsort(events, num_events, sizeof(struct dump_event), compare_start);
+
+        // Sequence numbers restart with every capture, so match each drawn
+        // frame to the latest sensor event with its sequence
+        const struct trace_event *sensor_events[NUM_SENSOR_TIMES] = { 0 };
+        int latency_id = 0;
+
+        // Drops are counted from the start of the dump, older ones were
+        // overwritten
+        struct drop_counter drop_counters[MAX_DROP_COUNTERS];
+        int num_drop_counters = 0;
+
+        for (size_t i = 0; i < num_events; ++i) {
+                const struct trace_event *event = &events[i].event;
+                pid_t tid = events[i].tid;
+
+                if (event->name == SENSOR_EVENT) {
+                        fprintf(file,
+                                "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"p\","
+                                "\"ts\":%" PRId64 ",\"pid\":%d,\"tid\":%d,"
+                                "\"args\":{\"sequence\":%u}},\n",
+                                event->name,
+                                event->start,
+                                pid,
+                                tid,
+                                event->sequence);
+
+                        sensor_events[event->sequence % NUM_SENSOR_TIMES] = event;
+                        continue;
+                }
+
+                if (event->is_drop) {
+                        fprintf(file,
+                                "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+                                "\"ts\":%" PRId64 ",\"pid\":%d,\"tid\":%d,"
+                                "\"args\":{\"sequence\":%u}},\n",
+                                event->name,
+                                event->start,
+                                pid,
+                                tid,
+                                event->sequence);
+                        uint64_t count = count_drop(
+                                drop_counters, &num_drop_counters, event->name);
+                        if (count > 0) {
+                                fprintf(file,
+                                        "{\"name\":\"%s\",\"ph\":\"C\","
+                                        "\"ts\":%" PRId64 ",\"pid\":%d,"
+                                        "\"args\":{\"dropped\":%" PRIu64 "}},\n",
+                                        event->name,
+                                        event->start,
+                                        pid,
+                                        count);
+                        }
+                        continue;
+                }
+
+                fprintf(file,
+                        "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" PRId64
+                        ",\"dur\":%" PRId64 ",\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"sequence\":%u}},\n",
+                        event->name,
+                        event->start,
+                        event->end - event->start,
+                        pid,
+                        tid,
+                        event->sequence);
+
+                const struct trace_event *sensor =
+                        sensor_events[event->sequence % NUM_SENSOR_TIMES];
+                if (strcmp(event->name, PREVIEW_DRAW_EVENT) == 0 && sensor &&
+                    sensor->sequence == event->sequence) {
+                        ++latency_id;
+                        fprintf(file,
+                                "{\"name\":\"sensor_to_glass\",\"cat\":\"latency\","
+                                "\"ph\":\"b\",\"id\":%d,\"ts\":%" PRId64
+                                ",\"pid\":%d,\"args\":{\"sequence\":%u,"
+                                "\"latency_ms\":%.3f}},\n",
+                                latency_id,
+                                sensor->start,
+                                pid,
+                                event->sequence,
+                                (event->end - sensor->start) / 1000.0);
+                        fprintf(file,
+                                "{\"name\":\"sensor_to_glass\",\"cat\":\"latency\","
+                                "\"ph\":\"e\",\"id\":%d,\"ts\":%" PRId64
+                                ",\"pid\":%d},\n",
+                                latency_id,
+                                event->end,
+                                pid);
+                }
+        }
+
+        // Chrome trace doesn't allow a trailing comma, end with metadata
+        fprintf(file,
+                "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"args\":{\"name\":\"megapixels\"}}\n]}\n",
+                pid);
+
+        free(events);
+
+        bool success = fclose(file) == 0;
+        if (success) {
+                printf("Wrote trace to %s\n", path);
+        }
+        return success;
+}
+
+static char *
+get_dump_path()
+{
+        const char *path = g_getenv("MEGAPIXELS_TRACE");
+        if (path && path[0]) {
+                return g_strdup(path);
+        }
+        return g_strdup_printf("/tmp/megapixels-trace-%d.json", getpid());
+}
+
+static gboolean
+on_dump_signal(gpointer data)
+{
+        char *path = get_dump_path();
+        mp_trace_dump(path);
+        g_free(path);
+        return G_SOURCE_CONTINUE;
+}
+
+void
+mp_trace_start()
+{
+        g_unix_signal_add(SIGUSR1, on_dump_signal, NULL);
+}
+
+void
+mp_trace_stop()
+{
+        const char *path = g_getenv("MEGAPIXELS_TRACE");
+        if (path && path[0]) {
+                mp_trace_dump(path);
+        }
+}
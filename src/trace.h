@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Always-on tracing of the stages every frame goes through. Each thread
+ * records spans into its own ring buffer without taking locks, so the cost
+ * is two clock reads and a few stores per span. Spans are keyed by the V4L2
+ * buffer sequence number of the frame they work on.
+ *
+ * The trace is written as Chrome trace JSON, which chrome://tracing and
+ * Perfetto load, on SIGUSR1 and when Megapixels exits if MEGAPIXELS_TRACE is
+ * set to the path to write to. Without it SIGUSR1 writes to
+ * /tmp/megapixels-trace-<pid>.json.
+ */
+
+// Microseconds on CLOCK_MONOTONIC, the same clock as V4L2 buffer timestamps
+int64_t mp_trace_now();
+
+// Record a span from start until now, name must be a string literal
+void mp_trace_span(const char *name, uint32_t sequence, int64_t start);
+// Record when the sensor captured the frame, from the V4L2 buffer timestamp
+void mp_trace_frame(uint32_t sequence, int64_t timestamp);
+// Record that a frame was dropped at the named stage, the dump has a counter of
+// the drops of every stage next to the events
+void mp_trace_drop(const char *name, uint32_t sequence);
+
+// Install the SIGUSR1 handler on the default main context
+void mp_trace_start();
+// Write the trace to MEGAPIXELS_TRACE if it is set
+void mp_trace_stop();
+
+bool mp_trace_dump(const char *path);
@@ -0,0 +1,281 @@
+// For IOV_MAX
+#define _GNU_SOURCE
+
+#include "uring_writer.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_LIBURING
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <liburing.h>
+#include <string.h>
+#include <unistd.h>
+
+struct _MPUringWriter {
+        struct io_uring ring;
+        unsigned int queue_depth;
+
+        // Taken to fill and submit the submission queue, which isn't thread
+        // safe. The completion queue is only read by the completion thread.
+        GMutex mutex;
+        GCond cond;
+        int num_in_flight;
+
+        GThread *thread;
+};
+
+struct uring_request {
+        int fd;
+        size_t size;
+
+        // Completions still expected for the requests of the chain
+        int num_pending;
+        size_t written;
+        int error;
+
+        MPUringWriterCallback callback;
+        void *user_data;
+};
+
+static void
+finish_request(MPUringWriter *writer, struct uring_request *request)
+{
+        int error = request->error;
+        // A short write cancels the rest of the chain without an error
+        if (!error && request->written != request->size) {
+                error = EIO;
+        }
+
+        if (close(request->fd) != 0 && !error) {
+                error = errno;
+        }
+
+        request->callback(error, request->user_data);
+        free(request);
+
+        g_mutex_lock(&writer->mutex);
+        --writer->num_in_flight;
+        g_cond_broadcast(&writer->cond);
+        g_mutex_unlock(&writer->mutex);
+}
+
+static gpointer
+complete_requests(MPUringWriter *writer)
+{
+        for (;;) {
+                struct io_uring_cqe *cqe;
+                int ret = io_uring_wait_cqe(&writer->ring, &cqe);
+                if (ret == -EINTR) {
+                        continue;
+                }
+                if (ret < 0) {
+                        g_printerr("Could not wait for io_uring: %s\n",
+                                   strerror(-ret));
+                        break;
+                }
+
+                struct uring_request *request = io_uring_cqe_get_data(cqe);
+                int res = cqe->res;
+                io_uring_cqe_seen(&writer->ring, cqe);
+
+                // Sent by mp_uring_writer_free() once everything is done
+                if (!request) {
+                        break;
+                }
+
+                if (res < 0) {
+                        // Later requests in the chain are canceled, keep
+                        // the error that caused it
+                        if (!request->error) {
+                                request->error = -res;
+                        }
+                } else {
+                        request->written += res;
+                }
+
+                if (--request->num_pending == 0) {
+                        finish_request(writer, request);
+                }
+        }
+
+        return NULL;
+}
+
+MPUringWriter *
+mp_uring_writer_new(unsigned int queue_depth)
+{
+        MPUringWriter *writer = calloc(1, sizeof(MPUringWriter));
+        int ret = io_uring_queue_init(queue_depth, &writer->ring, 0);
+        if (ret < 0) {
+                printf("io_uring is not available: %s\n", strerror(-ret));
+                free(writer);
+                return NULL;
+        }
+
+        writer->queue_depth = queue_depth;
+        g_mutex_init(&writer->mutex);
+        g_cond_init(&writer->cond);
+        writer->thread = g_thread_new(
+                "uring_complete", (GThreadFunc)complete_requests, writer);
+        return writer;
+}
+
+static void
+submit(MPUringWriter *writer)
+{
+        int ret;
+        while ((ret = io_uring_submit(&writer->ring)) == -EINTR ||
+               ret == -EAGAIN || ret == -EBUSY) {
+                // The completion thread makes room
+                g_thread_yield();
+        }
+        if (ret < 0) {
+                g_printerr("Could not submit to io_uring: %s\n", strerror(-ret));
+        }
+}
+
+void
+mp_uring_writer_free(MPUringWriter *writer)
+{
+        g_mutex_lock(&writer->mutex);
+        while (writer->num_in_flight > 0) {
+                g_cond_wait(&writer->cond, &writer->mutex);
+        }
+
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&writer->ring);
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, NULL);
+        submit(writer);
+        g_mutex_unlock(&writer->mutex);
+
+        g_thread_join(writer->thread);
+        io_uring_queue_exit(&writer->ring);
+        g_mutex_clear(&writer->mutex);
+        g_cond_clear(&writer->cond);
+        free(writer);
+}
+
+bool
+mp_uring_writer_register_buffers(MPUringWriter *writer,
+                                 uint8_t **buffers,
+                                 int count,
+                                 size_t size)
+{
+        struct iovec iov[count];
+        for (int i = 0; i < count; ++i) {
+                iov[i].iov_base = buffers[i];
+                iov[i].iov_len = size;
+        }
+
+        g_mutex_lock(&writer->mutex);
+        int ret = io_uring_register_buffers(&writer->ring, iov, count);
+        g_mutex_unlock(&writer->mutex);
+
+        if (ret < 0) {
+                printf("Could not register io_uring buffers: %s\n", strerror(-ret));
+                return false;
+        }
+        return true;
+}
+
+void
+mp_uring_writer_write(MPUringWriter *writer,
+                      int fd,
+                      const struct iovec *iov,
+                      int iovcnt,
+                      int buffer_index,
+                      MPUringWriterCallback callback,
+                      void *user_data)
+{
+        struct uring_request *request = calloc(1, sizeof(struct uring_request));
+        request->fd = fd;
+        request->callback = callback;
+        request->user_data = user_data;
+        for (int i = 0; i < iovcnt; ++i) {
+                request->size += iov[i].iov_len;
+        }
+
+        // A write for the registered buffer, vectored writes of at most
+        // IOV_MAX buffers for the rest and the fsync
+        int first = buffer_index >= 0 ? 1 : 0;
+        int num_writes = first + (iovcnt - first + IOV_MAX - 1) / IOV_MAX;
+        request->num_pending = num_writes + 1;
+        assert(request->num_pending <= writer->queue_depth);
+
+        g_mutex_lock(&writer->mutex);
+        ++writer->num_in_flight;
+
+        off_t offset = 0;
+        struct io_uring_sqe *sqe;
+        if (buffer_index >= 0) {
+                sqe = io_uring_get_sqe(&writer->ring);
+                io_uring_prep_write_fixed(sqe,
+                                          fd,
+                                          iov[0].iov_base,
+                                          iov[0].iov_len,
+                                          offset,
+                                          buffer_index);
+                io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+                io_uring_sqe_set_data(sqe, request);
+                offset += iov[0].iov_len;
+        }
+        for (int i = first; i < iovcnt; i += IOV_MAX) {
+                int count = MIN(iovcnt - i, IOV_MAX);
+                sqe = io_uring_get_sqe(&writer->ring);
+                io_uring_prep_writev(sqe, fd, &iov[i], count, offset);
+                io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+                io_uring_sqe_set_data(sqe, request);
+                for (int j = i; j < i + count; ++j) {
+                        offset += iov[j].iov_len;
+                }
+        }
+
+        // Only runs once all the writes succeeded
+        sqe = io_uring_get_sqe(&writer->ring);
+        io_uring_prep_fsync(sqe, fd, 0);
+        io_uring_sqe_set_data(sqe, request);
+
+        submit(writer);
+        g_mutex_unlock(&writer->mutex);
+}
+
+#else
+
+MPUringWriter *
+mp_uring_writer_new(unsigned int queue_depth)
+{
+        printf("io_uring is not available: built without liburing\n");
+        return NULL;
+}
+
+void
+mp_uring_writer_free(MPUringWriter *writer)
+{
+}
+
+bool
+mp_uring_writer_register_buffers(MPUringWriter *writer,
+                                 uint8_t **buffers,
+                                 int count,
+                                 size_t size)
+{
+        return false;
+}
+
+void
+mp_uring_writer_write(MPUringWriter *writer,
+                      int fd,
+                      const struct iovec *iov,
+                      int iovcnt,
+                      int buffer_index,
+                      MPUringWriterCallback callback,
+                      void *user_data)
+{
+}
+
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Writes files through io_uring, so the threads preparing them don't wait for
+ * the disk. The data of a file is written by a chain of linked requests that
+ * ends with an fsync, all submitted at once. A completion thread closes the
+ * file and calls back once it's on disk.
+ *
+ * Buffers registered with the writer are written without the kernel mapping
+ * their pages for every write, which is used for the frames the DNG writer
+ * repacks.
+ */
+typedef struct _MPUringWriter MPUringWriter;
+
+// Called from the completion thread, error is 0 or an errno value
+typedef void (*MPUringWriterCallback)(int error, void *user_data);
+
+// Returns NULL when io_uring is not supported by the kernel or the build
+MPUringWriter *mp_uring_writer_new(unsigned int queue_depth);
+// Waits for all writes to complete
+void mp_uring_writer_free(MPUringWriter *writer);
+
+// Registers count buffers of size bytes, which stay pinned in memory for the
+// life of the writer. Fails when RLIMIT_MEMLOCK doesn't allow it.
+bool mp_uring_writer_register_buffers(MPUringWriter *writer,
+                                      uint8_t **buffers,
+                                      int count,
+                                      size_t size);
+
+// Writes iov to fd from the start of the file, syncs and closes it. The first
+// buffer lies in registered buffer buffer_index, or buffer_index is -1. The
+// buffers have to stay valid until the callback.
+void mp_uring_writer_write(MPUringWriter *writer,
+                           int fd,
+                           const struct iovec *iov,
+                           int iovcnt,
+                           int buffer_index,
+                           MPUringWriterCallback callback,
+                           void *user_data);
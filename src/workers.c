@@ -0,0 +1,169 @@
+#include "workers.h"
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct _MPWorkerJob {
+        MPWorkerFunc func;
+        void *data;
+
+        // One for every task pushed to the pool, and one for the waiting thread
+        gint ref_count;
+
+        GMutex mutex;
+        GCond cond;
+        int num_queued;
+        int num_running;
+};
+
+struct bands {
+        MPBandFunc func;
+        void *data;
+        int count;
+        int num_bands;
+        gint next_band;
+};
+
+static void
+unref_job(MPWorkerJob *job)
+{
+        if (g_atomic_int_dec_and_test(&job->ref_count)) {
+                g_mutex_clear(&job->mutex);
+                g_cond_clear(&job->cond);
+                free(job);
+        }
+}
+
+static void
+run_task(MPWorkerJob *job, gpointer user_data)
+{
+        g_mutex_lock(&job->mutex);
+        // Skipped by mp_workers_run
+        if (job->num_queued == 0) {
+                g_mutex_unlock(&job->mutex);
+                unref_job(job);
+                return;
+        }
+        --job->num_queued;
+        ++job->num_running;
+        g_mutex_unlock(&job->mutex);
+
+        job->func(job->data);
+
+        g_mutex_lock(&job->mutex);
+        --job->num_running;
+        g_cond_signal(&job->cond);
+        g_mutex_unlock(&job->mutex);
+
+        unref_job(job);
+}
+
+// The pool is created on first use and kept for the lifetime of the process
+static GThreadPool *
+get_pool()
+{
+        static GThreadPool *pool = NULL;
+
+        if (g_once_init_enter(&pool)) {
+                GThreadPool *new_pool = g_thread_pool_new((GFunc)run_task,
+                                                          NULL,
+                                                          g_get_num_processors(),
+                                                          TRUE,
+                                                          NULL);
+                g_once_init_leave(&pool, new_pool);
+        }
+
+        return pool;
+}
+
+int
+mp_workers_get_num_threads()
+{
+        return g_thread_pool_get_max_threads(get_pool());
+}
+
+MPWorkerJob *
+mp_workers_start(MPWorkerFunc func, void *data, int num_threads)
+{
+        GThreadPool *pool = get_pool();
+
+        num_threads = MAX(num_threads, 0);
+
+        MPWorkerJob *job = malloc(sizeof(MPWorkerJob));
+        job->func = func;
+        job->data = data;
+        job->ref_count = num_threads + 1;
+        g_mutex_init(&job->mutex);
+        g_cond_init(&job->cond);
+        job->num_queued = num_threads;
+        job->num_running = 0;
+
+        for (int i = 0; i < num_threads; ++i) {
+                g_thread_pool_push(pool, job, NULL);
+        }
+
+        return job;
+}
+
+void
+mp_workers_wait(MPWorkerJob *job)
+{
+        g_mutex_lock(&job->mutex);
+        while (job->num_queued > 0 || job->num_running > 0) {
+                g_cond_wait(&job->cond, &job->mutex);
+        }
+        g_mutex_unlock(&job->mutex);
+
+        unref_job(job);
+}
+
+void
+mp_workers_run(MPWorkerFunc func, void *data, int num_threads)
+{
+        if (num_threads <= 1) {
+                func(data);
+                return;
+        }
+
+        MPWorkerJob *job = mp_workers_start(func, data, num_threads - 1);
+
+        func(data);
+
+        // All work was taken once func returns here, tasks that are still
+        // queued would only find none left. Skipping them also means a full
+        // pool can't keep this waiting.
+        g_mutex_lock(&job->mutex);
+        job->num_queued = 0;
+        while (job->num_running > 0) {
+                g_cond_wait(&job->cond, &job->mutex);
+        }
+        g_mutex_unlock(&job->mutex);
+
+        unref_job(job);
+}
+
+static void
+run_bands(struct bands *bands)
+{
+        int band;
+        while ((band = g_atomic_int_add(&bands->next_band, 1)) < bands->num_bands) {
+                bands->func(bands->data,
+                            (int64_t)bands->count * band / bands->num_bands,
+                            (int64_t)bands->count * (band + 1) / bands->num_bands);
+        }
+}
+
+void
+mp_workers_run_bands(MPBandFunc func, void *data, int count, int num_bands)
+{
+        struct bands bands = {
+                .func = func,
+                .data = data,
+                .count = count,
+                .num_bands = CLAMP(num_bands, 1, MAX(count, 1)),
+                .next_band = 0,
+        };
+
+        mp_workers_run((MPWorkerFunc)run_bands, &bands, bands.num_bands);
+}
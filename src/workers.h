@@ -0,0 +1,35 @@
+#pragma once
+
+/*
+ * One pool of threads, as many as there are cores, shared by everything that
+ * splits an image over the cores. Creating threads for every frame costs more
+ * than the work on small images, and separate pools would each take all cores.
+ *
+ * The functions run on the pool take their work from a counter in data until
+ * there is none left, so how many of them run at once doesn't matter.
+ */
+typedef void (*MPWorkerFunc)(void *data);
+
+typedef struct _MPWorkerJob MPWorkerJob;
+
+// Number of threads in the pool
+int mp_workers_get_num_threads();
+
+// Run func on up to num_threads threads, the calling thread being one of them,
+// and return when they're done. Threads that didn't start by the time the
+// calling thread finished are skipped.
+void mp_workers_run(MPWorkerFunc func, void *data, int num_threads);
+
+// Run func on num_threads threads of the pool in the background
+MPWorkerJob *mp_workers_start(MPWorkerFunc func, void *data, int num_threads);
+// Wait for a job that was started and free it
+void mp_workers_wait(MPWorkerJob *job);
+
+/*
+ * Split the items 0 to count - 1 into num_bands bands of consecutive items, and
+ * call func with the start and end of each of them from the pool. Returns when
+ * all bands are done.
+ */
+typedef void (*MPBandFunc)(void *data, int start, int end);
+
+void mp_workers_run_bands(MPBandFunc func, void *data, int count, int num_bands);
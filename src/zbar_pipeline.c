@@ -1,16 +1,17 @@
 #include "zbar_pipeline.h"
 
+#include "image.h"
 #include "io_pipeline.h"
+#include "mailbox.h"
 #include "main.h"
 #include "pipeline.h"
+#include "trace.h"
 #include <assert.h>
+#include <inttypes.h>
 #include <zbar.h>
 
 struct _MPZBarImage {
-        uint8_t *data;
-        MPPixelFormat pixel_format;
-        int width;
-        int height;
+        MPFrame *frame;
         int rotation;
         bool mirrored;
 
@@ -19,8 +20,8 @@ struct _MPZBarImage {
 
 static MPPipeline *pipeline;
 
-static volatile int frames_processed = 0;
-static volatile int frames_received = 0;
+// Newest image waiting to be scanned
+static MPMailbox *mailbox;
 
 static zbar_image_scanner_t *scanner;
 
@@ -34,6 +35,8 @@ setup(MPPipeline *pipeline, const void *data)
 void
 mp_zbar_pipeline_start()
 {
+        mailbox = mp_mailbox_new((MPMailboxFreeFunc)mp_zbar_image_unref);
+
         pipeline = mp_pipeline_new();
 
         mp_pipeline_invoke(pipeline, setup, NULL, 0);
@@ -43,6 +46,22 @@ void
 mp_zbar_pipeline_stop()
 {
         mp_pipeline_free(pipeline);
+
+        MPMailboxStats stats;
+        mp_mailbox_clear(mailbox);
+        mp_mailbox_get_stats(mailbox, &stats);
+        printf("ZBar frames: %" PRIu64 " scanned, %" PRIu64 " replaced, %" PRIu64
+               " dropped\n",
+               stats.delivered,
+               stats.replaced,
+               stats.dropped);
+        mp_mailbox_free(mailbox);
+}
+
+void
+mp_zbar_pipeline_sync()
+{
+        mp_pipeline_sync(pipeline);
 }
 
 static bool
@@ -102,12 +121,13 @@ map_coords(int *x, int *y, int width, int height, int rotation, bool mirrored)
 }
 
 static MPZBarCode
-process_symbol(const MPZBarImage *image,
+process_symbol(int rotation,
+               bool mirrored,
                int width,
                int height,
                const zbar_symbol_t *symbol)
 {
-        if (image->rotation == 90 || image->rotation == 270) {
+        if (rotation == 90 || rotation == 270) {
                 int tmp = width;
                 width = height;
                 height = tmp;
@@ -153,8 +173,8 @@ process_symbol(const MPZBarImage *image,
                            &code.bounds_y[i],
                            width,
                            height,
-                           image->rotation,
-                           image->mirrored);
+                           rotation,
+                           mirrored);
         }
 
         const char *data = zbar_symbol_get_data(symbol);
@@ -167,72 +187,43 @@ process_symbol(const MPZBarImage *image,
 }
 
 static void
-process_image(MPPipeline *pipeline, MPZBarImage **_image)
+process_image(MPPipeline *pipeline, const void *args)
 {
-        MPZBarImage *image = *_image;
+        MPZBarImage *image = mp_mailbox_take(mailbox);
+        if (!image) {
+                return;
+        }
+
+        const MPMode *mode = mp_frame_get_mode(image->frame);
+        const uint8_t *image_data = mp_frame_get_data(image->frame);
 
-        assert(image->pixel_format == MP_PIXEL_FMT_BGGR8 ||
-               image->pixel_format == MP_PIXEL_FMT_GBRG8 ||
-               image->pixel_format == MP_PIXEL_FMT_GRBG8 ||
-               image->pixel_format == MP_PIXEL_FMT_RGGB8 ||
-               image->pixel_format == MP_PIXEL_FMT_BGGR10P ||
-               image->pixel_format == MP_PIXEL_FMT_GBRG10P ||
-               image->pixel_format == MP_PIXEL_FMT_GRBG10P ||
-               image->pixel_format == MP_PIXEL_FMT_RGGB10P);
+        assert(mode->pixel_format == MP_PIXEL_FMT_BGGR8 ||
+               mode->pixel_format == MP_PIXEL_FMT_GBRG8 ||
+               mode->pixel_format == MP_PIXEL_FMT_GRBG8 ||
+               mode->pixel_format == MP_PIXEL_FMT_RGGB8 ||
+               mode->pixel_format == MP_PIXEL_FMT_BGGR10P ||
+               mode->pixel_format == MP_PIXEL_FMT_GBRG10P ||
+               mode->pixel_format == MP_PIXEL_FMT_GRBG10P ||
+               mode->pixel_format == MP_PIXEL_FMT_RGGB10P);
 
         // Create a grayscale image for scanning from the current preview.
         // Rotate/mirror correctly.
-        int width = image->width / 2;
-        int height = image->height / 2;
+        int width = mode->width / 2;
+        int height = mode->height / 2;
+
+        uint32_t sequence = mp_frame_get_buffer(image->frame)->sequence;
+        int64_t trace_start = mp_trace_now();
 
         uint8_t *data = malloc(width * height * sizeof(uint8_t));
-        size_t row_length =
-                mp_pixel_format_width_to_bytes(image->pixel_format, image->width);
-        int padding_bytes =
-                mp_pixel_format_width_to_padding(image->pixel_format, image->width);
-        size_t i = 0, padding_offset = 0;
-        size_t offset;
-        switch (image->pixel_format) {
-        case MP_PIXEL_FMT_BGGR8:
-        case MP_PIXEL_FMT_GBRG8:
-        case MP_PIXEL_FMT_GRBG8:
-        case MP_PIXEL_FMT_RGGB8:
-                for (int y = 0; y < image->height; y += 2) {
-                        for (int x = 0; x < row_length; x += 2) {
-                                data[i++] = image->data[x + row_length * y];
-                        }
-                }
-                break;
-        case MP_PIXEL_FMT_BGGR10P:
-        case MP_PIXEL_FMT_GBRG10P:
-        case MP_PIXEL_FMT_GRBG10P:
-        case MP_PIXEL_FMT_RGGB10P:
-                // Skip 5th byte of each 4-pixel segment by incrementing an
-                // offset every time a 5th byte is reached, making the
-                // X coordinate land on the next byte:
-                //
-                // image->data | | | | X | | | | X | | | | X | | | | X | ...
-                // x           0   2   4   6   8  10  12  14  16  18  20 ...
-                // offset      0       1       2       3       4       5 ...
-                //                     >       --->    ----->  ------->
-                // x + offset  0   2     4   6     8  10    12  16    18 ...
-                for (int y = 0; y < image->height; y += 2) {
-                        offset = 0;
-                        for (int x = 0; x < image->width; x += 2) {
-                                if (x % 4 == 0)
-                                        offset += 1;
-
-                                data[i++] = image->data[x + offset + padding_offset +
-                                                        row_length * y];
-                        }
-
-                        // Skip padding
-                        padding_offset += padding_bytes * 2;
-                }
-                break;
-        default:
-                assert(0);
-        }
+        mp_image_extract_gray(image_data, mode, data);
+
+        mp_trace_span("zbar_gray", sequence, trace_start);
+
+        // The grayscale copy is all that's needed from here on, give the
+        // camera buffer back as soon as possible
+        int rotation = image->rotation;
+        bool mirrored = image->mirrored;
+        mp_zbar_image_unref(image);
 
         // Create image for zbar
         zbar_image_t *zbar_image = zbar_image_create();
@@ -243,8 +234,10 @@ process_image(MPPipeline *pipeline, MPZBarImage **_image)
                             width * height * sizeof(uint8_t),
                             zbar_image_free_data);
 
+        trace_start = mp_trace_now();
         int res = zbar_scan_image(scanner, zbar_image);
         assert(res >= 0);
+        mp_trace_span("zbar_scan", sequence, trace_start);
 
         if (res > 0) {
                 MPZBarScanResult *result = malloc(sizeof(MPZBarScanResult));
@@ -253,8 +246,8 @@ process_image(MPPipeline *pipeline, MPZBarImage **_image)
                 const zbar_symbol_t *symbol = zbar_image_first_symbol(zbar_image);
                 for (int i = 0; i < MIN(res, 8); ++i) {
                         assert(symbol != NULL);
-                        result->codes[i] =
-                                process_symbol(image, width, height, symbol);
+                        result->codes[i] = process_symbol(
+                                rotation, mirrored, width, height, symbol);
                         symbol = zbar_symbol_next(symbol);
                 }
 
@@ -264,41 +257,25 @@ process_image(MPPipeline *pipeline, MPZBarImage **_image)
         }
 
         zbar_image_destroy(zbar_image);
-        mp_zbar_image_unref(image);
-
-        ++frames_processed;
 }
 
 void
 mp_zbar_pipeline_process_image(MPZBarImage *image)
 {
-        // If we haven't processed the previous frame yet, drop this one
-        if (frames_received != frames_processed) {
-                mp_zbar_image_unref(image);
-                return;
+        // Only the newest image is scanned, one still waiting is released
+        uint32_t sequence = mp_frame_get_buffer(image->frame)->sequence;
+        if (mp_mailbox_put(mailbox, image)) {
+                mp_pipeline_invoke(pipeline, process_image, NULL, 0);
+        } else {
+                mp_trace_drop("zbar_replaced", sequence);
         }
-
-        ++frames_received;
-
-        mp_pipeline_invoke(pipeline,
-                           (MPPipelineCallback)process_image,
-                           &image,
-                           sizeof(MPZBarImage *));
 }
 
 MPZBarImage *
-mp_zbar_image_new(uint8_t *data,
-                  MPPixelFormat pixel_format,
-                  int width,
-                  int height,
-                  int rotation,
-                  bool mirrored)
+mp_zbar_image_new(MPFrame *frame, int rotation, bool mirrored)
 {
         MPZBarImage *image = malloc(sizeof(MPZBarImage));
-        image->data = data;
-        image->pixel_format = pixel_format;
-        image->width = width;
-        image->height = height;
+        image->frame = frame;
         image->rotation = rotation;
         image->mirrored = mirrored;
         image->ref_count = 1;
@@ -316,7 +293,7 @@ void
 mp_zbar_image_unref(MPZBarImage *image)
 {
         if (--image->ref_count == 0) {
-                free(image->data);
+                mp_frame_unref(image->frame);
                 free(image);
         }
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "camera_config.h"
+#include "frame.h"
 
 typedef struct _MPZBarImage MPZBarImage;
 
@@ -18,14 +19,10 @@ typedef struct {
 
 void mp_zbar_pipeline_start();
 void mp_zbar_pipeline_stop();
+void mp_zbar_pipeline_sync();
 
 void mp_zbar_pipeline_process_image(MPZBarImage *image);
 
-MPZBarImage *mp_zbar_image_new(uint8_t *data,
-                               MPPixelFormat pixel_format,
-                               int width,
-                               int height,
-                               int rotation,
-                               bool mirrored);
+MPZBarImage *mp_zbar_image_new(MPFrame *frame, int rotation, bool mirrored);
 MPZBarImage *mp_zbar_image_ref(MPZBarImage *image);
 void mp_zbar_image_unref(MPZBarImage *image);
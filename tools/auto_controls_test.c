@@ -0,0 +1,112 @@
+#include "auto_controls.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Same grid as mp_image_compute_stats samples
+#define NUM_SAMPLES (64 * 48)
+#define NUM_FRAMES 120
+// The exposure has to be left alone for this many frames at the end
+#define NUM_STABLE_FRAMES 40
+
+#define EXPOSURE_MIN 1
+#define EXPOSURE_MAX 10000
+#define BLACK_LEVEL (16 / 255.0f)
+
+/*
+ * A scene is the brightness of every sample at an exposure of 1, most of it
+ * spread evenly and a part of it a highlight that's brighter by a factor.
+ */
+struct scene {
+        const char *name;
+        float highlight_fraction;
+        float highlight_factor;
+};
+
+static const struct scene scenes[] = {
+        { "no highlights", 0, 1 },
+        // These used to swing between halving and doubling the exposure
+        { "mildly clipped highlight", 0.05f, 8 },
+        { "clipped highlight", 0.03f, 12 },
+        { "bright highlight", 0.03f, 16 },
+        { "light sources", 0.03f, 50 },
+        { "large highlight", 0.2f, 3 },
+};
+#define NUM_SCENES (sizeof(scenes) / sizeof(scenes[0]))
+
+static float
+get_radiance(const struct scene *scene, int i)
+{
+        // Deterministic spread between 0.2 and 1.0 over the samples
+        float base = 0.2f + 0.8f * (float)((i * 7919) % NUM_SAMPLES) / NUM_SAMPLES;
+        if (i < NUM_SAMPLES * scene->highlight_fraction) {
+                return base * scene->highlight_factor;
+        }
+        return base;
+}
+
+static void
+expose(const struct scene *scene, int exposure, MPImageStats *stats)
+{
+        memset(stats, 0, sizeof(MPImageStats));
+
+        float black = BLACK_LEVEL * 255;
+        for (int i = 0; i < NUM_SAMPLES; ++i) {
+                float value = black + get_radiance(scene, i) * exposure * 0.05f;
+                uint32_t luminance = (uint32_t)fminf(value, 255);
+
+                ++stats->histogram[luminance * MP_IMAGE_HISTOGRAM_BINS / 256];
+                stats->luminance_sum += luminance;
+                ++stats->num_samples;
+        }
+}
+
+// Returns whether the exposure settled
+static bool
+run_scene(const struct scene *scene)
+{
+        MPAutoControls *controls = mp_auto_controls_new(
+                EXPOSURE_MIN, EXPOSURE_MAX, 0, 0, BLACK_LEVEL);
+
+        int exposure = 1000;
+        int gain = 0;
+        int last_change = 0;
+        int num_changes = 0;
+        for (int frame = 0; frame < NUM_FRAMES; ++frame) {
+                MPImageStats stats;
+                expose(scene, exposure, &stats);
+
+                if (mp_auto_controls_update(
+                            controls, &stats, true, &exposure, false, &gain)) {
+                        last_change = frame;
+                        ++num_changes;
+                }
+        }
+        mp_auto_controls_free(controls);
+
+        bool settled = last_change < NUM_FRAMES - NUM_STABLE_FRAMES;
+        printf("  %-26s exposure %5d after %2d changes, last in frame %3d%s\n",
+               scene->name,
+               exposure,
+               num_changes,
+               last_change,
+               settled ? "" : "  NOT SETTLED");
+        return settled;
+}
+
+int
+main(int argc, char *argv[])
+{
+        if (argc > 1) {
+                printf("Usage: %s\n", argv[0]);
+                return 1;
+        }
+
+        printf("Auto exposure over %d frames, starting at 1000\n", NUM_FRAMES);
+
+        bool success = true;
+        for (size_t i = 0; i < NUM_SCENES; ++i) {
+                success &= run_scene(&scenes[i]);
+        }
+        return success ? 0 : 1;
+}
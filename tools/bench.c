@@ -0,0 +1,557 @@
+#include "camera_config.h"
+#include "developer.h"
+#include "dng_writer.h"
+#include "gl_thumbnail.h"
+#include "gl_util.h"
+#include "gles2_debayer.h"
+#include "image.h"
+#include "mode.h"
+#include "raw10.h"
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_WARMUP 2
+#define NUM_ITERATIONS 20
+// For the kernels that take hundreds of milliseconds per frame
+#define NUM_SLOW_ITERATIONS 5
+
+#define MAX_MODES (MP_MAX_CAMERAS * 2)
+
+struct bench_frame {
+        const struct mp_camera_config *camera;
+        MPMode mode;
+
+        uint8_t *image;
+        size_t size;
+
+        uint8_t *output;
+        uint32_t *thumb;
+        char *dir;
+
+        GLES2Debayer *debayer;
+        GLThumbnailer *thumbnailer;
+        GLuint input_texture;
+        GLuint output_texture;
+        GLuint thumb_frame_buffer;
+};
+
+struct bench_kernel {
+        const char *name;
+        void (*run)(struct bench_frame *frame);
+        int num_iterations;
+        bool needs_10bit;
+        bool needs_gl;
+};
+
+static GdkGLContext *context = NULL;
+
+double
+get_time()
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+        double da = *(const double *)a, db = *(const double *)b;
+        return (da > db) - (da < db);
+}
+
+static struct mp_dng_info
+get_info(struct bench_frame *frame)
+{
+        struct mp_dng_info info = {
+                .camera = frame->camera,
+                .mode = frame->mode,
+                .rotation = 0,
+                .time = time(NULL),
+                .exposure_is_manual = false,
+                .exposure = frame->mode.height,
+                .gain = 1,
+                .gain_max = 256,
+                .flash_enabled = false,
+                .is_merged = false,
+        };
+        return info;
+}
+
+static void
+run_raw10_repack(struct bench_frame *frame)
+{
+        mp_raw10_repack(frame->image, frame->output, &frame->mode);
+}
+
+static void
+run_zbar_gray(struct bench_frame *frame)
+{
+        mp_image_extract_gray(frame->image, &frame->mode, frame->output);
+}
+
+static void
+run_blank_detect(struct bench_frame *frame)
+{
+        // The frame is random, so this always stops at the first byte
+        // unless it happens to be zero
+        mp_image_is_blank(frame->image, &frame->mode);
+}
+
+static void
+run_image_stats(struct bench_frame *frame)
+{
+        MPImageStats stats;
+        mp_image_compute_stats(frame->image, &frame->mode, &stats);
+}
+
+static void
+run_sharpness(struct bench_frame *frame)
+{
+        MPImageRegion region = { 0.4f, 0.4f, 0.2f, 0.2f };
+        mp_image_get_sharpness(frame->image, &frame->mode, &region);
+}
+
+static void
+run_dng_write(struct bench_frame *frame)
+{
+        struct mp_dng_info info = get_info(frame);
+
+        char *path = g_build_filename(frame->dir, "bench.dng", NULL);
+        GBytes *image = g_bytes_new_static(frame->image, frame->size);
+        mp_dng_writer_write(path, image, &info, NULL, NULL);
+        mp_dng_writer_sync();
+        g_bytes_unref(image);
+        g_free(path);
+}
+
+static void
+run_develop_jpeg(struct bench_frame *frame)
+{
+        struct mp_dng_info info = get_info(frame);
+
+        char *path = g_build_filename(frame->dir, "bench.jpg", NULL);
+        mp_develop_jpeg(path, frame->image, &info, g_get_num_processors());
+        g_free(path);
+}
+
+static void
+run_gl_debayer(struct bench_frame *frame)
+{
+        uint32_t stride =
+                mp_pixel_format_width_to_bytes(frame->mode.pixel_format,
+                                               frame->mode.width) +
+                mp_pixel_format_width_to_padding(frame->mode.pixel_format,
+                                                 frame->mode.width);
+
+        glBindTexture(GL_TEXTURE_2D, frame->input_texture);
+        glTexSubImage2D(GL_TEXTURE_2D,
+                        0,
+                        0,
+                        0,
+                        stride,
+                        frame->mode.height,
+                        GL_LUMINANCE,
+                        GL_UNSIGNED_BYTE,
+                        frame->image);
+        gles2_debayer_process(
+                frame->debayer, frame->output_texture, frame->input_texture);
+
+        // Wait for the GPU, so the time includes the actual debayering
+        glFinish();
+        check_gl();
+}
+
+// How the capture thumbnail used to be made, reading back the whole preview
+static void
+run_gl_readback(struct bench_frame *frame)
+{
+        glBindFramebuffer(GL_FRAMEBUFFER, frame->thumb_frame_buffer);
+        glReadPixels(0,
+                     0,
+                     frame->mode.width / 2,
+                     frame->mode.height / 2,
+                     GL_RGBA,
+                     GL_UNSIGNED_BYTE,
+                     frame->thumb);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        check_gl();
+}
+
+static void
+run_gl_thumbnail(struct bench_frame *frame)
+{
+        static const GLfloat identity[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+
+        uint32_t width = frame->mode.width / 2;
+        uint32_t height = frame->mode.height / 2;
+        uint32_t scale = MAX(width, height);
+        GLThumbnail *thumbnail = gl_thumbnailer_render(frame->thumbnailer,
+                                                       frame->output_texture,
+                                                       width * 256 / scale,
+                                                       height * 256 / scale,
+                                                       identity);
+        g_bytes_unref(gl_thumbnail_finish(thumbnail));
+}
+
+static const struct bench_kernel kernels[] = {
+        { "raw10_repack", run_raw10_repack, NUM_ITERATIONS, true, false },
+        { "zbar_gray", run_zbar_gray, NUM_ITERATIONS, false, false },
+        { "blank_detect", run_blank_detect, NUM_ITERATIONS, false, false },
+        { "image_stats", run_image_stats, NUM_ITERATIONS, false, false },
+        { "sharpness", run_sharpness, NUM_ITERATIONS, false, false },
+        { "dng_write", run_dng_write, NUM_SLOW_ITERATIONS, false, false },
+        { "develop_jpeg", run_develop_jpeg, NUM_SLOW_ITERATIONS, false, false },
+        { "gl_debayer", run_gl_debayer, NUM_ITERATIONS, false, true },
+        { "gl_readback", run_gl_readback, NUM_ITERATIONS, false, true },
+        { "gl_thumbnail", run_gl_thumbnail, NUM_ITERATIONS, false, true },
+};
+
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/*
+ * Create a GLES context without a surface, like the one the process pipeline
+ * uses for the preview. This needs a display, but no window.
+ */
+static bool
+init_gl()
+{
+        if (!gtk_init_check()) {
+                g_printerr("No display, skipping the GL kernels\n");
+                return false;
+        }
+
+        GError *error = NULL;
+        context = gdk_display_create_gl_context(gdk_display_get_default(), &error);
+        if (context == NULL) {
+                g_printerr("Failed to initialize OpenGL context: %s\n",
+                           error->message);
+                g_clear_error(&error);
+                return false;
+        }
+
+        gdk_gl_context_set_use_es(context, true);
+        gdk_gl_context_set_required_version(context, 2, 0);
+        gdk_gl_context_set_forward_compatible(context, false);
+
+        gdk_gl_context_realize(context, &error);
+        if (error != NULL) {
+                g_printerr("Failed to create OpenGL context: %s\n",
+                           error->message);
+                g_clear_object(&context);
+                g_clear_error(&error);
+                return false;
+        }
+
+        gdk_gl_context_make_current(context);
+
+        if (!gdk_gl_context_get_use_es(context)) {
+                GLuint vao;
+                glGenVertexArrays(1, &vao);
+                glBindVertexArray(vao);
+        }
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        check_gl();
+
+        return true;
+}
+
+static GLuint
+new_texture(GLint format, uint32_t width, uint32_t height)
+{
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D,
+                     0,
+                     format,
+                     width,
+                     height,
+                     0,
+                     format,
+                     GL_UNSIGNED_BYTE,
+                     NULL);
+        check_gl();
+        return texture;
+}
+
+static void
+setup_gl_debayer(struct bench_frame *frame)
+{
+        const MPMode *mode = &frame->mode;
+        uint32_t row_length =
+                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width);
+        uint32_t padding_bytes =
+                mp_pixel_format_width_to_padding(mode->pixel_format, mode->width);
+
+        frame->input_texture = new_texture(
+                GL_LUMINANCE, row_length + padding_bytes, mode->height);
+        frame->output_texture =
+                new_texture(GL_RGBA, mode->width / 2, mode->height / 2);
+
+        frame->debayer = gles2_debayer_new(mode->pixel_format);
+        gles2_debayer_use(frame->debayer);
+        gles2_debayer_configure(frame->debayer,
+                                mode->width / 2,
+                                mode->height / 2,
+                                mode->width,
+                                mode->height,
+                                padding_bytes,
+                                0,
+                                false,
+                                NULL,
+                                frame->camera->blacklevel);
+        check_gl();
+
+        // Read back from the debayered texture like the process pipeline does
+        glGenFramebuffers(1, &frame->thumb_frame_buffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, frame->thumb_frame_buffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER,
+                               GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D,
+                               frame->output_texture,
+                               0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        check_gl();
+
+        int major, minor;
+        gdk_gl_context_get_version(context, &major, &minor);
+        frame->thumbnailer = gl_thumbnailer_new(
+                !gdk_gl_context_get_use_es(context) || major >= 3);
+        gles2_debayer_use(frame->debayer);
+}
+
+static void
+free_gl_debayer(struct bench_frame *frame)
+{
+        gl_thumbnailer_free(frame->thumbnailer);
+        glDeleteFramebuffers(1, &frame->thumb_frame_buffer);
+        gles2_debayer_free(frame->debayer);
+        glDeleteTextures(1, &frame->input_texture);
+        glDeleteTextures(1, &frame->output_texture);
+}
+
+static void
+bench_kernel(const struct bench_kernel *kernel,
+             struct bench_frame *frame,
+             bool is_first)
+{
+        double *times = malloc(kernel->num_iterations * sizeof(double));
+        for (int i = 0; i < NUM_WARMUP + kernel->num_iterations; ++i) {
+                double start = get_time();
+                kernel->run(frame);
+                double end = get_time();
+
+                if (i >= NUM_WARMUP) {
+                        times[i - NUM_WARMUP] = end - start;
+                }
+        }
+
+        qsort(times, kernel->num_iterations, sizeof(double), compare_double);
+
+        double total = 0;
+        for (int i = 0; i < kernel->num_iterations; ++i) {
+                total += times[i];
+        }
+        double median = times[kernel->num_iterations / 2];
+
+        printf("%s\n"
+               "        {\n"
+               "          \"name\": \"%s\",\n"
+               "          \"iterations\": %d,\n"
+               "          \"min_ms\": %.4f,\n"
+               "          \"median_ms\": %.4f,\n"
+               "          \"mean_ms\": %.4f,\n"
+               "          \"max_ms\": %.4f,\n"
+               "          \"frame_mb_per_s\": %.1f\n"
+               "        }",
+               is_first ? "" : ",",
+               kernel->name,
+               kernel->num_iterations,
+               times[0] * 1000,
+               median * 1000,
+               total / kernel->num_iterations * 1000,
+               times[kernel->num_iterations - 1] * 1000,
+               frame->size / median / 1e6);
+
+        free(times);
+}
+
+static void
+bench_mode(const struct mp_camera_config *camera, const MPMode *mode, bool is_first)
+{
+        g_printerr("Benchmarking %s %dx%d\n",
+                   mp_pixel_format_to_str(mode->pixel_format),
+                   mode->width,
+                   mode->height);
+
+        struct bench_frame frame = {
+                .camera = camera,
+                .mode = *mode,
+        };
+
+        uint32_t row_length =
+                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width);
+        frame.size = (row_length + mp_pixel_format_width_to_padding(
+                                           mode->pixel_format, mode->width)) *
+                     mode->height;
+
+        // Random data keeps the DNG and JPEG sizes close to a real worst case
+        frame.image = malloc(frame.size);
+        srand(0);
+        for (size_t i = 0; i < frame.size; ++i) {
+                frame.image[i] = rand();
+        }
+
+        frame.output = malloc(row_length * mode->height);
+        frame.thumb =
+                calloc((mode->width / 2) * (mode->height / 2), sizeof(uint32_t));
+        frame.dir = g_dir_make_tmp("megapixels-bench.XXXXXX", NULL);
+
+        if (context) {
+                setup_gl_debayer(&frame);
+        }
+
+        printf("%s\n"
+               "    {\n"
+               "      \"camera\": \"%s\",\n"
+               "      \"format\": \"%s\",\n"
+               "      \"width\": %d,\n"
+               "      \"height\": %d,\n"
+               "      \"frame_bytes\": %zu,\n"
+               "      \"kernels\": [",
+               is_first ? "" : ",",
+               camera->cfg_name,
+               mp_pixel_format_to_str(mode->pixel_format),
+               mode->width,
+               mode->height,
+               frame.size);
+
+        bool is_first_kernel = true;
+        for (int i = 0; i < NUM_KERNELS; ++i) {
+                const struct bench_kernel *kernel = &kernels[i];
+                if (kernel->needs_10bit &&
+                    mp_pixel_format_bits_per_pixel(mode->pixel_format) != 10) {
+                        continue;
+                }
+                if (kernel->needs_gl && !context) {
+                        continue;
+                }
+
+                bench_kernel(kernel, &frame, is_first_kernel);
+                is_first_kernel = false;
+        }
+
+        printf("\n      ]\n    }");
+
+        if (context) {
+                free_gl_debayer(&frame);
+        }
+
+        char *path = g_build_filename(frame.dir, "bench.dng", NULL);
+        g_remove(path);
+        g_free(path);
+        path = g_build_filename(frame.dir, "bench.jpg", NULL);
+        g_remove(path);
+        g_free(path);
+        g_rmdir(frame.dir);
+
+        g_free(frame.dir);
+        free(frame.image);
+        free(frame.output);
+        free(frame.thumb);
+}
+
+static bool
+has_mode(const MPMode *modes, int num_modes, const MPMode *mode)
+{
+        for (int i = 0; i < num_modes; ++i) {
+                if (modes[i].pixel_format == mode->pixel_format &&
+                    modes[i].width == mode->width &&
+                    modes[i].height == mode->height) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+int
+main(int argc, char *argv[])
+{
+        if (argc > 2) {
+                printf("Usage: %s [config_file]\n", argv[0]);
+                return 1;
+        }
+
+        bool loaded = argc == 2 ? mp_load_config_file(argv[1]) : mp_load_config();
+        if (!loaded) {
+                return 1;
+        }
+
+        // Only the Bayer modes go through all of the kernels
+        const struct mp_camera_config *cameras[MAX_MODES];
+        MPMode modes[MAX_MODES];
+        int num_modes = 0;
+
+        for (size_t i = 0; i < MP_MAX_CAMERAS; ++i) {
+                const struct mp_camera_config *config = mp_get_camera_config(i);
+                if (!config) {
+                        break;
+                }
+
+                const MPMode *camera_modes[] = {
+                        &config->capture_mode,
+                        &config->preview_mode,
+                };
+                for (int j = 0; j < 2; ++j) {
+                        const MPMode *mode = camera_modes[j];
+                        if (!mp_pixel_format_cfa_pattern(mode->pixel_format) ||
+                            has_mode(modes, num_modes, mode)) {
+                                continue;
+                        }
+
+                        cameras[num_modes] = config;
+                        modes[num_modes++] = *mode;
+                }
+        }
+
+        if (num_modes == 0) {
+                g_printerr("No Bayer modes configured\n");
+                return 1;
+        }
+
+        bool has_gl = init_gl();
+
+        mp_dng_writer_start();
+
+        printf("{\n"
+               "  \"version\": \"%s\",\n"
+               "  \"threads\": %d,\n"
+               "  \"raw10_kernel\": \"%s\",\n"
+               "  \"gl\": %s,\n"
+               "  \"modes\": [",
+               VERSION,
+               g_get_num_processors(),
+               mp_raw10_kernel_name(mp_raw10_best_kernel()),
+               has_gl ? "true" : "false");
+
+        for (int i = 0; i < num_modes; ++i) {
+                bench_mode(cameras[i], &modes[i], i == 0);
+        }
+
+        printf("\n  ]\n}\n");
+
+        mp_dng_writer_stop();
+        g_clear_object(&context);
+
+        return 0;
+}
@@ -0,0 +1,500 @@
+#include "camera_config.h"
+#include "dng_writer.h"
+#include "mode.h"
+#include "raw10.h"
+#include "recording.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tiffio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_WARMUP 1
+#define NUM_ITERATIONS 10
+
+#define MAX_MODES (MP_MAX_CAMERAS * 2)
+
+// Frames of a recording that are written, in turn
+#define MAX_RECORDED_FRAMES NUM_ITERATIONS
+
+#define TIFFTAG_FORWARDMATRIX1 50964
+
+static const float colormatrix_srgb[] = { 3.2409, -1.5373, -0.4986, -0.9692, 1.8759,
+                                          0.0415, 0.0556,  -0.2039, 1.0569 };
+
+double
+get_time()
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+        double da = *(const double *)a, db = *(const double *)b;
+        return (da > db) - (da < db);
+}
+
+static void
+register_custom_tiff_tags(TIFF *tif)
+{
+        static const TIFFFieldInfo custom_fields[] = {
+                { TIFFTAG_FORWARDMATRIX1,
+                  -1,
+                  -1,
+                  TIFF_SRATIONAL,
+                  FIELD_CUSTOM,
+                  1,
+                  1,
+                  "ForwardMatrix1" },
+        };
+
+        // Add missing dng fields
+        TIFFMergeFieldInfo(tif,
+                           custom_fields,
+                           sizeof(custom_fields) / sizeof(custom_fields[0]));
+}
+
+/*
+ * The way the DNG writer used to work, through libtiff with a scanline per
+ * write and the EXIF directory patched in afterwards. Kept here to compare
+ * against.
+ */
+static bool
+libtiff_write_dng(const char *path,
+                  const uint8_t *image,
+                  const struct mp_dng_info *info)
+{
+        const struct mp_camera_config *camera = info->camera;
+        MPMode mode = info->mode;
+
+        uint32_t bits_per_sample = mp_pixel_format_bits_per_pixel(mode.pixel_format);
+        size_t row_length =
+                mp_pixel_format_width_to_bytes(mode.pixel_format, mode.width);
+        int level_shift = 0;
+
+        // Merged bursts are written with 16 bits per sample, with the levels
+        // scaled up to match
+        if (info->is_merged) {
+                bits_per_sample = 16;
+                row_length = mode.width * sizeof(uint16_t);
+                level_shift = 16 - mp_pixel_format_pixel_depth(mode.pixel_format);
+        }
+
+        struct tm tim = *(localtime(&info->time));
+
+        char datetime[20] = { 0 };
+        strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tim);
+
+        TIFF *tif = TIFFOpen(path, "w");
+        if (!tif) {
+                g_printerr("Could not open tiff %s\n", path);
+                return false;
+        }
+
+        uint32_t preview_width = mode.width >> 4;
+        uint32_t preview_height = mode.height >> 4;
+
+        // Define TIFF thumbnail
+        TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 1);
+        TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, preview_width);
+        TIFFSetField(tif, TIFFTAG_IMAGELENGTH, preview_height);
+        TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
+        TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+        TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+        TIFFSetField(tif, TIFFTAG_MAKE, mp_get_device_make());
+        TIFFSetField(tif, TIFFTAG_MODEL, mp_get_device_model());
+        TIFFSetField(tif, TIFFTAG_ORIENTATION, mp_dng_info_get_orientation(info));
+        TIFFSetField(tif, TIFFTAG_DATETIME, datetime);
+        TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
+        TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+        TIFFSetField(tif, TIFFTAG_SOFTWARE, "Megapixels");
+        long sub_offset = 0;
+        TIFFSetField(tif, TIFFTAG_SUBIFD, 1, &sub_offset);
+        TIFFSetField(tif, TIFFTAG_DNGVERSION, "\001\001\0\0");
+        TIFFSetField(tif, TIFFTAG_DNGBACKWARDVERSION, "\001\0\0\0");
+        char uniquecameramodel[255];
+        sprintf(uniquecameramodel,
+                "%s %s",
+                mp_get_device_make(),
+                mp_get_device_model());
+        TIFFSetField(tif, TIFFTAG_UNIQUECAMERAMODEL, uniquecameramodel);
+        if (camera->colormatrix[0]) {
+                TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, camera->colormatrix);
+        } else {
+                TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, colormatrix_srgb);
+        }
+        if (camera->forwardmatrix[0]) {
+                TIFFSetField(tif, TIFFTAG_FORWARDMATRIX1, 9, camera->forwardmatrix);
+        }
+        static const float neutral[] = { 1.0, 1.0, 1.0 };
+        TIFFSetField(tif, TIFFTAG_ASSHOTNEUTRAL, 3, neutral);
+        TIFFSetField(tif, TIFFTAG_CALIBRATIONILLUMINANT1, 21);
+        // Write black thumbnail, only used by rotation-aware programs
+        unsigned char *buf = (unsigned char *)calloc(1, preview_width * 3);
+        for (int row = 0; row < preview_height; row++) {
+                TIFFWriteScanline(tif, buf, row, 0);
+        }
+        free(buf);
+        TIFFWriteDirectory(tif);
+
+        // Define main photo
+        TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 0);
+        TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, mode.width);
+        TIFFSetField(tif, TIFFTAG_IMAGELENGTH, mode.height);
+        TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, bits_per_sample);
+        TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
+        TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+        TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+        static const short cfapatterndim[] = { 2, 2 };
+        TIFFSetField(tif, TIFFTAG_CFAREPEATPATTERNDIM, cfapatterndim);
+#if (TIFFLIB_VERSION < 20201219) && !LIBTIFF_CFA_PATTERN
+        TIFFSetField(tif,
+                     TIFFTAG_CFAPATTERN,
+                     mp_pixel_format_cfa_pattern(mode.pixel_format));
+#else
+        TIFFSetField(tif,
+                     TIFFTAG_CFAPATTERN,
+                     4,
+                     mp_pixel_format_cfa_pattern(mode.pixel_format));
+#endif
+        int whitelevel = camera->whitelevel;
+        if (!whitelevel) {
+                whitelevel =
+                        (1 << mp_pixel_format_pixel_depth(mode.pixel_format)) - 1;
+        }
+        whitelevel <<= level_shift;
+        TIFFSetField(tif, TIFFTAG_WHITELEVEL, 1, &whitelevel);
+        if (camera->blacklevel) {
+                const float blacklevel = camera->blacklevel << level_shift;
+                TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 1, &blacklevel);
+        }
+        TIFFCheckpointDirectory(tif);
+
+        uint8_t *output_image = (uint8_t *)image;
+
+        // Repack 10-bit image from sensor format into a sequencial format
+        if (bits_per_sample == 10) {
+                output_image = malloc(row_length * mode.height);
+
+                mp_raw10_repack(image, output_image, &mode);
+        }
+
+        for (int row = 0; row < mode.height; row++) {
+                TIFFWriteScanline(
+                        tif, (void *)output_image + row * row_length, row, 0);
+        }
+        TIFFWriteDirectory(tif);
+
+        if (output_image != image)
+                free(output_image);
+
+        // Add an EXIF block to the tiff
+        TIFFCreateEXIFDirectory(tif);
+        // 1 = manual, 2 = full auto, 3 = aperture priority, 4 = shutter priority
+        if (!info->exposure_is_manual) {
+                TIFFSetField(tif, EXIFTAG_EXPOSUREPROGRAM, 2);
+        } else {
+                TIFFSetField(tif, EXIFTAG_EXPOSUREPROGRAM, 1);
+        }
+
+        TIFFSetField(
+                tif, EXIFTAG_EXPOSURETIME, mp_dng_info_get_exposure_time(info));
+        uint16_t isospeed = mp_dng_info_get_iso(info);
+        if (isospeed) {
+                TIFFSetField(tif, EXIFTAG_ISOSPEEDRATINGS, 1, &isospeed);
+        }
+        if (!camera->has_flash) {
+                // No flash function
+                TIFFSetField(tif, EXIFTAG_FLASH, 0x20);
+        } else if (info->flash_enabled) {
+                // Flash present and fired
+                TIFFSetField(tif, EXIFTAG_FLASH, 0x1);
+        } else {
+                // Flash present but not fired
+                TIFFSetField(tif, EXIFTAG_FLASH, 0x0);
+        }
+
+        TIFFSetField(tif, EXIFTAG_DATETIMEORIGINAL, datetime);
+        TIFFSetField(tif, EXIFTAG_DATETIMEDIGITIZED, datetime);
+        if (camera->fnumber) {
+                TIFFSetField(tif, EXIFTAG_FNUMBER, camera->fnumber);
+        }
+        if (camera->focallength) {
+                TIFFSetField(tif, EXIFTAG_FOCALLENGTH, camera->focallength);
+        }
+        if (camera->focallength && camera->cropfactor) {
+                TIFFSetField(tif,
+                             EXIFTAG_FOCALLENGTHIN35MMFILM,
+                             (short)(camera->focallength * camera->cropfactor));
+        }
+        uint64_t exif_offset = 0;
+        TIFFWriteCustomDirectory(tif, &exif_offset);
+        TIFFFreeDirectory(tif);
+
+        // Update exif pointer
+        TIFFSetDirectory(tif, 0);
+        TIFFSetField(tif, TIFFTAG_EXIFIFD, exif_offset);
+        TIFFRewriteDirectory(tif);
+
+        // Make sure the file is on disk before the postprocessor gets to it
+        TIFFFlush(tif);
+        bool success = fsync(TIFFFileno(tif)) == 0;
+        if (!success) {
+                g_printerr("Could not sync %s\n", path);
+        }
+
+        TIFFClose(tif);
+
+        return success;
+}
+
+typedef bool (*WriteFunc)(const char *path,
+                          const uint8_t *image,
+                          const struct mp_dng_info *info);
+
+static bool
+lj92_write_dng(const char *path,
+               const uint8_t *image,
+               const struct mp_dng_info *info)
+{
+        struct mp_dng_info compressed = *info;
+        compressed.compress = true;
+        return mp_dng_write(path, image, &compressed);
+}
+
+static void
+add_mode(MPMode *modes, int *num_modes, const MPMode *mode)
+{
+        if (!mp_pixel_format_cfa_pattern(mode->pixel_format)) {
+                return;
+        }
+
+        for (int i = 0; i < *num_modes; ++i) {
+                if (modes[i].pixel_format == mode->pixel_format &&
+                    modes[i].width == mode->width &&
+                    modes[i].height == mode->height) {
+                        return;
+                }
+        }
+
+        modes[(*num_modes)++] = *mode;
+}
+
+/*
+ * Writes the images in turn. The throughput is of the raw image as it's stored
+ * uncompressed, so compressed files compare with the others, and the ratio is
+ * of that to the size of the files.
+ */
+static void
+bench_writer(const char *name,
+             WriteFunc write,
+             const char *dir,
+             const uint8_t **images,
+             int num_images,
+             const struct mp_dng_info *info)
+{
+        char *path = g_build_filename(dir, "bench.dng", NULL);
+
+        double times[NUM_ITERATIONS];
+        double file_size = 0;
+        for (int i = 0; i < NUM_WARMUP + NUM_ITERATIONS; ++i) {
+                g_remove(path);
+
+                double start = get_time();
+                bool success = write(path, images[i % num_images], info);
+                double end = get_time();
+
+                if (!success) {
+                        printf("  %-7s failed\n", name);
+                        g_free(path);
+                        return;
+                }
+
+                if (i >= NUM_WARMUP) {
+                        times[i - NUM_WARMUP] = end - start;
+
+                        GStatBuf st;
+                        g_stat(path, &st);
+                        file_size += st.st_size;
+                }
+        }
+
+        qsort(times, NUM_ITERATIONS, sizeof(double), compare_double);
+
+        g_remove(path);
+        g_free(path);
+
+        const MPMode *mode = &info->mode;
+        double image_size =
+                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width) *
+                (double)mode->height;
+        double median = times[NUM_ITERATIONS / 2];
+        printf("  %-7s min %8.3fms median %8.3fms %8.1fMB/s ratio %5.2f\n",
+               name,
+               times[0] * 1000,
+               median * 1000,
+               image_size / median / 1e6,
+               image_size * NUM_ITERATIONS / file_size);
+}
+
+static void
+bench_images(const struct mp_camera_config *camera,
+             const MPMode *mode,
+             const char *dir,
+             const uint8_t **images,
+             int num_images)
+{
+        struct mp_dng_info info = {
+                .camera = camera,
+                .mode = *mode,
+                .rotation = 0,
+                .time = time(NULL),
+                .exposure_is_manual = false,
+                .exposure = mode->height,
+                .gain = 1,
+                .gain_max = 256,
+                .flash_enabled = false,
+        };
+
+        printf("%s %dx%d\n",
+               mp_pixel_format_to_str(mode->pixel_format),
+               mode->width,
+               mode->height);
+
+        bench_writer("libtiff", libtiff_write_dng, dir, images, num_images, &info);
+        bench_writer("native", mp_dng_write, dir, images, num_images, &info);
+        bench_writer("lj92", lj92_write_dng, dir, images, num_images, &info);
+}
+
+static void
+bench_mode(const struct mp_camera_config *camera,
+           const MPMode *mode,
+           const char *dir)
+{
+        size_t size =
+                (mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width) +
+                 mp_pixel_format_width_to_padding(mode->pixel_format, mode->width)) *
+                mode->height;
+
+        // Random data, like the noise in a real frame. It's the worst case
+        // for compression.
+        uint8_t *image = malloc(size);
+        srand(0);
+        for (size_t i = 0; i < size; ++i) {
+                image[i] = rand();
+        }
+
+        const uint8_t *images[] = { image };
+        bench_images(camera, mode, dir, images, 1);
+
+        free(image);
+}
+
+/*
+ * Writes the frames of a recording from the sensor, for compression ratios of
+ * real images. The camera with a mode of the same size provides the metadata.
+ */
+static bool
+bench_recording(const char *recording_path, const char *dir)
+{
+        MPRecording *recording = mp_recording_open(recording_path);
+        if (!recording) {
+                return false;
+        }
+
+        int num_frames = mp_recording_get_num_frames(recording);
+        if (num_frames == 0 ||
+            !mp_pixel_format_cfa_pattern(
+                    mp_recording_get_frame(recording, 0)->mode.pixel_format)) {
+                printf("%s has no Bayer frames\n", recording_path);
+                mp_recording_close(recording);
+                return false;
+        }
+
+        // Frames after a mode switch are skipped
+        const MPMode *mode = &mp_recording_get_frame(recording, 0)->mode;
+        const uint8_t *images[MAX_RECORDED_FRAMES];
+        int num_images = 0;
+        for (int i = 0; i < num_frames && num_images < MAX_RECORDED_FRAMES; ++i) {
+                const MPRecordedFrame *frame = mp_recording_get_frame(recording, i);
+                if (mp_mode_is_equivalent(&frame->mode, mode)) {
+                        images[num_images++] = frame->data;
+                }
+        }
+
+        const struct mp_camera_config *camera = mp_get_camera_config(0);
+        for (size_t i = 0; i < MP_MAX_CAMERAS; ++i) {
+                const struct mp_camera_config *config = mp_get_camera_config(i);
+                if (!config) {
+                        break;
+                }
+                if ((config->capture_mode.width == mode->width &&
+                     config->capture_mode.height == mode->height) ||
+                    (config->preview_mode.width == mode->width &&
+                     config->preview_mode.height == mode->height)) {
+                        camera = config;
+                        break;
+                }
+        }
+
+        printf("%s, %d frames\n", recording_path, num_images);
+        bench_images(camera, mode, dir, images, num_images);
+
+        mp_recording_close(recording);
+        return true;
+}
+
+int
+main(int argc, char *argv[])
+{
+        if (argc > 3) {
+                printf("Usage: %s [config_file [recording]]\n", argv[0]);
+                return 1;
+        }
+
+        bool loaded = argc >= 2 ? mp_load_config_file(argv[1]) : mp_load_config();
+        if (!loaded) {
+                return 1;
+        }
+
+        TIFFSetTagExtender(register_custom_tiff_tags);
+
+        // Set TMPDIR to measure the file system photos are saved on
+        char *dir = g_dir_make_tmp("megapixels-dng-bench.XXXXXX", NULL);
+        printf("Writing to %s, each write is synced\n", dir);
+
+        if (argc == 3) {
+                bool success = bench_recording(argv[2], dir);
+                g_rmdir(dir);
+                g_free(dir);
+                return success ? 0 : 1;
+        }
+
+        for (size_t i = 0; i < MP_MAX_CAMERAS; ++i) {
+                const struct mp_camera_config *camera = mp_get_camera_config(i);
+                if (!camera) {
+                        break;
+                }
+
+                MPMode modes[MAX_MODES];
+                int num_modes = 0;
+                add_mode(modes, &num_modes, &camera->capture_mode);
+                add_mode(modes, &num_modes, &camera->preview_mode);
+
+                printf("%s\n", camera->cfg_name);
+                for (int j = 0; j < num_modes; ++j) {
+                        bench_mode(camera, &modes[j], dir);
+                }
+        }
+
+        g_rmdir(dir);
+        g_free(dir);
+
+        return 0;
+}
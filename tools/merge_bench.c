@@ -0,0 +1,204 @@
+#include "burst_merge.h"
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tiffio.h>
+#include <time.h>
+
+#define MAX_FRAMES 16
+#define NUM_ITERATIONS 3
+
+struct raw_frame {
+        uint32_t width;
+        uint32_t height;
+        int depth;
+        uint16_t *data;
+};
+
+double
+get_time()
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void
+unpack_row(const uint8_t *src, uint16_t *dst, uint32_t width, int bits)
+{
+        if (bits == 8) {
+                for (uint32_t x = 0; x < width; ++x) {
+                        dst[x] = src[x];
+                }
+        } else if (bits == 16) {
+                memcpy(dst, src, width * sizeof(uint16_t));
+        } else {
+                // TIFF packs samples starting at the most significant bit
+                uint32_t acc = 0;
+                int acc_bits = 0;
+                for (uint32_t x = 0; x < width; ++x) {
+                        while (acc_bits < bits) {
+                                acc = (acc << 8) | *src++;
+                                acc_bits += 8;
+                        }
+                        acc_bits -= bits;
+                        dst[x] = (acc >> acc_bits) & ((1 << bits) - 1);
+                }
+        }
+}
+
+/*
+ * Read the raw image from a DNG written by Megapixels, which is the first
+ * SubIFD. The main IFD only holds the thumbnail.
+ */
+static bool
+read_dng(const char *path, struct raw_frame *frame)
+{
+        TIFF *tif = TIFFOpen(path, "r");
+        if (!tif) {
+                return false;
+        }
+
+        bool ok = false;
+        uint16_t num_subifds;
+        uint64_t *subifds;
+        if (!TIFFGetField(tif, TIFFTAG_SUBIFD, &num_subifds, &subifds) ||
+            num_subifds < 1 || !TIFFSetSubDirectory(tif, subifds[0])) {
+                printf("%s: no raw image\n", path);
+                goto out;
+        }
+
+        // Compressed raw images are stored in lossless JPEG tiles, which
+        // libtiff doesn't decode
+        uint16_t compression = COMPRESSION_NONE;
+        TIFFGetField(tif, TIFFTAG_COMPRESSION, &compression);
+        if (compression != COMPRESSION_NONE) {
+                printf("%s: compressed, save bursts with compress-raw off\n", path);
+                goto out;
+        }
+
+        uint16_t bits;
+        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &frame->width);
+        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &frame->height);
+        TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+        if (bits != 8 && bits != 10 && bits != 12 && bits != 16) {
+                printf("%s: unsupported bit depth %d\n", path, bits);
+                goto out;
+        }
+
+        frame->depth = bits;
+        frame->data =
+                malloc((size_t)frame->width * frame->height * sizeof(uint16_t));
+
+        uint8_t *row = _TIFFmalloc(TIFFScanlineSize(tif));
+        for (uint32_t y = 0; y < frame->height; ++y) {
+                TIFFReadScanline(tif, row, y, 0);
+                unpack_row(row,
+                           frame->data + (size_t)y * frame->width,
+                           frame->width,
+                           bits);
+        }
+        _TIFFfree(row);
+
+        ok = true;
+out:
+        TIFFClose(tif);
+        return ok;
+}
+
+static void
+bench_frames(struct raw_frame *frames, int num_frames, int num_threads)
+{
+        double best = 0;
+        MPBurstMergeStats stats;
+
+        for (int i = 0; i < NUM_ITERATIONS; ++i) {
+                double start = get_time();
+
+                MPBurstMerge *merge = mp_burst_merge_new(frames[0].width,
+                                                         frames[0].height,
+                                                         frames[0].depth,
+                                                         num_threads);
+                for (int j = 0; j < num_frames; ++j) {
+                        mp_burst_merge_add_frame16(merge, frames[j].data);
+                }
+                mp_burst_merge_get_stats(merge, &stats);
+                mp_burst_merge_free(merge);
+
+                double time = get_time() - start;
+                if (i == 0 || time < best) {
+                        best = time;
+                }
+        }
+
+        printf("%2d frames %2d threads: %8.1fms (align %7.1fms, merge %7.1fms), "
+               "%.0f%% of tiles accepted\n",
+               num_frames,
+               num_threads,
+               best * 1000,
+               stats.align_time * 1000,
+               stats.merge_time * 1000,
+               stats.tiles_accepted * 100);
+}
+
+int
+main(int argc, char *argv[])
+{
+        if (argc != 2) {
+                printf("Usage: %s [burst_dir]\n", argv[0]);
+                return 1;
+        }
+
+        struct raw_frame frames[MAX_FRAMES];
+        int num_frames = 0;
+
+        // Bursts are saved as 0.dng, 1.dng, ...
+        for (int i = 0; i < MAX_FRAMES; ++i) {
+                char path[512];
+                snprintf(path, sizeof(path), "%s/%d.dng", argv[1], i);
+                if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+                        break;
+                }
+
+                if (!read_dng(path, &frames[num_frames])) {
+                        return 1;
+                }
+
+                if (frames[num_frames].width != frames[0].width ||
+                    frames[num_frames].height != frames[0].height ||
+                    frames[num_frames].depth != frames[0].depth) {
+                        printf("%s: doesn't match the first frame\n", path);
+                        return 1;
+                }
+
+                ++num_frames;
+        }
+
+        if (num_frames < 2) {
+                printf("Need at least 2 frames in %s\n", argv[1]);
+                return 1;
+        }
+
+        printf("%dx%d, %d bits\n",
+               frames[0].width,
+               frames[0].height,
+               frames[0].depth);
+
+        int thread_counts[] = { 1, g_get_num_processors() };
+        for (int n = 2; n <= num_frames; ++n) {
+                for (int t = 0; t < 2; ++t) {
+                        if (t == 1 && thread_counts[1] == 1) {
+                                break;
+                        }
+
+                        bench_frames(frames, n, thread_counts[t]);
+                }
+        }
+
+        for (int i = 0; i < num_frames; ++i) {
+                free(frames[i].data);
+        }
+
+        return 0;
+}
@@ -0,0 +1,287 @@
+#include "pipeline.h"
+#include <assert.h>
+#include <glib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_WARMUP 100
+#define NUM_ROUND_TRIPS 10000
+#define NUM_MESSAGES 200000
+
+double
+get_time()
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+        double da = *(const double *)a, db = *(const double *)b;
+        return (da > db) - (da < db);
+}
+
+/*
+ * The way mp_pipeline_invoke used to work, a malloc and a GMainContext
+ * dispatch for every message. Kept here to compare against.
+ */
+struct glib_pipeline {
+        GMainContext *main_context;
+        GMainLoop *main_loop;
+        pthread_t thread;
+};
+
+struct glib_invoke_args {
+        MPPipelineCallback callback;
+};
+
+static void *
+glib_thread_main_loop(void *arg)
+{
+        struct glib_pipeline *pipeline = arg;
+
+        g_main_loop_run(pipeline->main_loop);
+        return NULL;
+}
+
+static void *
+glib_pipeline_new()
+{
+        struct glib_pipeline *pipeline = malloc(sizeof(struct glib_pipeline));
+        pipeline->main_context = g_main_context_new();
+        pipeline->main_loop = g_main_loop_new(pipeline->main_context, false);
+        int res = pthread_create(
+                &pipeline->thread, NULL, glib_thread_main_loop, pipeline);
+        assert(res == 0);
+
+        return pipeline;
+}
+
+static bool
+glib_invoke_impl(struct glib_invoke_args *args)
+{
+        args->callback(NULL, args + 1);
+        return false;
+}
+
+static void
+glib_pipeline_invoke(void *p,
+                     MPPipelineCallback callback,
+                     const void *data,
+                     size_t size)
+{
+        struct glib_pipeline *pipeline = p;
+
+        struct glib_invoke_args *args =
+                malloc(sizeof(struct glib_invoke_args) + size);
+        args->callback = callback;
+        memcpy(args + 1, data, size);
+
+        g_main_context_invoke_full(pipeline->main_context,
+                                   G_PRIORITY_DEFAULT,
+                                   (GSourceFunc)glib_invoke_impl,
+                                   args,
+                                   free);
+}
+
+static bool
+glib_unlock_mutex(GMutex *mutex)
+{
+        g_mutex_unlock(mutex);
+        return false;
+}
+
+static void
+glib_pipeline_sync(void *p)
+{
+        struct glib_pipeline *pipeline = p;
+
+        GMutex mutex;
+        g_mutex_init(&mutex);
+        g_mutex_lock(&mutex);
+
+        g_main_context_invoke_full(pipeline->main_context,
+                                   G_PRIORITY_LOW,
+                                   (GSourceFunc)glib_unlock_mutex,
+                                   &mutex,
+                                   NULL);
+        g_mutex_lock(&mutex);
+        g_mutex_unlock(&mutex);
+
+        g_mutex_clear(&mutex);
+}
+
+static void
+glib_pipeline_free(void *p)
+{
+        struct glib_pipeline *pipeline = p;
+
+        g_main_loop_quit(pipeline->main_loop);
+        g_main_context_wakeup(pipeline->main_context);
+
+        void *r;
+        pthread_join(pipeline->thread, &r);
+        g_main_loop_unref(pipeline->main_loop);
+        g_main_context_unref(pipeline->main_context);
+        free(pipeline);
+}
+
+static void *
+ring_pipeline_new()
+{
+        return mp_pipeline_new();
+}
+
+static void
+ring_pipeline_invoke(void *pipeline,
+                     MPPipelineCallback callback,
+                     const void *data,
+                     size_t size)
+{
+        mp_pipeline_invoke(pipeline, callback, data, size);
+}
+
+static void
+ring_pipeline_sync(void *pipeline)
+{
+        mp_pipeline_sync(pipeline);
+}
+
+static void
+ring_pipeline_free(void *pipeline)
+{
+        mp_pipeline_free(pipeline);
+}
+
+struct bench_backend {
+        const char *name;
+        void *(*new)();
+        void (*invoke)(void *pipeline,
+                       MPPipelineCallback callback,
+                       const void *data,
+                       size_t size);
+        void (*sync)(void *pipeline);
+        void (*free)(void *pipeline);
+};
+
+static const struct bench_backend backends[] = {
+        { "glib",
+          glib_pipeline_new,
+          glib_pipeline_invoke,
+          glib_pipeline_sync,
+          glib_pipeline_free },
+        { "ring",
+          ring_pipeline_new,
+          ring_pipeline_invoke,
+          ring_pipeline_sync,
+          ring_pipeline_free },
+};
+
+#define NUM_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+// Same size as the buffer release messages sent for every frame
+struct bench_message {
+        int *counter;
+        uint32_t index;
+};
+
+static void
+on_ping(MPPipeline *pipeline, atomic_bool **done)
+{
+        atomic_store(*done, true);
+}
+
+static void
+on_message(MPPipeline *pipeline, const struct bench_message *message)
+{
+        ++*message->counter;
+}
+
+static void
+bench_round_trip(const struct bench_backend *backend, void *pipeline)
+{
+        static double times[NUM_ROUND_TRIPS];
+
+        atomic_bool done;
+        atomic_bool *done_ptr = &done;
+        for (int i = 0; i < NUM_WARMUP + NUM_ROUND_TRIPS; ++i) {
+                atomic_store(&done, false);
+
+                double start = get_time();
+                backend->invoke(pipeline,
+                                (MPPipelineCallback)on_ping,
+                                &done_ptr,
+                                sizeof(atomic_bool *));
+                while (!atomic_load(&done)) {
+                }
+                double end = get_time();
+
+                if (i >= NUM_WARMUP) {
+                        times[i - NUM_WARMUP] = end - start;
+                }
+        }
+
+        qsort(times, NUM_ROUND_TRIPS, sizeof(double), compare_double);
+
+        printf("  %-4s round trip: median %7.2fus p99 %7.2fus\n",
+               backend->name,
+               times[NUM_ROUND_TRIPS / 2] * 1e6,
+               times[NUM_ROUND_TRIPS * 99 / 100] * 1e6);
+}
+
+static void
+bench_throughput(const struct bench_backend *backend, void *pipeline)
+{
+        int counter = 0;
+        struct bench_message message = {
+                .counter = &counter,
+        };
+
+        double start = get_time();
+        for (int i = 0; i < NUM_MESSAGES; ++i) {
+                message.index = i;
+                backend->invoke(pipeline,
+                                (MPPipelineCallback)on_message,
+                                &message,
+                                sizeof(struct bench_message));
+        }
+        backend->sync(pipeline);
+        double end = get_time();
+
+        printf("  %-4s throughput: %9.0f messages/s%s\n",
+               backend->name,
+               NUM_MESSAGES / (end - start),
+               counter == NUM_MESSAGES ? "" : " LOST MESSAGES");
+}
+
+int
+main(int argc, char *argv[])
+{
+        if (argc > 1) {
+                printf("Usage: %s\n", argv[0]);
+                return 1;
+        }
+
+        printf("%d round trips, %d messages of %zu bytes\n",
+               NUM_ROUND_TRIPS,
+               NUM_MESSAGES,
+               sizeof(struct bench_message));
+
+        for (int i = 0; i < NUM_BACKENDS; ++i) {
+                const struct bench_backend *backend = &backends[i];
+                void *pipeline = backend->new();
+
+                bench_round_trip(backend, pipeline);
+                bench_throughput(backend, pipeline);
+
+                backend->free(pipeline);
+        }
+
+        return 0;
+}
@@ -0,0 +1,163 @@
+#include "camera_config.h"
+#include "mode.h"
+#include "raw10.h"
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_WARMUP 2
+#define NUM_ITERATIONS 20
+
+#define MAX_MODES (MP_MAX_CAMERAS * (MP_MAX_FORMATS + 2))
+
+double
+get_time()
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+        double da = *(const double *)a, db = *(const double *)b;
+        return (da > db) - (da < db);
+}
+
+static void
+add_mode(MPMode *modes, int *num_modes, const MPMode *mode)
+{
+        if (mode->pixel_format == MP_PIXEL_FMT_UNSUPPORTED ||
+            mp_pixel_format_bits_per_pixel(mode->pixel_format) != 10) {
+                return;
+        }
+
+        for (int i = 0; i < *num_modes; ++i) {
+                if (modes[i].pixel_format == mode->pixel_format &&
+                    modes[i].width == mode->width &&
+                    modes[i].height == mode->height) {
+                        return;
+                }
+        }
+
+        modes[(*num_modes)++] = *mode;
+}
+
+static void
+bench_mode(const MPMode *mode)
+{
+        size_t row_length =
+                mp_pixel_format_width_to_bytes(mode->pixel_format, mode->width);
+        size_t src_size =
+                (row_length +
+                 mp_pixel_format_width_to_padding(mode->pixel_format, mode->width)) *
+                mode->height;
+        size_t dst_size = row_length * mode->height;
+
+        uint8_t *src = malloc(src_size);
+        uint8_t *expected = malloc(dst_size);
+        uint8_t *dst = malloc(dst_size);
+
+        srand(0);
+        for (size_t i = 0; i < src_size; ++i) {
+                src[i] = rand();
+        }
+
+        mp_raw10_repack_with(MP_RAW10_KERNEL_SCALAR, 1, src, expected, mode);
+
+        printf("%s %dx%d\n",
+               mp_pixel_format_to_str(mode->pixel_format),
+               mode->width,
+               mode->height);
+
+        int thread_counts[] = { 1, g_get_num_processors() };
+        for (int kernel = 0; kernel < MP_RAW10_KERNEL_MAX; ++kernel) {
+                if (!mp_raw10_kernel_is_supported(kernel)) {
+                        continue;
+                }
+
+                for (int t = 0; t < 2; ++t) {
+                        if (t == 1 && thread_counts[1] == 1) {
+                                break;
+                        }
+
+                        double times[NUM_ITERATIONS];
+                        for (int i = 0; i < NUM_WARMUP + NUM_ITERATIONS; ++i) {
+                                memset(dst, 0, dst_size);
+
+                                double start = get_time();
+                                mp_raw10_repack_with(
+                                        kernel, thread_counts[t], src, dst, mode);
+                                double end = get_time();
+
+                                if (i >= NUM_WARMUP) {
+                                        times[i - NUM_WARMUP] = end - start;
+                                }
+                        }
+
+                        qsort(times, NUM_ITERATIONS, sizeof(double), compare_double);
+
+                        bool exact = memcmp(dst, expected, dst_size) == 0;
+                        double median = times[NUM_ITERATIONS / 2];
+
+                        printf("  %-6s %2d threads: min %7.3fms median %7.3fms "
+                               "%8.1fMB/s%s\n",
+                               mp_raw10_kernel_name(kernel),
+                               thread_counts[t],
+                               times[0] * 1000,
+                               median * 1000,
+                               src_size / median / 1e6,
+                               exact ? "" : " MISMATCH");
+                }
+        }
+
+        free(src);
+        free(expected);
+        free(dst);
+}
+
+int
+main(int argc, char *argv[])
+{
+        if (argc > 2) {
+                printf("Usage: %s [config_file]\n", argv[0]);
+                return 1;
+        }
+
+        bool loaded = argc == 2 ? mp_load_config_file(argv[1]) : mp_load_config();
+        if (!loaded) {
+                return 1;
+        }
+
+        MPMode modes[MAX_MODES];
+        int num_modes = 0;
+
+        for (size_t i = 0; i < MP_MAX_CAMERAS; ++i) {
+                const struct mp_camera_config *config = mp_get_camera_config(i);
+                if (!config) {
+                        break;
+                }
+
+                add_mode(modes, &num_modes, &config->capture_mode);
+                add_mode(modes, &num_modes, &config->preview_mode);
+                for (int j = 0; j < config->num_media_formats; ++j) {
+                        add_mode(modes, &num_modes, &config->media_formats[j].mode);
+                }
+        }
+
+        if (num_modes == 0) {
+                printf("No 10-bit modes configured\n");
+                return 1;
+        }
+
+        printf("Best kernel: %s\n", mp_raw10_kernel_name(mp_raw10_best_kernel()));
+
+        for (int i = 0; i < num_modes; ++i) {
+                bench_mode(&modes[i]);
+        }
+
+        return 0;
+}
@@ -0,0 +1,126 @@
+#include "swap_chain.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_FRAMES 2000000
+// Words written to every frame, enough for a torn frame to show up
+#define FRAME_WORDS 64
+
+double
+get_time()
+{
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * Every word of a frame holds its sequence number. The producer fills its back
+ * buffer one word at a time, so a buffer that both threads have at once shows
+ * up as a frame with mixed sequence numbers. Build with -Db_sanitize=thread to
+ * also have the accesses checked.
+ */
+struct frame {
+        volatile uint64_t words[FRAME_WORDS];
+};
+
+static struct frame frames[MP_SWAP_CHAIN_SIZE];
+static MPSwapChain *swap_chain;
+static atomic_bool producer_done = false;
+
+static void *
+produce(void *arg)
+{
+        for (uint64_t sequence = 1; sequence <= NUM_FRAMES; ++sequence) {
+                struct frame *frame = &frames[mp_swap_chain_get_back(swap_chain)];
+                for (int i = 0; i < FRAME_WORDS; ++i) {
+                        frame->words[i] = sequence;
+                }
+                mp_swap_chain_publish(swap_chain);
+        }
+
+        atomic_store(&producer_done, true);
+        return NULL;
+}
+
+// Returns the sequence of the frame, or 0 if it was torn
+static uint64_t
+read_frame(const struct frame *frame)
+{
+        uint64_t sequence = frame->words[0];
+        for (int i = 1; i < FRAME_WORDS; ++i) {
+                if (frame->words[i] != sequence) {
+                        return 0;
+                }
+        }
+        return sequence;
+}
+
+int
+main(int argc, char *argv[])
+{
+        if (argc > 1) {
+                printf("Usage: %s\n", argv[0]);
+                return 1;
+        }
+
+        swap_chain = mp_swap_chain_new();
+
+        pthread_t producer;
+        int res = pthread_create(&producer, NULL, produce, NULL);
+        assert(res == 0);
+
+        // The consumer spins, reading every frame it gets twice so a producer
+        // writing into the front buffer is caught as well
+        uint64_t last_sequence = 0;
+        uint64_t num_acquired = 0;
+        uint64_t num_torn = 0;
+        uint64_t num_out_of_order = 0;
+        double start = get_time();
+        for (;;) {
+                bool done = atomic_load(&producer_done);
+
+                int index = mp_swap_chain_acquire(swap_chain);
+                if (index >= 0) {
+                        uint64_t sequence = read_frame(&frames[index]);
+                        if (sequence == 0 ||
+                            read_frame(&frames[index]) != sequence) {
+                                ++num_torn;
+                        } else if (sequence < last_sequence) {
+                                ++num_out_of_order;
+                        } else if (sequence > last_sequence) {
+                                last_sequence = sequence;
+                                ++num_acquired;
+                        }
+                }
+
+                // One more acquire after the producer is done picks up its
+                // last frame
+                if (done) {
+                        break;
+                }
+        }
+        double end = get_time();
+
+        pthread_join(producer, NULL);
+        mp_swap_chain_free(swap_chain);
+
+        printf("%d frames in %.0fms, %" PRIu64 " acquired, %" PRIu64
+               " torn, %" PRIu64 " out of order, last %" PRIu64 "\n",
+               NUM_FRAMES,
+               (end - start) * 1e3,
+               num_acquired,
+               num_torn,
+               num_out_of_order,
+               last_sequence);
+
+        bool success = num_torn == 0 && num_out_of_order == 0 &&
+                       last_sequence == NUM_FRAMES;
+        return success ? 0 : 1;
+}